@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdarg.h>
 
@@ -51,6 +52,7 @@
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -113,8 +115,30 @@ typedef struct SendBufList {
    int                   len;
    AsyncSocketSendFn     sendFn;
    void                 *clientData;
+   struct iovec         *iov;      // Gather segments from AsyncSocket_Sendv
+   int                   iovCnt;
+   struct iovec         *iovSpace; // Storage for iov, kept when recycled
+   int                   iovSpaceCnt;
+   AsyncSocketBuf       *owner;    // Reference held by AsyncSocket_SendBuf
 } SendBufList;
 
+/*
+ * Completed entries are kept on a per-socket free list, up to this many,
+ * so a socket sending steadily does no allocation per send.
+ */
+#define ASOCK_SENDBUF_FREE_MAX 16
+
+/*
+ * Most segments AsyncSocketWriteBuffers hands to a single gather write.
+ */
+#define ASOCK_MAX_WRITE_IOV 64
+
+/*
+ * Most bytes AsyncSocketFillRecvBuffer reads on one poll callback before
+ * returning to the loop, so a busy socket can't starve the others.
+ */
+#define ASOCK_RECV_BUDGET (256 * 1024)
+
 struct AsyncSocket {
    int id;
    AsyncSocketState state;
@@ -139,7 +163,9 @@ struct AsyncSocket {
    void *recvBuf;
    int recvPos;
    int recvLen;
+   Bool recvPartial;               /* fire recvFn on any data, see RecvPartial */
    Bool recvCb;
+   Bool recvPaused;                /* recv kept, poll callback off, see PauseRecv */
 
 #ifdef __APPLE_READ_BUG_WORKAROUND__
    Bool  readPausedForSocketBug;
@@ -151,12 +177,19 @@ struct AsyncSocket {
 
    SendBufList *sendBufList;
    SendBufList **sendBufTail;
+   SendBufList *sendBufFree;
+   int sendBufFreeCnt;
    int sendPos;
    Bool sendCb;
    Bool sendBufFull;
 
    Bool sslConnected;
 
+   AsyncSocketSslConnectFn sslConnectFn;
+   void *sslConnectClientData;
+   SSLVerifyParam *sslVerifyParam;
+   void **sslSession;
+
    Bool inRecvLoop;
 };
 
@@ -171,8 +204,14 @@ static void AsyncSocketConnectCallback(void *clientData);
 static void AsyncSocketRecvCallback(void *clientData);
 static void AsyncSocketRecvUDPCallback(void *clientData);
 static void AsyncSocketSendCallback(void *clientData);
+static void AsyncSocketSslConnectCallback(void *clientData);
 static int AsyncSocketAddRef(AsyncSocket *s);
 static int AsyncSocketRelease(AsyncSocket *s);
+static int AsyncSocketQueueSendBuf(AsyncSocket *asock, SendBufList *newBuf);
+static SendBufList *AsyncSocketAllocSendBuf(AsyncSocket *asock, int iovCnt);
+static void AsyncSocketFreeSendBuf(AsyncSocket *asock, SendBufList *entry);
+static int AsyncSocketGatherSendBufs(AsyncSocket *s, struct iovec *iov,
+                                     int *len);
 static int AsyncSocketBlockingWork(AsyncSocket *asock, Bool read, void *buf, int len,
                                    int *completed, int timeoutMS);
 static VMwareStatus AsyncSocketPollAdd(AsyncSocket *asock, Bool socket,
@@ -180,11 +219,15 @@ static VMwareStatus AsyncSocketPollAdd(AsyncSocket *asock, Bool socket,
 				       ...);
 static Bool AsyncSocketPollRemove(AsyncSocket *asock, Bool socket,
                                   int flags, PollerFunction callback);
-static AsyncSocket *AsyncSocketInit(int socketType,
+static AsyncSocket *AsyncSocketInit(int socketFamily, int socketType,
                                     AsyncSocketPollParams *pollParams,
                                     int *outError);
 static Bool AsyncSocketBind(AsyncSocket *asock, unsigned int ip,
                             unsigned short port, int *outError);
+#ifndef _WIN32
+static Bool AsyncSocketBindUnix(AsyncSocket *asock, const char *path,
+                                int *outError);
+#endif
 static Bool AsyncSocketListen(AsyncSocket *asock, AsyncSocketConnectFn connectFn,
                               void *clientData, int *outError);
 static AsyncSocket *AsyncSocketConnectIP(uint32 ip,
@@ -194,6 +237,13 @@ static AsyncSocket *AsyncSocketConnectIP(uint32 ip,
                                          AsyncSocketConnectFlags flags,
                                          AsyncSocketPollParams *pollParams,
                                          int *outError);
+static AsyncSocket *AsyncSocketConnectAddr(int socketFamily,
+                                           const struct sockaddr *addr,
+                                           socklen_t addrLen,
+                                           AsyncSocketConnectFn connectFn,
+                                           void *clientData,
+                                           AsyncSocketPollParams *pollParams,
+                                           int *outError);
 static int AsyncSocketResolveAddr(const char *hostname, unsigned short port,
                                   int type, struct sockaddr_in *addr);
 
@@ -494,7 +544,8 @@ AsyncSocket_ListenIP(unsigned int ip,
                      AsyncSocketPollParams *pollParams,
                      int *outError)
 {
-   AsyncSocket *asock = AsyncSocketInit(SOCK_STREAM, pollParams, outError);
+   AsyncSocket *asock = AsyncSocketInit(AF_INET, SOCK_STREAM, pollParams,
+                                        outError);
    if (NULL != asock
        && AsyncSocketBind(asock, ip, port, outError)
        && AsyncSocketListen(asock, connectFn, clientData, outError)) {
@@ -505,6 +556,110 @@ AsyncSocket_ListenIP(unsigned int ip,
 }
 
 
+#ifndef _WIN32
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketUnixAddr --
+ *
+ *      Fill in a sockaddr_un for a Unix-domain socket path.  A path starting
+ *      with '@' names a socket in the Linux abstract namespace, which has no
+ *      file and goes away with the last descriptor.
+ *
+ * Results:
+ *      TRUE with the address length in *addrLen, FALSE if the path is empty,
+ *      too long or abstract on a platform without abstract sockets.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+AsyncSocketUnixAddr(const char *path,         // IN
+                    struct sockaddr_un *addr, // OUT
+                    socklen_t *addrLen)       // OUT
+{
+   size_t pathLen;
+
+   ASSERT(addr);
+   ASSERT(addrLen);
+
+   if (!path || !*path) {
+      return FALSE;
+   }
+
+   pathLen = strlen(path);
+   if (pathLen >= sizeof addr->sun_path) {
+      Warning(ASOCKPREFIX "Unix socket path \"%s\" is too long\n", path);
+      return FALSE;
+   }
+
+   memset(addr, 0, sizeof *addr);
+   addr->sun_family = AF_UNIX;
+
+   if (path[0] == '@') {
+#ifdef __linux__
+      /* Abstract names are the bytes after a leading NUL, unterminated. */
+      memcpy(addr->sun_path + 1, path + 1, pathLen - 1);
+      *addrLen = offsetof(struct sockaddr_un, sun_path) + pathLen;
+#else
+      Warning(ASOCKPREFIX "abstract Unix socket \"%s\" is not supported\n",
+              path);
+      return FALSE;
+#endif
+   } else {
+      memcpy(addr->sun_path, path, pathLen);
+      *addrLen = offsetof(struct sockaddr_un, sun_path) + pathLen + 1;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_ListenUnix --
+ *
+ *      Listens on the Unix-domain socket path and accepts new connections.
+ *      Fires the connect callback with new AsyncSocket object for each
+ *      connection.  A path starting with '@' is an abstract socket name.
+ *
+ *      A stale socket file left at the path is not removed; the caller owns
+ *      the path and should unlink it when the listener is closed.
+ *
+ * Results:
+ *      New AsyncSocket in listening state or NULL on error.
+ *
+ * Side effects:
+ *      Creates new socket, binds and listens.  Creates the socket file for
+ *      a filesystem path.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+AsyncSocket *
+AsyncSocket_ListenUnix(const char *path,
+                       AsyncSocketConnectFn connectFn,
+                       void *clientData,
+                       AsyncSocketPollParams *pollParams,
+                       int *outError)
+{
+   AsyncSocket *asock = AsyncSocketInit(AF_UNIX, SOCK_STREAM, pollParams,
+                                        outError);
+   if (NULL != asock
+       && AsyncSocketBindUnix(asock, path, outError)
+       && AsyncSocketListen(asock, connectFn, clientData, outError)) {
+      return asock;
+   }
+
+   return NULL;
+}
+#endif // !_WIN32
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -527,7 +682,8 @@ AsyncSocket_BindUDP(unsigned short port,
                     AsyncSocketPollParams *pollParams,
                     int *outError)
 {
-   AsyncSocket *asock = AsyncSocketInit(SOCK_DGRAM, pollParams, outError);
+   AsyncSocket *asock = AsyncSocketInit(AF_INET, SOCK_DGRAM, pollParams,
+                                        outError);
 
    if (NULL != asock && AsyncSocketBind(asock, INADDR_ANY, port, outError)) {
       asock->connectFn = NULL;
@@ -556,7 +712,8 @@ AsyncSocket_BindUDP(unsigned short port,
  */
 
 AsyncSocket *
-AsyncSocketInit(int socketType,                    // IN
+AsyncSocketInit(int socketFamily,                  // IN
+                int socketType,                    // IN
                 AsyncSocketPollParams *pollParams, // IN
                 int *outError)                     // OUT
 {
@@ -566,9 +723,9 @@ AsyncSocketInit(int socketType,                    // IN
    int fd = -1;
 
    /*
-    * Create a new TCP/IP socket
+    * Create a new TCP/IP or Unix-domain socket
     */
-   if ((fd = socket(AF_INET, socketType, 0)) == -1) {
+   if ((fd = socket(socketFamily, socketType, 0)) == -1) {
       sysErr = ASOCK_LASTERROR();
       Warning(ASOCKPREFIX "could not create new socket, error %d: %s\n",
               sysErr, Err_Errno2String(sysErr));
@@ -730,6 +887,68 @@ error:
    return FALSE;
 }
 
+
+#ifndef _WIN32
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketBindUnix --
+ *
+ *      This is an internal routine that binds a socket to a Unix-domain
+ *      socket path.
+ *
+ * Results:
+ *      Returns TRUE upon success, FALSE upon failure.
+ *
+ * Side effects:
+ *      Socket is bound to the path.  On failure the asock is freed.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+AsyncSocketBindUnix(AsyncSocket *asock, // IN
+                    const char *path,   // IN
+                    int *outError)      // OUT
+{
+   struct sockaddr_un local_addr;
+   socklen_t addrLen;
+   int error = ASOCKERR_BIND;
+   int sysErr;
+
+   ASSERT(NULL != asock);
+
+   if (!AsyncSocketUnixAddr(path, &local_addr, &addrLen)) {
+      error = ASOCKERR_INVAL;
+      goto error;
+   }
+
+   Log(ASOCKPREFIX "creating new listening socket on %s\n", path);
+
+   if (bind(asock->fd, (struct sockaddr *) &local_addr, addrLen) != 0) {
+      sysErr = ASOCK_LASTERROR();
+      if (sysErr == ASOCK_EADDRINUSE) {
+         error = ASOCKERR_BINDADDRINUSE;
+      }
+      Warning("could not bind socket to %s, error %d: %s\n", path, sysErr,
+              Err_Errno2String(sysErr));
+      goto error;
+   }
+   return TRUE;
+
+error:
+   if (asock->fd != -1) {
+      ASOCK_CLOSEFD(asock->fd);
+   }
+   free(asock);
+
+   if (outError) {
+      *outError = error;
+   }
+   return FALSE;
+}
+#endif // !_WIN32
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -953,20 +1172,9 @@ AsyncSocketConnectIP(uint32 ip,
                      AsyncSocketPollParams *pollParams,
                      int *outError)
 {
-   int fd = -1;
    struct sockaddr_in local_addr;
-   VMwareStatus pollStatus;
-   AsyncSocket *asock = NULL;
-   int error = ASOCKERR_GENERIC;
-   int sysErr;
    int socketFamily = PF_INET;
 
-   if (!connectFn) {
-      error = ASOCKERR_INVAL;
-      Warning(ASOCKPREFIX "invalid arguments to connect!\n");
-      goto error;
-   }
-
    /* 
     * Allow selecting alternate network stack for ESX.
     */
@@ -974,10 +1182,12 @@ AsyncSocketConnectIP(uint32 ip,
    if ((flags & (ASOCKCONN_USE_ESX_SHADOW_STACK | 
                  ASOCKCONN_USE_ESX_NATIVE_STACK)) ==
        (ASOCKCONN_USE_ESX_SHADOW_STACK | ASOCKCONN_USE_ESX_NATIVE_STACK)) {
-      error = ASOCKERR_INVAL;
       Warning(ASOCKPREFIX "Can choose only one ESX stack for connect!\n");
       LOG(2, (ASOCKPREFIX "Tried BOTH ESX stacks?!\n"));
-      goto error;
+      if (outError) {
+         *outError = ASOCKERR_INVAL;
+      }
+      return NULL;
    }
 
    if (flags & ASOCKCONN_USE_ESX_SHADOW_STACK) {
@@ -990,24 +1200,6 @@ AsyncSocketConnectIP(uint32 ip,
    }
 #endif
 
-   /*
-    * Create a new IP socket
-    */
-   if ((fd = socket(socketFamily, SOCK_STREAM, 0)) == -1) {
-      sysErr = ASOCK_LASTERROR();
-      Warning(ASOCKPREFIX "failed to create socket, error %d: %s\n",
-              sysErr, Err_Errno2String(sysErr));
-      error = ASOCKERR_CONNECT;
-      goto error;
-   }
-
-   /*
-    * Wrap it with an asock
-    */
-   if ((asock = AsyncSocket_AttachToFd(fd, pollParams, &error)) == NULL) {
-      goto error;
-   }
-
    /*
     * Create a address structure to pass to connect
     */
@@ -1025,6 +1217,116 @@ AsyncSocketConnectIP(uint32 ip,
 
    local_addr.sin_addr.s_addr = ip;
 
+   return AsyncSocketConnectAddr(socketFamily, (struct sockaddr *) &local_addr,
+                                 sizeof local_addr, connectFn, clientData,
+                                 pollParams, outError);
+}
+
+
+#ifndef _WIN32
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_ConnectUnix --
+ *
+ *      AsyncSocket constructor. Connects to the Unix-domain socket path, and
+ *      passes the caller a valid asock via the callback once the connection
+ *      has been established.  A path starting with '@' is an abstract
+ *      socket name.
+ *
+ * Results:
+ *      AsyncSocket * on success and NULL on failure.
+ *      On failure, error is returned in *outError.
+ *
+ * Side effects:
+ *      Allocates an AsyncSocket, registers a poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+AsyncSocket *
+AsyncSocket_ConnectUnix(const char *path,
+                        AsyncSocketConnectFn connectFn,
+                        void *clientData,
+                        AsyncSocketConnectFlags flags,
+                        AsyncSocketPollParams *pollParams,
+                        int *outError)
+{
+   struct sockaddr_un addr;
+   socklen_t addrLen;
+
+   if (!AsyncSocketUnixAddr(path, &addr, &addrLen)) {
+      Warning(ASOCKPREFIX "invalid arguments to connect!\n");
+      if (outError) {
+         *outError = ASOCKERR_INVAL;
+      }
+      return NULL;
+   }
+
+   Log(ASOCKPREFIX "creating new socket, connecting to %s\n", path);
+   return AsyncSocketConnectAddr(AF_UNIX, (struct sockaddr *) &addr, addrLen,
+                                 connectFn, clientData, pollParams, outError);
+}
+#endif // !_WIN32
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketConnectAddr --
+ *
+ *      Internal AsyncSocket constructor shared by the IP and Unix-domain
+ *      connects.  Creates a stream socket of the given family and connects
+ *      it to addr.
+ *
+ * Results:
+ *      AsyncSocket * on success and NULL on failure.
+ *
+ * Side effects:
+ *      Allocates an AsyncSocket, registers a poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static AsyncSocket *
+AsyncSocketConnectAddr(int socketFamily,                  // IN
+                       const struct sockaddr *addr,       // IN
+                       socklen_t addrLen,                 // IN
+                       AsyncSocketConnectFn connectFn,    // IN
+                       void *clientData,                  // IN
+                       AsyncSocketPollParams *pollParams, // IN
+                       int *outError)                     // OUT
+{
+   int fd = -1;
+   VMwareStatus pollStatus;
+   AsyncSocket *asock = NULL;
+   int error = ASOCKERR_GENERIC;
+   int sysErr;
+
+   if (!connectFn) {
+      error = ASOCKERR_INVAL;
+      Warning(ASOCKPREFIX "invalid arguments to connect!\n");
+      goto error;
+   }
+
+   /*
+    * Create a new IP or Unix-domain socket
+    */
+   if ((fd = socket(socketFamily, SOCK_STREAM, 0)) == -1) {
+      sysErr = ASOCK_LASTERROR();
+      Warning(ASOCKPREFIX "failed to create socket, error %d: %s\n",
+              sysErr, Err_Errno2String(sysErr));
+      error = ASOCKERR_CONNECT;
+      goto error;
+   }
+
+   /*
+    * Wrap it with an asock
+    */
+   if ((asock = AsyncSocket_AttachToFd(fd, pollParams, &error)) == NULL) {
+      goto error;
+   }
+
    /*
     * Call connect(), which can either succeed immediately or return an error
     * indicating that the connection is in progress. In the latter case, we
@@ -1034,7 +1336,7 @@ AsyncSocketConnectIP(uint32 ip,
     * connection succeeds immediately, we just schedule the connect callback
     * as a one-time (RTime) callback instead.
     */
-   if (connect(fd, (struct sockaddr *) &local_addr, sizeof(local_addr)) != 0) {
+   if (connect(fd, addr, addrLen) != 0) {
       if (ASOCK_LASTERROR() == ASOCK_ECONNECTING) {
 	 ASOCKLOG(1, asock, ("registering write callback for socket connect\n"));
          pollStatus = AsyncSocketPollAdd(asock, TRUE, POLL_FLAG_WRITE,
@@ -1232,30 +1534,102 @@ AsyncSocket_UseNodelay(AsyncSocket *asock, Bool nodelay)
 /*
  *----------------------------------------------------------------------------
  *
- * AsyncSocket_Recv --
- *
- *      Registers a callback that will fire once the specified amount of data
- *      has been received on the socket.  This handles both TCP and UDP.
+ * AsyncSocketRegisterRecv --
  *
- *      Data that was not retrieved at the last call of SSL_read() could still
- *      be buffered inside the SSL layer and will be retrieved on the next
- *      call to SSL_read(). However poll/select might not mark the socket as rea
- *      for reading since there might not be any data in the underlying network
- *      socket layer. Hence in the read callback, we keep spinning until all
- *      all the data buffered inside the SSL layer is retrieved before
- *      returning to the poll loop (See AsyncSocketFillRecvBuffer()).
+ *      Common part of AsyncSocket_Recv and AsyncSocket_RecvPartial: installs
+ *      the recv poll callback if needed and records the request.  Arguments
+ *      have already been checked.
  *
- *      However, we might not have come out of Poll in the first place, e.g.
- *      if this is the first call to AsyncSocket_Recv() after creating a new
- *      connection. In this situation, if there is buffered SSL data pending,
- *      we have to schedule an RTTime callback to force retrieval of the data.
- *      This could also happen if the client calls AsyncSocket_RecvBlocking,
- *      some data is left in the SSL layer, and the client then calls
- *      AsyncSocket_Recv. We use the inRecvLoop variable to detect and handle
- *      this condition, i.e., if inRecvLoop is FALSE, we need to schedule the
- *      RTime callback.
+ * Results:
+ *      ASOCKERR_*.
  *
- *      This can be used with either TCP or UDP sockets. 
+ * Side effects:
+ *      Could register poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static int
+AsyncSocketRegisterRecv(AsyncSocket *asock,             // IN
+                        void *buf,                      // IN
+                        int len,                        // IN
+                        Bool partial,                   // IN
+                        AsyncSocketRecvFn recvFn,       // IN
+                        AsyncSocketRecvUDPFn recvUDPFn, // IN
+                        void *clientData)               // IN
+{
+   if (asock->state != AsyncSocketConnected) {
+      ASOCKWARN(asock, ("recv called but state is not connected!\n"));
+      return ASOCKERR_NOTCONNECTED;
+   }
+
+   if (!asock->recvBuf && !asock->recvCb && !asock->recvPaused) {
+      VMwareStatus pollStatus;
+
+      /*
+       * Register the Poll callback
+       */
+      ASOCKLOG(3, asock, ("installing recv poll callback\n"));
+
+      pollStatus = AsyncSocketPollAdd(asock, TRUE, POLL_FLAG_READ | POLL_FLAG_PERIODIC,
+                      (SOCK_STREAM == asock->type) ? AsyncSocketRecvCallback :
+                                                   AsyncSocketRecvUDPCallback);
+
+      if (pollStatus != VMWARE_STATUS_SUCCESS) {
+         ASOCKWARN(asock, ("failed to install recv callback!\n"));
+         return ASOCKERR_POLL;
+      }
+      asock->recvCb = TRUE;
+   }
+
+   if (SOCK_STREAM == asock->type && SSL_Pending(asock->sslSock)
+                                                    && !asock->inRecvLoop) {
+      ASOCKLOG(0, asock, ("installing recv RTime poll callback\n"));
+      if (Poll_CB_RTime(AsyncSocketRecvCallback, asock, 0, FALSE, NULL) !=
+          VMWARE_STATUS_SUCCESS) {
+         return ASOCKERR_POLL;
+      }
+   }
+
+   asock->recvBuf = buf;
+   asock->recvFn = recvFn;
+   asock->recvUDPFn = recvUDPFn;
+   asock->recvLen = len;
+   asock->recvPartial = partial;
+   asock->recvPos = 0;
+   asock->clientData = clientData;
+
+   return ASOCKERR_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_Recv --
+ *
+ *      Registers a callback that will fire once the specified amount of data
+ *      has been received on the socket.  This handles both TCP and UDP.
+ *
+ *      Data that was not retrieved at the last call of SSL_read() could still
+ *      be buffered inside the SSL layer and will be retrieved on the next
+ *      call to SSL_read(). However poll/select might not mark the socket as rea
+ *      for reading since there might not be any data in the underlying network
+ *      socket layer. Hence in the read callback, we keep spinning until all
+ *      all the data buffered inside the SSL layer is retrieved before
+ *      returning to the poll loop (See AsyncSocketFillRecvBuffer()).
+ *
+ *      However, we might not have come out of Poll in the first place, e.g.
+ *      if this is the first call to AsyncSocket_Recv() after creating a new
+ *      connection. In this situation, if there is buffered SSL data pending,
+ *      we have to schedule an RTTime callback to force retrieval of the data.
+ *      This could also happen if the client calls AsyncSocket_RecvBlocking,
+ *      some data is left in the SSL layer, and the client then calls
+ *      AsyncSocket_Recv. We use the inRecvLoop variable to detect and handle
+ *      this condition, i.e., if inRecvLoop is FALSE, we need to schedule the
+ *      RTime callback.
+ *
+ *      This can be used with either TCP or UDP sockets. 
  *
  *      TCP usage:
  *      AsyncSocket_Recv(AsyncSocket *asock,
@@ -1329,47 +1703,55 @@ AsyncSocket_Recv(AsyncSocket *asock,
       return ASOCKERR_INVAL;
    }
 
-   if (asock->state != AsyncSocketConnected) {
-      ASOCKWARN(asock, ("recv called but state is not connected!\n"));
-      return ASOCKERR_NOTCONNECTED;
-   }
-
-   if (!asock->recvBuf && !asock->recvCb) {
-      VMwareStatus pollStatus;
+   return AsyncSocketRegisterRecv(asock, buf, len, FALSE, recvFn, recvUDPFn,
+                                  clientData);
+}
 
-      /*
-       * Register the Poll callback
-       */
-      ASOCKLOG(3, asock, ("installing recv poll callback\n"));
 
-      pollStatus = AsyncSocketPollAdd(asock, TRUE, POLL_FLAG_READ | POLL_FLAG_PERIODIC,
-                      (SOCK_STREAM == asock->type) ? AsyncSocketRecvCallback :
-                                                   AsyncSocketRecvUDPCallback);
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_RecvPartial --
+ *
+ *      Like AsyncSocket_Recv for a TCP socket, except that recvFn fires as
+ *      soon as any data has been read into buf, with the number of bytes
+ *      read (at most len) rather than waiting for len bytes.
+ *
+ *      On each poll callback AsyncSocketFillRecvBuffer keeps reading, and
+ *      firing recvFn, while the socket or the SSL layer has more data, up to
+ *      ASOCK_RECV_BUDGET bytes.  As with AsyncSocket_Recv, the request stays
+ *      registered with the same buffer unless recvFn registers another one
+ *      or cancels it.
+ *
+ * Results:
+ *      ASOCKERR_*.
+ *
+ * Side effects:
+ *      Could register poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
 
-      if (pollStatus != VMWARE_STATUS_SUCCESS) {
-         ASOCKWARN(asock, ("failed to install recv callback!\n"));
-         return ASOCKERR_POLL;
-      }
-      asock->recvCb = TRUE;
+int
+AsyncSocket_RecvPartial(AsyncSocket *asock,       // IN
+                        void *buf,                // IN
+                        int len,                  // IN: most bytes per recvFn
+                        AsyncSocketRecvFn recvFn, // IN
+                        void *clientData)         // IN
+{
+   if (!asock || !buf || !recvFn || len <= 0 ||
+       asock->type != SOCK_STREAM) {
+      Warning(ASOCKPREFIX "RecvPartial called with invalid arguments!\n");
+      return ASOCKERR_INVAL;
    }
 
-   if (SOCK_STREAM == asock->type && SSL_Pending(asock->sslSock)
-                                                    && !asock->inRecvLoop) {
-      ASOCKLOG(0, asock, ("installing recv RTime poll callback\n"));
-      if (Poll_CB_RTime(AsyncSocketRecvCallback, asock, 0, FALSE, NULL) !=
-          VMWARE_STATUS_SUCCESS) {
-         return ASOCKERR_POLL;
-      }
+   if (!asock->errorFn) {
+      ASOCKWARN(asock, ("%s: no registered error handler!\n", __FUNCTION__));
+      return ASOCKERR_INVAL;
    }
 
-   asock->recvBuf = buf;
-   asock->recvFn = recvFn;
-   asock->recvUDPFn = recvUDPFn;
-   asock->recvLen = len;
-   asock->recvPos = 0;
-   asock->clientData = clientData;
-
-   return ASOCKERR_SUCCESS;
+   return AsyncSocketRegisterRecv(asock, buf, len, TRUE, recvFn, NULL,
+                                  clientData);
 }
 
 
@@ -1601,90 +1983,355 @@ AsyncSocketBlockingWork(AsyncSocket *s,
       now = Hostinfo_SystemTimerUS() / 1000;
    } while ((now < done && timeoutMS > 0) || (timeoutMS < 0));
 
-   return ASOCKERR_TIMEOUT;
+   return ASOCKERR_TIMEOUT;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_Send --
+ *
+ *      Queues the provided data for sending on the socket. If a send callback
+ *      is provided, the callback is fired after the data has been written to
+ *      the socket. Note that this only guarantees that the data has been
+ *      copied to the transmit buffer, we make no promises about whether it
+ *      has actually been transmitted, or received by the client, when the
+ *      callback is fired.
+ *
+ *      Send callbacks should also be able to deal with being called if none
+ *      or only some of the queued buffer has been transmitted, since the send
+ *      callbacks for any remaining buffers are fired by AsyncSocket_Close().
+ *      This condition can be detected by checking the len parameter passed to
+ *      the send callback.
+ *
+ * Results:
+ *      ASOCKERR_*.
+ *
+ * Side effects:
+ *      May register poll callback or perform I/O.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int
+AsyncSocket_Send(AsyncSocket *asock,
+                 void *buf,
+                 int len,
+                 AsyncSocketSendFn sendFn,
+                 void *clientData)
+{
+   SendBufList *newBuf;
+
+   /*
+    * Note: I think it should be fine to send with a length of zero and a
+    * buffer of NULL or any other garbage value.  However the code
+    * downstream of here is unprepared for it (silently misbehaves).  Hence
+    * the <= zero check instead of just a < zero check.  --Jeremy.
+    */
+   if (!asock || !buf || len <= 0) {
+      Warning(ASOCKPREFIX "Send called with invalid arguments! asynchSock: %p "
+              "buffer: %p length: %d\n", asock, buf, len);
+      return ASOCKERR_INVAL;
+   }
+
+   ASSERT(SOCK_STREAM == asock->type);
+
+   if (asock->state != AsyncSocketConnected) {
+      ASOCKWARN(asock, ("send called but state is not connected!\n"));
+      return ASOCKERR_NOTCONNECTED;
+   }
+
+   /*
+    * Allocate and initialize new send buffer entry
+    */
+   newBuf = AsyncSocketAllocSendBuf(asock, 0);
+   newBuf->buf = buf;
+   newBuf->len = len;
+   newBuf->sendFn = sendFn;
+   newBuf->clientData = clientData;
+
+   return AsyncSocketQueueSendBuf(asock, newBuf);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_Sendv --
+ *
+ *      Queues the provided gather segments for sending on the socket, to be
+ *      written as if they were one contiguous buffer.  The iov array itself
+ *      is copied, so only the memory the segments point at must remain valid
+ *      until the send callback fires.  The callback receives the iov pointer
+ *      passed in as its buf argument, and the total length (or the amount
+ *      written when fired from AsyncSocket_Close) as len.
+ *
+ *      See AsyncSocket_Send for the send callback contract.
+ *
+ * Results:
+ *      ASOCKERR_*.
+ *
+ * Side effects:
+ *      May register poll callback or perform I/O.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int
+AsyncSocket_Sendv(AsyncSocket *asock,          // IN
+                  struct iovec *iov,           // IN
+                  int iovCnt,                  // IN
+                  AsyncSocketSendFn sendFn,    // IN/OPT
+                  void *clientData)            // IN/OPT
+{
+   SendBufList *newBuf;
+   int len = 0;
+   int i;
+
+   if (!asock || !iov || iovCnt <= 0) {
+      Warning(ASOCKPREFIX "Sendv called with invalid arguments! asynchSock: "
+              "%p iov: %p count: %d\n", asock, iov, iovCnt);
+      return ASOCKERR_INVAL;
+   }
+
+   for (i = 0; i < iovCnt; i++) {
+      len += iov[i].iov_len;
+   }
+   if (len <= 0) {
+      Warning(ASOCKPREFIX "Sendv called with invalid length %d\n", len);
+      return ASOCKERR_INVAL;
+   }
+
+   ASSERT(SOCK_STREAM == asock->type);
+
+   if (asock->state != AsyncSocketConnected) {
+      ASOCKWARN(asock, ("sendv called but state is not connected!\n"));
+      return ASOCKERR_NOTCONNECTED;
+   }
+
+   newBuf = AsyncSocketAllocSendBuf(asock, iovCnt);
+   newBuf->buf = iov;
+   newBuf->len = len;
+   newBuf->sendFn = sendFn;
+   newBuf->clientData = clientData;
+   memcpy(newBuf->iov, iov, iovCnt * sizeof(struct iovec));
+
+   return AsyncSocketQueueSendBuf(asock, newBuf);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_SendBuf --
+ *
+ *      Queues len bytes at buf for sending, where buf lies in the memory
+ *      owned by the reference counted owner.  A reference to owner is held
+ *      until the bytes are written or the socket is closed, and released
+ *      with AsyncSocket_BufRelease, so the caller can drop its own
+ *      reference right away and there is no send callback.
+ *
+ * Results:
+ *      ASOCKERR_*.  No reference is taken on failure.
+ *
+ * Side effects:
+ *      May register poll callback or perform I/O.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int
+AsyncSocket_SendBuf(AsyncSocket *asock,     // IN
+                    AsyncSocketBuf *owner,  // IN
+                    void *buf,              // IN
+                    int len)                // IN
+{
+   SendBufList *newBuf;
+   int result;
+
+   if (!asock || !owner || !buf || len <= 0) {
+      Warning(ASOCKPREFIX "SendBuf called with invalid arguments! asynchSock: "
+              "%p owner: %p buffer: %p length: %d\n", asock, owner, buf, len);
+      return ASOCKERR_INVAL;
+   }
+
+   ASSERT(SOCK_STREAM == asock->type);
+   ASSERT(owner->refCount > 0 && owner->releaseFn);
+
+   if (asock->state != AsyncSocketConnected) {
+      ASOCKWARN(asock, ("send called but state is not connected!\n"));
+      return ASOCKERR_NOTCONNECTED;
+   }
+
+   newBuf = AsyncSocketAllocSendBuf(asock, 0);
+   newBuf->buf = buf;
+   newBuf->len = len;
+   newBuf->owner = owner;
+   owner->refCount++;
+
+   result = AsyncSocketQueueSendBuf(asock, newBuf);
+   if (result != ASOCKERR_SUCCESS) {
+      /* The caller still holds its own reference. */
+      owner->refCount--;
+   }
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_BufRelease --
+ *
+ *      Drop a reference to an AsyncSocketBuf, calling its releaseFn once
+ *      the last one is gone.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May release the buffer.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+AsyncSocket_BufRelease(AsyncSocketBuf *owner) // IN
+{
+   ASSERT(owner);
+   ASSERT(owner->refCount > 0);
+
+   if (--owner->refCount == 0) {
+      owner->releaseFn(owner);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketAllocSendBuf --
+ *
+ *      Take a cleared send buffer entry from the socket's free list, or
+ *      allocate one.  If iovCnt is non-zero, the entry's iov points at
+ *      room for that many segments.
+ *
+ * Results:
+ *      The entry.
+ *
+ * Side effects:
+ *      May allocate memory.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static SendBufList *
+AsyncSocketAllocSendBuf(AsyncSocket *asock, // IN
+                        int iovCnt)         // IN
+{
+   SendBufList *entry = asock->sendBufFree;
+
+   if (entry) {
+      asock->sendBufFree = entry->next;
+      asock->sendBufFreeCnt--;
+      entry->next = NULL;
+   } else {
+      entry = Util_SafeCalloc(1, sizeof *entry);
+   }
+
+   if (iovCnt > 0) {
+      if (entry->iovSpaceCnt < iovCnt) {
+         free(entry->iovSpace);
+         entry->iovSpace = Util_SafeMalloc(iovCnt * sizeof *entry->iovSpace);
+         entry->iovSpaceCnt = iovCnt;
+      }
+      entry->iov = entry->iovSpace;
+      entry->iovCnt = iovCnt;
+   }
+
+   return entry;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketFreeSendBuf --
+ *
+ *      Put a finished send buffer entry back on the socket's free list, or
+ *      free it if the list is full.  The caller has already dealt with its
+ *      send callback and owner.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AsyncSocketFreeSendBuf(AsyncSocket *asock,  // IN
+                       SendBufList *entry)  // IN
+{
+   struct iovec *iovSpace = entry->iovSpace;
+   int iovSpaceCnt = entry->iovSpaceCnt;
+
+   if (asock->sendBufFreeCnt >= ASOCK_SENDBUF_FREE_MAX) {
+      free(iovSpace);
+      free(entry);
+      return;
+   }
+
+   memset(entry, 0, sizeof *entry);
+   entry->iovSpace = iovSpace;
+   entry->iovSpaceCnt = iovSpaceCnt;
+   entry->next = asock->sendBufFree;
+   asock->sendBufFree = entry;
+   asock->sendBufFreeCnt++;
 }
 
 
 /*
  *----------------------------------------------------------------------------
  *
- * AsyncSocket_Send --
+ * AsyncSocketQueueSendBuf --
  *
- *      Queues the provided data for sending on the socket. If a send callback
- *      is provided, the callback is fired after the data has been written to
- *      the socket. Note that this only guarantees that the data has been
- *      copied to the transmit buffer, we make no promises about whether it
- *      has actually been transmitted, or received by the client, when the
- *      callback is fired.
+ *      Appends a send buffer entry to the socket's outgoing list.
  *
- *      Send callbacks should also be able to deal with being called if none
- *      or only some of the queued buffer has been transmitted, since the send
- *      callbacks for any remaining buffers are fired by AsyncSocket_Close().
- *      This condition can be detected by checking the len parameter passed to
- *      the send callback.
+ *      If the send buffer list is currently empty, we schedule a one-time
+ *      callback to "prime" the output. This is necessary to support the
+ *      FD_WRITE network event semantic for sockets on Windows (see
+ *      WSAEventSelect documentation). The event won't signal unless a
+ *      previous write() on the socket failed with WSAEWOULDBLOCK, so we have
+ *      to perform at least one partial write before we can start polling
+ *      for write.
  *
  * Results:
- *      ASOCKERR_*.
+ *      ASOCKERR_SUCCESS or ASOCKERR_POLL.  The entry is recycled on failure,
+ *      without releasing its owner.
  *
  * Side effects:
- *      May register poll callback or perform I/O.
+ *      May register poll callback.
  *
  *----------------------------------------------------------------------------
  */
 
-int
-AsyncSocket_Send(AsyncSocket *asock,
-                 void *buf,
-                 int len,
-                 AsyncSocketSendFn sendFn,
-                 void *clientData)
+static int
+AsyncSocketQueueSendBuf(AsyncSocket *asock,  // IN
+                        SendBufList *newBuf) // IN
 {
-   SendBufList *newBuf;
-
-   /*
-    * Note: I think it should be fine to send with a length of zero and a
-    * buffer of NULL or any other garbage value.  However the code
-    * downstream of here is unprepared for it (silently misbehaves).  Hence
-    * the <= zero check instead of just a < zero check.  --Jeremy.
-    */
-   if (!asock || !buf || len <= 0) {
-      Warning(ASOCKPREFIX "Send called with invalid arguments! asynchSock: %p "
-              "buffer: %p length: %d\n", asock, buf, len);
-      return ASOCKERR_INVAL;
-   }
-
-   ASSERT(SOCK_STREAM == asock->type);
-
-   if (asock->state != AsyncSocketConnected) {
-      ASOCKWARN(asock, ("send called but state is not connected!\n"));
-      return ASOCKERR_NOTCONNECTED;
-   }
-
-   /*
-    * If the send buffer list is currently empty, we schedule a one-time
-    * callback to "prime" the output. This is necessary to support the
-    * FD_WRITE network event semantic for sockets on Windows (see
-    * WSAEventSelect documentation). The event won't signal unless a previous
-    * write() on the socket failed with WSAEWOULDBLOCK, so we have to perform
-    * at least one partial write before we can start polling for write.
-    */
    if (!asock->sendBufList && !asock->sendCb) {
       if (AsyncSocketPollAdd(asock, FALSE, 0, AsyncSocketSendCallback, 0)
           != VMWARE_STATUS_SUCCESS) {
+         AsyncSocketFreeSendBuf(asock, newBuf);
          return ASOCKERR_POLL;
       }
       asock->sendCb = TRUE;
    }
 
-   /*
-    * Allocate and initialize new send buffer entry
-    */
-   newBuf = Util_SafeCalloc(1, sizeof(SendBufList));
-   newBuf->buf = buf;
-   newBuf->len = len;
-   newBuf->sendFn = sendFn;
-   newBuf->clientData = clientData;
-
    /*
     * Append new send buffer to the tail of list.
     */
@@ -1874,6 +2521,9 @@ bye:
  * AsyncSocketFillRecvBuffer --
  *
  *      Called when an asock has data ready to be read via the poll callback.
+ *      Reads at most ASOCK_RECV_BUDGET bytes; if the SSL layer still holds
+ *      data after that, an RTime callback is scheduled to come back for it,
+ *      since poll won't report it.
  *
  * Results:
  *      ASOCKERR_SUCCESS if everything worked, 
@@ -1895,6 +2545,7 @@ AsyncSocketFillRecvBuffer(AsyncSocket *s)
    int sysErr = 0;
    int result;
    int pending = 0;
+   int budget = ASOCK_RECV_BUDGET;
    VmTimeType drainStartTime = 0;
 
    ASSERT(s->state == AsyncSocketConnected);
@@ -1937,8 +2588,16 @@ AsyncSocketFillRecvBuffer(AsyncSocket *s)
 
       if (recvd > 0) {
 	 s->sslConnected = TRUE;
-	 if ((s->recvPos += recvd) == s->recvLen) {
+         budget -= recvd;
+
+         /*
+          * A partial request completes with whatever was read.  Setting
+          * recvPos to recvLen lets the automatic reset below treat it the
+          * same as a full buffer.
+          */
+	 if (s->recvPartial || s->recvPos + recvd == s->recvLen) {
 	    void *recvBuf = s->recvBuf;
+            int recvLen = s->recvPos + recvd;
 	    ASOCKLOG(3, s, ("recv buffer full, calling recvFn\n"));
 
             /*
@@ -1952,17 +2611,32 @@ AsyncSocketFillRecvBuffer(AsyncSocket *s)
              */
 
 	    s->recvBuf = NULL;
-	    s->recvFn(recvBuf, s->recvLen, s, s->clientData);
+            s->recvPos = s->recvLen;
+	    s->recvFn(recvBuf, recvLen, s, s->clientData);
 	    if (s->state == AsyncSocketClosed) {
 	       ASOCKLG0(s, ("owner closed connection in recv callback\n"));
 	       result = ASOCKERR_CLOSED;
 	       goto exit;
+	    } else if (!s->recvCb) {
+               /*
+                * Owner called AsyncSocket_CancelRecv or AsyncSocket_PauseRecv
+                * in the recv callback.  A paused recv keeps its buffer.
+                */
+               if (s->recvPaused && s->recvLen - s->recvPos == 0) {
+                  s->recvPos = 0;
+                  s->recvBuf = recvBuf;
+               }
+               ASOCKLOG(3, s, ("recv cancelled in recv callback\n"));
+               result = ASOCKERR_SUCCESS;
+               goto exit;
 	    } else if (s->recvLen - s->recvPos == 0) {
                /* Automatically reset keeping the current handler */
                s->recvPos = 0;
                s->recvBuf = recvBuf;
             }
-	 }
+	 } else {
+            s->recvPos += recvd;
+         }
       } else if (recvd == 0) {
 	 ASOCKLG0(s, ("recv detected client closed connection\n"));
          /*
@@ -1994,8 +2668,12 @@ AsyncSocketFillRecvBuffer(AsyncSocket *s)
        *      (See AsyncSocket_SetDrainTimeout)
        */
 
+      /*
+       * A partial request that filled its buffer likely left more in
+       * the socket; keep going the way draining would.
+       */
+      isDraining = s->recvPartial && recvd == needed;
       needed = s->recvLen - s->recvPos;
-      isDraining = FALSE;
       ASSERT(needed > 0);
 
       if (s->drainTimeoutUS) {
@@ -2017,13 +2695,23 @@ AsyncSocketFillRecvBuffer(AsyncSocket *s)
          needed = MIN(needed, pending);
       }
 
-   } while (needed);
+   } while (needed && budget > 0);
 
    /*
-    * Reach this point only when previous SSL_Pending returns 0 or 
-    * error is ASOCK_EWOULDBLOCK
+    * Reach this point only when previous SSL_Pending returns 0, error is
+    * ASOCK_EWOULDBLOCK, or the budget ran out.  Anything still buffered
+    * in the SSL layer won't wake poll, so come back for it.
     */
-   ASSERT(pending == 0 || sysErr == ASOCK_EWOULDBLOCK);
+   ASSERT(pending == 0 || sysErr == ASOCK_EWOULDBLOCK || budget <= 0);
+   if (budget <= 0 && SSL_Pending(s->sslSock)) {
+      ASOCKLOG(2, s, ("recv budget used up, installing recv RTime callback\n"));
+      Poll_CB_RTimeRemove(AsyncSocketRecvCallback, s, FALSE);
+      if (Poll_CB_RTime(AsyncSocketRecvCallback, s, 0, FALSE, NULL) !=
+          VMWARE_STATUS_SUCCESS) {
+         result = ASOCKERR_POLL;
+         goto exit;
+      }
+   }
 
    /*
     * Both a spurious wakeup and receiving any data even if it wasn't enough
@@ -2039,6 +2727,67 @@ exit:
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocketGatherSendBufs --
+ *
+ *      Describe the unsent part of the outgoing list as one iovec array,
+ *      starting sendPos bytes into the head entry and continuing across
+ *      as many queued entries as fit in ASOCK_MAX_WRITE_IOV segments.
+ *
+ * Results:
+ *      Number of segments filled in.  *len is set to their total size.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static int
+AsyncSocketGatherSendBufs(AsyncSocket *s,       // IN
+                          struct iovec *iov,    // OUT: ASOCK_MAX_WRITE_IOV
+                          int *len)             // OUT
+{
+   SendBufList *cur;
+   int skip = s->sendPos;
+   int cnt = 0;
+
+   *len = 0;
+   for (cur = s->sendBufList;
+        cur != NULL && cnt < ASOCK_MAX_WRITE_IOV;
+        cur = cur->next) {
+      struct iovec single;
+      struct iovec *segs = cur->iov;
+      int numSegs = cur->iovCnt;
+      int i;
+
+      if (segs == NULL) {
+         single.iov_base = cur->buf;
+         single.iov_len = cur->len;
+         segs = &single;
+         numSegs = 1;
+      }
+
+      for (i = 0; i < numSegs && cnt < ASOCK_MAX_WRITE_IOV; i++) {
+         if (skip >= (int)segs[i].iov_len) {
+            skip -= segs[i].iov_len;
+            continue;
+         }
+         iov[cnt].iov_base = (uint8 *) segs[i].iov_base + skip;
+         iov[cnt].iov_len = segs[i].iov_len - skip;
+         *len += iov[cnt].iov_len;
+         skip = 0;
+         cnt++;
+      }
+   }
+   ASSERT(cnt > 0);
+
+   return cnt;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -2048,11 +2797,18 @@ exit:
  *      actually writes to the wire assuming there's space in the buffers
  *      for the socket.
  *
+ *      Queued entries are written together: plain sockets flush up to
+ *      ASOCK_MAX_WRITE_IOV segments per writev, and SSL_Writev packs them
+ *      into full-size TLS records.  After SSL_ERROR_WANT_WRITE, SSL_Writev
+ *      repeats its failed write on the next call, whatever was queued
+ *      meanwhile; that data is still at the head of the list, since
+ *      nothing was popped.
+ *
  * Results:
  *      ASOCKERR_SUCESS if everything worked, else ASOCKERR_GENERIC.
  *
  * Side effects:
- *      None.
+ *      Fires the send callbacks of completed entries.
  *----------------------------------------------------------------------------
  */
 
@@ -2076,33 +2832,56 @@ AsyncSocketWriteBuffers(AsyncSocket *s)
    AsyncSocketAddRef(s);
 
    while (s->sendBufList && s->state == AsyncSocketConnected) {
-      SendBufList *head = s->sendBufList;
+      struct iovec iov[ASOCK_MAX_WRITE_IOV];
       int error = 0;
       int sent = 0;
-      int left = head->len - s->sendPos;
+      int left;
+      int cnt;
 
-      sent = SSL_Write(s->sslSock,
-                       (uint8 *) head->buf + s->sendPos, left);
-      ASOCKLOG(3, s, ("left\t%d\tsent\t%d\tremain\t%d\n",
-                      left, sent, left - sent));
+      cnt = AsyncSocketGatherSendBufs(s, iov, &left);
+      sent = SSL_Writev(s->sslSock, iov, cnt);
+      ASOCKLOG(3, s, ("left\t%d\tsent\t%d\tremain\t%d\tsegs\t%d\n",
+                      left, sent, left - sent, cnt));
       if (sent > 0) {
+         SendBufList *done = NULL;
+         SendBufList **doneTail = &done;
+
          s->sendBufFull = FALSE;
 	 s->sslConnected = TRUE;
-         if ((s->sendPos += sent) == head->len) {
-            /*
-             * We're done with the current buffer, so pop it off and nuke it.
-             * We do the list management *first*, so that the list is in a
-             * consistent state.
-             */
-            SendBufList tmp = *head;
 
+         /*
+          * Pop every entry that is now completely written, and do the list
+          * management *first*, so that the list is in a consistent state
+          * before any completion fires.
+          */
+         while (sent > 0) {
+            SendBufList *head = s->sendBufList;
+            int headLeft = head->len - s->sendPos;
+
+            if (sent < headLeft) {
+               s->sendPos += sent;
+               break;
+            }
+            sent -= headLeft;
+            s->sendPos = 0;
             s->sendBufList = head->next;
             if (s->sendBufList == NULL) {
                s->sendBufTail = &(s->sendBufList);
             }
-            s->sendPos = 0;
-            free(head);
+            head->next = NULL;
+            *doneTail = head;
+            doneTail = &head->next;
+         }
+
+         while (done != NULL) {
+            SendBufList tmp = *done;
+
+            AsyncSocketFreeSendBuf(s, done);
+            done = tmp.next;
 
+            if (tmp.owner) {
+               AsyncSocket_BufRelease(tmp.owner);
+            }
             if (tmp.sendFn) {
                /*
                 * XXX
@@ -2660,7 +3439,7 @@ AsyncSocket_Close(AsyncSocket *asock)
        * registered, and only fire the callbacks here if there was no error
        * handler invoked.
        */
-      ASSERT(!asock->recvBuf || asock->recvCb);
+      ASSERT(!asock->recvBuf || asock->recvCb || asock->recvPaused);
       if (asock->recvCb) {
          ASOCKLOG(1, asock, ("recvCb is non-NULL, removing recv callback\n"));
          removed = AsyncSocketPollRemove(asock, TRUE,
@@ -2694,6 +3473,16 @@ AsyncSocket_Close(AsyncSocket *asock)
          asock->sendCb = FALSE;
       }
 
+      if (asock->sslConnectFn) {
+         ASOCKLOG(1, asock, ("removing SSL connect callback\n"));
+         removed = AsyncSocketPollRemove(asock, TRUE, POLL_FLAG_WRITE,
+                                         AsyncSocketSslConnectCallback)
+            || AsyncSocketPollRemove(asock, TRUE, POLL_FLAG_READ,
+                                     AsyncSocketSslConnectCallback);
+         ASSERT(removed);
+         asock->sslConnectFn = NULL;
+      }
+
       while (asock->sendBufList) {
          /*
           * Pop each remaining buffer and fire its completion callback.
@@ -2704,9 +3493,12 @@ AsyncSocket_Close(AsyncSocket *asock)
                                        asock->sendPos, asock,
                                        asock->sendBufList->clientData);
          }
+         if (cur->owner) {
+            AsyncSocket_BufRelease(cur->owner);
+         }
          asock->sendBufList = asock->sendBufList->next;
          asock->sendPos = 0;
-         free(cur);
+         AsyncSocketFreeSendBuf(asock, cur);
       }
 
       break;
@@ -2780,6 +3572,108 @@ AsyncSocket_IsSendBufferFull(AsyncSocket *asock)
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_PauseRecv --
+ *
+ *      Stop reading from a TCP socket without dropping its recv request:
+ *      only the recv poll callback is removed, so unlike
+ *      AsyncSocket_CancelRecv this works while sends are pending.  The
+ *      request, with its buffer, callback and any partially received data,
+ *      is kept for AsyncSocket_ResumeRecv.  May be called from the recv
+ *      callback.
+ *
+ * Results:
+ *      ASOCKERR_SUCCESS, or ASOCKERR_INVAL if no recv is registered.
+ *
+ * Side effects:
+ *      Removes the recv poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int
+AsyncSocket_PauseRecv(AsyncSocket *asock) // IN
+{
+   Bool removed;
+
+   ASSERT(asock);
+
+   if (asock->type != SOCK_STREAM || asock->state != AsyncSocketConnected ||
+       !asock->recvCb) {
+      return ASOCKERR_INVAL;
+   }
+
+   ASOCKLOG(1, asock, ("Removing poll recv callback while pausing recv.\n"));
+   removed = AsyncSocketPollRemove(asock, TRUE,
+                                   POLL_FLAG_READ | POLL_FLAG_PERIODIC,
+                                   AsyncSocketRecvCallback);
+   ASSERT_NOT_IMPLEMENTED(removed);
+
+   /* Also drop any RTime callback queued for data buffered by SSL. */
+   Poll_CB_RTimeRemove(AsyncSocketRecvCallback, asock, FALSE);
+
+   asock->recvCb = FALSE;
+   asock->recvPaused = TRUE;
+
+   return ASOCKERR_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AsyncSocket_ResumeRecv --
+ *
+ *      Start reading again for a recv request stopped with
+ *      AsyncSocket_PauseRecv.  The recv callback doesn't fire from here,
+ *      only once poll finds data, so this may be called from anywhere.
+ *
+ * Results:
+ *      ASOCKERR_*.
+ *
+ * Side effects:
+ *      Registers the recv poll callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int
+AsyncSocket_ResumeRecv(AsyncSocket *asock) // IN
+{
+   VMwareStatus pollStatus;
+
+   ASSERT(asock);
+
+   if (!asock->recvPaused) {
+      return ASOCKERR_INVAL;
+   }
+   if (asock->state != AsyncSocketConnected) {
+      return ASOCKERR_NOTCONNECTED;
+   }
+
+   pollStatus = AsyncSocketPollAdd(asock, TRUE,
+                                   POLL_FLAG_READ | POLL_FLAG_PERIODIC,
+                                   AsyncSocketRecvCallback);
+   if (pollStatus != VMWARE_STATUS_SUCCESS) {
+      ASOCKWARN(asock, ("failed to install recv callback!\n"));
+      return ASOCKERR_POLL;
+   }
+   asock->recvCb = TRUE;
+   asock->recvPaused = FALSE;
+
+   /* Poll won't report data already read into the SSL layer. */
+   if (SSL_Pending(asock->sslSock) && !asock->inRecvLoop &&
+       Poll_CB_RTime(AsyncSocketRecvCallback, asock, 0, FALSE, NULL) !=
+       VMWARE_STATUS_SUCCESS) {
+      return ASOCKERR_POLL;
+   }
+
+   return ASOCKERR_SUCCESS;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -3142,6 +4036,13 @@ AsyncSocketRelease(AsyncSocket *s)
 {
    if (0 == --s->refCount) {
       ASOCKLOG(1, s, ("Final release; freeing asock struct\n"));
+      while (s->sendBufFree) {
+         SendBufList *cur = s->sendBufFree;
+
+         s->sendBufFree = cur->next;
+         free(cur->iovSpace);
+         free(cur);
+      }
       free(s);
       return 0;
    }
@@ -3249,6 +4150,9 @@ AsyncSocketPollRemove(AsyncSocket *asock,
  *    A partially read response may exist as AsyncSocketRecvCallback calls 
  *    the recv callback only when all the data has been received.
  *
+ *    It may also be called from the recv callback, to stop receiving until
+ *    AsyncSocket_Recv is called again.  It fails while a send is pending.
+ *
  * Results:
  *    ASOCKERR_SUCCESS or ASOCKERR_INVAL.
  *
@@ -3283,19 +4187,22 @@ AsyncSocket_CancelRecv(AsyncSocket *asock,         // IN
       return ASOCKERR_INVAL;
    }
 
-   if (asock->recvCb) {
-      Bool removed;
-      ASOCKLOG(1, asock, ("Removing poll recv callback while cancelling recv.\n"));
-      /*
-       * TODO: Maybe factor out this conditional to select between AsyncSocketRecvCallback
-       * and AsyncSocketRecvUDPCallback.
-       */
-      removed = AsyncSocketPollRemove(asock, TRUE,
-                                      POLL_FLAG_READ | POLL_FLAG_PERIODIC,
-                                      isTcp ? AsyncSocketRecvCallback :
-                                      AsyncSocketRecvUDPCallback);
-      ASSERT_NOT_IMPLEMENTED(removed);
+   if (asock->recvCb || asock->recvPaused) {
+      if (asock->recvCb) {
+         Bool removed;
+         ASOCKLOG(1, asock, ("Removing poll recv callback while cancelling recv.\n"));
+         /*
+          * TODO: Maybe factor out this conditional to select between AsyncSocketRecvCallback
+          * and AsyncSocketRecvUDPCallback.
+          */
+         removed = AsyncSocketPollRemove(asock, TRUE,
+                                         POLL_FLAG_READ | POLL_FLAG_PERIODIC,
+                                         isTcp ? AsyncSocketRecvCallback :
+                                         AsyncSocketRecvUDPCallback);
+         ASSERT_NOT_IMPLEMENTED(removed);
+      }
       asock->recvCb = FALSE;
+      asock->recvPaused = FALSE;
       if (isTcp && partialRecvd && asock->recvLen > 0) {
          ASOCKLOG(1, asock, ("Partially read %d bytes out of %d bytes while "
          	             "cancelling recv request.\n", asock->recvPos, asock->recvLen));
@@ -3509,3 +4416,119 @@ AsyncSocket_ConnectSSL(AsyncSocket *asock,          // IN
    ASSERT(asock);
    return SSL_ConnectAndVerify(asock->sslSock, verifyParam);
 }
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AsyncSocket_StartSslConnect --
+ *
+ *    Start the SSL handshake on a connected socket without blocking.  The
+ *    handshake is driven from poll callbacks and sslConnectFn fires when
+ *    it is over.  If session points at an SSL session from an earlier
+ *    connection to the same server, it is offered to skip the full
+ *    handshake.  verifyParam and session must stay valid until then, and
+ *    no recv or send may be started on the socket meanwhile.
+ *
+ * Results:
+ *    TRUE if the handshake was started, FALSE otherwise.
+ *
+ * Side effects:
+ *    On success *session is replaced with the session now in use, and the
+ *    callback is told whether it was the one offered.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+AsyncSocket_StartSslConnect(AsyncSocket *asock,                   // IN
+                            SSLVerifyParam *verifyParam,          // IN/OPT
+                            void **session,                       // IN/OUT/OPT
+                            AsyncSocketSslConnectFn sslConnectFn, // IN
+                            void *clientData)                     // IN
+{
+   VMwareStatus pollStatus;
+
+   ASSERT(asock);
+   ASSERT(sslConnectFn);
+
+   if (asock->state != AsyncSocketConnected || asock->sslConnectFn) {
+      Warning(ASOCKPREFIX "SSL connect on a socket not ready for it\n");
+      return FALSE;
+   }
+
+   /*
+    * A freshly connected socket is writable, so the first handshake step
+    * runs on the next poll iteration.
+    */
+   pollStatus = AsyncSocketPollAdd(asock, TRUE, POLL_FLAG_WRITE,
+                                   AsyncSocketSslConnectCallback);
+   if (pollStatus != VMWARE_STATUS_SUCCESS) {
+      Warning(ASOCKPREFIX "failed to register SSL connect callback\n");
+      return FALSE;
+   }
+
+   asock->sslConnectFn = sslConnectFn;
+   asock->sslConnectClientData = clientData;
+   asock->sslVerifyParam = verifyParam;
+   asock->sslSession = session;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AsyncSocketSslConnectCallback --
+ *
+ *    Poll callback for a socket in the middle of an SSL handshake.  Moves
+ *    the handshake on and waits for the direction it asks for, or fires
+ *    the completion callback.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    See AsyncSocket_StartSslConnect.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+AsyncSocketSslConnectCallback(void *clientData) // IN
+{
+   AsyncSocket *asock = (AsyncSocket *) clientData;
+   AsyncSocketSslConnectFn sslConnectFn;
+   Bool connected;
+   Bool resumed;
+
+   ASSERT(asock);
+   ASSERT(asock->sslConnectFn);
+
+   AsyncSocketAddRef(asock);
+
+   connected = SSL_ConnectNonBlocking(asock->sslSock, asock->sslVerifyParam,
+                                      asock->sslSession);
+   if (connected &&
+       (SSL_WantRead(asock->sslSock) || SSL_WantWrite(asock->sslSock))) {
+      VMwareStatus pollStatus;
+
+      pollStatus = AsyncSocketPollAdd(asock, TRUE,
+                                      SSL_WantRead(asock->sslSock) ?
+                                         POLL_FLAG_READ : POLL_FLAG_WRITE,
+                                      AsyncSocketSslConnectCallback);
+      if (pollStatus == VMWARE_STATUS_SUCCESS) {
+         goto exit;
+      }
+      Warning(ASOCKPREFIX "failed to register SSL connect callback\n");
+      connected = FALSE;
+   }
+
+   resumed = connected && SSL_SessionReused(asock->sslSock);
+   sslConnectFn = asock->sslConnectFn;
+   asock->sslConnectFn = NULL;
+   sslConnectFn(connected, resumed, asock, asock->sslConnectClientData);
+
+exit:
+   AsyncSocketRelease(asock);
+}
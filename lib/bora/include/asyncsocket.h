@@ -170,6 +170,8 @@ typedef void (*AsyncSocketErrorFn) (int error, AsyncSocket *asock,
                                     void *clientData);
 
 typedef void (*AsyncSocketConnectFn) (AsyncSocket *asock, void *clientData);
+typedef void (*AsyncSocketSslConnectFn) (Bool connected, Bool resumed,
+                                         AsyncSocket *asock, void *clientData);
 
 /*
  * Listen on port and fire callback with new asock
@@ -192,6 +194,17 @@ AsyncSocket *AsyncSocket_ListenIPStr(const char *ipStr,
                                      AsyncSocketPollParams *pollParams,
                                      int *error);
 
+#ifndef _WIN32
+/*
+ * Listen on a Unix-domain socket path ('@' prefix for an abstract name)
+ */
+AsyncSocket *AsyncSocket_ListenUnix(const char *path,
+                                    AsyncSocketConnectFn connectFn,
+                                    void *clientData,
+                                    AsyncSocketPollParams *pollParams,
+                                    int *error);
+#endif
+
 AsyncSocket *AsyncSocket_BindUDP(unsigned short port,
                                  void *clientData,
                                  AsyncSocketPollParams *pollParams,
@@ -212,12 +225,25 @@ AsyncSocket *AsyncSocket_ConnectIP(unsigned int ip, unsigned short port,
                                    AsyncSocketConnectFlags flags,
                                    AsyncSocketPollParams *pollParams,
                                    int *error);
+#ifndef _WIN32
+AsyncSocket *AsyncSocket_ConnectUnix(const char *path,
+                                     AsyncSocketConnectFn connectFn,
+                                     void *clientData,
+                                     AsyncSocketConnectFlags flags,
+                                     AsyncSocketPollParams *pollParams,
+                                     int *error);
+#endif
 
 /*
  * Initiate SSL connection on existing asock, with optional cert verification
  */
 Bool AsyncSocket_ConnectSSL(AsyncSocket *asock,
                             struct _SSLVerifyParam *verifyParam);
+Bool AsyncSocket_StartSslConnect(AsyncSocket *asock,
+                                 struct _SSLVerifyParam *verifyParam,
+                                 void **session,
+                                 AsyncSocketSslConnectFn sslConnectFn,
+                                 void *clientData);
 
 /*
  * Create a new AsyncSocket from an existing socket
@@ -253,6 +279,13 @@ int AsyncSocket_Flush(AsyncSocket *asock, int timeoutMS);
  */
 int AsyncSocket_Recv(AsyncSocket *asock, void *buf, int len, ...);
 
+/*
+ * Receive into buf and call recvFn with whatever arrived, up to len bytes
+ * (TCP only)
+ */
+int AsyncSocket_RecvPartial(AsyncSocket *asock, void *buf, int len,
+                            AsyncSocketRecvFn recvFn, void *clientData);
+
 /*
  * Specify the amount of data to send/receive and how long to wait before giving
  * up.
@@ -271,10 +304,38 @@ int AsyncSocket_SendBlocking(AsyncSocket *asock,
 int AsyncSocket_Send(AsyncSocket *asock, void *buf, int len,
                       AsyncSocketSendFn sendFn, void *clientData);
 
+/*
+ * Same as AsyncSocket_Send, but gathers the data from several segments
+ */
+struct iovec;
+int AsyncSocket_Sendv(AsyncSocket *asock, struct iovec *iov, int iovCnt,
+                      AsyncSocketSendFn sendFn, void *clientData);
+
+/*
+ * Reference counted owner of memory sent with AsyncSocket_SendBuf.  The
+ * owner embeds it in its buffer, counting its own reference, and releaseFn
+ * runs once AsyncSocket_BufRelease drops the last one.
+ */
+typedef struct AsyncSocketBuf {
+   int refCount;
+   void (*releaseFn)(struct AsyncSocketBuf *owner);
+} AsyncSocketBuf;
+
+void AsyncSocket_BufRelease(AsyncSocketBuf *owner);
+
+/*
+ * Same as AsyncSocket_Send, but instead of a send callback holds a reference
+ * to the buffer's owner until the data has been written
+ */
+int AsyncSocket_SendBuf(AsyncSocket *asock, AsyncSocketBuf *owner,
+                        void *buf, int len);
+
 int AsyncSocket_SendTo(AsyncSocket *asock, void *buf, int len,
                        AsyncSocketSendToType type, ... );
 
 int AsyncSocket_IsSendBufferFull(AsyncSocket *asock);
+int AsyncSocket_PauseRecv(AsyncSocket *asock);
+int AsyncSocket_ResumeRecv(AsyncSocket *asock);
 int AsyncSocket_CancelRecv(AsyncSocket *asock, int *partialRecvd, void **recvBuf,
                            void **recvFn); 
 
@@ -166,6 +166,7 @@ typedef uint32 PollClassSet;
 EXTERN void Poll_InitDefault(void);
 EXTERN void Poll_InitDefaultWithHighWin32EventLimit(void);
 EXTERN void Poll_InitGtk(void); // On top of glib for Linux
+EXTERN void Poll_InitEpoll(void); // On top of epoll(7) for Linux
 EXTERN void Poll_InitCF(void);  // On top of CoreFoundation for OSX
 
 
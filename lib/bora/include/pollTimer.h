@@ -0,0 +1,129 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * pollTimer.h --
+ *
+ *      POLL_REALTIME queue shared by the Poll implementations: 4-ary
+ *      min-heaps ordered by firing time, plus a (callback, clientData)
+ *      index so Poll_CallbackRemove doesn't have to scan.
+ */
+
+#ifndef _POLLTIMER_H_
+#define _POLLTIMER_H_
+
+#define INCLUDE_ALLOW_USERLEVEL
+#include "includeCheck.h"
+
+#include "vm_basic_types.h"
+#include "poll.h"
+
+
+/*
+ * Embedded in each implementation's realtime entry.  The owner fills in
+ * f and clientData before PollTimer_Add; everything else is maintained
+ * here.
+ */
+typedef struct PollTimer {
+   VmTimeType time;             // when the callback is due
+   uint64 seq;                  // queued order, breaks ties on time
+   PollerFunction f;            // lookup key
+   void *clientData;            // lookup key
+   int index;                   // heap slot, -1 when not queued
+   Bool periodic;
+   struct PollTimer *hashNext;
+} PollTimer;
+
+typedef struct PollTimerHeap {
+   PollTimer **nodes;
+   int num;
+   int size;
+} PollTimerHeap;
+
+/*
+ * One-shot and periodic timers live in separate heaps because periodic
+ * ones may fire up to a slop interval early; keeping them apart lets
+ * both heads be checked without walking either heap.
+ */
+typedef struct PollTimerQueue {
+   PollTimerHeap oneShot;
+   PollTimerHeap periodic;
+   PollTimer **hash;
+   unsigned int hashBits;
+   unsigned int numTimers;
+   uint64 nextSeq;
+} PollTimerQueue;
+
+
+void PollTimer_InitQueue(PollTimerQueue *queue);
+void PollTimer_ExitQueue(PollTimerQueue *queue);
+void PollTimer_Add(PollTimerQueue *queue, PollTimer *timer,
+                   VmTimeType time, Bool periodic);
+void PollTimer_Remove(PollTimerQueue *queue, PollTimer *timer);
+void PollTimer_Reschedule(PollTimerQueue *queue, PollTimer *timer,
+                          VmTimeType time);
+PollTimer *PollTimer_Lookup(PollTimerQueue *queue, PollerFunction f,
+                            void *clientData, PollTimer *prev);
+PollTimer *PollTimer_NextDue(PollTimerQueue *queue, VmTimeType now,
+                             VmTimeType periodicSlop);
+VmTimeType PollTimer_NextTime(PollTimerQueue *queue);
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_IsQueued --
+ *
+ *      Whether a timer is currently in the queue.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+PollTimer_IsQueued(const PollTimer *timer) // IN
+{
+   return timer->index >= 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_Any --
+ *
+ *      Some queued timer, or NULL if the queue is empty.  Used to drain
+ *      the queue on exit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE PollTimer *
+PollTimer_Any(const PollTimerQueue *queue) // IN
+{
+   if (queue->oneShot.num > 0) {
+      return queue->oneShot.nodes[queue->oneShot.num - 1];
+   }
+   if (queue->periodic.num > 0) {
+      return queue->periodic.nodes[queue->periodic.num - 1];
+   }
+   return NULL;
+}
+
+#endif /* _POLLTIMER_H_ */
@@ -147,16 +147,21 @@ Bool SSL_Connect(SSLSock sSock);
 Bool SSL_ConnectAndVerify(SSLSock sSock, SSLVerifyParam *verifyParam);
 Bool SSL_ConnectAndVerifyWithContext(SSLSock sSock, SSLVerifyParam *verifyParam,
                                      void *ctx);
+Bool SSL_ConnectNonBlocking(SSLSock sSock, SSLVerifyParam *verifyParam,
+                            void **session);
 Bool SSL_VerifyX509(SSLVerifyParam *verifyParam, void *x509Cert);
 Bool SSL_Accept(SSLSock sSock);
 Bool SSL_AcceptWithContext(SSLSock sSock, void *ctx);
 Bool SSL_CheckCert(SSLSock sSock, char *host, Bool allowSelfSigned);
 ssize_t SSL_Read(SSLSock ssl, char *buf, size_t num);
 ssize_t SSL_Write(SSLSock ssl,const char  *buf, size_t num);
+struct iovec;
+ssize_t SSL_Writev(SSLSock ssl, const struct iovec *iov, int iovCnt);
 int SSL_Shutdown(SSLSock ssl);
 int SSL_GetFd(SSLSock sSock);
 int SSL_Pending(SSLSock ssl);
 long SSL_SetMode(SSLSock ssl, long mode);
+Bool SSL_SessionReused(SSLSock ssl);
 int SSL_Want(const SSLSock ssl);
 int SSL_WantRead(const SSLSock ssl);
 int SSL_WantWrite(const SSLSock ssl);
@@ -421,6 +421,19 @@
 #endif
 
 
+/*
+ * SSL_session_reused is a macro over SSL_ctrl up to OpenSSL 1.0.x, and a
+ * function from 1.1.0 on, which also dropped SSL_CTRL_GET_SESSION_REUSED.
+ */
+
+#ifdef SSL_CTRL_GET_SESSION_REUSED
+#define VMW_SSL_RET_FUNCTIONS_SESSION_REUSED
+#else
+#define VMW_SSL_RET_FUNCTIONS_SESSION_REUSED \
+   VMW_SSL_FUNC(ssl, int, SSL_session_reused, (SSL *s), (s))
+#endif
+
+
 /*
  * These allow for libcurl (circa v7.18.0) to be linked statically.
  */
@@ -529,6 +542,7 @@
 #define VMW_SSL_RET_FUNCTIONS \
    VMW_SSL_RET_FUNCTIONS_COMMON \
    VMW_SSL_RET_FUNCTIONS_098 \
+   VMW_SSL_RET_FUNCTIONS_SESSION_REUSED \
    VMW_SSL_RET_FUNCTIONS_LIBCURL
 
 #define VMW_SSL_FUNCTIONS \
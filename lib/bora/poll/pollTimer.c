@@ -0,0 +1,526 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * pollTimer.c --
+ *
+ *      Realtime timer queue for the Poll implementations.  Insert,
+ *      cancel and reschedule are O(log n); finding a timer by callback
+ *      is O(1) on average.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmware.h"
+#include "util.h"
+#include "pollTimer.h"
+
+
+#define POLL_TIMER_ARITY         4
+#define POLL_TIMER_HASH_MIN_BITS 6
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerBefore --
+ *
+ *      Heap order: earlier due time first, and among timers due at the
+ *      same time, the one queued or rescheduled first.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+PollTimerBefore(const PollTimer *a,     // IN
+                const PollTimer *b)     // IN
+{
+   return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerHeapSet --
+ *
+ *      Store a timer in a heap slot.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+PollTimerHeapSet(PollTimerHeap *heap,   // IN
+                 int index,             // IN
+                 PollTimer *timer)      // IN
+{
+   heap->nodes[index] = timer;
+   timer->index = index;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerSiftUp --
+ *
+ *      Move the timer at index towards the root until its parent comes
+ *      before it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Heap reordered.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollTimerSiftUp(PollTimerHeap *heap,    // IN
+                int index)              // IN
+{
+   PollTimer *timer = heap->nodes[index];
+
+   while (index > 0) {
+      int parent = (index - 1) / POLL_TIMER_ARITY;
+
+      if (PollTimerBefore(heap->nodes[parent], timer)) {
+         break;
+      }
+      PollTimerHeapSet(heap, index, heap->nodes[parent]);
+      index = parent;
+   }
+   PollTimerHeapSet(heap, index, timer);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerSiftDown --
+ *
+ *      Move the timer at index towards the leaves until none of its
+ *      children comes before it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Heap reordered.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollTimerSiftDown(PollTimerHeap *heap,  // IN
+                  int index)            // IN
+{
+   PollTimer *timer = heap->nodes[index];
+
+   for (;;) {
+      int first = index * POLL_TIMER_ARITY + 1;
+      int last = MIN(first + POLL_TIMER_ARITY, heap->num);
+      int best;
+      int i;
+
+      if (first >= heap->num) {
+         break;
+      }
+      best = first;
+      for (i = first + 1; i < last; i++) {
+         if (PollTimerBefore(heap->nodes[i], heap->nodes[best])) {
+            best = i;
+         }
+      }
+      if (PollTimerBefore(timer, heap->nodes[best])) {
+         break;
+      }
+      PollTimerHeapSet(heap, index, heap->nodes[best]);
+      index = best;
+   }
+   PollTimerHeapSet(heap, index, timer);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerHeapFix --
+ *
+ *      Restore heap order after the timer at index changed time or was
+ *      replaced.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollTimerHeapFix(PollTimerHeap *heap,   // IN
+                 int index)             // IN
+{
+   if (index > 0 &&
+       PollTimerBefore(heap->nodes[index],
+                       heap->nodes[(index - 1) / POLL_TIMER_ARITY])) {
+      PollTimerSiftUp(heap, index);
+   } else {
+      PollTimerSiftDown(heap, index);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerHashBucket --
+ *
+ *      Find the lookup chain for a callback/clientData pair.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE PollTimer **
+PollTimerHashBucket(PollTimerQueue *queue,      // IN
+                    PollerFunction f,           // IN
+                    void *clientData)           // IN
+{
+   uint32 h = (uint32)(((uintptr_t)clientData >> 3) ^ ((uintptr_t)f >> 2));
+
+   h *= 2654435761U; // Knuth's multiplicative hash
+   return &queue->hash[h >> (32 - queue->hashBits)];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimerHashGrow --
+ *
+ *      Double the lookup table and rehash every timer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollTimerHashGrow(PollTimerQueue *queue)        // IN
+{
+   PollTimer **old = queue->hash;
+   unsigned int oldSize = 1U << queue->hashBits;
+   unsigned int i;
+
+   queue->hashBits++;
+   queue->hash = Util_SafeCalloc(1U << queue->hashBits, sizeof *queue->hash);
+   for (i = 0; i < oldSize; i++) {
+      PollTimer *timer;
+      PollTimer *next;
+
+      for (timer = old[i]; timer != NULL; timer = next) {
+         PollTimer **bucket =
+            PollTimerHashBucket(queue, timer->f, timer->clientData);
+
+         next = timer->hashNext;
+         timer->hashNext = *bucket;
+         *bucket = timer;
+      }
+   }
+   free(old);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_InitQueue --
+ *
+ *      Set up an empty timer queue.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates the lookup table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PollTimer_InitQueue(PollTimerQueue *queue)     // OUT
+{
+   memset(queue, 0, sizeof *queue);
+   queue->hashBits = POLL_TIMER_HASH_MIN_BITS;
+   queue->hash = Util_SafeCalloc(1U << queue->hashBits, sizeof *queue->hash);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_ExitQueue --
+ *
+ *      Free a timer queue.  The timers themselves belong to the caller
+ *      and must have been removed already.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PollTimer_ExitQueue(PollTimerQueue *queue)     // IN
+{
+   ASSERT(queue->numTimers == 0);
+   free(queue->oneShot.nodes);
+   free(queue->periodic.nodes);
+   free(queue->hash);
+   memset(queue, 0, sizeof *queue);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_Add --
+ *
+ *      Queue a timer to be due at the given time.  The caller must have
+ *      set timer->f and timer->clientData.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May grow the heap or the lookup table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PollTimer_Add(PollTimerQueue *queue,   // IN
+              PollTimer *timer,        // IN
+              VmTimeType time,         // IN
+              Bool periodic)           // IN
+{
+   PollTimerHeap *heap = periodic ? &queue->periodic : &queue->oneShot;
+   PollTimer **bucket;
+
+   if (heap->num == heap->size) {
+      heap->size = MAX(64, heap->size * 2);
+      heap->nodes = Util_SafeRealloc(heap->nodes,
+                                     heap->size * sizeof *heap->nodes);
+   }
+   timer->time = time;
+   timer->seq = queue->nextSeq++;
+   timer->periodic = periodic;
+   heap->nodes[heap->num] = timer;
+   PollTimerSiftUp(heap, heap->num++);
+
+   if (++queue->numTimers > (2U << queue->hashBits)) {
+      PollTimerHashGrow(queue);
+   }
+   bucket = PollTimerHashBucket(queue, timer->f, timer->clientData);
+   timer->hashNext = *bucket;
+   *bucket = timer;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_Remove --
+ *
+ *      Take a queued timer out of the queue.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PollTimer_Remove(PollTimerQueue *queue,        // IN
+                 PollTimer *timer)             // IN
+{
+   PollTimerHeap *heap = timer->periodic ? &queue->periodic : &queue->oneShot;
+   PollTimer **tp;
+   int index = timer->index;
+
+   ASSERT(index >= 0 && index < heap->num && heap->nodes[index] == timer);
+
+   heap->num--;
+   if (index < heap->num) {
+      PollTimerHeapSet(heap, index, heap->nodes[heap->num]);
+      PollTimerHeapFix(heap, index);
+   }
+   timer->index = -1;
+
+   for (tp = PollTimerHashBucket(queue, timer->f, timer->clientData);
+        *tp != timer;
+        tp = &(*tp)->hashNext) {
+      ASSERT(*tp != NULL); // must find
+   }
+   *tp = timer->hashNext;
+   timer->hashNext = NULL;
+   queue->numTimers--;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_Reschedule --
+ *
+ *      Change when a queued timer is due.  It goes behind timers already
+ *      queued for the same time, as if it were removed and added again.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+PollTimer_Reschedule(PollTimerQueue *queue,    // IN
+                     PollTimer *timer,         // IN
+                     VmTimeType time)          // IN
+{
+   ASSERT(PollTimer_IsQueued(timer));
+
+   timer->time = time;
+   timer->seq = queue->nextSeq++;
+   PollTimerHeapFix(timer->periodic ? &queue->periodic : &queue->oneShot,
+                    timer->index);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_Lookup --
+ *
+ *      Find queued timers for a callback/clientData pair.  Pass NULL
+ *      for prev to get the first one, and the previous result to get
+ *      the next.
+ *
+ * Results:
+ *      A matching timer, or NULL if there are no (more).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+PollTimer *
+PollTimer_Lookup(PollTimerQueue *queue,        // IN
+                 PollerFunction f,             // IN
+                 void *clientData,             // IN
+                 PollTimer *prev)              // IN: NULL or last result
+{
+   PollTimer *timer = prev ? prev->hashNext
+                           : *PollTimerHashBucket(queue, f, clientData);
+
+   for (; timer != NULL; timer = timer->hashNext) {
+      if (timer->f == f && timer->clientData == clientData) {
+         return timer;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_NextDue --
+ *
+ *      Find the earliest timer that may fire now: one-shot timers that
+ *      are due, and periodic ones due within periodicSlop.
+ *
+ * Results:
+ *      The timer, or NULL if nothing is due.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+PollTimer *
+PollTimer_NextDue(PollTimerQueue *queue,       // IN
+                  VmTimeType now,              // IN
+                  VmTimeType periodicSlop)     // IN
+{
+   PollTimer *oneShot = NULL;
+   PollTimer *periodic = NULL;
+
+   if (queue->oneShot.num > 0 && queue->oneShot.nodes[0]->time <= now) {
+      oneShot = queue->oneShot.nodes[0];
+   }
+   if (queue->periodic.num > 0 &&
+       queue->periodic.nodes[0]->time <= now + periodicSlop) {
+      periodic = queue->periodic.nodes[0];
+   }
+
+   if (oneShot == NULL) {
+      return periodic;
+   }
+   if (periodic == NULL || PollTimerBefore(oneShot, periodic)) {
+      return oneShot;
+   }
+   return periodic;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollTimer_NextTime --
+ *
+ *      When the earliest queued timer is due.
+ *
+ * Results:
+ *      That time, or 0 if the queue is empty.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VmTimeType
+PollTimer_NextTime(PollTimerQueue *queue)      // IN
+{
+   if (queue->oneShot.num == 0) {
+      return queue->periodic.num == 0 ? 0 : queue->periodic.nodes[0]->time;
+   }
+   if (queue->periodic.num == 0) {
+      return queue->oneShot.nodes[0]->time;
+   }
+   return MIN(queue->oneShot.nodes[0]->time, queue->periodic.nodes[0]->time);
+}
@@ -41,6 +41,7 @@
 #include "vmware.h"
 #include "vthreadBase.h"
 #include "pollImpl.h"
+#include "pollTimer.h"
 #include "hostinfo.h"
 #include "err.h"
 #include "util.h"
@@ -97,7 +98,7 @@ typedef struct PollEntry {
    Bool onQueue;		// this entry is on a poll queue
    PollerFunction f;
    void *clientData;
-   VmTimeType time;		// valid for POLL_REALTIME
+   PollTimer timer;		// valid for POLL_REALTIME
 
    union {
       uint32 delay;	 // The interval length between periodic callbacks
@@ -167,8 +168,9 @@ typedef struct {
 #endif
 
 typedef struct Poll {
-   PollEntry *queue[POLL_NUM_QUEUES];
+   PollEntry *queue[POLL_NUM_QUEUES];   // POLL_REALTIME is in timers
    PollEntry *free;
+   PollTimerQueue timers;
 
    struct ClassEvents {
       int numEvents;
@@ -216,6 +218,13 @@ PollFire(PollEntry *e)
 }
 
 
+static INLINE PollEntry *
+PollEntryFromTimer(PollTimer *timer)
+{
+   return (PollEntry *)((char *)timer - offsetof(PollEntry, timer));
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -310,6 +319,7 @@ PollDefaultInit(void)
 {
    ASSERT(pollState == NULL);
    pollState = Util_SafeCalloc(1, sizeof *pollState);
+   PollTimer_InitQueue(&pollState->timers);
 
    PollDefaultReset();
 }
@@ -347,6 +357,7 @@ PollDefaultExit(void)
 #endif
 
    PollDefaultReset();                           // destroy queue entries
+   PollTimer_ExitQueue(&poll->timers);
    WIN32_ONLY(ASSERT(socket2EventList == NULL);) // not used
    free(poll);                                   // free main structure
    pollState = NULL;
@@ -376,10 +387,18 @@ PollDefaultReset(void)
    Poll *poll = pollState;
    PollEntry *pe;
    PollEntry *next;
+   PollTimer *timer;
    int i;
 
    ASSERT(poll != NULL);
 
+   while ((timer = PollTimer_Any(&poll->timers)) != NULL) {
+      PollTimer_Remove(&poll->timers, timer);
+      pe = PollEntryFromTimer(timer);
+      ASSERT(pe->count > 0);
+      free(pe);
+   }
+
    for (i = 0; i < POLL_NUM_QUEUES; i++) {
       for (pe = poll->queue[i]; pe != NULL; pe = next) {
 	 next = pe->next;
@@ -478,40 +497,6 @@ PollDefaultLoopTimeout(Bool loop,          // IN: loop forever if TRUE, else do
 #undef CHECK_EXIT
 
 
-/*
- *----------------------------------------------------------------------
- *
- * PollInsert --
- *
- *      inserted into ordered queue of events.
- *
- *----------------------------------------------------------------------
- */
-
-static void
-PollInsert(PollEntry **queue,   // IN-OUT
-           PollEntry *e)        // IN
-{
-   ASSERT(e->count > 0);
-   ASSERT(!e->onQueue);
-   e->onQueue = TRUE;
-
-   if (*queue && (*queue)->time < e->time) {
-      PollEntry *tmp = *queue;
-      while (tmp->next && tmp->next->time < e->time) {
-         tmp = tmp->next;
-      }
-      ASSERT(e != tmp->next);
-      e->next = tmp->next;
-      tmp->next = e;
-   } else {
-      ASSERT(e != *queue);
-      e->next = *queue;
-      *queue = e;
-   }
-}
-
-
 /*
  *----------------------------------------------------------------------
  *
@@ -556,20 +541,16 @@ PollGetNextTime(PollEventType type,	// IN: Head of which queue
                 PollClass class)        // IN: Class mask
 {
    Poll *poll = pollState;
-   PollEntry *queue;
    PollClassSet classSet = 1 << class;
 
    ASSERT(type == POLL_REALTIME || type == POLL_VTIME);
-   queue = poll->queue[type];
+   ASSERT(poll->queue[POLL_VTIME] == NULL);
 
-   while (queue) {
-      if (queue->classSet & classSet) {
-         return queue->time;
-      }
-      queue = queue->next;
+   /* Realtime callbacks are always POLL_CS_MAIN. */
+   if (type != POLL_REALTIME || (classSet & POLL_CS_MAIN) == 0) {
+      return 0;
    }
-
-   return 0;
+   return PollTimer_NextTime(&poll->timers);
 }
 
 
@@ -610,6 +591,21 @@ PollDefaultCallbackRemove(PollClassSet classSet,
       if ((flags & (POLL_FLAG_READ|POLL_FLAG_WRITE)) == 0) {
 	 flags |= POLL_FLAG_READ;
       }
+   } else if (type == POLL_REALTIME) {
+      PollTimer *timer = NULL;
+
+      while ((timer = PollTimer_Lookup(&poll->timers, f, clientData,
+                                       timer)) != NULL) {
+         e = PollEntryFromTimer(timer);
+         if (e->classSet == classSet && e->flags == flags) {
+            ASSERT(e->onQueue);
+            e->onQueue = FALSE;
+            PollTimer_Remove(&poll->timers, timer);
+            PollEntryDecrement(poll, &e);
+            return TRUE;
+         }
+      }
+      return FALSE;
    }
 
    for (ep = &poll->queue[type]; (e = *ep) != NULL; ep = &e->next) {
@@ -892,9 +888,12 @@ PollDefaultCallback(PollClassSet classSet,
 
    case POLL_REALTIME:
       e->info.delay = (flags & POLL_FLAG_PERIODIC) ? info : 0;
-      e->time = info + Hostinfo_SystemTimerUS();
       ASSERT_BUG(2430, info >= 0);
-      ASSERT_BUG(1319, e->time > 0);
+      e->timer.f = f;
+      e->timer.clientData = clientData;
+      PollTimer_Add(&poll->timers, &e->timer, info + Hostinfo_SystemTimerUS(),
+                    (flags & POLL_FLAG_PERIODIC) != 0);
+      ASSERT_BUG(1319, e->timer.time > 0);
       break;
 
    case POLL_DEVICE: {
@@ -908,7 +907,6 @@ PollDefaultCallback(PollClassSet classSet,
       }
       /* info is a file descriptor/handle */
       e->info.fd = info;
-      e->time = 0;		//unused field
 #ifdef _WIN32
       if (flags & POLL_FLAG_SOCKET) {
          eventHandle = PollMapSocketToEvent((SOCKET)info,
@@ -1078,7 +1076,6 @@ PollDefaultCallback(PollClassSet classSet,
    case POLL_MAIN_LOOP:
       ASSERT(info == 0);
       e->info.fd = (PollDevHandle) VMW_INVALID_HANDLE;   /* unused field */
-      e->time = 0;                                       /* unused field */
       break;
 
    default:
@@ -1086,8 +1083,7 @@ PollDefaultCallback(PollClassSet classSet,
    }
 
    if (typeQueue == POLL_REALTIME) {
-      /* The queue is ordered, insert in the right place */
-      PollInsert(&poll->queue[typeQueue], e);
+      e->onQueue = TRUE;
    } else {
       /* The other queues are unordered, so just insert in front */
       e->next = poll->queue[typeQueue];
@@ -1156,8 +1152,8 @@ PollExecuteQueue(PollEventType typeQueue,
  *
  * PollFireRealtimeCallback --
  *
- *	Dequeue and fire a specified entry on the real time queue.
- *      A periodic entry is re-inserted into the queue.
+ *	Fire a specified entry on the real time queue.  A one-shot
+ *	entry is dequeued first, a periodic one is rescheduled.
  *
  * Result:
  *      TRUE if a callback was fired, else FALSE.
@@ -1172,46 +1168,32 @@ PollExecuteQueue(PollEventType typeQueue,
 static INLINE Bool
 PollFireRealtimeCallback(Poll *poll,            // IN: Poll struct
                          PollEntry *e,          // IN: entry to fire
-               	         PollEntry *previous,   // IN: previous entry in queue
 			 VmTimeType realTime)   // IN: current real time
 {
-   Bool fired = FALSE;
-
    ASSERT(e->count > 0);
    ASSERT(e->onQueue);
 
-   /* First, dequeue the entry */
-   e->onQueue = FALSE;
-   if (previous) {
-      previous->next = e->next;
-   } else {
-      ASSERT(e == poll->queue[POLL_REALTIME]);
-      poll->queue[POLL_REALTIME] = e->next;
-   }
-
    if ((e->flags & POLL_FLAG_PERIODIC) != 0) {
-       fired = TRUE;
        ASSERT(e->info.delay > 0);
-       e->time = realTime + e->info.delay;
-
-       PollInsert(&poll->queue[POLL_REALTIME], e);
+       PollTimer_Reschedule(&poll->timers, &e->timer,
+                            realTime + e->info.delay);
        e->count++;
        PollFire(e);
        if (--e->count <= 0) {
           PollEntryFree(e, poll);
        }
-
    } else {
       LOG(3, ("POLL: executing realtime callback %p(%p)\n",
 	  e->f, e->clientData));
-      fired = TRUE;
+      e->onQueue = FALSE;
+      PollTimer_Remove(&poll->timers, &e->timer);
       PollFire(e);
       if (--e->count <= 0) {
 	 PollEntryFree(e, poll);
       }
    }
 
-   return fired;
+   return TRUE;
 }
 
 
@@ -1254,33 +1236,24 @@ PollExecuteTimeQueues(VmTimeRealClock realTime,
     *
     * Periodic callbacks that are within POLL_TIME_SLOP microseconds in the
     * future are also eligible for firing.
-    * This code is tricky in that it can be recursively invoked by the callback,
-    * i.e., the queue can change as a side effect of firing.
+    * The queue can change as a side effect of firing, so the earliest
+    * eligible callback is looked up again after each one fires.
     *
-    * To handle this, two nested loops are used. The inner searches the time
-    * queue for the first eligible callback. If found, the callback is fired,
-    * we break out of the inner loop, and let the outer loop initiate a new
-    * search beginning from the head.
-    * If none is found, the outer loop terminates.
+    * Realtime callbacks are always POLL_CS_MAIN (see PollDefaultCallback).
     */
 
+   if ((classSet & POLL_CS_MAIN) == 0) {
+      return FALSE;
+   }
+
    do {
-      PollEntry *e        = poll->queue[POLL_REALTIME]; 
-      PollEntry *previous = NULL;
-      found               = FALSE;
-
-      while (e != NULL && e->time <= realTime + POLL_TIME_SLOP) {
-         if ((e->time <= realTime || (e->flags & POLL_FLAG_PERIODIC) != 0) &&
-	     (e->classSet & classSet)) {
-            found = TRUE;
-            if (PollFireRealtimeCallback(poll, e, previous, realTime)) {
-               fired = TRUE;
-            }
-            break;
-         } else {
-	    previous = e;
-            e = e->next;
-         }
+      PollTimer *timer = PollTimer_NextDue(&poll->timers, realTime,
+                                           POLL_TIME_SLOP);
+
+      found = timer != NULL;
+      if (found &&
+          PollFireRealtimeCallback(poll, PollEntryFromTimer(timer), realTime)) {
+         fired = TRUE;
       }
    } while (found);
 
@@ -0,0 +1,1332 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * pollEpoll.c --
+ *
+ *      An implementation of the Poll interface on top of Linux epoll(7).
+ *
+ *      Queue and class semantics are the same as pollDefault.c, but
+ *      device callbacks are registered with one epoll set per poll class
+ *      when they are added and unregistered when they are removed, so a
+ *      pass through the loop costs O(ready) instead of O(registered) and
+ *      there is no fixed limit on the number of descriptors.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "vmware.h"
+#include "pollImpl.h"
+#include "pollTimer.h"
+#include "hostinfo.h"
+#include "err.h"
+#include "util.h"
+
+#define LOGLEVEL_MODULE poll
+#include "loglevel_user.h"
+
+
+/*
+ * See pollDefault.c: periodic callbacks this close to their deadline are
+ * fired early rather than missed by a host tick.
+ */
+#define POLL_TIME_SLOP  2000 // 2 milliseconds
+
+/*
+ * Ready descriptors fetched per epoll_wait().  This bounds stack usage, not
+ * the number of descriptors: epoll is level-triggered, so anything left
+ * over is reported again on the next pass.
+ */
+#define POLL_EPOLL_BATCH 256
+
+/* Main loop callbacks gathered on the stack before falling back to heap. */
+#define POLL_MAIN_LOOP_BATCH 64
+
+#define POLL_HASH_MIN_BITS 6
+
+#define POLLINREADY     (EPOLLIN | EPOLLHUP | EPOLLERR)
+#define POLLOUTREADY    (EPOLLOUT | EPOLLHUP | EPOLLERR)
+
+
+typedef struct PollEntry {
+   struct PollEntry *next;      // queue link
+   struct PollEntry **prevp;    // &previous->next, or the queue head
+   struct PollEntry *hashNext;  // lookup chain for CallbackRemove
+   int count;                   // reference count
+   PollClassSet classSet;
+   int flags;
+   PollEventType type;
+   Bool onQueue;                // this entry is on a poll queue
+   PollerFunction f;
+   void *clientData;
+   PollTimer timer;             // valid for POLL_REALTIME
+
+   union {
+      uint32 delay;      // The interval length between periodic callbacks
+      PollDevHandle fd;  // fd for POLL_DEVICE events
+   } info;
+} PollEntry;
+
+typedef struct PollFdInfo {
+   PollEntry *readPollEntry;
+   PollEntry *writePollEntry;
+   uint32 events;               // mask currently registered with the kernel
+} PollFdInfo;
+
+typedef struct PollEpollSet {
+   int epfd;
+   int numRegistered;           // descriptors with a non-zero mask
+   int numFds;                  // size of fds[]
+   PollFdInfo *fds;             // indexed by descriptor
+} PollEpollSet;
+
+typedef struct Poll {
+   PollEntry *queue[POLL_NUM_QUEUES];   // POLL_REALTIME is in timers
+   PollEntry *free;
+   PollTimerQueue timers;
+
+   PollEntry **hash;            // other queued entries by (f, clientData)
+   unsigned int hashBits;
+   unsigned int numQueued;
+
+   PollEpollSet sets[POLL_FIXED_CLASSES];
+} Poll;
+
+static Poll *pollState;
+
+
+static void PollEpollReset(void);
+static void PollEntryDequeue(Poll *poll, PollEntry *e);
+static Bool PollFireQueue(Poll *poll, PollEntry **queue, int n);
+
+
+static INLINE void
+PollFire(PollEntry *e)
+{
+   (e->f)(e->clientData);
+}
+
+
+static INLINE PollEntry *
+PollEntryFromTimer(PollTimer *timer)
+{
+   return (PollEntry *)((char *)timer - offsetof(PollEntry, timer));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEntryIncrement --
+ *
+ *      Increment a poll entry's reference count
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+PollEntryIncrement(PollEntry *e) // IN/OUT
+{
+   ASSERT(e);
+   e->count++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEntryFree --
+ *
+ *      put poll entry on the polling device's free list
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollEntryFree(PollEntry *e,     // IN
+              Poll *poll)       // IN
+{
+   ASSERT(e->count == 0);
+   ASSERT(!e->onQueue);
+   e->next = poll->free;
+   poll->free = e;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEntryDecrement --
+ *
+ *      Decrement a poll entry's reference count and destroy
+ *      it if the count reaches zero.
+ *
+ * Side effects
+ *
+ *      If the entry is destroyed, the caller's pointer to it
+ *      is set to NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+PollEntryDecrement(Poll *poll,     // IN
+                   PollEntry **ep) // IN/OUT
+{
+   PollEntry *e;
+
+   ASSERT(ep);
+   e = *ep;
+   ASSERT(e);
+   ASSERT(e->count);
+   if (--e->count <= 0) {
+      PollEntryFree(e, poll);
+      *ep = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollHashBucket --
+ *
+ *      Find the lookup chain for a callback/clientData pair.
+ *
+ * Results:
+ *      Pointer to the head of the chain.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE PollEntry **
+PollHashBucket(Poll *poll,              // IN
+               PollerFunction f,        // IN
+               void *clientData)        // IN
+{
+   uint32 h = (uint32)(((uintptr_t)clientData >> 3) ^ ((uintptr_t)f >> 2));
+
+   h *= 2654435761U; // Knuth's multiplicative hash
+   return &poll->hash[h >> (32 - poll->hashBits)];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollHashInsert --
+ *
+ *      Add a queued entry to the lookup table, doubling the table when
+ *      the chains get long.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May rehash every queued entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollHashInsert(Poll *poll,      // IN
+               PollEntry *e)    // IN
+{
+   PollEntry **bucket;
+
+   if (++poll->numQueued > (2U << poll->hashBits)) {
+      PollEntry **old = poll->hash;
+      unsigned int oldSize = 1U << poll->hashBits;
+      unsigned int i;
+
+      poll->hashBits++;
+      poll->hash = Util_SafeCalloc(1U << poll->hashBits, sizeof *poll->hash);
+      for (i = 0; i < oldSize; i++) {
+         PollEntry *cur;
+         PollEntry *next;
+
+         for (cur = old[i]; cur != NULL; cur = next) {
+            next = cur->hashNext;
+            bucket = PollHashBucket(poll, cur->f, cur->clientData);
+            cur->hashNext = *bucket;
+            *bucket = cur;
+         }
+      }
+      free(old);
+   }
+
+   bucket = PollHashBucket(poll, e->f, e->clientData);
+   e->hashNext = *bucket;
+   *bucket = e;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollHashRemove --
+ *
+ *      Drop a queued entry from the lookup table.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollHashRemove(Poll *poll,      // IN
+               PollEntry *e)    // IN
+{
+   PollEntry **ep;
+
+   for (ep = PollHashBucket(poll, e->f, e->clientData);
+        *ep != e;
+        ep = &(*ep)->hashNext) {
+      ASSERT(*ep != NULL); // must find
+   }
+   *ep = e->hashNext;
+   e->hashNext = NULL;
+   ASSERT(poll->numQueued > 0);
+   poll->numQueued--;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollQueueLink --
+ *
+ *      Insert an entry in front of *head.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+PollQueueLink(PollEntry **head, // IN/OUT
+              PollEntry *e)     // IN
+{
+   e->next = *head;
+   if (e->next != NULL) {
+      e->next->prevp = &e->next;
+   }
+   e->prevp = head;
+   *head = e;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollQueueUnlink --
+ *
+ *      Remove an entry from whichever queue it is linked into.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+PollQueueUnlink(PollEntry *e)   // IN
+{
+   ASSERT(e->prevp != NULL && *e->prevp == e);
+   *e->prevp = e->next;
+   if (e->next != NULL) {
+      e->next->prevp = e->prevp;
+   }
+   e->next = NULL;
+   e->prevp = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollFdInfo --
+ *
+ *      Find the per-descriptor state of an epoll set, growing the
+ *      table to cover fd if needed.
+ *
+ * Results:
+ *      Pointer into the set's table.
+ *
+ * Side effects:
+ *      May reallocate the table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static PollFdInfo *
+PollEpollFdInfo(PollEpollSet *set,      // IN
+                int fd)                 // IN
+{
+   ASSERT(fd >= 0);
+
+   if (fd >= set->numFds) {
+      int numFds = MAX(64, set->numFds * 2);
+
+      while (numFds <= fd) {
+         numFds *= 2;
+      }
+      set->fds = Util_SafeRealloc(set->fds, numFds * sizeof *set->fds);
+      memset(set->fds + set->numFds, 0,
+             (numFds - set->numFds) * sizeof *set->fds);
+      set->numFds = numFds;
+   }
+   return &set->fds[fd];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollSync --
+ *
+ *      Bring the kernel's registration for fd in line with the read
+ *      and write entries currently attached to it.
+ *
+ * Results:
+ *      TRUE on success, FALSE if epoll_ctl refused the descriptor.
+ *
+ * Side effects:
+ *      Zero or one epoll_ctl call, two if the descriptor was closed and
+ *      reused without its callbacks being removed first.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollEpollSync(PollEpollSet *set,        // IN
+              int fd,                   // IN
+              PollFdInfo *fdInfo)       // IN/OUT
+{
+   struct epoll_event ev;
+   int op;
+   int ret;
+
+   memset(&ev, 0, sizeof ev);
+   ev.events = (fdInfo->readPollEntry ? EPOLLIN : 0) |
+               (fdInfo->writePollEntry ? EPOLLOUT : 0);
+   ev.data.fd = fd;
+
+   if (ev.events == fdInfo->events) {
+      return TRUE;
+   }
+
+   if (ev.events == 0) {
+      /*
+       * The descriptor may already be closed, in which case the kernel
+       * dropped it from the set on its own.
+       */
+      if (epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, &ev) < 0 &&
+          errno != EBADF && errno != ENOENT) {
+         Warning("POLL: epoll_ctl(DEL, %d) failed: %s\n", fd, Err_ErrString());
+      }
+      fdInfo->events = 0;
+      set->numRegistered--;
+      return TRUE;
+   }
+
+   op = fdInfo->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+   ret = epoll_ctl(set->epfd, op, fd, &ev);
+   if (ret < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+      ret = epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &ev);
+   } else if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+      ret = epoll_ctl(set->epfd, EPOLL_CTL_MOD, fd, &ev);
+   }
+   if (ret < 0) {
+      Warning("POLL: epoll_ctl(%s, %d) failed: %s\n",
+              op == EPOLL_CTL_ADD ? "ADD" : "MOD", fd, Err_ErrString());
+      return FALSE;
+   }
+
+   if (fdInfo->events == 0) {
+      set->numRegistered++;
+   }
+   fdInfo->events = ev.events;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollDetach --
+ *
+ *      Remove a device entry from the epoll sets of the first
+ *      numClasses classes in its class set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      epoll_ctl.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollEpollDetach(Poll *poll,             // IN
+                PollEntry *e,           // IN
+                int numClasses)         // IN
+{
+   int fd = e->info.fd;
+   int i;
+
+   for (i = 0; i < numClasses; i++) {
+      PollEpollSet *set = &poll->sets[i];
+      PollFdInfo *fdInfo;
+
+      if ((e->classSet & (1 << i)) == 0) {
+         continue;
+      }
+
+      ASSERT(fd < set->numFds);
+      fdInfo = &set->fds[fd];
+      ASSERT(fdInfo->readPollEntry == e || fdInfo->writePollEntry == e);
+
+      if (fdInfo->readPollEntry == e) {
+         fdInfo->readPollEntry = NULL;
+      }
+      if (fdInfo->writePollEntry == e) {
+         fdInfo->writePollEntry = NULL;
+      }
+      PollEpollSync(set, fd, fdInfo);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollAttach --
+ *
+ *      Register a device entry with the epoll set of every class in its
+ *      class set.
+ *
+ * Results:
+ *      VMWARE_STATUS_SUCCESS, or VMWARE_STATUS_ERROR if the kernel
+ *      refused the descriptor.
+ *
+ * Side effects:
+ *      epoll_ctl.  Nothing is left registered on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMwareStatus
+PollEpollAttach(Poll *poll,             // IN
+                PollEntry *e)           // IN
+{
+   int fd = e->info.fd;
+   int i;
+
+   for (i = 0; i < POLL_FIXED_CLASSES; i++) {
+      PollEpollSet *set = &poll->sets[i];
+      PollFdInfo *fdInfo;
+
+      if ((e->classSet & (1 << i)) == 0) {
+         continue;
+      }
+
+      fdInfo = PollEpollFdInfo(set, fd);
+
+      /*
+       * Assert that a maximum of one callback may be registered
+       * for a given direction on a given descriptor.
+       */
+      if (e->flags & POLL_FLAG_WRITE) {
+         ASSERT(!fdInfo->writePollEntry);
+         fdInfo->writePollEntry = e;
+      }
+      if (e->flags & POLL_FLAG_READ) {
+         ASSERT(!fdInfo->readPollEntry);
+         fdInfo->readPollEntry = e;
+      }
+
+      if (!PollEpollSync(set, fd, fdInfo)) {
+         if (fdInfo->writePollEntry == e) {
+            fdInfo->writePollEntry = NULL;
+         }
+         if (fdInfo->readPollEntry == e) {
+            fdInfo->readPollEntry = NULL;
+         }
+         PollEpollDetach(poll, e, i);
+         return VMWARE_STATUS_ERROR;
+      }
+   }
+   return VMWARE_STATUS_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollInit --
+ *
+ *      Module initialization.
+ *
+ * Results: void
+ *
+ * Side effects: poll is alive
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollEpollInit(void)
+{
+   Poll *poll;
+   int i;
+
+   ASSERT(pollState == NULL);
+   poll = pollState = Util_SafeCalloc(1, sizeof *pollState);
+
+   poll->hashBits = POLL_HASH_MIN_BITS;
+   poll->hash = Util_SafeCalloc(1U << poll->hashBits, sizeof *poll->hash);
+   PollTimer_InitQueue(&poll->timers);
+
+   for (i = 0; i < POLL_FIXED_CLASSES; i++) {
+      int epfd = epoll_create(64); // size is only a hint
+
+      if (epfd < 0) {
+         Panic("POLL: epoll_create failed: %s\n", Err_ErrString());
+      }
+      fcntl(epfd, F_SETFD, FD_CLOEXEC);
+      poll->sets[i].epfd = epfd;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollExit --
+ *
+ *      module de-initalization
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PollEpollExit(void)
+{
+   Poll *poll = pollState;
+   int i;
+
+   PollEpollReset();                  // destroy queue entries
+   for (i = 0; i < POLL_FIXED_CLASSES; i++) {
+      close(poll->sets[i].epfd);
+   }
+   PollTimer_ExitQueue(&poll->timers);
+   free(poll->hash);
+   free(poll);                        // free main structure
+   pollState = NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PollEpollReset --
+ *
+ *      Clear all entries from all queues and forget every descriptor.
+ *
+ * Results:
+ *      No.
+ *
+ * Side effects:
+ *	No more callbacks until new ones are registered.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+PollEpollReset(void)
+{
+   Poll *poll = pollState;
+   PollEntry *pe;
+   PollEntry *next;
+   PollTimer *timer;
+   int i;
+
+   ASSERT(poll != NULL);
+
+   while ((timer = PollTimer_Any(&poll->timers)) != NULL) {
+      PollTimer_Remove(&poll->timers, timer);
+      pe = PollEntryFromTimer(timer);
+      ASSERT(pe->count > 0);
+      free(pe);
+   }
+
+   for (i = 0; i < POLL_NUM_QUEUES; i++) {
+      for (pe = poll->queue[i]; pe != NULL; pe = next) {
+	 next = pe->next;
+         ASSERT(pe->count > 0);
+	 free(pe);
+      }
+      poll->queue[i] = NULL;
+   }
+
+   for (pe = poll->free; pe != NULL; pe = next) {
+      next = pe->next;
+      ASSERT(pe->count == 0);
+      free(pe);
+   }
+   poll->free = NULL;
+
+   memset(poll->hash, 0, (1U << poll->hashBits) * sizeof *poll->hash);
+   poll->numQueued = 0;
+
+   for (i = 0; i < POLL_FIXED_CLASSES; i++) {
+      PollEpollSet *set = &poll->sets[i];
+      int fd;
+
+      for (fd = 0; fd < set->numFds && set->numRegistered > 0; fd++) {
+         if (set->fds[fd].events != 0) {
+            epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, NULL);
+            set->numRegistered--;
+         }
+      }
+      free(set->fds);
+      set->fds = NULL;
+      set->numFds = 0;
+      set->numRegistered = 0;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PollEntryDequeue --
+ *
+ *      Remove an entry from its poll queue.
+ *
+ * Results:
+ *      No
+ *
+ * Side effects:
+ *	Alter the queue, drop the queue's reference to the entry,
+ *	and possibly change the epoll sets for a POLL_DEVICE entry.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+PollEntryDequeue(Poll *poll,    // IN
+                 PollEntry *e)  // IN
+{
+   ASSERT(e->onQueue);
+   e->onQueue = FALSE;
+   if (e->type == POLL_REALTIME) {
+      PollTimer_Remove(&poll->timers, &e->timer);
+   } else {
+      PollQueueUnlink(e);
+      PollHashRemove(poll, e);
+      if (e->type == POLL_DEVICE) {
+         PollEpollDetach(poll, e, POLL_FIXED_CLASSES);
+      }
+   }
+   PollEntryDecrement(poll, &e); // might be the last reference
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollFireAndDequeue --
+ *
+ *   If a poll entry is on a poll queue, fire it. Before firing, the
+ *   entry is removed from the queue if it is non-periodic.
+ *
+ * Result:
+ *
+ *   TRUE if the entry was on the queue and was fired. FALSE otherwise
+ *
+ * Side effects:
+ *
+ *   The entry may be dequeued and destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollFireAndDequeue(Poll *poll,           // IN
+                   PollEntry *e)         // IN
+{
+   ASSERT(e);
+   ASSERT(e->count > 0);
+
+   if (!e->onQueue) {
+      return FALSE;
+   }
+
+   /*
+    * Maintain a reference on e while firing; the callback might remove it
+    * and we don't want it to totally disappear till we're ready.
+    */
+   PollEntryIncrement(e);
+   if ((e->flags & POLL_FLAG_PERIODIC) == 0) {
+      PollEntryDequeue(poll, e);
+   }
+
+   PollFire(e);
+
+   /*
+    * Balance the increment above.  Note that this will destroy e if it's
+    * already been dequeued.
+    */
+   PollEntryDecrement(poll, &e);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * PollFireQueue --
+ *
+ *      Fire the N entries gathered in QUEUE, each of which carries a
+ *      reference taken by the caller.
+ *
+ * Results:
+ *      TRUE if at least one callback fired. FALSE otherwise.
+ *
+ * Side effects:
+ *	The callbacks may do anything, including calling
+ *	Poll_Loop reentrantly.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+PollFireQueue(Poll *poll,       // IN
+              PollEntry **queue,// IN
+              int n)            // IN
+{
+   Bool fired = FALSE;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      PollEntry *e = queue[i];
+
+      if (PollFireAndDequeue(poll, e)) {
+         fired = TRUE;
+      }
+      PollEntryDecrement(poll, &e);
+   }
+   return fired;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollExecuteMainLoop --
+ *
+ *	Fire all the main loop callbacks of a class and
+ *	dequeue the one-time entries.
+ *
+ * Result:
+ *      TRUE if a callback was fired, else FALSE.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollExecuteMainLoop(Poll *poll,         // IN
+                    PollClass class)    // IN
+{
+   PollClassSet classSet = 1 << class;
+   PollEntry *stackQueue[POLL_MAIN_LOOP_BATCH];
+   PollEntry **queue = stackQueue;
+   PollEntry *e;
+   Bool fired;
+   int n = 0;
+
+   for (e = poll->queue[POLL_MAIN_LOOP]; e != NULL; e = e->next) {
+      if ((e->classSet & classSet) != 0) {
+         n++;
+      }
+   }
+   if (n == 0) {
+      return FALSE;
+   }
+   if (n > ARRAYSIZE(stackQueue)) {
+      queue = Util_SafeMalloc(n * sizeof *queue);
+   }
+
+   n = 0;
+   for (e = poll->queue[POLL_MAIN_LOOP]; e != NULL; e = e->next) {
+      if ((e->classSet & classSet) != 0) {
+         /* Balanced by the decrement in PollFireQueue. */
+         PollEntryIncrement(e);
+         queue[n++] = e;
+      }
+   }
+
+   fired = PollFireQueue(poll, queue, n);
+   if (queue != stackQueue) {
+      free(queue);
+   }
+   return fired;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollExecuteTimeQueues --
+ *
+ *	Fire every realtime callback of the class that is due by
+ *	realTime, rescheduling periodic ones.  Callbacks only fire once
+ *	per call, and the queue may change under us as they fire, so the
+ *	earliest due timer is looked up again after each one.
+ *
+ * Result:
+ *      TRUE if a callback was fired, else FALSE.
+ *
+ * Side effects:
+ *      Time-based callbacks can be fired.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollExecuteTimeQueues(Poll *poll,               // IN
+                      VmTimeType realTime,      // IN
+                      PollClass class)          // IN
+{
+   Bool fired = FALSE;
+   PollTimer *timer;
+
+   /* Realtime callbacks are always POLL_CS_MAIN (see PollEpollCallback). */
+   if (((1 << class) & POLL_CS_MAIN) == 0) {
+      return FALSE;
+   }
+
+   while ((timer = PollTimer_NextDue(&poll->timers, realTime,
+                                     POLL_TIME_SLOP)) != NULL) {
+      PollEntry *e = PollEntryFromTimer(timer);
+
+      PollEntryIncrement(e);
+      if ((e->flags & POLL_FLAG_PERIODIC) != 0) {
+         ASSERT(e->info.delay > 0);
+         PollTimer_Reschedule(&poll->timers, timer, realTime + e->info.delay);
+      } else {
+         LOG(3, ("POLL: executing realtime callback %p(%p)\n",
+                 e->f, e->clientData));
+         PollEntryDequeue(poll, e);
+      }
+      PollFire(e);
+      PollEntryDecrement(poll, &e);
+      fired = TRUE;
+   }
+
+   return fired;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollGetNextTime --
+ *
+ *	Returns the time the next realtime callback of the class wants
+ *	to fire.
+ *
+ * Results:
+ *	Firing time, or 0 if there is none.
+ *
+ * Side Effects:
+ *	None.
+ *----------------------------------------------------------------------
+ */
+
+static VmTimeType
+PollGetNextTime(Poll *poll,             // IN
+                PollClass class)        // IN
+{
+   if (((1 << class) & POLL_CS_MAIN) == 0) {
+      return 0;
+   }
+   return PollTimer_NextTime(&poll->timers);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollExecuteDevice --
+ *
+ *      Wait on the class's epoll set and fire the callbacks of the
+ *      descriptors that are ready.
+ *
+ * Result: whether we fired anything
+ *
+ * Side effects: everything.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollExecuteDevice(Poll *poll,           // IN
+                  uint32 timeout,       // IN microsecs
+                  PollClass class)      // IN
+{
+   PollEpollSet *set = &poll->sets[class];
+   struct epoll_event events[POLL_EPOLL_BATCH];
+   PollEntry *queue[2 * POLL_EPOLL_BATCH];
+   int retval;
+   int n = 0;
+   int i;
+
+   ASSERT(0 <= class && class < POLL_FIXED_CLASSES);
+
+   /* Cut out early if nothing to wait on and not sleepy. */
+   if (set->numRegistered == 0 && timeout == 0) {
+      return FALSE;
+   }
+
+   retval = epoll_wait(set->epfd, events, ARRAYSIZE(events),
+                       CEILING(timeout, 1000));
+   if (retval <= 0) {
+      if (retval < 0 && errno != EINTR) {
+         Warning("POLL: epoll_wait failed: %s\n", Err_ErrString());
+         NOT_REACHED();
+      }
+      return FALSE;
+   }
+
+   /*
+    * Gather everything first and take a reference on each entry: the
+    * callbacks may remove other ready entries, or register new ones on
+    * the same descriptors.
+    */
+   for (i = 0; i < retval; i++) {
+      int fd = events[i].data.fd;
+      uint32 revents = events[i].events;
+      PollFdInfo *fdInfo;
+
+      ASSERT(fd >= 0 && fd < set->numFds);
+      fdInfo = &set->fds[fd];
+
+      if ((revents & POLLINREADY) && fdInfo->readPollEntry) {
+         queue[n++] = fdInfo->readPollEntry;
+         PollEntryIncrement(fdInfo->readPollEntry);
+      }
+      if ((revents & POLLOUTREADY) && fdInfo->writePollEntry &&
+          fdInfo->writePollEntry != fdInfo->readPollEntry) {
+         queue[n++] = fdInfo->writePollEntry;
+         PollEntryIncrement(fdInfo->writePollEntry);
+      }
+   }
+
+   return n > 0 && PollFireQueue(poll, queue, n);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollLoopTimeout --
+ *
+ *	The poll loop.
+ *	This is supposed to be the main loop for most programs.
+ *
+ * Result:
+ *	Void.
+ *
+ * Side effects:
+ *      Fiat lux!
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define CHECK_EXIT() \
+   if (exit && *exit == TRUE) { return; }
+
+static void
+PollEpollLoopTimeout(Bool loop,          // IN: loop forever if TRUE, else do one pass.
+                     Bool *exit,         // IN: NULL or set to TRUE to end loop.
+                     PollClass class,    // IN: class of events (POLL_CLASS_*)
+                     int timeout)        // IN: maximum time to sleep
+{
+   Poll *poll = pollState;
+
+   ASSERT(timeout >= 0);
+   ASSERT((class & POLL_CS_BIT) == 0); // Prevent confusion.
+
+   if (exit && *exit == TRUE) {
+      Warning("Poll: Asked to return before even starting!\n");
+      ASSERT_DEVEL(FALSE);
+      return;
+   }
+
+   do {
+      VmTimeType nextTimeEvent;
+      VmTimeType now;
+
+      PollExecuteMainLoop(poll, class);
+      CHECK_EXIT();
+
+      now = Hostinfo_SystemTimerUS();
+      PollExecuteTimeQueues(poll, now, class);
+      CHECK_EXIT();
+
+      if (timeout == 0) {
+         nextTimeEvent = 0;
+      } else if ((nextTimeEvent = PollGetNextTime(poll, class)) == 0) {
+         /* Cannot just use -1 since main-loop callbacks still want to fire. */
+         nextTimeEvent = timeout;
+      } else {
+         nextTimeEvent = MAX(0, nextTimeEvent - now);
+         nextTimeEvent = MIN(nextTimeEvent, timeout);
+      }
+      ASSERT(nextTimeEvent >= 0);
+      ASSERT(nextTimeEvent <= 0xffffffff);
+
+      PollExecuteDevice(poll, (uint32) nextTimeEvent, class);
+      CHECK_EXIT();
+   } while (loop);
+}
+
+#undef CHECK_EXIT
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollCallbackRemove --
+ *
+ *      remove a callback from the real-time queue, the file descriptor
+ *      sets, or the main loop queue.
+ *
+ * Results:
+ *      TRUE if entry found and removed, FALSE otherwise
+ *
+ * Side effects:
+ *      queues modified
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+PollEpollCallbackRemove(PollClassSet classSet,  // IN
+                        int flags,              // IN
+                        PollerFunction f,       // IN
+                        void *clientData,       // IN
+                        PollEventType type)     // IN
+{
+   Poll *poll = pollState;
+   PollEntry *e;
+
+   ASSERT(poll);
+   ASSERT(type >= 0 && type < POLL_NUM_QUEUES);
+
+   if (type == POLL_DEVICE) {
+      /*
+       * When neither flag is passed, default to READ.
+       */
+      if ((flags & (POLL_FLAG_READ|POLL_FLAG_WRITE)) == 0) {
+	 flags |= POLL_FLAG_READ;
+      }
+   } else if (type == POLL_REALTIME) {
+      PollTimer *timer = NULL;
+
+      while ((timer = PollTimer_Lookup(&poll->timers, f, clientData,
+                                       timer)) != NULL) {
+         e = PollEntryFromTimer(timer);
+         if (e->classSet == classSet && e->flags == flags) {
+            PollEntryDequeue(poll, e);
+            return TRUE;
+         }
+      }
+      return FALSE;
+   }
+
+   for (e = *PollHashBucket(poll, f, clientData); e != NULL; e = e->hashNext) {
+      if (e->f == f && e->clientData == clientData && e->type == type &&
+          e->classSet == classSet && e->flags == flags) {
+         PollEntryDequeue(poll, e);
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PollEpollCallback --
+ *
+ *      Insert a callback into one of the queues (e.g., the real-time
+ *      queue, the file descriptor sets, or the main loop queue).
+ *
+ *      For the POLL_REALTIME or POLL_DEVICE queues, entries can be
+ *      inserted for good, to fire on a periodic basis (by setting the
+ *      POLL_FLAG_PERIODIC flag).
+ *
+ *      Otherwise, the callback fires only once.
+ *
+ *	For periodic POLL_REALTIME callbacks, "info" is the time in
+ *	microseconds between execution of the callback.  For
+ *	POLL_DEVICE callbacks, info is a file descriptor.
+ *
+ * Results:
+ *      VMWARE_STATUS_SUCCESS, or VMWARE_STATUS_ERROR if the descriptor
+ *      could not be added to an epoll set.
+ *
+ * Side effects:
+ *      Queues and epoll sets modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMwareStatus
+PollEpollCallback(PollClassSet classSet,        // IN
+                  int flags,                    // IN
+                  PollerFunction f,             // IN
+                  void *clientData,             // IN
+                  PollEventType type,           // IN
+                  PollDevHandle info,           // IN
+                  struct DeviceLock *lock)      // IN
+{
+   Poll *poll = pollState;
+   PollEntry *e;
+
+   ASSERT(f);
+   ASSERT(lock == NULL);
+   ASSERT(poll != NULL);
+   LOG(3, ("POLL: inserting callback %p(%p), type 0x%x, %s = %"FMTH"d\n",
+	   f, clientData, type, (type == POLL_DEVICE) ? "fd": "delay",
+           info));
+   ASSERT_NOT_IMPLEMENTED(type != POLL_VIRTUALREALTIME);
+   ASSERT_NOT_IMPLEMENTED(type != POLL_VTIME);
+   ASSERT(   (type == POLL_DEVICE)
+          == ((flags & (POLL_FLAG_READ | POLL_FLAG_WRITE)) != 0));
+   ASSERT((flags&(POLL_FLAG_READ|POLL_FLAG_WRITE))
+          != (POLL_FLAG_READ|POLL_FLAG_WRITE));
+
+   /* Make sure caller passed POLL_CS instead of POLL_CLASS. */
+   ASSERT(classSet & POLL_CS_BIT);
+   /* For now, only allow POLL_CS_MAIN for time events. */
+   ASSERT_NOT_IMPLEMENTED(classSet == POLL_CS_MAIN || type != POLL_REALTIME);
+   /* Every callback must be in POLL_CLASS_MAIN (plus possibly others) */
+   ASSERT((classSet & 1 << POLL_CLASS_MAIN) != 0);
+
+   if (poll->free) {
+      e = poll->free;
+      poll->free = e->next;
+   } else {
+      e = Util_SafeCalloc(1, sizeof *e);
+   }
+   ASSERT(e->count == 0);
+   e->next = NULL;
+   e->prevp = NULL;
+   e->hashNext = NULL;
+   PollEntryIncrement(e);
+   e->f          = f;
+   e->clientData = clientData;
+   e->classSet	 = classSet;
+   e->flags	 = flags;
+   e->type       = type;
+
+   switch (type) {
+   case POLL_REALTIME:
+      ASSERT(info >= 0);
+      e->info.delay = (flags & POLL_FLAG_PERIODIC) ? info : 0;
+      e->timer.f = f;
+      e->timer.clientData = clientData;
+      PollTimer_Add(&poll->timers, &e->timer, info + Hostinfo_SystemTimerUS(),
+                    (flags & POLL_FLAG_PERIODIC) != 0);
+      e->onQueue = TRUE;
+      return VMWARE_STATUS_SUCCESS;
+   case POLL_DEVICE:
+      ASSERT(info >= 0);
+      e->info.fd = info;
+      if (PollEpollAttach(poll, e) != VMWARE_STATUS_SUCCESS) {
+         PollEntryDecrement(poll, &e);
+         return VMWARE_STATUS_ERROR;
+      }
+      PollQueueLink(&poll->queue[type], e);
+      break;
+   case POLL_MAIN_LOOP:
+      ASSERT(info == 0);
+      e->info.fd = -1;   /* unused field */
+      PollQueueLink(&poll->queue[type], e);
+      break;
+   default:
+      NOT_REACHED();
+   }
+
+   e->onQueue = TRUE;
+   PollHashInsert(poll, e);
+   return VMWARE_STATUS_SUCCESS;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Poll_InitEpoll --
+ *
+ *      Public init function for this Poll implementation. Poll loop will be
+ *      up and running after this is called.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      One epoll descriptor per poll class is opened.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Poll_InitEpoll(void)
+{
+   static PollImpl epollImpl =
+   {
+      PollEpollInit,
+      PollEpollExit,
+      PollEpollLoopTimeout,
+      PollEpollCallback,
+      PollEpollCallbackRemove,
+   };
+
+   Poll_InitWithImpl(&epollImpl);
+}
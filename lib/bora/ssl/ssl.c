@@ -98,8 +98,18 @@ struct SSLSockStruct {
    IOState ioState;
    int sslIOError;
    SyncRecMutex spinlock;
+
+   char *writevBuf;   // Record packing buffer for SSL_Writev, lazily allocated
+   const char *writevRetryBuf; // SSL_write for SSL_Writev to repeat, or NULL
+   size_t writevRetryLen;
 };
 
+/*
+ * Largest amount of plaintext SSL_Writev packs into a single SSL_write, so
+ * that a run of small segments goes out as one full-size TLS record.
+ */
+#define SSL_WRITEV_BUFSIZE SSL3_RT_MAX_PLAIN_LENGTH
+
 #ifndef _WIN32
 #include <dlfcn.h>
 #endif
@@ -2133,37 +2143,31 @@ SSL_ConnectAndVerify(SSLSock sSock,               // IN: SSL socket
 /*
  *----------------------------------------------------------------------
  *
- * SSL_ConnectAndVerifyWithContext()
+ * SSLConnectSetup()
  *
- *      Similar to SSL_Connect, but allows for verification of
- *      peer-certificate. Verification is turned on if the verifyParam
- *      is non-NULL, in which case the verifyParam data structure
- *      stores input and output parameters for the verification.
+ *      Create the client side SSL object of a socket, ready for
+ *      SSL_connect.  Verification is turned on if the verifyParam is
+ *      non-NULL.  A session from an earlier connection to the same
+ *      server, if given, is offered for an abbreviated handshake.
+ *
+ * Results:
+ *      FALSE on failure.
  *
  *---------------------------------------------------------------------- 
  */
 
-Bool SSL_ConnectAndVerifyWithContext(SSLSock sSock,               // IN: SSL socket
-                                     SSLVerifyParam *verifyParam, // IN: Certification validation parameters
-                                     void *ctx)                   // IN: OpenSSL context (SSL_CTX *)
+static Bool
+SSLConnectSetup(SSLSock sSock,               // IN: SSL socket
+                SSLVerifyParam *verifyParam, // IN: Certification validation parameters
+                void *session,               // IN: SSL_SESSION * to resume, or NULL
+                void *ctx)                   // IN: OpenSSL context (SSL_CTX *)
 {
-   int retVal;
-   Bool ret = TRUE;
-   time_t startTime;
-   ASSERT_BUG(37562, SSLModuleInitialized);
-   ASSERT(sSock);
-   ASSERT(ctx);
-   ASSERT_DEVEL(sSock->initialized == 12345);
-
-   BEGIN_NO_STACK_MALLOC_TRACKER;
-
    sSock->sslCnx = SSL_new(ctx);
    if (!sSock->sslCnx) {
       SSLPrintErrors();
       Warning("Error creating sslCnx from ctx\n");
       sSock->connectionFailed = TRUE;
-      ret = FALSE;
-      goto end;
+      return FALSE;
    }
    SSL_set_connect_state(sSock->sslCnx);
 
@@ -2173,15 +2177,55 @@ Bool SSL_ConnectAndVerifyWithContext(SSLSock sSock,               // IN: SSL soc
       SSL_set_verify(sSock->sslCnx, SSL_VERIFY_PEER, SSLVerifyCb);
    }
 
+   if (session != NULL && !SSL_set_session(sSock->sslCnx, session)) {
+      /* Not fatal, the handshake just won't be abbreviated. */
+      SSLPrintErrors();
+   }
+
    SSL_LOG(("SSL: connect, ssl created %d\n", sSock->fd));
    if (!SSL_set_fd(sSock->sslCnx, sSock->fd)) {
       SSLPrintErrors();
       Warning("Error setting fd for SSL connection\n");
       sSock->connectionFailed = TRUE;
+      return FALSE;
+   }
+   SSL_LOG(("SSL: connect fd set done\n"));
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SSL_ConnectAndVerifyWithContext()
+ *
+ *      Similar to SSL_Connect, but allows for verification of
+ *      peer-certificate. Verification is turned on if the verifyParam
+ *      is non-NULL, in which case the verifyParam data structure
+ *      stores input and output parameters for the verification.
+ *
+ *---------------------------------------------------------------------- 
+ */
+
+Bool SSL_ConnectAndVerifyWithContext(SSLSock sSock,               // IN: SSL socket
+                                     SSLVerifyParam *verifyParam, // IN: Certification validation parameters
+                                     void *ctx)                   // IN: OpenSSL context (SSL_CTX *)
+{
+   int retVal;
+   Bool ret = TRUE;
+   time_t startTime;
+   ASSERT_BUG(37562, SSLModuleInitialized);
+   ASSERT(sSock);
+   ASSERT(ctx);
+   ASSERT_DEVEL(sSock->initialized == 12345);
+
+   BEGIN_NO_STACK_MALLOC_TRACKER;
+
+   if (!SSLConnectSetup(sSock, verifyParam, NULL, ctx)) {
       ret = FALSE;
       goto end;
    }
-   SSL_LOG(("SSL: connect fd set done\n"));
 
    /* XXX Because we use non blocking sockets, it could be that
     * SSL_connect will return without finishing (because either
@@ -2225,6 +2269,83 @@ Bool SSL_ConnectAndVerifyWithContext(SSLSock sSock,               // IN: SSL soc
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SSL_ConnectNonBlocking()
+ *
+ *      Start or continue a client handshake with the default context,
+ *      without waiting on the socket.  When SSL_WantRead or SSL_WantWrite
+ *      says so afterwards, call again once the socket is readable or
+ *      writable.  The verifyParam, if any, must stay valid until the
+ *      handshake is done.
+ *
+ *      If session is non-NULL, *session is an SSL session from an earlier
+ *      connection to the same server, or NULL.  It is offered on the first
+ *      call, and replaced with the session in use once the handshake is
+ *      done; SSL_SessionReused then tells whether the server accepted it.
+ *
+ * Results:
+ *      FALSE on failure.  TRUE otherwise, the handshake being done unless
+ *      SSL_WantRead or SSL_WantWrite.
+ *
+ * Side effects:
+ *      May free the session in *session.
+ *
+ *---------------------------------------------------------------------- 
+ */
+
+Bool
+SSL_ConnectNonBlocking(SSLSock sSock,               // IN: SSL socket
+                       SSLVerifyParam *verifyParam, // IN: Certificate validation parameters
+                       void **session)              // IN/OUT/OPT: SSL_SESSION *
+{
+   int retVal;
+
+   ASSERT_BUG(37562, SSLModuleInitialized);
+   ASSERT(sSock);
+   ASSERT_DEVEL(sSock->initialized == 12345);
+
+   if (sSock->connectionFailed) {
+      return FALSE;
+   }
+   if (!sSock->sslCnx &&
+       !SSLConnectSetup(sSock, verifyParam, session ? *session : NULL,
+                        SSL_DefaultContext())) {
+      return FALSE;
+   }
+
+   retVal = SSL_connect(sSock->sslCnx);
+   sSock->sslIOError = SSLSetErrorState(sSock->sslCnx, retVal);
+   if (sSock->sslIOError == SSL_ERROR_WANT_READ ||
+       sSock->sslIOError == SSL_ERROR_WANT_WRITE) {
+      return TRUE;
+   }
+
+   SSL_set_ex_data(sSock->sslCnx, SSLVerifyParamIx, NULL);
+
+   if (sSock->sslIOError != SSL_ERROR_NONE) {
+      SSLPrintErrors();
+      Warning("SSL: connect failed\n");
+      sSock->connectionFailed = TRUE;
+      return FALSE;
+   }
+   SSL_LOG(("SSL: connect done\n"));
+
+   SSLPrintCipher(sSock->sslCnx);
+   sSock->encrypted = TRUE;
+
+   if (session != NULL) {
+      if (*session != NULL) {
+         SSL_SESSION_free(*session);
+      }
+      *session = SSL_get1_session(sSock->sslCnx);
+   }
+
+   return TRUE;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2748,6 +2869,94 @@ SSL_Write(SSLSock ssl,
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SSL_Writev()
+ *
+ *    Functional equivalent of the writev() syscall.  Unencrypted
+ *    connections use writev directly.  For encrypted connections the
+ *    leading segments are packed into a per-socket buffer of up to one
+ *    full TLS record and written with a single SSL_write, unless the
+ *    first segment is already record-sized, in which case it is written
+ *    in place.
+ *
+ *    OpenSSL requires an SSL_write that failed with SSL_ERROR_WANT_READ
+ *    or SSL_ERROR_WANT_WRITE to be retried with the same buffer and
+ *    length.  The caller may have queued more segments by the time it
+ *    retries, so the call after such a failure repeats the failed
+ *    SSL_write as it was, and the new segments wait for the next one.
+ *    The caller must not drop or change the data it passed until then.
+ *
+ * Results:
+ *    Returns the number of bytes written, or -1 on error.
+ *
+ * Side effects:
+ *    May allocate the socket's packing buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+ssize_t
+SSL_Writev(SSLSock ssl,               // IN
+           const struct iovec *iov,   // IN
+           int iovCnt)                // IN
+{
+   const char *buf;
+   size_t len;
+   ssize_t ret;
+   int i;
+
+   ASSERT(ssl);
+   ASSERT_DEVEL(ssl->initialized == 12345);
+   ASSERT(iov && iovCnt > 0);
+
+#ifndef _WIN32
+   if (!ssl->encrypted && !ssl->connectionFailed) {
+      BEGIN_NO_STACK_MALLOC_TRACKER;
+      ret = writev(ssl->fd, iov, iovCnt);
+      END_NO_STACK_MALLOC_TRACKER;
+      return ret;
+   }
+#endif
+
+   if (ssl->writevRetryBuf != NULL) {
+      /* The data it holds is still at the front of the iov. */
+      ASSERT(ssl->writevRetryBuf == ssl->writevBuf ||
+             ssl->writevRetryBuf == iov[0].iov_base);
+      buf = ssl->writevRetryBuf;
+      len = ssl->writevRetryLen;
+   } else if (iovCnt == 1 || iov[0].iov_len >= SSL_WRITEV_BUFSIZE) {
+      buf = iov[0].iov_base;
+      len = iov[0].iov_len;
+   } else {
+      if (!ssl->writevBuf) {
+         ssl->writevBuf = malloc(SSL_WRITEV_BUFSIZE);
+         ASSERT_MEM_ALLOC(ssl->writevBuf);
+      }
+
+      len = 0;
+      for (i = 0; i < iovCnt && len < SSL_WRITEV_BUFSIZE; i++) {
+         size_t segLen = MIN(iov[i].iov_len, SSL_WRITEV_BUFSIZE - len);
+
+         memcpy(ssl->writevBuf + len, iov[i].iov_base, segLen);
+         len += segLen;
+      }
+      buf = ssl->writevBuf;
+   }
+
+   ret = SSL_Write(ssl, buf, len);
+   if (ret < 0 && (ssl->sslIOError == SSL_ERROR_WANT_WRITE ||
+                   ssl->sslIOError == SSL_ERROR_WANT_READ)) {
+      ssl->writevRetryBuf = buf;
+      ssl->writevRetryLen = len;
+   } else {
+      ssl->writevRetryBuf = NULL;
+   }
+   return ret;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2831,6 +3040,7 @@ SSL_Shutdown(SSLSock ssl)
 
    SyncRecMutex_Destroy(&ssl->spinlock);
 
+   free(ssl->writevBuf);
    free(ssl);
    SSL_LOG(("SSL: shutdown done\n"));
    return retVal;
@@ -2860,6 +3070,33 @@ SSL_GetFd(SSLSock ssl) // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SSL_SessionReused()
+ *
+ *    Check whether the server accepted the session offered to
+ *    SSL_ConnectNonBlocking.
+ *
+ * Results:
+ *    TRUE if the connect was an abbreviated handshake.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+SSL_SessionReused(SSLSock ssl) // IN
+{
+   ASSERT(ssl);
+   ASSERT_DEVEL(ssl->initialized == 12345);
+
+   return ssl->sslCnx && SSL_session_reused(ssl->sslCnx) != 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -0,0 +1,174 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * allocCount.c --
+ *
+ *      LD_PRELOAD library used by vmware-view-tunnel-bench -a.  Counts
+ *      malloc, calloc and realloc calls in the preloaded process, and on
+ *      SIGUSR2 writes the counts to the file named by ALLOC_COUNT_FILE as
+ *      "<snapshot> <malloc> <calloc> <realloc>".  glibc only.
+ */
+
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile unsigned long allocMallocs;
+static volatile unsigned long allocCallocs;
+static volatile unsigned long allocReallocs;
+static unsigned long allocSnapshots;
+static const char *allocFile;
+
+
+void *
+malloc(size_t size) // IN
+{
+   allocMallocs++;
+   return __libc_malloc(size);
+}
+
+
+void *
+calloc(size_t nmemb, // IN
+       size_t size)  // IN
+{
+   allocCallocs++;
+   return __libc_calloc(nmemb, size);
+}
+
+
+void *
+realloc(void *ptr,   // IN
+        size_t size) // IN
+{
+   allocReallocs++;
+   return __libc_realloc(ptr, size);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AllocFormat --
+ *
+ *      Append a decimal number and a separator to buf, without stdio so it
+ *      can be used from a signal handler.
+ *
+ * Results:
+ *      Position after the separator.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+AllocFormat(char *buf,         // OUT
+            unsigned long num, // IN
+            char sep)          // IN
+{
+   char digits[24];
+   int n = 0;
+
+   do {
+      digits[n++] = '0' + num % 10;
+      num /= 10;
+   } while (num);
+   while (n) {
+      *buf++ = digits[--n];
+   }
+   *buf++ = sep;
+   return buf;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AllocDumpCb --
+ *
+ *      SIGUSR2 handler.  Replaces ALLOC_COUNT_FILE's contents with the
+ *      current counts.  The snapshot number goes first, so a reader can
+ *      tell when the write for its signal has landed.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Writes the file.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+AllocDumpCb(int sig) // IN
+{
+   char buf[128];
+   char *end = buf;
+   int fd;
+
+   end = AllocFormat(end, ++allocSnapshots, ' ');
+   end = AllocFormat(end, allocMallocs, ' ');
+   end = AllocFormat(end, allocCallocs, ' ');
+   end = AllocFormat(end, allocReallocs, '\n');
+
+   fd = open(allocFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd >= 0) {
+      if (write(fd, buf, end - buf) < 0) {
+         /* Nothing to do; the bench times out waiting for the snapshot. */
+      }
+      close(fd);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * AllocCountInit --
+ *
+ *      Install the SIGUSR2 handler if ALLOC_COUNT_FILE is set.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void __attribute__((constructor))
+AllocCountInit(void)
+{
+   allocFile = getenv("ALLOC_COUNT_FILE");
+   if (allocFile) {
+      signal(SIGUSR2, AllocDumpCb);
+   }
+}
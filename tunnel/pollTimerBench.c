@@ -0,0 +1,317 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * pollTimerBench.c --
+ *
+ *      Micro-benchmark for POLL_REALTIME callbacks.  For each Poll
+ *      implementation, registers N timers, then churns them the way the
+ *      tunnel's lost-contact and ACK timers do (cancel and re-add with a
+ *      new deadline) while running loop passes, and finally makes them
+ *      all due and times firing them.  First checks that timers due at
+ *      the same time come out of the queue in the order they were queued.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmware.h"
+#include "poll.h"
+#include "pollTimer.h"
+#include "hostinfo.h"
+
+
+#define DEFAULT_TIMERS 10000
+#define DEFAULT_CHURN 1000000
+#define DEFAULT_PERIODIC 100
+#define CHURN_PER_PASS 64
+#define PERIODIC_USEC (50 * 1000)
+#define MIN_DELAY_USEC (1000 * 1000)
+#define MAX_DELAY_USEC (60 * 1000 * 1000)
+#define FIFO_TIMERS 100
+
+
+typedef struct BenchTimer {
+   int fired;
+} BenchTimer;
+
+static uint32 benchSeed = 1;
+static int benchFired;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRandom --
+ *
+ *      Small deterministic PRNG so every backend sees the same sequence.
+ *
+ * Results:
+ *      A pseudo-random number in [0, 2^31).
+ *
+ * Side effects:
+ *      Advances the seed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+BenchRandom(void)
+{
+   benchSeed = benchSeed * 1103515245 + 12345;
+   return benchSeed >> 1;
+}
+
+
+static int
+BenchDelay(void)
+{
+   return MIN_DELAY_USEC + BenchRandom() % (MAX_DELAY_USEC - MIN_DELAY_USEC);
+}
+
+
+static void
+BenchFireCb(void *clientData) // IN
+{
+   ((BenchTimer *) clientData)->fired++;
+   benchFired++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckFifo --
+ *
+ *      Queue timers due at the same time, reschedule every third one to
+ *      that same time again, and check that they are popped in the order
+ *      they were last queued.
+ *
+ * Results:
+ *      TRUE if the order was right.
+ *
+ * Side effects:
+ *      Prints the result.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckFifo(void)
+{
+   PollTimerQueue queue;
+   PollTimer timers[FIFO_TIMERS];
+   int expect[FIFO_TIMERS];
+   int numExpect = 0;
+   Bool ok = TRUE;
+   int i;
+
+   PollTimer_InitQueue(&queue);
+   memset(timers, 0, sizeof timers);
+   for (i = 0; i < FIFO_TIMERS; i++) {
+      timers[i].f = BenchFireCb;
+      timers[i].clientData = &timers[i];
+      PollTimer_Add(&queue, &timers[i], 1000, FALSE);
+   }
+   for (i = 0; i < FIFO_TIMERS; i++) {
+      if (i % 3 != 0) {
+         expect[numExpect++] = i;
+      }
+   }
+   for (i = 0; i < FIFO_TIMERS; i += 3) {
+      PollTimer_Reschedule(&queue, &timers[i], 1000);
+      expect[numExpect++] = i;
+   }
+
+   for (i = 0; i < FIFO_TIMERS; i++) {
+      PollTimer *timer = PollTimer_NextDue(&queue, 1000, 0);
+
+      if (timer != &timers[expect[i]]) {
+         printf("fifo     timer %d fired in place of %d\n",
+                timer ? (int)(timer - timers) : -1, expect[i]);
+         ok = FALSE;
+         break;
+      }
+      PollTimer_Remove(&queue, timer);
+   }
+   for (i = 0; i < FIFO_TIMERS; i++) {
+      if (PollTimer_IsQueued(&timers[i])) {
+         PollTimer_Remove(&queue, &timers[i]);
+      }
+   }
+   PollTimer_ExitQueue(&queue);
+
+   if (ok) {
+      printf("fifo     %8d timers due together fired in queued order\n",
+             FIFO_TIMERS);
+   }
+   return ok;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRun --
+ *
+ *      Run the add / churn / fire phases against the current Poll
+ *      implementation and print one line per phase.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Registers and fires callbacks.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchRun(const char *name,     // IN
+         int numTimers,        // IN
+         int numChurn,         // IN
+         int numPeriodic)      // IN
+{
+   BenchTimer *timers = calloc(numTimers + numPeriodic, sizeof *timers);
+   VmTimeType start;
+   VmTimeType elapsed;
+   int passes;
+   int i;
+
+   benchSeed = 1;
+
+   start = Hostinfo_SystemTimerUS();
+   for (i = 0; i < numTimers; i++) {
+      Poll_CB_RTime(BenchFireCb, &timers[i], BenchDelay(), FALSE, NULL);
+   }
+   elapsed = Hostinfo_SystemTimerUS() - start;
+   printf("%-8s add     %8d timers   %8.1f ns/op\n", name, numTimers,
+          elapsed * 1000.0 / numTimers);
+
+   for (i = numTimers; i < numTimers + numPeriodic; i++) {
+      Poll_CB_RTime(BenchFireCb, &timers[i], PERIODIC_USEC, TRUE, NULL);
+   }
+
+   start = Hostinfo_SystemTimerUS();
+   for (i = 0; i < numChurn; i++) {
+      BenchTimer *t = &timers[BenchRandom() % numTimers];
+
+      Poll_CB_RTimeRemove(BenchFireCb, t, FALSE);
+      Poll_CB_RTime(BenchFireCb, t, BenchDelay(), FALSE, NULL);
+      if (i % CHURN_PER_PASS == 0) {
+         Poll_LoopTimeout(FALSE, NULL, POLL_CLASS_MAIN, 0);
+      }
+   }
+   elapsed = Hostinfo_SystemTimerUS() - start;
+   printf("%-8s churn   %8d re-arms  %8.1f ns/op\n", name, numChurn,
+          elapsed * 1000.0 / numChurn);
+
+   for (i = numTimers; i < numTimers + numPeriodic; i++) {
+      Poll_CB_RTimeRemove(BenchFireCb, &timers[i], TRUE);
+   }
+
+   /* Make every timer due now, then time the loop passes that fire them. */
+   for (i = 0; i < numTimers; i++) {
+      Poll_CB_RTimeRemove(BenchFireCb, &timers[i], FALSE);
+      Poll_CB_RTime(BenchFireCb, &timers[i], BenchRandom() % 1000, FALSE,
+                    NULL);
+   }
+   usleep(2000);
+   benchFired = 0;
+
+   start = Hostinfo_SystemTimerUS();
+   passes = 0;
+   do {
+      Poll_LoopTimeout(FALSE, NULL, POLL_CLASS_MAIN, 0);
+      passes++;
+   } while (benchFired < numTimers);
+   elapsed = Hostinfo_SystemTimerUS() - start;
+   printf("%-8s fire    %8d timers   %8.1f ns/op (%d passes)\n", name,
+          numTimers, elapsed * 1000.0 / numTimers, passes);
+
+   free(timers);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * main --
+ *
+ *      Check timer order, then benchmark each Poll implementation in
+ *      turn.
+ *
+ * Results:
+ *      0, or 1 if the order check failed.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+main(int argc,    // IN
+     char **argv) // IN
+{
+   int numTimers = DEFAULT_TIMERS;
+   int numChurn = DEFAULT_CHURN;
+   int numPeriodic = DEFAULT_PERIODIC;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "n:c:p:")) != -1) {
+      switch (opt) {
+      case 'n':
+         numTimers = atoi(optarg);
+         break;
+      case 'c':
+         numChurn = atoi(optarg);
+         break;
+      case 'p':
+         numPeriodic = atoi(optarg);
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-n timers] [-c churn ops] "
+                 "[-p periodic timers]\n", argv[0]);
+         return 1;
+      }
+   }
+   if (numTimers <= 0 || numChurn < 0 || numPeriodic < 0) {
+      fprintf(stderr, "%s: counts must be positive\n", argv[0]);
+      return 1;
+   }
+
+   if (!BenchCheckFifo()) {
+      return 1;
+   }
+
+   Poll_InitDefault();
+   BenchRun("default", numTimers, numChurn, numPeriodic);
+   Poll_Exit();
+
+   Poll_InitEpoll();
+   BenchRun("epoll", numTimers, numChurn, numPeriodic);
+   Poll_Exit();
+
+   return 0;
+}
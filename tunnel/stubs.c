@@ -26,8 +26,10 @@
  */
 
 
+#include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <stdio.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
@@ -43,6 +45,7 @@
 #include "loglevel_tools.h"
 #include "msg.h"
 #include "posix.h"
+#include "preference.h"
 #include "syncMutex.h"
 #include "syncRecMutex.h"
 
@@ -106,10 +109,141 @@ Msg_GetString(const char *idString) // IN
 }
 
 
+/*
+ * Tunnel preferences are read from the same file the vmware-view UI keeps its
+ * preferences in, so "view.tunnel.*" keys can be set alongside the others.
+ * Only the simple 'key = "value"' lines the UI writes are understood.
+ */
+
+#define PREFERENCES_FILE_NAME ".vmware/view-preferences"
+
+
+typedef struct PreferenceEntry {
+   struct PreferenceEntry *next;
+   char *key;
+   char *value;
+} PreferenceEntry;
+
+static PreferenceEntry *preferences = NULL;
+
+
 Bool
 Preference_Init(void)
 {
-   return FALSE;
+   const char *home = getenv("HOME");
+   char path[PATH_MAX];
+   char line[1024];
+   FILE *fp;
+
+   if (!home || snprintf(path, sizeof path, "%s/%s", home,
+                         PREFERENCES_FILE_NAME) >= sizeof path) {
+      return FALSE;
+   }
+
+   fp = fopen(path, "r");
+   if (!fp) {
+      return FALSE;
+   }
+
+   while (fgets(line, sizeof line, fp)) {
+      PreferenceEntry *entry;
+      char *key = line;
+      char *value;
+      char *end;
+
+      while (isspace((unsigned char)*key)) {
+         key++;
+      }
+      if (*key == '#' || !(value = strchr(key, '='))) {
+         continue;
+      }
+
+      for (end = value; end > key && isspace((unsigned char)end[-1]); end--);
+      *end = '\0';
+
+      for (value++; isspace((unsigned char)*value); value++);
+      for (end = value + strlen(value);
+           end > value && isspace((unsigned char)end[-1]); end--);
+      *end = '\0';
+      if (end - value >= 2 && *value == '"' && end[-1] == '"') {
+         end[-1] = '\0';
+         value++;
+      }
+
+      if (!*key) {
+         continue;
+      }
+
+      entry = malloc(sizeof *entry);
+      if (!entry) {
+         break;
+      }
+      entry->key = strdup(key);
+      entry->value = strdup(value);
+      entry->next = preferences;
+      preferences = entry;
+   }
+
+   fclose(fp);
+   return TRUE;
+}
+
+
+static const char *
+PreferenceLookup(const char *name) // IN
+{
+   PreferenceEntry *entry;
+
+   /* Later lines were pushed last, so they win over earlier duplicates. */
+   for (entry = preferences; entry; entry = entry->next) {
+      if (entry->key && entry->value && strcasecmp(entry->key, name) == 0) {
+         return entry->value;
+      }
+   }
+   return NULL;
+}
+
+
+Bool
+Preference_GetBool(Bool defaultValue, // IN
+                   const char *name)  // IN
+{
+   const char *value = PreferenceLookup(name);
+
+   if (!value) {
+      return defaultValue;
+   }
+   return strcasecmp(value, "TRUE") == 0 || strcasecmp(value, "yes") == 0 ||
+          strcmp(value, "1") == 0;
+}
+
+
+int32
+Preference_GetLong(int32 defaultValue, // IN
+                   const char *name)   // IN
+{
+   const char *value = PreferenceLookup(name);
+   char *end;
+   long ret;
+
+   if (!value) {
+      return defaultValue;
+   }
+   ret = strtol(value, &end, 0);
+   return (*value && !*end) ? (int32)ret : defaultValue;
+}
+
+
+char *
+Preference_GetString(const char *defaultValue, // IN
+                     const char *name)         // IN
+{
+   const char *value = PreferenceLookup(name);
+
+   if (!value) {
+      value = defaultValue;
+   }
+   return value ? strdup(value) : NULL;
 }
 
 
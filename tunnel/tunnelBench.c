@@ -0,0 +1,915 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * tunnelBench.c --
+ *
+ *      Throughput and latency benchmark for vmware-view-tunnel.  Starts
+ *      vmware-view-tunnel-server and a tunnel connected to it, pushes data
+ *      through K echo channels while timing small pings on one more, and
+ *      reports MB/s, ping latency percentiles, and the tunnel's CPU time per
+ *      MB and peak RSS.
+ *
+ *      With -u the channels are reached over Unix-domain sockets instead of
+ *      loopback TCP.  The tunnel runs with a scratch HOME whose preferences
+ *      set view.tunnel.unixSocketPrefix to the same prefix, and with -U also
+ *      view.tunnel.unixOnly.
+ *
+ *      With -S the tunnel asks for that many stripes, and the server grants
+ *      them.  With -R as well, the server rejects every stripe POST, and
+ *      the run checks that the tunnel carries on over its main connection.
+ *
+ *      With -a the tunnel runs with the given allocCount.c library
+ *      preloaded, and the malloc, calloc and realloc calls it makes during
+ *      the timed run are reported per MB.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define DEFAULT_CHANNELS 4
+#define DEFAULT_MB 16
+#define DEFAULT_WRITE_SIZE 16384
+#define DEFAULT_PORT 18443
+#define DEFAULT_LISTEN_PORT 18500
+#define PING_SIZE 64
+#define MAX_PINGS 100000
+#define IDLE_PINGS 200
+#define CONNECT_TIMEOUT_MS 10000
+#define RUN_TIMEOUT_MS 300000
+#define ALLOC_TIMEOUT_MS 2000
+#define MB (1024.0 * 1024.0)
+
+
+typedef struct {
+   int fd;
+   long long sent;
+   long long recvd;
+} BenchChannel;
+
+static double gPings[MAX_PINGS];
+static int gNumPings;
+static double gIdlePings[IDLE_PINGS];
+static unsigned long gAllocSnapshots;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchNow --
+ *
+ *      Monotonic-enough wall clock.
+ *
+ * Results:
+ *      Milliseconds.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static double
+BenchNow(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPattern --
+ *
+ *      Byte expected at offset off of a channel's stream, so echoes can be
+ *      checked without keeping what was sent.
+ *
+ * Results:
+ *      The byte.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static inline unsigned char
+BenchPattern(int chan,      // IN
+             long long off) // IN
+{
+   return (unsigned char) (off * 7 + (off >> 12) + chan);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSpawn --
+ *
+ *      Fork and exec argv, with stdout and stderr sent to /dev/null unless
+ *      verbose.  If home is set, it replaces HOME.  If allocLib is set, it
+ *      is preloaded and told to write its counts to allocFile.
+ *
+ * Results:
+ *      Child pid.
+ *
+ * Side effects:
+ *      Exits on failure.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static pid_t
+BenchSpawn(char **argv,           // IN
+           int verbose,           // IN
+           const char *home,      // IN/OPT
+           const char *allocLib,  // IN/OPT
+           const char *allocFile) // IN/OPT
+{
+   pid_t pid = fork();
+
+   if (pid < 0) {
+      perror("fork");
+      exit(1);
+   }
+   if (pid == 0) {
+      if (!verbose) {
+         int fd = open("/dev/null", O_WRONLY);
+
+         dup2(fd, 1);
+         dup2(fd, 2);
+      }
+      if (home) {
+         setenv("HOME", home, 1);
+      }
+      if (allocLib) {
+         setenv("LD_PRELOAD", allocLib, 1);
+         setenv("ALLOC_COUNT_FILE", allocFile, 1);
+      }
+      execv(argv[0], argv);
+      fprintf(stderr, "Unable to run %s: %s\n", argv[0], strerror(errno));
+      _exit(1);
+   }
+   return pid;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWritePrefs --
+ *
+ *      Create a scratch HOME for the tunnel, whose preferences file puts
+ *      its listeners on Unix-domain sockets named <unixPrefix>bench<i>, if
+ *      unixPrefix is set, and asks for stripes.
+ *
+ * Results:
+ *      0 on success, -1 on failure.
+ *
+ * Side effects:
+ *      Creates home/.vmware/view-preferences, removed by BenchRemovePrefs.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+BenchWritePrefs(const char *home,       // IN
+                const char *unixPrefix, // IN/OPT
+                int unixOnly,           // IN
+                int stripes)            // IN
+{
+   char path[128];
+   FILE *f;
+
+   snprintf(path, sizeof path, "%s/.vmware", home);
+   if (mkdir(home, 0700) < 0 || mkdir(path, 0700) < 0) {
+      perror(path);
+      return -1;
+   }
+
+   snprintf(path, sizeof path, "%s/.vmware/view-preferences", home);
+   f = fopen(path, "w");
+   if (!f) {
+      perror(path);
+      return -1;
+   }
+   if (unixPrefix) {
+      fprintf(f, "view.tunnel.unixSocketPrefix = \"%s\"\n", unixPrefix);
+      fprintf(f, "view.tunnel.unixOnly = \"%s\"\n",
+              unixOnly ? "TRUE" : "FALSE");
+   }
+   fprintf(f, "view.tunnel.stripes = \"%d\"\n", stripes);
+   fclose(f);
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRemovePrefs --
+ *
+ *      Remove the scratch HOME made by BenchWritePrefs.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchRemovePrefs(const char *home) // IN
+{
+   char path[128];
+
+   snprintf(path, sizeof path, "%s/.vmware/view-preferences", home);
+   unlink(path);
+   snprintf(path, sizeof path, "%s/.vmware", home);
+   rmdir(path);
+   rmdir(home);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchAllocSnapshot --
+ *
+ *      Signal the tunnel's preloaded allocCount library to write its counts,
+ *      and wait for them to land in allocFile.
+ *
+ * Results:
+ *      0 with the malloc, calloc and realloc counts in counts, or -1.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+BenchAllocSnapshot(pid_t pid,               // IN
+                   const char *allocFile,   // IN
+                   unsigned long counts[3]) // OUT
+{
+   double start = BenchNow();
+
+   gAllocSnapshots++;
+   kill(pid, SIGUSR2);
+
+   while (BenchNow() - start < ALLOC_TIMEOUT_MS) {
+      FILE *f = fopen(allocFile, "r");
+      unsigned long snapshot;
+      int n = 0;
+
+      if (f) {
+         n = fscanf(f, "%lu %lu %lu %lu", &snapshot, &counts[0], &counts[1],
+                    &counts[2]);
+         fclose(f);
+      }
+      if (n == 4 && snapshot == gAllocSnapshots) {
+         return 0;
+      }
+      usleep(1000);
+   }
+   return -1;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchConnect --
+ *
+ *      Connect to a port on 127.0.0.1, or to the bench<i> Unix-domain socket
+ *      for that port's listener if unixPrefix is set, retrying until it is
+ *      listened on.
+ *
+ * Results:
+ *      Non-blocking socket, or -1 on timeout.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+BenchConnect(int port,               // IN
+             int index,              // IN: Listener number on the server
+             const char *unixPrefix) // IN/OPT
+{
+   struct sockaddr_in addr;
+   struct sockaddr_un unixAddr;
+   struct sockaddr *sa = (struct sockaddr *) &addr;
+   socklen_t saLen = sizeof addr;
+   double deadline = BenchNow() + CONNECT_TIMEOUT_MS;
+   int one = 1;
+
+   memset(&addr, 0, sizeof addr);
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if (unixPrefix) {
+      memset(&unixAddr, 0, sizeof unixAddr);
+      unixAddr.sun_family = AF_UNIX;
+      snprintf(unixAddr.sun_path, sizeof unixAddr.sun_path, "%sbench%d",
+               unixPrefix, index);
+      saLen = offsetof(struct sockaddr_un, sun_path) +
+              strlen(unixAddr.sun_path);
+      if (unixAddr.sun_path[0] == '@') {
+         unixAddr.sun_path[0] = '\0'; // Abstract name, no trailing NUL
+      } else {
+         saLen++;
+      }
+      sa = (struct sockaddr *) &unixAddr;
+   }
+
+   while (BenchNow() < deadline) {
+      int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+
+      if (fd < 0) {
+         perror("socket");
+         exit(1);
+      }
+      if (connect(fd, sa, saLen) == 0) {
+         if (!unixPrefix) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+         }
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+         return fd;
+      }
+      close(fd);
+      usleep(20000);
+   }
+   return -1;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPing --
+ *
+ *      Send one ping on the blocking-polled ping socket and wait for all of
+ *      its echo.
+ *
+ * Results:
+ *      Round trip in milliseconds, or -1 on error.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static double
+BenchPing(int fd) // IN
+{
+   char buf[PING_SIZE];
+   double start = BenchNow();
+   int got = 0;
+
+   memset(buf, 'p', sizeof buf);
+   if (write(fd, buf, sizeof buf) != sizeof buf) {
+      return -1;
+   }
+   while (got < sizeof buf) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      ssize_t n;
+
+      if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) <= 0) {
+         return -1;
+      }
+      n = read(fd, buf + got, sizeof buf - got);
+      if (n <= 0 && !(n < 0 && errno == EAGAIN)) {
+         return -1;
+      }
+      got += n > 0 ? n : 0;
+   }
+   return BenchNow() - start;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCompare --
+ *
+ *      qsort comparison for doubles.
+ *
+ * Results:
+ *      <0, 0, >0.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+BenchCompare(const void *a, // IN
+             const void *b) // IN
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPrintLatency --
+ *
+ *      Sort the samples and print their percentiles.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Sorts samples.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchPrintLatency(const char *label, // IN
+                  double *samples,   // IN/OUT
+                  int count)         // IN
+{
+   if (count == 0) {
+      printf("%-20s no samples\n", label);
+      return;
+   }
+   qsort(samples, count, sizeof *samples, BenchCompare);
+   printf("%-20s n=%d p50=%.3f p90=%.3f p99=%.3f max=%.3f ms\n", label,
+          count, samples[count * 50 / 100], samples[count * 90 / 100],
+          samples[count * 99 / 100], samples[count - 1]);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRun --
+ *
+ *      Push bytesPerChan through each channel, checking every echoed byte,
+ *      with a ping outstanding on pingFd for the whole run.
+ *
+ * Results:
+ *      Elapsed milliseconds, or -1 on error.
+ *
+ * Side effects:
+ *      Fills gPings.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static double
+BenchRun(BenchChannel *chans,    // IN/OUT
+         int numChans,           // IN
+         int pingFd,             // IN
+         long long bytesPerChan, // IN
+         int writeSize)          // IN
+{
+   struct pollfd *pfds = calloc(numChans + 1, sizeof *pfds);
+   char *buf = malloc(writeSize);
+   char pingBuf[PING_SIZE];
+   int pingGot = 0;
+   double pingStart;
+   double start = BenchNow();
+   int done = 0;
+   int i;
+
+   memset(pingBuf, 'p', sizeof pingBuf);
+   pingStart = BenchNow();
+   if (write(pingFd, pingBuf, sizeof pingBuf) != sizeof pingBuf) {
+      goto error;
+   }
+
+   while (done < numChans) {
+      if (BenchNow() - start > RUN_TIMEOUT_MS) {
+         fprintf(stderr, "Timed out.\n");
+         goto error;
+      }
+
+      for (i = 0; i < numChans; i++) {
+         pfds[i].fd = chans[i].recvd < bytesPerChan ? chans[i].fd : -1;
+         pfds[i].events = POLLIN |
+            (chans[i].sent < bytesPerChan ? POLLOUT : 0);
+         pfds[i].revents = 0;
+      }
+      pfds[numChans].fd = pingFd;
+      pfds[numChans].events = POLLIN;
+      pfds[numChans].revents = 0;
+
+      if (poll(pfds, numChans + 1, 1000) < 0) {
+         perror("poll");
+         goto error;
+      }
+
+      for (i = 0; i < numChans; i++) {
+         BenchChannel *chan = &chans[i];
+         ssize_t n;
+
+         if (pfds[i].revents & POLLOUT) {
+            int len = writeSize;
+            int j;
+
+            if (bytesPerChan - chan->sent < len) {
+               len = bytesPerChan - chan->sent;
+            }
+            for (j = 0; j < len; j++) {
+               buf[j] = BenchPattern(i, chan->sent + j);
+            }
+            n = write(chan->fd, buf, len);
+            if (n < 0 && errno != EAGAIN) {
+               perror("write");
+               goto error;
+            }
+            chan->sent += n > 0 ? n : 0;
+         }
+
+         if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int j;
+
+            n = read(chan->fd, buf, writeSize);
+            if (n == 0 || (n < 0 && errno != EAGAIN)) {
+               fprintf(stderr, "Channel %d closed after %lld bytes.\n", i,
+                       chan->recvd);
+               goto error;
+            }
+            for (j = 0; j < n; j++) {
+               if ((unsigned char) buf[j] != BenchPattern(i, chan->recvd + j)) {
+                  fprintf(stderr, "Channel %d corrupt at byte %lld.\n", i,
+                          chan->recvd + j);
+                  goto error;
+               }
+            }
+            chan->recvd += n > 0 ? n : 0;
+            if (chan->recvd == bytesPerChan) {
+               done++;
+            }
+         }
+      }
+
+      if (pfds[numChans].revents & POLLIN) {
+         ssize_t n = read(pingFd, pingBuf + pingGot, sizeof pingBuf - pingGot);
+
+         if (n <= 0 && !(n < 0 && errno == EAGAIN)) {
+            fprintf(stderr, "Ping channel closed.\n");
+            goto error;
+         }
+         pingGot += n > 0 ? n : 0;
+         if (pingGot == sizeof pingBuf) {
+            if (gNumPings < MAX_PINGS) {
+               gPings[gNumPings++] = BenchNow() - pingStart;
+            }
+            pingGot = 0;
+            pingStart = BenchNow();
+            if (write(pingFd, pingBuf, sizeof pingBuf) != sizeof pingBuf) {
+               goto error;
+            }
+         }
+      }
+   }
+
+   /* Let the last ping come back so the channel is idle for what follows. */
+   while (pingGot < sizeof pingBuf) {
+      struct pollfd pfd = { pingFd, POLLIN, 0 };
+      ssize_t n;
+
+      if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) <= 0) {
+         goto error;
+      }
+      n = read(pingFd, pingBuf + pingGot, sizeof pingBuf - pingGot);
+      if (n <= 0 && !(n < 0 && errno == EAGAIN)) {
+         goto error;
+      }
+      pingGot += n > 0 ? n : 0;
+   }
+
+   free(buf);
+   free(pfds);
+   return BenchNow() - start;
+
+error:
+   free(buf);
+   free(pfds);
+   return -1;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPrintUsage --
+ *
+ *      Print usage and exit.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Exits.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchPrintUsage(const char *binName) // IN
+{
+   fprintf(stderr,
+           "Usage: %s [-k channels] [-m MB per channel] [-w write size]\n"
+           "       [-p server port] [-l first listen port] [-u unix prefix]\n"
+           "       [-U] [-t tunnel binary] [-s server binary] [-a alloc lib]\n"
+           "       [-S stripes] [-R] [-v]\n",
+           binName);
+   exit(1);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * main --
+ *
+ *      Start the server and tunnel, run the benchmark, and report.
+ *
+ * Results:
+ *      0 if every byte came back intact, 1 otherwise.
+ *
+ * Side effects:
+ *      Kills the children it started.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+main(int argc,    // IN
+     char **argv) // IN
+{
+   const char *tunnelBin = "./vmware-view-tunnel";
+   const char *serverBin = "./vmware-view-tunnel-server";
+   int numChans = DEFAULT_CHANNELS;
+   int mbPerChan = DEFAULT_MB;
+   int writeSize = DEFAULT_WRITE_SIZE;
+   int port = DEFAULT_PORT;
+   int listenPort = DEFAULT_LISTEN_PORT;
+   int verbose = 0;
+   const char *unixPrefix = NULL;
+   int unixOnly = 0;
+   int stripes = 1;
+   int rejectStripes = 0;
+   char stripesArg[16];
+   char home[64];
+   char *allocLib = NULL;
+   char allocFile[64];
+   unsigned long allocsBefore[3];
+   unsigned long allocsAfter[3];
+   char portArg[16];
+   char listenPortArg[16];
+   char numListenArg[16];
+   char url[64];
+   char *serverArgv[12];
+   char *tunnelArgv[4];
+   pid_t serverPid;
+   pid_t tunnelPid;
+   BenchChannel *chans;
+   int pingFd;
+   double elapsed;
+   double totalMB = 0;
+   double cpuMs;
+   struct rusage ru;
+   int status;
+   int ret = 1;
+   int opt;
+   int i;
+
+   while ((opt = getopt(argc, argv, "k:m:w:p:l:u:Ut:s:a:S:Rv")) != -1) {
+      switch (opt) {
+      case 'k':
+         numChans = atoi(optarg);
+         break;
+      case 'm':
+         mbPerChan = atoi(optarg);
+         break;
+      case 'w':
+         writeSize = atoi(optarg);
+         break;
+      case 'p':
+         port = atoi(optarg);
+         break;
+      case 'l':
+         listenPort = atoi(optarg);
+         break;
+      case 'u':
+         unixPrefix = optarg;
+         break;
+      case 'U':
+         unixOnly = 1;
+         break;
+      case 't':
+         tunnelBin = optarg;
+         break;
+      case 's':
+         serverBin = optarg;
+         break;
+      case 'a':
+         /* LD_PRELOAD wants a path the tunnel can find from anywhere. */
+         allocLib = realpath(optarg, NULL);
+         if (!allocLib) {
+            fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+            return 1;
+         }
+         break;
+      case 'S':
+         stripes = atoi(optarg);
+         break;
+      case 'R':
+         rejectStripes = 1;
+         break;
+      case 'v':
+         verbose = 1;
+         break;
+      default:
+         BenchPrintUsage(argv[0]);
+      }
+   }
+   if (numChans <= 0 || mbPerChan <= 0 || writeSize <= 0 ||
+       (unixOnly && !unixPrefix) || stripes <= 0 ||
+       (rejectStripes && stripes <= 1)) {
+      BenchPrintUsage(argv[0]);
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+   snprintf(allocFile, sizeof allocFile, "/tmp/tunnel-bench-allocs.%d",
+            (int) getpid());
+   snprintf(home, sizeof home, "/tmp/tunnel-bench-home.%d", (int) getpid());
+   if ((unixPrefix || stripes > 1) &&
+       BenchWritePrefs(home, unixPrefix, unixOnly, stripes) < 0) {
+      BenchRemovePrefs(home);
+      return 1;
+   }
+
+   /* One listener per bulk channel plus one for pings. */
+   snprintf(portArg, sizeof portArg, "%d", port);
+   snprintf(listenPortArg, sizeof listenPortArg, "%d", listenPort);
+   snprintf(numListenArg, sizeof numListenArg, "%d", numChans + 1);
+   serverArgv[0] = (char *) serverBin;
+   serverArgv[1] = "-p";
+   serverArgv[2] = portArg;
+   serverArgv[3] = "-l";
+   serverArgv[4] = listenPortArg;
+   serverArgv[5] = "-n";
+   serverArgv[6] = numListenArg;
+   i = 7;
+   if (stripes > 1) {
+      snprintf(stripesArg, sizeof stripesArg, "%d", stripes);
+      serverArgv[i++] = "-s";
+      serverArgv[i++] = stripesArg;
+   }
+   if (rejectStripes) {
+      serverArgv[i++] = "-r";
+   }
+   serverArgv[i] = NULL;
+   serverPid = BenchSpawn(serverArgv, verbose, NULL, NULL, NULL);
+
+   snprintf(url, sizeof url, "http://127.0.0.1:%d", port);
+   tunnelArgv[0] = (char *) tunnelBin;
+   tunnelArgv[1] = url;
+   tunnelArgv[2] = "bench";
+   tunnelArgv[3] = NULL;
+   usleep(100000);
+   tunnelPid = BenchSpawn(tunnelArgv, verbose,
+                          unixPrefix || stripes > 1 ? home : NULL,
+                          allocLib, allocFile);
+
+   chans = calloc(numChans, sizeof *chans);
+   for (i = 0; i < numChans; i++) {
+      chans[i].fd = BenchConnect(listenPort + i, i, unixPrefix);
+      if (chans[i].fd < 0) {
+         fprintf(stderr, "Unable to connect to tunnel port %d.\n",
+                 listenPort + i);
+         goto exit;
+      }
+   }
+   pingFd = BenchConnect(listenPort + numChans, numChans, unixPrefix);
+   if (pingFd < 0) {
+      fprintf(stderr, "Unable to connect to tunnel port %d.\n",
+              listenPort + numChans);
+      goto exit;
+   }
+
+   /* Make sure every channel is raised before the clock starts. */
+   if (BenchPing(pingFd) < 0) {
+      fprintf(stderr, "Ping failed.\n");
+      goto exit;
+   }
+
+   if (allocLib && BenchAllocSnapshot(tunnelPid, allocFile,
+                                      allocsBefore) < 0) {
+      fprintf(stderr, "No allocation counts from the tunnel.\n");
+      goto exit;
+   }
+
+   elapsed = BenchRun(chans, numChans, pingFd,
+                      (long long) mbPerChan * (long long) MB, writeSize);
+   if (elapsed < 0) {
+      goto exit;
+   }
+
+   if (allocLib && BenchAllocSnapshot(tunnelPid, allocFile,
+                                      allocsAfter) < 0) {
+      fprintf(stderr, "No allocation counts from the tunnel.\n");
+      goto exit;
+   }
+
+   for (i = 0; i < IDLE_PINGS; i++) {
+      gIdlePings[i] = BenchPing(pingFd);
+      if (gIdlePings[i] < 0) {
+         fprintf(stderr, "Ping failed.\n");
+         goto exit;
+      }
+   }
+
+   /* Each MB crosses the tunnel twice, once each way. */
+   totalMB = (double) numChans * mbPerChan;
+   printf("channels             %d x %d MB, %d byte writes\n", numChans,
+          mbPerChan, writeSize);
+   printf("throughput           %.1f MB/s echoed (%.1f ms)\n",
+          totalMB * 1000.0 / elapsed, elapsed);
+   BenchPrintLatency("ping under load", gPings, gNumPings);
+   BenchPrintLatency("ping idle", gIdlePings, IDLE_PINGS);
+   if (allocLib) {
+      printf("tunnel allocs/MB     %.1f malloc, %.1f calloc, %.1f realloc\n",
+             (allocsAfter[0] - allocsBefore[0]) / totalMB,
+             (allocsAfter[1] - allocsBefore[1]) / totalMB,
+             (allocsAfter[2] - allocsBefore[2]) / totalMB);
+   }
+   ret = 0;
+
+exit:
+   kill(tunnelPid, SIGTERM);
+   if (wait4(tunnelPid, &status, 0, &ru) == tunnelPid && ret == 0) {
+      cpuMs = ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0 +
+              ru.ru_stime.tv_sec * 1000.0 + ru.ru_stime.tv_usec / 1000.0;
+      printf("tunnel cpu           %.1f ms total, %.2f ms/MB\n", cpuMs,
+             cpuMs / totalMB);
+      printf("tunnel peak rss      %ld KB\n", ru.ru_maxrss);
+   }
+   kill(serverPid, SIGTERM);
+   waitpid(serverPid, &status, 0);
+   if (allocLib) {
+      unlink(allocFile);
+      free(allocLib);
+   }
+   if (unixPrefix || stripes > 1) {
+      BenchRemovePrefs(home);
+   }
+
+   return ret;
+}
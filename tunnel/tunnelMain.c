@@ -23,21 +23,32 @@
  *
  *      Multi-channel socket proxy over HTTP with control messages, lossless
  *      reconnect, heartbeats, etc.
+ *
+ *      Runs one tunnel session given on the command line, or with -d, runs
+ *      as a daemon hosting any number of sessions started and stopped over
+ *      a control socket.  Sessions share the poll loop, SSL library, and
+ *      the addresses and SSL sessions of the servers they connect to.
  */
 
 
+#define _GNU_SOURCE     /* For struct ucred */
 #include <arpa/inet.h>  /* For inet_ntoa */
 #include <sys/types.h>  /* For getsockname */
-#include <sys/socket.h> /* For getsockname */
+#include <sys/socket.h> /* For getsockname, SO_PEERCRED */
 #include <netdb.h>      /* For getnameinfo */
 #include <netinet/in.h> /* For getsockname */
+#include <sys/uio.h>    /* For struct iovec */
+#include <unistd.h>     /* For getuid */
 
 
 #include "tunnelProxy.h"
+#include "tunnelStats.h"
 
+#include "circList.h"
 #include "dynbuf.h"
 #include "log.h"
 #include "msg.h"
+#include "poll.h"
 #include "preference.h"
 #include "ssl.h"
 #include "str.h"
@@ -47,21 +58,117 @@
 
 #define APPNAME "vmware-view-tunnel"
 #define TMPBUFSIZE 1024 * 16 /* arbitrary */
-#define BLOCKING_TIMEOUT_MS 1000 * 3 /* 3 seconds, arbitrary */
+#define MAX_SENDS_PENDING 2 /* Leave the rest queued for TunnelProxy to order */
+#define STANDBY_RETRY_MS 1000 * 30 /* 30 seconds, arbitrary */
+#define MAX_HEADER_SIZE 1024 * 16 /* arbitrary */
+#define CONTROL_FLUSH_MS 1000 /* Longest a closing control client may take */
+#define STEP_TIMEOUT_MS 1000 * 120 /* As SSL_CONNECT_WAIT_TIMEOUT */
+
+
+typedef struct TunnelSession TunnelSession;
+typedef struct TunnelStripe TunnelStripe;
+
+/*
+ * A send in flight on a stripe, passed to TunnelSendvCompleteCb.
+ */
+typedef struct TunnelStripeSend {
+   TunnelStripe *stripe;
+   TunnelProxySendv *sendv; // NULL while the slot is free
+} TunnelStripeSend;
+
+/*
+ * One HTTP connection of a session.  Stripe 0 is the main connection, the
+ * others are only opened once the server accepts a striped session.
+ */
+struct TunnelStripe {
+   TunnelSession *session;
+   int index;
+   AsyncSocket *asock;
+   Bool connected;
+   Bool recvHeaderDone;
+   int headerScanned; // Bytes of recvBuf searched for the end of the header
+   DynBuf recvBuf;
+   int sendsPending;
+   TunnelStripeSend sends[MAX_SENDS_PENDING];
+   Bool standbyReady; // Connected and idle, see gStandby
+   Bool fromStandby;  // Taken over from gStandby
+   Bool addrCached;   // Connected to gConnectIp without a lookup
+   Bool sslResumed;   // SSL session of an earlier connection resumed
+   const char *timeoutStep; // Awaited step, see TunnelStripeSetTimeout
+};
+
+/*
+ * Where connections go, the tunnel server or a proxy.  The address it
+ * resolved to and the SSL session negotiated with the server are kept for
+ * reconnects and stripes, and for other sessions to the same server.
+ */
+typedef struct TunnelTarget {
+   ListItem list;
+   char *serverHost;
+   unsigned short serverPort;
+   char *connectHost;
+   unsigned short connectPort;
+   uint32 connectIp; // Host byte order, 0 if not known
+   void *sslSession;
+} TunnelTarget;
+
+/*
+ * A TunnelProxy and the HTTP connections it runs over.
+ */
+struct TunnelSession {
+   ListItem list;
+   unsigned int id;
+   char *serverArg;
+   char *connectionIdArg;
+   TunnelProxy *tp;
+   TunnelStripe stripes[TP_MAX_STRIPES];
+   int stripeCount;
+   int connects;
+
+   /* Decided on the first connect, see TunnelConnectTarget. */
+   Bool serverSecure;
+   TunnelTarget *target;
+   AsyncSocketConnectFn connectFn;
 
+   /*
+    * With the view.tunnel.standby pref set, a spare connection to the server
+    * is kept open, SSL and proxy CONNECT done, for a reconnect to post on.
+    */
+   Bool standbyWanted;
+   TunnelStripe standby;
+};
 
-static char *gServerArg = NULL;
-static char *gConnectionIdArg = NULL;
+/*
+ * A connection to the daemon's control socket.  Commands are lines of
+ * space separated words, and each is answered by a line starting with "ok"
+ * or "error", after any lines of output.  The control socket is a Unix
+ * socket that only the daemon's user may connect to.
+ */
+typedef struct TunnelControl {
+   AsyncSocket *asock;
+   DynBuf recvBuf;
+   int sendsPending;
+   Bool closing;
+} TunnelControl;
 
-static TunnelProxy *gTunnelProxy = NULL;
-static AsyncSocket *gAsock = NULL;
-static Bool gRecvHeaderDone = FALSE;
-static char gRecvByte = 0;
-static DynBuf gRecvBuf;
+static ListItem *gSessions = NULL;
+static ListItem *gTargets = NULL;
+static unsigned int gLastSessionId = 0;
+static Bool gDaemon = FALSE;
 
 
-static void TunnelConnect(void);
+static void TunnelConnect(TunnelStripe *stripe);
 static void TunnelSocketConnectCb(AsyncSocket *asock, void *userData);
+static void TunnelStripesCb(TunnelProxy *tp, int stripes, void *userData);
+static void TunnelSessionEnd(TunnelSession *session);
+static void TunnelStandbyClose(TunnelSession *session, const char *reason);
+static void TunnelStandbyRecvCb(void *buf, int len, AsyncSocket *asock,
+                                void *userData);
+static void TunnelStandbyRetryCb(void *clientData);
+static void TunnelStandbyPostCb(void *clientData);
+static void TunnelControlCloseTimeoutCb(void *clientData);
+static void TunnelStripeTimeoutCb(void *clientData);
+void TunnelSendNeededCb(TunnelProxy *tp, void *userData);
 
 
 /*
@@ -187,288 +294,297 @@ error:
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelDisconnectCb --
+ * TunnelStripeUrl --
  *
- *      TunnelProxy disconnected callback.  If there is a reconnect secret,
- *      calls TunnelConnect attempt reconnect, otherwise exits with error.
+ *      Get the URL to POST to for a stripe's connection.
  *
  * Results:
- *      None
+ *      The TunnelProxy connect URL for the main connection, or its stripe
+ *      URL otherwise.  NULL if the stripe cannot be opened.  Caller must
+ *      free it.
  *
  * Side effects:
- *      May call TunnelConnect.
+ *      None
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelDisconnectCb(TunnelProxy *tp,             // IN
-                   const char *reconnectSecret, // IN
-                   const char *reason,          // IN
-                   void *userData)              // IN: not used
+static char *
+TunnelStripeUrl(TunnelStripe *stripe) // IN
 {
-   AsyncSocket_Close(gAsock);
-   gAsock = NULL;
-   gRecvHeaderDone = FALSE;
-   if (reconnectSecret) {
-      Warning("TUNNEL RESET: %s\n", reason ? reason : "Unknown reason");
-      TunnelConnect();
-   } else if (reason) {
-      Warning("TUNNEL DISCONNECT: %s\n", reason);
-      exit(1);
-   } else {
-      Warning("TUNNEL EXIT\n");
-      exit(0);
+   TunnelSession *session = stripe->session;
+
+   if (stripe->index == 0) {
+      return TunnelProxy_GetConnectUrl(session->tp, session->serverArg);
    }
+   return TunnelProxy_GetStripeUrl(session->tp, session->serverArg,
+                                   stripe->index);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketRead --
+ * TunnelStripeSetTimeout --
  *
- *      Utility to read all pending data from an async socket non-blocking,
- *      first prepending buf, and append it all to a DynBuf.
+ *      Give a step of a stripe's connection STEP_TIMEOUT_MS to complete,
+ *      replacing the deadline of the previous step.  The blocking SSL
+ *      connect of old gave up after as long; without a deadline, a server
+ *      that stops answering would hold the stripe forever.
  *
  * Results:
- *      Byte count of buf + newly read bytes that were appended to recvBuf, 
- *      or -1 if read failed.
+ *      None
  *
  * Side effects:
- *      Calls AsyncSocket_RecvBlocking with 0 timeout, TunnelDisconnectCb on 
- *      read error.
+ *      With a NULL step, only cancels the deadline.
  *
  *-----------------------------------------------------------------------------
  */
 
-int
-TunnelSocketRead(void *buf,          // IN: prepend buffer
-                 int len,            // IN: buf length
-                 AsyncSocket *asock, // IN: source asock
-                 DynBuf *recvBuf)    // IN: dest buf
+static void
+TunnelStripeSetTimeout(TunnelStripe *stripe, // IN
+                       const char *step)     // IN/OPT: step name, for errors
 {
-   int asockErr = ASOCKERR_SUCCESS;
-   int totalRecvLen = 0;
-
-   if (buf) {
-      DynBuf_Append(recvBuf, buf, len);
-      totalRecvLen += len;
+   if (stripe->timeoutStep) {
+      Poll_CB_RTimeRemove(TunnelStripeTimeoutCb, stripe, FALSE);
    }
 
-   /* Append all available data non-blocking (specify 0 timeout) */
-   while (asockErr == ASOCKERR_SUCCESS) {
-      char tmpBuf[TMPBUFSIZE];
-      int recvLen = 0;
-
-      asockErr = AsyncSocket_RecvBlocking(gAsock, tmpBuf, sizeof(tmpBuf),
-                                          &recvLen, 0);
-
-      if (asockErr != ASOCKERR_SUCCESS && asockErr != ASOCKERR_TIMEOUT) {
-         char *msg;
-         char *reason;
-         size_t reasonLen = 0;
+   stripe->timeoutStep = step;
+   if (step) {
+      Poll_CB_RTime(TunnelStripeTimeoutCb, stripe, STEP_TIMEOUT_MS * 1000,
+                    FALSE, NULL);
+   }
+}
 
-         msg = Msg_GetString(MSGID("cdk.linuxTunnel.errorReading")
-                             "Error reading from tunnel HTTP socket: %s\n");
-         reason = Str_Asprintf(&reasonLen, msg,
-                               AsyncSocket_Err2String(asockErr));
 
-         TunnelDisconnectCb(gTunnelProxy, NULL, reason, NULL);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStripeClose --
+ *
+ *      Close a stripe's connection, if open, ready for TunnelConnect.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Pending send callbacks fire from the close, see
+ *      TunnelSendvCompleteCb.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-         free(reason);
-         free(msg);
-         return -1;
-      }
+static void
+TunnelStripeClose(TunnelStripe *stripe) // IN
+{
+   AsyncSocket *asock = stripe->asock;
 
-      DynBuf_Append(recvBuf, tmpBuf, recvLen);
-      totalRecvLen += recvLen;
+   TunnelStripeSetTimeout(stripe, NULL);
+   if (!asock) {
+      return;
    }
 
-   return totalRecvLen;
+   stripe->asock = NULL;
+   AsyncSocket_Close(asock);
+   stripe->connected = FALSE;
+   stripe->recvHeaderDone = FALSE;
+   stripe->sendsPending = 0;
+   DynBuf_SetSize(&stripe->recvBuf, 0);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketParseHeader --
- *
- *      Simple HTTP header parsing.  Just looks in the DynBuf for the "\r\n\r\n"
- *      that terminates an HTTP header from the body. If found, the header is
- *      removed from the front of the DynBuf.
+ * TunnelDisconnectCb --
  *
- *      XXX: Parse response header, instead of assuming server/proxy will kill
- *      connection on failure.
+ *      TunnelProxy disconnected callback.  Closes the connection of every
+ *      stripe.  If there is a reconnect secret, calls TunnelConnect attempt
+ *      reconnect, otherwise exits with error, or in daemon mode ends the
+ *      session.
  *
  * Results:
- *      True if headers have been received, false otherwise.
+ *      None
  *
  * Side effects:
- *      None
+ *      May call TunnelConnect.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-TunnelSocketParseHeader(DynBuf *recvBuf) // IN
+void
+TunnelDisconnectCb(TunnelProxy *tp,             // IN
+                   const char *reconnectSecret, // IN
+                   const char *reason,          // IN
+                   void *userData)              // IN: TunnelSession
 {
-   char *dataStart;
-   int dataSize;
+   TunnelSession *session = userData;
+   int i;
 
-   if (DynBuf_GetSize(recvBuf) == 0) {
-      return FALSE;
-   }
+   /* A standby connection taken over may not have been posted on yet. */
+   Poll_CB_RTimeRemove(TunnelStandbyPostCb, &session->stripes[0], FALSE);
 
-   /* Look for end of header */
-   dataStart = Str_Strnstr((char*) DynBuf_Get(recvBuf), "\r\n\r\n",
-                           DynBuf_GetSize(recvBuf));
-   if (!dataStart) {
-      return FALSE;
+   for (i = 0; i < session->stripeCount; i++) {
+      TunnelStripeClose(&session->stripes[i]);
    }
+   session->stripeCount = 1;
 
-   /* Remove header from beginning of recvBuf */
-   dataStart += 4;
-   dataSize = DynBuf_GetSize(recvBuf);
-   dataSize -= dataStart - ((char*) DynBuf_Get(recvBuf));
-   memmove(DynBuf_Get(recvBuf), dataStart, dataSize);
-   DynBuf_SetSize(recvBuf, dataSize);
-
-   return TRUE;
+   if (reconnectSecret) {
+      Warning("TUNNEL RESET: %s\n", reason ? reason : "Unknown reason");
+      TunnelConnect(&session->stripes[0]);
+   } else if (reason) {
+      Warning("TUNNEL DISCONNECT: %s\n", reason);
+      if (!gDaemon) {
+         exit(1);
+      }
+      TunnelSessionEnd(session);
+   } else {
+      Warning("TUNNEL EXIT\n");
+      if (!gDaemon) {
+         exit(0);
+      }
+      TunnelSessionEnd(session);
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketRecvCb --
+ * TunnelStripeFailed --
  *
- *      AsyncSocket data received callback.  Reads available data from the
- *      tunnel socket, and pushes into the TunnelProxy using
- *      TunnelProxy_HTTPRecv.  Ignores response headers.
+ *      Give up on a stripe's connection.  Closes the standby connection.
+ *      The failure of the main connection calls TunnelDisconnectCb without
+ *      a reconnect secret.
+ *
+ *      An extra stripe that fails takes the stripes above it along, and the
+ *      session carries on over the ones below.  If any of the dropped
+ *      stripes already carried chunks, which may be lost, the TunnelProxy
+ *      is reset to reconnect and resend them; the reconnect does not reopen
+ *      the dropped stripes.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      None
+ *      The stripe's socket is closed.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelSocketRecvCb(void *buf,          // IN: gRecvByte
-                   int len,            // IN: always 1
-                   AsyncSocket *asock, // IN
-                   void *userData)     // IN: not used
+static void
+TunnelStripeFailed(TunnelStripe *stripe, // IN
+                   const char *reason)   // IN
 {
-   if (TunnelSocketRead(buf, len, asock, &gRecvBuf) < 0) {
-      NOT_REACHED();
+   TunnelSession *session = stripe->session;
+   Bool carriedChunks = FALSE;
+   int i;
+
+   TunnelStripeSetTimeout(stripe, NULL);
+
+   if (stripe == &session->standby) {
+      TunnelStandbyClose(session, reason);
+      return;
+   } else if (stripe->index == 0) {
+      TunnelDisconnectCb(session->tp, NULL, reason, session);
+      return;
    }
 
-   if (!gRecvHeaderDone) {
-      gRecvHeaderDone = TunnelSocketParseHeader(&gRecvBuf);
-   }
+   Warning("Tunnel stripe %d failed: %s\n", stripe->index, reason);
 
-   if (gRecvHeaderDone && DynBuf_GetSize(&gRecvBuf) > 0) {
-      TunnelProxy_HTTPRecv(gTunnelProxy, (char*) DynBuf_Get(&gRecvBuf),
-                           DynBuf_GetSize(&gRecvBuf), TRUE);
+   /* Chunks only go over a stripe once its response header arrived. */
+   for (i = stripe->index; i < session->stripeCount; i++) {
+      carriedChunks = carriedChunks || session->stripes[i].recvHeaderDone;
+   }
+   TunnelProxy_LimitStripes(session->tp, stripe->index);
 
-      /* Reset recvBuf for next read */
-      DynBuf_SetSize(&gRecvBuf, 0);
+   if (carriedChunks) {
+      if (TunnelProxy_Reset(session->tp, reason) != TP_ERR_OK) {
+         TunnelDisconnectCb(session->tp, NULL, reason, session);
+      }
+      return;
    }
 
-   /* Recv at least 1-byte before calling this callback again */
-   AsyncSocket_Recv(gAsock, &gRecvByte, 1, TunnelSocketRecvCb, NULL);
+   for (i = stripe->index; i < session->stripeCount; i++) {
+      TunnelStripeClose(&session->stripes[i]);
+   }
+   session->stripeCount = stripe->index;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketProxyRecvCb --
+ * TunnelStripeTimeoutCb --
  *
- *      AsyncSocket data received callback, used during initial proxy server
- *      CONNECT setup.  Reads available data from the tunnel socket, and looks
- *      for the end of the HTTP header.  If found, starts tunnel endpoint POST
- *      request, otherwise, calls AsyncSocket_Recv to reinvoke this callback.
+ *      Poll callback for the deadline of TunnelStripeSetTimeout.  Fails the
+ *      stripe, naming the step that did not complete.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      None
+ *      Calls TunnelStripeFailed.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelSocketProxyRecvCb(void *buf,          // IN: gRecvByte
-                        int len,            // IN: always 1
-                        AsyncSocket *asock, // IN
-                        void *userData)     // IN: not used
+static void
+TunnelStripeTimeoutCb(void *clientData) // IN: TunnelStripe
 {
-   if (TunnelSocketRead(buf, len, asock, &gRecvBuf) < 0) {
-      NOT_REACHED();
-   }
+   TunnelStripe *stripe = clientData;
+   char *reason = Str_Asprintf(NULL, "%s timed out", stripe->timeoutStep);
 
-   if (TunnelSocketParseHeader(&gRecvBuf)) {
-      /* Proxy portion of connect is done.  Connect using normal path. */
-      DynBuf_Destroy(&gRecvBuf);
-      TunnelSocketConnectCb(gAsock, NULL);
-   } else {
-      /* Recv at least 1-byte before calling this callback again */
-      AsyncSocket_Recv(gAsock, &gRecvByte, 1, TunnelSocketProxyRecvCb, NULL);
-   }
+   stripe->timeoutStep = NULL;
+   TunnelStripeFailed(stripe, reason);
+   free(reason);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSendNeededCb --
- *
- *      TunnelProxy send needed callback.  Fetches the available HTTP chunk data
- *      and performs a blocking sends over the AsyncSocket.
+ * TunnelRecvAppend --
  *
- *      XXX: Use async send, and heap-allocated send buffer?
+ *      Issue an AsyncSocket_RecvPartial into the free space at the end of
+ *      a DynBuf, growing it first if little is left.  The recv callback
+ *      adds what arrived with TunnelRecvCommit, and must issue the recv
+ *      again or cancel it, as the DynBuf may move.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      None
+ *      May grow buf.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelSendNeededCb(TunnelProxy *tp, // IN
-                   void *userData)  // IN: not used
+static void
+TunnelRecvAppend(AsyncSocket *asock,       // IN
+                 DynBuf *buf,              // IN/OUT
+                 AsyncSocketRecvFn recvFn, // IN
+                 void *clientData)         // IN
 {
-   while (TRUE) {
-      char *sendBuf = Util_SafeMalloc(TMPBUFSIZE);
-      int sendSize = TMPBUFSIZE;
+   size_t size = DynBuf_GetSize(buf);
 
-      TunnelProxy_HTTPSend(gTunnelProxy, sendBuf, &sendSize, TRUE);
-      if (sendSize == 0) {
-         free(sendBuf);
-         break;
-      }
-
-      AsyncSocket_Send(gAsock, sendBuf, sendSize, (AsyncSocketSendFn) free,
-                       NULL);
+   if (DynBuf_GetAllocatedSize(buf) - size < TMPBUFSIZE / 4) {
+      Bool grown = DynBuf_Enlarge(buf, size + TMPBUFSIZE);
+      ASSERT_MEM_ALLOC(grown);
    }
+
+   AsyncSocket_RecvPartial(asock, (char *) DynBuf_Get(buf) + size,
+                           DynBuf_GetAllocatedSize(buf) - size, recvFn,
+                           clientData);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketErrorCb --
+ * TunnelRecvCommit --
  *
- *      AsyncSocket error callback.  Calls TunnelDisconnectCb with the
- *      AsyncSocket error string as the disconnect reason.
+ *      Add len bytes read by the recv from TunnelRecvAppend to the DynBuf.
  *
  * Results:
  *      None
@@ -479,132 +595,192 @@ TunnelSendNeededCb(TunnelProxy *tp, // IN
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelSocketErrorCb(int error,          // IN
-                    AsyncSocket *asock, // IN
-                    void *userData)     // IN: not used
+static void
+TunnelRecvCommit(DynBuf *buf,     // IN/OUT
+                 void *recvd,     // IN/OPT: from the recv callback
+                 int len)         // IN
 {
-   TunnelDisconnectCb(gTunnelProxy, NULL, AsyncSocket_Err2String(error), NULL);
+   size_t size = DynBuf_GetSize(buf);
+
+   if (len > 0) {
+      ASSERT(recvd == (char *) DynBuf_Get(buf) + size);
+      DynBuf_SetSize(buf, size + len);
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketConnectCb --
- *
- *      AsyncSocket connection callback.  Converts the socket to SSL, if the URL
- *      passed on the command line is HTTPS, posts a simple HTTP1.1 request
- *      header, sets up socket read IO handler, and tells the TunnelProxy it is
- *      now connected.
+ * TunnelSocketParseHeader --
  *
- *      XXX: Support connecting through a proxy.
+ *      Incremental HTTP response header parsing.  Looks for the "\r\n\r\n"
+ *      that terminates the header in the part of the stripe's recvBuf not
+ *      searched by an earlier call.  Once found, checks the status line for
+ *      a 2xx code and removes the header from the front of the recvBuf.
+ *      The header must arrive within STEP_TIMEOUT_MS of the first call,
+ *      made before anything was received.
  *
  * Results:
- *      None
+ *      1 if the header has been received and the request succeeded, 0 if
+ *      more of the header is needed, -1 on failure.
  *
  * Side effects:
- *      None
+ *      On failure calls TunnelStripeFailed, naming the request in the
+ *      reason.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelSocketConnectCb(AsyncSocket *asock, // IN
-                      void *userData)     // IN: not used
+static int
+TunnelSocketParseHeader(TunnelStripe *stripe, // IN
+                        const char *request)  // IN: request name, for errors
 {
-   TunnelProxyErr err = TP_ERR_OK;
-   char *request;
-   size_t requestSize = 0;
-   int sendSize = 0;
-   int asockErr = ASOCKERR_SUCCESS;
-   char *serverUrl;
-   char *host = NULL;
-   unsigned short port = 0;
-   char *path = NULL;
-   Bool secure = FALSE;
-   const char *hostIp = NULL;
-   char hostName[1024];
-
-   serverUrl = TunnelProxy_GetConnectUrl(gTunnelProxy, gServerArg);
-   if (!TunnelParseUrl(serverUrl, NULL, &host, &port, &path, &secure)) {
-      NOT_IMPLEMENTED();
+   char *header = DynBuf_Get(&stripe->recvBuf);
+   int headerSize = DynBuf_GetSize(&stripe->recvBuf);
+   char *dataStart;
+   char *lineEnd;
+   char statusLine[64];
+   size_t lineLen;
+   int status = 0;
+   char *reason;
+
+   if (headerSize == 0) {
+      TunnelStripeSetTimeout(stripe, request);
+      return 0;
    }
 
-   /* Establish SSL, but don't enforce the cert */
-   if (secure && !AsyncSocket_ConnectSSL(asock, NULL)) {
-      NOT_IMPLEMENTED();
+   /* The terminator may straddle what was already searched. */
+   stripe->headerScanned = MAX(0, stripe->headerScanned - 3);
+   dataStart = Str_Strnstr(header + stripe->headerScanned, "\r\n\r\n",
+                           headerSize - stripe->headerScanned);
+   if (!dataStart) {
+      stripe->headerScanned = headerSize;
+      if (headerSize <= MAX_HEADER_SIZE) {
+         return 0;
+      }
+      reason = Str_Asprintf(NULL, "%s failed: response header too long",
+                            request);
+      goto fail;
    }
+   dataStart += 4;
 
-   request = Str_Asprintf(&requestSize,
-      "POST %s HTTP/1.1\r\n"
-      "Host: %s:%d\r\n"
-      "Accept: text/*, application/octet-stream\r\n"
-      "User-agent: Mozilla/4.0 (compatible; MSIE 6.0)\r\n"
-      "Pragma: no-cache\r\n"
-      "Connection: Keep-Alive\r\n"
-      "Transfer-Encoding: chunked\r\n"
-      "Content-Type: application/octet-stream\r\n"
-      "Cache-Control: no-cache, no-store, must-revalidate\r\n"
-      "\r\n", path, host, port);
+   lineEnd = Str_Strnstr(header, "\r\n", dataStart - header);
 
-   /* Send initial request header */
-   asockErr = AsyncSocket_SendBlocking(gAsock, request, requestSize,
-                                       &sendSize, BLOCKING_TIMEOUT_MS);
-   if (asockErr != ASOCKERR_SUCCESS) {
-      Panic("TunnelSocketConnectCb: initial write failed: %s\n",
-            AsyncSocket_Err2String(asockErr));
+   /* The recvBuf is not NUL-terminated, sscanf needs a copy that is. */
+   lineLen = MIN(lineEnd - header, sizeof statusLine - 1);
+   memcpy(statusLine, header, lineLen);
+   statusLine[lineLen] = '\0';
+
+   if (sscanf(statusLine, "HTTP/%*u.%*u %3d", &status) != 1 ||
+       status < 200 || status > 299) {
+      reason = Str_Asprintf(NULL, "%s failed: %.*s", request,
+                            (int) (lineEnd - header), header);
+      goto fail;
    }
-   ASSERT(sendSize == requestSize);
 
-   /* Kick off channel reading */
-   DynBuf_Init(&gRecvBuf);
-   TunnelSocketRecvCb(NULL, 0, NULL, NULL);
+   /* Remove header from beginning of recvBuf */
+   headerSize -= dataStart - header;
+   memmove(header, dataStart, headerSize);
+   DynBuf_SetSize(&stripe->recvBuf, headerSize);
+   stripe->headerScanned = 0;
+   TunnelStripeSetTimeout(stripe, NULL);
+
+   return 1;
+
+fail:
+   TunnelStripeFailed(stripe, reason);
+   free(reason);
+   return -1;
+}
 
-   {
-      /* Find the local address */
-      struct sockaddr addr = { 0 };
-      socklen_t addrLen = sizeof(addr);
-      int gaiErr;
 
-      if (getsockname(AsyncSocket_GetFd(gAsock), &addr, &addrLen) < 0) {
-         NOT_IMPLEMENTED();
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketRecvCb --
+ *
+ *      AsyncSocket data received callback.  Reads available data from the
+ *      tunnel socket, and pushes into the TunnelProxy.  A response header
+ *      without a 2xx status fails the stripe.  Called with no data to
+ *      start reading.
+ *
+ *      Once the response header has been skipped, data is read straight
+ *      into the TunnelProxy's receive buffer for the stripe using
+ *      TunnelProxy_HTTPRecvGetBuf and TunnelProxy_HTTPRecvCommit.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      hostIp = inet_ntoa(((struct sockaddr_in*) &addr)->sin_addr);
-      if (!hostIp) {
-         NOT_IMPLEMENTED();
+void
+TunnelSocketRecvCb(void *buf,          // IN/OPT: read data
+                   int len,            // IN/OPT: buf length
+                   AsyncSocket *asock, // IN/OPT
+                   void *userData)     // IN: TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+   TunnelProxy *tp = stripe->session->tp;
+   AsyncSocket *recvSock = stripe->asock;
+   char *recvBuf;
+   int recvSize = 0;
+
+   if (!stripe->recvHeaderDone) {
+      int parsed;
+
+      TunnelRecvCommit(&stripe->recvBuf, buf, len);
+      parsed = TunnelSocketParseHeader(stripe, "Tunnel request");
+      if (parsed < 0) {
+         return;
+      } else if (parsed == 0) {
+         TunnelRecvAppend(recvSock, &stripe->recvBuf, TunnelSocketRecvCb,
+                          stripe);
+         return;
       }
 
-      gaiErr = getnameinfo(&addr, addrLen, hostName, sizeof(hostName), NULL, 0,
-                           0);
-      if (gaiErr < 0) {
-         Warning("Unable to lookup name for localhost address '%s': %s.\n",
-                 hostIp, gai_strerror(gaiErr));
-         strcpy(hostName, hostIp);
+      stripe->recvHeaderDone = TRUE;
+      if (DynBuf_GetSize(&stripe->recvBuf) > 0) {
+         TunnelProxy_HTTPRecv(tp, stripe->index,
+                              (char*) DynBuf_Get(&stripe->recvBuf),
+                              DynBuf_GetSize(&stripe->recvBuf), TRUE);
+
+         /* Reset recvBuf for next connection */
+         DynBuf_SetSize(&stripe->recvBuf, 0);
+      }
+      if (stripe->index > 0) {
+         /* The server accepted the stripe, chunks may go over it now. */
+         TunnelSendNeededCb(tp, stripe->session);
       }
+   } else if (len > 0) {
+      TunnelProxy_HTTPRecvCommit(tp, stripe->index, len, TRUE);
    }
 
-   err = TunnelProxy_Connect(gTunnelProxy, hostIp, hostName,
-                             TunnelSendNeededCb, NULL,
-                             TunnelDisconnectCb, NULL);
-   ASSERT(err == TP_ERR_OK);
+   /* The TunnelProxy may have reset the connection while handling data. */
+   if (stripe->asock != recvSock) {
+      return;
+   }
 
-   free(serverUrl);
-   free(host);
-   free(path);
-   free(request);
+   recvBuf = TunnelProxy_HTTPRecvGetBuf(tp, stripe->index, &recvSize);
+   AsyncSocket_RecvPartial(recvSock, recvBuf, recvSize, TunnelSocketRecvCb,
+                           stripe);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelSocketProxyConnectCb --
+ * TunnelSocketProxyRecvCb --
  *
- *      AsyncSocket connection callback for the proxy server.  Sends a simple
- *      HTTP1.1 CONNECT request header, calls TunnelSocketProxyRecvCb to read
- *      the proxy response header.
+ *      AsyncSocket data received callback, used during initial proxy server
+ *      CONNECT setup.  Parses what arrived of the HTTP response header.
+ *      Once the proxy accepted, stops receiving and continues as for a
+ *      direct connection, otherwise waits for more of the header.  Called
+ *      with no data to start reading.
  *
  * Results:
  *      None
@@ -615,152 +791,1471 @@ TunnelSocketConnectCb(AsyncSocket *asock, // IN
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelSocketProxyConnectCb(AsyncSocket *asock, // IN
-                           void *userData)     // IN: not used
+void
+TunnelSocketProxyRecvCb(void *buf,          // IN/OPT: read data
+                        int len,            // IN/OPT: buf length
+                        AsyncSocket *asock, // IN/OPT
+                        void *userData)     // IN: TunnelStripe
 {
-   char *request;
-   size_t requestSize = 0;
-   int sendSize = 0;
-   int asockErr = ASOCKERR_SUCCESS;
-   char *serverUrl;
-   char *host = NULL;
-   unsigned short port = 0;
-
-   serverUrl = TunnelProxy_GetConnectUrl(gTunnelProxy, gServerArg);
-   if (!TunnelParseUrl(serverUrl, NULL, &host, &port, NULL, NULL)) {
-      NOT_IMPLEMENTED();
-   }
-
-   request = Str_Asprintf(&requestSize,
-      "CONNECT %s:%d HTTP/1.1\r\n"
-      "Host: %s:%d\r\n"
-      "User-agent: Mozilla/4.0 (compatible; MSIE 6.0)\r\n"
-      "Proxy-Connection: Keep-Alive\r\n"
-      "Content-Length: 0\r\n"
-      "\r\n", host, port, host, port);
+   TunnelStripe *stripe = userData;
+   int parsed;
 
-   /* Send initial request header */
-   asockErr = AsyncSocket_SendBlocking(gAsock, request, requestSize,
-                                       &sendSize, BLOCKING_TIMEOUT_MS);
-   if (asockErr != ASOCKERR_SUCCESS) {
-      Panic("TunnelSocketConnectCb: initial write failed: %s\n",
-            AsyncSocket_Err2String(asockErr));
+   TunnelRecvCommit(&stripe->recvBuf, buf, len);
+   parsed = TunnelSocketParseHeader(stripe, "Proxy CONNECT");
+   if (parsed > 0) {
+      /* Proxy portion of connect is done.  Connect using normal path. */
+      AsyncSocket_CancelRecv(stripe->asock, NULL, NULL, NULL);
+      DynBuf_SetSize(&stripe->recvBuf, 0);
+      TunnelSocketConnectCb(stripe->asock, stripe);
+   } else if (parsed == 0) {
+      TunnelRecvAppend(stripe->asock, &stripe->recvBuf,
+                       TunnelSocketProxyRecvCb, stripe);
    }
-   ASSERT(sendSize == requestSize);
-
-   /* Kick off channel reading */
-   DynBuf_Init(&gRecvBuf);
-   TunnelSocketProxyRecvCb(NULL, 0, NULL, NULL);
-
-   free(serverUrl);
-   free(host);
-   free(request);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelConnect --
+ * TunnelSendvCompleteCb --
  *
- *      Create an AsyncSocket and start the connection process for the server
- *      URL passed on the command line.  Will connect to the environment's
- *      http_proxy or https_proxy if set (depending on the protocol of the
- *      server URL).
+ *      AsyncSocket send callback for TunnelSendNeededCb.  Releases the
+ *      TunnelProxy chunk data the sent segments pointed at, and fetches more
+ *      if the socket is still the stripe's current one.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      Created socket is stored in the gAsock global.
+ *      May queue another send.
  *
  *-----------------------------------------------------------------------------
  */
 
 static void
-TunnelConnect(void)
+TunnelSendvCompleteCb(void *buf,          // IN: iovec array, not used
+                      int len,            // IN: not used
+                      AsyncSocket *asock, // IN
+                      void *clientData)   // IN: TunnelStripeSend
 {
-   const char *http_proxy = NULL;
-   const char *http_proxy_env = NULL;
-   const char *host;
-   unsigned short port;
-   int asockErr = ASOCKERR_SUCCESS;
-   AsyncSocketConnectFn connectFn;
-   char *serverUrl = NULL;
-   char *serverProto = NULL;
-   char *serverHost = NULL;
-   unsigned short serverPort = 0;
-   Bool serverSecure = FALSE;
-   char *proxyHost = NULL;
-   unsigned short proxyPort = 0;
+   TunnelStripeSend *send = clientData;
+   TunnelStripe *stripe = send->stripe;
 
-   ASSERT(!gAsock);
-   ASSERT(!gRecvHeaderDone);
+   TunnelProxy_HTTPSendvComplete(send->sendv);
+   send->sendv = NULL;
 
-   serverUrl = TunnelProxy_GetConnectUrl(gTunnelProxy, gServerArg);
-   if (!TunnelParseUrl(serverUrl, &serverProto, &serverHost, &serverPort, NULL,
-                       &serverSecure)) {
-      Panic("Invalid <server-url> argument: %s\n", serverUrl);
+   /* Sends still pending on a closed socket complete from its close. */
+   if (asock == stripe->asock) {
+      stripe->sendsPending--;
+      ASSERT(stripe->sendsPending >= 0);
+      TunnelSendNeededCb(stripe->session->tp, stripe->session);
    }
+}
 
-   if (Str_Strcmp(serverProto, "http") == 0) {
-      http_proxy_env = "http_proxy";
-      http_proxy = getenv(http_proxy_env);
-   } else if (Str_Strcmp(serverProto, "https") == 0) {
-      http_proxy_env = "https_proxy";
-      http_proxy = getenv(http_proxy_env);
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSendNeededCb --
+ *
+ *      TunnelProxy send needed callback.  Fetches the available HTTP chunk
+ *      data as gather segments pointing at the queued chunks, and queues an
+ *      async send of them over the AsyncSocket.
+ *
+ *      Only MAX_SENDS_PENDING sends are queued at once on each stripe, so a
+ *      backlog stays in the TunnelProxy, which decides which channel's data
+ *      goes next.  Each send goes to the connected stripe with the fewest
+ *      sends pending; the server puts chunks back in chunkId order.  Extra
+ *      stripes are only used once the server accepted them, so one it
+ *      rejects has nothing to resend.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelSendNeededCb(TunnelProxy *tp, // IN
+                   void *userData)  // IN: TunnelSession
+{
+   TunnelSession *session = userData;
+
+   for (;;) {
+      struct iovec *iov = NULL;
+      int iovCnt = 0;
+      TunnelProxySendv *sendv;
+      TunnelStripe *stripe = NULL;
+      TunnelStripeSend *send = NULL;
+      int i;
+
+      for (i = 0; i < session->stripeCount; i++) {
+         TunnelStripe *candidate = &session->stripes[i];
+
+         if (candidate->connected &&
+             (candidate->recvHeaderDone || candidate->index == 0) &&
+             candidate->sendsPending < MAX_SENDS_PENDING &&
+             (!stripe || candidate->sendsPending < stripe->sendsPending)) {
+            stripe = candidate;
+         }
+      }
+      if (!stripe) {
+         break;
+      }
+
+      sendv = TunnelProxy_HTTPSendv(tp, TRUE, &iov, &iovCnt);
+      if (!sendv) {
+         break;
+      }
+
+      for (i = 0; !send; i++) {
+         ASSERT(i < MAX_SENDS_PENDING);
+         if (!stripe->sends[i].sendv) {
+            send = &stripe->sends[i];
+         }
+      }
+      send->stripe = stripe;
+      send->sendv = sendv;
+
+      stripe->sendsPending++;
+      if (AsyncSocket_Sendv(stripe->asock, iov, iovCnt, TunnelSendvCompleteCb,
+                            send) != ASOCKERR_SUCCESS) {
+         stripe->sendsPending--;
+         send->sendv = NULL;
+         TunnelProxy_HTTPSendvComplete(sendv);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketErrorCb --
+ *
+ *      AsyncSocket error callback.  Calls TunnelStripeFailed with the
+ *      AsyncSocket error string as the reason.
+ *
+ *      A failure to connect drops the cached server address, so that the
+ *      next attempt looks it up again.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelSocketErrorCb(int error,          // IN
+                    AsyncSocket *asock, // IN
+                    void *userData)     // IN: TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+   TunnelSession *session = stripe->session;
+
+   if (!stripe->connected && !stripe->standbyReady) {
+      session->target->connectIp = 0;
+   }
+
+   TunnelStripeFailed(stripe, AsyncSocket_Err2String(error));
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelCacheAddr --
+ *
+ *      Remember the address a stripe's connection to the tunnel server (or
+ *      proxy) reached, so reconnects, stripes and other sessions skip the
+ *      hostname lookup.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Sets the connectIp of the session's target.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelCacheAddr(TunnelStripe *stripe) // IN
+{
+   TunnelTarget *target = stripe->session->target;
+   struct sockaddr_in addr;
+   socklen_t addrLen = sizeof addr;
+
+   if (target->connectIp == 0 &&
+       getpeername(AsyncSocket_GetFd(stripe->asock),
+                   (struct sockaddr *) &addr, &addrLen) == 0 &&
+       addr.sin_family == AF_INET) {
+      target->connectIp = ntohl(addr.sin_addr.s_addr);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSendRequestCb --
+ *
+ *      AsyncSocket send callback for TunnelSendRequest.  Frees the request.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSendRequestCb(void *buf,          // IN: request
+                    int len,            // IN: not used
+                    AsyncSocket *asock, // IN: not used
+                    void *clientData)   // IN: not used
+{
+   free(buf);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSendRequest --
+ *
+ *      Queue an HTTP request header on a stripe's socket without waiting for
+ *      it to go out.  Anything sent on the socket afterwards follows it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Takes ownership of request.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSendRequest(TunnelStripe *stripe, // IN
+                  char *request,        // IN
+                  size_t requestSize)   // IN
+{
+   int asockErr;
+
+   asockErr = AsyncSocket_Send(stripe->asock, request, requestSize,
+                               TunnelSendRequestCb, NULL);
+   if (asockErr != ASOCKERR_SUCCESS) {
+      Panic("TunnelSendRequest: initial write failed: %s\n",
+            AsyncSocket_Err2String(asockErr));
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketPost --
+ *
+ *      Post a simple HTTP1.1 request header on a stripe's connected socket,
+ *      set up socket read IO handler, and for the main connection tell the
+ *      TunnelProxy it is now connected.  Other stripes start sending once
+ *      the server accepts them, see TunnelSocketRecvCb.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May open the standby connection.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSocketPost(TunnelStripe *stripe) // IN
+{
+   TunnelSession *session = stripe->session;
+   TunnelProxyErr err = TP_ERR_OK;
+   char *request;
+   size_t requestSize = 0;
+   char *serverUrl;
+   char *host = NULL;
+   unsigned short port = 0;
+   char *path = NULL;
+   const char *hostIp = NULL;
+   char hostName[1024];
+
+   serverUrl = TunnelStripeUrl(stripe);
+   if (!serverUrl ||
+       !TunnelParseUrl(serverUrl, NULL, &host, &port, &path, NULL)) {
+      NOT_IMPLEMENTED();
+   }
+
+   request = Str_Asprintf(&requestSize,
+      "POST %s HTTP/1.1\r\n"
+      "Host: %s:%d\r\n"
+      "Accept: text/*, application/octet-stream\r\n"
+      "User-agent: Mozilla/4.0 (compatible; MSIE 6.0)\r\n"
+      "Pragma: no-cache\r\n"
+      "Connection: Keep-Alive\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+      "\r\n", path, host, port);
+
+   /* Send initial request header */
+   TunnelSendRequest(stripe, request, requestSize);
+   stripe->connected = TRUE;
+
+   /* Kick off channel reading */
+   TunnelSocketRecvCb(NULL, 0, NULL, stripe);
+
+   if (stripe->index > 0) {
+      goto exit;
+   }
+
+   {
+      /* Find the local address */
+      struct sockaddr addr = { 0 };
+      socklen_t addrLen = sizeof(addr);
+      int gaiErr;
+
+      if (getsockname(AsyncSocket_GetFd(stripe->asock), &addr,
+                      &addrLen) < 0) {
+         NOT_IMPLEMENTED();
+      }
+
+      hostIp = inet_ntoa(((struct sockaddr_in*) &addr)->sin_addr);
+      if (!hostIp) {
+         NOT_IMPLEMENTED();
+      }
+
+      gaiErr = getnameinfo(&addr, addrLen, hostName, sizeof(hostName), NULL, 0,
+                           0);
+      if (gaiErr < 0) {
+         Warning("Unable to lookup name for localhost address '%s': %s.\n",
+                 hostIp, gai_strerror(gaiErr));
+         strcpy(hostName, hostIp);
+      }
+   }
+
+   Log("Tunnel session %u %s over %s connection, %s address, %s.\n",
+       session->id, session->connects++ > 0 ? "reconnecting" : "connecting",
+       stripe->fromStandby ? "a standby" : "a new",
+       stripe->addrCached ? "cached" : "resolved",
+       !session->serverSecure ? "no SSL" :
+       stripe->sslResumed ? "SSL session resumed" : "full SSL handshake");
+
+   err = TunnelProxy_Connect(session->tp, hostIp, hostName,
+                             TunnelSendNeededCb, session,
+                             TunnelDisconnectCb, session,
+                             TunnelStripesCb, session);
+   ASSERT(err == TP_ERR_OK);
+
+   if (session->standbyWanted && !session->standby.asock) {
+      TunnelConnect(&session->standby);
+   }
+
+exit:
+   free(serverUrl);
+   free(host);
+   free(path);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketReady --
+ *
+ *      Called once a stripe's connection reaches the tunnel server, SSL
+ *      included.  Posts the tunnel request, or for the standby connection
+ *      waits until it is needed.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSocketReady(TunnelStripe *stripe) // IN
+{
+   if (stripe == &stripe->session->standby) {
+      stripe->standbyReady = TRUE;
+      /* Only an error or the server closing it is expected. */
+      TunnelRecvAppend(stripe->asock, &stripe->recvBuf, TunnelStandbyRecvCb,
+                       stripe);
+      return;
+   }
+
+   TunnelSocketPost(stripe);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketSslConnectCb --
+ *
+ *      AsyncSocket SSL connect callback.  Fails the stripe if the handshake
+ *      did not complete, otherwise calls TunnelSocketReady.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSocketSslConnectCb(Bool connected,     // IN
+                         Bool resumed,       // IN
+                         AsyncSocket *asock, // IN
+                         void *userData)     // IN: TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+
+   if (!connected) {
+      TunnelStripeFailed(stripe, "SSL handshake with tunnel server failed");
+      return;
+   }
+
+   TunnelStripeSetTimeout(stripe, NULL);
+   stripe->sslResumed = resumed;
+   TunnelSocketReady(stripe);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketConnectCb --
+ *
+ *      AsyncSocket connection callback.  Starts converting the socket to
+ *      SSL, if the session's server URL is HTTPS, resuming the SSL session
+ *      of an earlier connection when the server allows.  The handshake
+ *      runs from the poll loop, so other stripes and channels keep moving
+ *      meanwhile.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSocketConnectCb(AsyncSocket *asock, // IN
+                      void *userData)     // IN: TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+   TunnelSession *session = stripe->session;
+
+   TunnelCacheAddr(stripe);
+
+   if (!session->serverSecure) {
+      TunnelSocketReady(stripe);
+      return;
+   }
+
+   /* Establish SSL, but don't enforce the cert */
+   TunnelStripeSetTimeout(stripe, "SSL handshake with tunnel server");
+   if (!AsyncSocket_StartSslConnect(stripe->asock, NULL,
+                                    &session->target->sslSession,
+                                    TunnelSocketSslConnectCb, stripe)) {
+      TunnelStripeFailed(stripe, "Unable to start SSL handshake");
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSocketProxyConnectCb --
+ *
+ *      AsyncSocket connection callback for the proxy server.  Sends a simple
+ *      HTTP1.1 CONNECT request header, calls TunnelSocketProxyRecvCb to read
+ *      the proxy response header.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSocketProxyConnectCb(AsyncSocket *asock, // IN
+                           void *userData)     // IN: TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+   TunnelTarget *target = stripe->session->target;
+   char *request;
+   size_t requestSize = 0;
+
+   TunnelCacheAddr(stripe);
+
+   request = Str_Asprintf(&requestSize,
+      "CONNECT %s:%d HTTP/1.1\r\n"
+      "Host: %s:%d\r\n"
+      "User-agent: Mozilla/4.0 (compatible; MSIE 6.0)\r\n"
+      "Proxy-Connection: Keep-Alive\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n", target->serverHost, target->serverPort, target->serverHost,
+      target->serverPort);
+
+   /* Send initial request header */
+   TunnelSendRequest(stripe, request, requestSize);
+
+   /* Kick off channel reading */
+   TunnelSocketProxyRecvCb(NULL, 0, NULL, stripe);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStripesCb --
+ *
+ *      TunnelProxy stripes callback.  Opens a connection for each stripe of
+ *      the session past the main one that is not already open.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May call TunnelConnect.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStripesCb(TunnelProxy *tp, // IN
+                int stripes,     // IN
+                void *userData)  // IN: TunnelSession
+{
+   TunnelSession *session = userData;
+   int i;
+
+   ASSERT(stripes > 0 && stripes <= TP_MAX_STRIPES);
+
+   session->stripeCount = stripes;
+   for (i = 1; i < session->stripeCount; i++) {
+      if (!session->stripes[i].asock) {
+         TunnelConnect(&session->stripes[i]);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStandbyClose --
+ *
+ *      Close a session's standby connection, and try opening another one
+ *      after STANDBY_RETRY_MS.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStandbyClose(TunnelSession *session, // IN
+                   const char *reason)     // IN
+{
+   AsyncSocket *asock = session->standby.asock;
+
+   Log("Tunnel standby connection closed: %s\n", reason);
+
+   TunnelStripeSetTimeout(&session->standby, NULL);
+
+   session->standby.asock = NULL;
+   session->standby.standbyReady = FALSE;
+   if (asock) {
+      AsyncSocket_Close(asock);
+   }
+
+   Poll_CB_RTime(TunnelStandbyRetryCb, session, STANDBY_RETRY_MS * 1000,
+                 FALSE, NULL);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStandbyRecvCb --
+ *
+ *      AsyncSocket data received callback for the standby connection, which
+ *      the server should not send anything on.  Closes it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStandbyRecvCb(void *buf,          // IN: not used
+                    int len,            // IN: not used
+                    AsyncSocket *asock, // IN
+                    void *userData)     // IN: session's standby TunnelStripe
+{
+   TunnelStripe *stripe = userData;
+
+   AsyncSocket_CancelRecv(asock, NULL, NULL, NULL);
+   TunnelStandbyClose(stripe->session, "Unexpected data");
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStandbyRetryCb --
+ *
+ *      Poll callback to reopen a session's standby connection after it
+ *      closed.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May call TunnelConnect.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStandbyRetryCb(void *clientData) // IN: TunnelSession
+{
+   TunnelSession *session = clientData;
+
+   if (!session->standby.asock) {
+      TunnelConnect(&session->standby);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStandbyPostCb --
+ *
+ *      Poll callback to post the main tunnel connection over the standby
+ *      connection, once TunnelDisconnectCb has returned to the TunnelProxy.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Calls TunnelSocketPost.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStandbyPostCb(void *clientData) // IN: TunnelStripe
+{
+   TunnelStripe *stripe = clientData;
+
+   if (stripe->asock && !stripe->connected) {
+      TunnelSocketPost(stripe);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelLookupTarget --
+ *
+ *      Find the TunnelTarget for connections to a server through a proxy, or
+ *      directly if the connect host and port are the server's, creating it
+ *      if no session connected there yet.
+ *
+ * Results:
+ *      The TunnelTarget.
+ *
+ * Side effects:
+ *      Takes ownership of serverHost and connectHost.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TunnelTarget *
+TunnelLookupTarget(char *serverHost,           // IN
+                   unsigned short serverPort,  // IN
+                   char *connectHost,          // IN
+                   unsigned short connectPort) // IN
+{
+   TunnelTarget *target;
+   ListItem *li;
+
+   LIST_SCAN(li, gTargets) {
+      target = LIST_CONTAINER(li, TunnelTarget, list);
+      if (target->serverPort == serverPort &&
+          target->connectPort == connectPort &&
+          Str_Strcasecmp(target->serverHost, serverHost) == 0 &&
+          Str_Strcasecmp(target->connectHost, connectHost) == 0) {
+         free(serverHost);
+         free(connectHost);
+         return target;
+      }
+   }
+
+   target = Util_SafeCalloc(1, sizeof *target);
+   target->serverHost = serverHost;
+   target->serverPort = serverPort;
+   target->connectHost = connectHost;
+   target->connectPort = connectPort;
+   LIST_QUEUE(&target->list, &gTargets);
+
+   return target;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelConnectTarget --
+ *
+ *      Work out where TunnelConnect connects to for a session's server URL:
+ *      the server, or the environment's http_proxy or https_proxy if set
+ *      (depending on the protocol of the server URL).  Done once,
+ *      reconnects and stripes go to the same place.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Sets the session's serverSecure, target and connectFn.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelConnectTarget(TunnelSession *session) // IN
+{
+   const char *http_proxy = NULL;
+   const char *http_proxy_env = NULL;
+   char *serverUrl = NULL;
+   char *serverProto = NULL;
+   char *serverHost = NULL;
+   unsigned short serverPort = 0;
+   char *proxyHost = NULL;
+   unsigned short proxyPort = 0;
+
+   serverUrl = TunnelProxy_GetConnectUrl(session->tp, session->serverArg);
+   if (!TunnelParseUrl(serverUrl, &serverProto, &serverHost, &serverPort,
+                       NULL, &session->serverSecure)) {
+      Panic("Invalid <server-url> argument: %s\n", serverUrl);
+   }
+
+   if (Str_Strcmp(serverProto, "http") == 0) {
+      http_proxy_env = "http_proxy";
+      http_proxy = getenv(http_proxy_env);
+   } else if (Str_Strcmp(serverProto, "https") == 0) {
+      http_proxy_env = "https_proxy";
+      http_proxy = getenv(http_proxy_env);
       if (!http_proxy || !*http_proxy) {
          http_proxy_env = "HTTPS_PROXY";
          http_proxy = getenv(http_proxy_env);
       }
    } else {
-      Panic("Unknown <server-url> protocol '%s'.\n", serverProto);
+      Panic("Unknown <server-url> protocol '%s'.\n", serverProto);
+   }
+
+   if (http_proxy) {
+      if (!*http_proxy) {
+         /* Ignore empty proxy env var */
+         http_proxy = NULL;
+      } else if (!TunnelParseUrl(http_proxy, NULL, &proxyHost, &proxyPort,
+                                 NULL, NULL)) {
+         Warning("Invalid %s URL '%s'.  Attempting direct connection.\n",
+                 http_proxy_env, http_proxy);
+         http_proxy = NULL;
+      }
+   }
+
+   if (http_proxy) {
+      Log("Connecting to tunnel server '%s:%d' over %s, via %s server '%s:%d'.\n",
+          serverHost, serverPort, session->serverSecure ? "HTTPS" : "HTTP",
+          http_proxy_env, proxyHost, proxyPort);
+      session->connectFn = TunnelSocketProxyConnectCb;
+   } else {
+      Log("Connecting to tunnel server '%s:%d' over %s.\n", serverHost,
+          serverPort, session->serverSecure ? "HTTPS" : "HTTP");
+      free(proxyHost);
+      proxyHost = Util_SafeStrdup(serverHost);
+      proxyPort = serverPort;
+      session->connectFn = TunnelSocketConnectCb;
+   }
+   ASSERT(proxyHost && proxyPort > 0);
+
+   session->target = TunnelLookupTarget(serverHost, serverPort, proxyHost,
+                                        proxyPort);
+
+   free(serverUrl);
+   free(serverProto);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelConnect --
+ *
+ *      Create an AsyncSocket and start the connection process for a stripe,
+ *      or the standby connection.  The address of the first connection to
+ *      the session's target is reused by the others.  The main connection
+ *      takes over the standby connection instead if it is ready.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Created socket is stored in the stripe.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelConnect(TunnelStripe *stripe) // IN
+{
+   TunnelSession *session = stripe->session;
+   TunnelTarget *target;
+   int asockErr = ASOCKERR_SUCCESS;
+   char *serverUrl;
+
+   ASSERT(!stripe->asock);
+   ASSERT(!stripe->recvHeaderDone);
+
+   stripe->headerScanned = 0;
+   DynBuf_SetSize(&stripe->recvBuf, 0);
+   stripe->fromStandby = FALSE;
+   stripe->addrCached = FALSE;
+   stripe->sslResumed = FALSE;
+
+   if (stripe == &session->stripes[0] && session->standby.standbyReady) {
+      TunnelStripe *standby = &session->standby;
+
+      /* Nothing is ever sent on the standby, so its recv can be cancelled. */
+      asockErr = AsyncSocket_CancelRecv(standby->asock, NULL, NULL, NULL);
+      ASSERT(asockErr == ASOCKERR_SUCCESS);
+      stripe->asock = standby->asock;
+      stripe->fromStandby = TRUE;
+      stripe->sslResumed = standby->sslResumed;
+      stripe->addrCached = standby->addrCached;
+      standby->asock = NULL;
+      standby->standbyReady = FALSE;
+
+      AsyncSocket_SetErrorFn(stripe->asock, TunnelSocketErrorCb, stripe);
+      Poll_CB_RTime(TunnelStandbyPostCb, stripe, 0, FALSE, NULL);
+      return;
+   }
+
+   serverUrl = TunnelStripeUrl(stripe);
+   if (!serverUrl) {
+      Warning("Not opening tunnel stripe %d: no reconnect secret.\n",
+              stripe->index);
+      return;
+   }
+   free(serverUrl);
+
+   if (!session->target) {
+      TunnelConnectTarget(session);
+   }
+   target = session->target;
+
+   if (target->connectIp) {
+      stripe->addrCached = TRUE;
+      stripe->asock = AsyncSocket_ConnectIP(target->connectIp,
+                                            target->connectPort,
+                                            session->connectFn, stripe, 0,
+                                            NULL, &asockErr);
+   } else {
+      stripe->asock = AsyncSocket_Connect(target->connectHost,
+                                          target->connectPort,
+                                          session->connectFn, stripe, 0,
+                                          NULL, &asockErr);
+   }
+   if (ASOCKERR_SUCCESS != asockErr) {
+      char *reason = Str_Asprintf(NULL, "Connection failed: %s (%d)",
+                                  AsyncSocket_Err2String(asockErr),
+                                  asockErr);
+
+      /* A lookup failure is not worth taking down a daemon's sessions. */
+      stripe->asock = NULL;
+      TunnelStripeFailed(stripe, reason);
+      free(reason);
+      return;
+   }
+   ASSERT(stripe->asock);
+
+   AsyncSocket_SetErrorFn(stripe->asock, TunnelSocketErrorCb, stripe);
+   AsyncSocket_UseNodelay(stripe->asock, TRUE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSessionCreate --
+ *
+ *      Create a session for a server URL and connection ID, ready for
+ *      TunnelConnect.
+ *
+ * Results:
+ *      The session, or NULL if the URL is not an HTTP or HTTPS one.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TunnelSession *
+TunnelSessionCreate(const char *serverArg,       // IN
+                    const char *connectionIdArg) // IN
+{
+   TunnelSession *session;
+   char *proto = NULL;
+   Bool valid;
+   int i;
+
+   valid = TunnelParseUrl(serverArg, &proto, NULL, NULL, NULL, NULL) &&
+           (Str_Strcmp(proto, "http") == 0 || Str_Strcmp(proto, "https") == 0);
+   free(proto);
+   if (!valid || !*connectionIdArg) {
+      return NULL;
+   }
+
+   session = Util_SafeCalloc(1, sizeof *session);
+   session->id = ++gLastSessionId;
+   session->serverArg = Util_SafeStrdup(serverArg);
+   session->connectionIdArg = Util_SafeStrdup(connectionIdArg);
+   session->stripeCount = 1;
+
+   for (i = 0; i < TP_MAX_STRIPES; i++) {
+      session->stripes[i].session = session;
+      session->stripes[i].index = i;
+      DynBuf_Init(&session->stripes[i].recvBuf);
+   }
+   session->standby.session = session;
+   DynBuf_Init(&session->standby.recvBuf);
+   session->standbyWanted = Preference_GetBool(FALSE, "view.tunnel.standby");
+
+   session->tp = TunnelProxy_Create(session->connectionIdArg, NULL, NULL,
+                                    NULL, NULL, NULL, NULL);
+   ASSERT(session->tp);
+
+   LIST_QUEUE(&session->list, &gSessions);
+   TunnelStats_Add(session->tp, session->id);
+
+   return session;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSessionFreeCb --
+ *
+ *      Poll callback to free a session ended by TunnelSessionEnd, once
+ *      nothing up the stack can still be using it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Closes the session's listeners and channels.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSessionFreeCb(void *clientData) // IN: TunnelSession
+{
+   TunnelSession *session = clientData;
+   int i;
+
+   TunnelProxy_Free(session->tp);
+
+   for (i = 0; i < TP_MAX_STRIPES; i++) {
+      DynBuf_Destroy(&session->stripes[i].recvBuf);
+   }
+   DynBuf_Destroy(&session->standby.recvBuf);
+   free(session->serverArg);
+   free(session->connectionIdArg);
+   free(session);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelSessionEnd --
+ *
+ *      End a daemon's session: close its connections, and free it from the
+ *      poll loop, as this may be called from its TunnelProxy's callbacks.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelSessionEnd(TunnelSession *session) // IN
+{
+   int i;
+
+   Log("Tunnel session %u ended.\n", session->id);
+
+   LIST_DEL(&session->list, &gSessions);
+   TunnelStats_Remove(session->tp);
+
+   Poll_CB_RTimeRemove(TunnelStandbyPostCb, &session->stripes[0], FALSE);
+   Poll_CB_RTimeRemove(TunnelStandbyRetryCb, session, FALSE);
+
+   for (i = 0; i < TP_MAX_STRIPES; i++) {
+      TunnelStripe *stripe = &session->stripes[i];
+      AsyncSocket *asock = stripe->asock;
+
+      TunnelStripeSetTimeout(stripe, NULL);
+      if (asock) {
+         stripe->asock = NULL;
+         stripe->connected = FALSE;
+         AsyncSocket_Close(asock);
+      }
+   }
+   TunnelStripeSetTimeout(&session->standby, NULL);
+   if (session->standby.asock) {
+      AsyncSocket *asock = session->standby.asock;
+
+      session->standby.asock = NULL;
+      AsyncSocket_Close(asock);
+   }
+
+   Poll_CB_RTime(TunnelSessionFreeCb, session, 0, FALSE, NULL);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelLookupSession --
+ *
+ *      Find a daemon's session by the ID the control socket gave it.
+ *
+ * Results:
+ *      The session, or NULL.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TunnelSession *
+TunnelLookupSession(const char *idStr) // IN
+{
+   unsigned int id;
+   ListItem *li;
+
+   if (!idStr || !StrUtil_StrToUint(&id, idStr)) {
+      return NULL;
+   }
+
+   LIST_SCAN(li, gSessions) {
+      TunnelSession *session = LIST_CONTAINER(li, TunnelSession, list);
+
+      if (session->id == id) {
+         return session;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlClose --
+ *
+ *      Close a control connection, if flush is set only once the replies
+ *      queued on it are sent.  Reads stop meanwhile, and a client that
+ *      doesn't take its replies within CONTROL_FLUSH_MS is dropped.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Frees the TunnelControl, maybe later.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlClose(TunnelControl *ctrl, // IN
+                   Bool flush)          // IN
+{
+   AsyncSocket *asock = ctrl->asock;
+
+   if (flush && ctrl->sendsPending > 0) {
+      if (!ctrl->closing) {
+         /* TunnelControlSendCb or TunnelControlCloseTimeoutCb finish it. */
+         ctrl->closing = TRUE;
+         AsyncSocket_PauseRecv(asock);
+         Poll_CB_RTime(TunnelControlCloseTimeoutCb, ctrl,
+                       CONTROL_FLUSH_MS * 1000, FALSE, NULL);
+      }
+      return;
+   }
+
+   if (ctrl->closing) {
+      Poll_CB_RTimeRemove(TunnelControlCloseTimeoutCb, ctrl, FALSE);
+   }
+
+   /* Replies not sent yet have their send callbacks fired from the close. */
+   ctrl->asock = NULL;
+   AsyncSocket_Close(asock);
+   DynBuf_Destroy(&ctrl->recvBuf);
+   free(ctrl);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlCloseTimeoutCb --
+ *
+ *      Poll callback dropping a closing control connection whose client
+ *      didn't read its replies in time.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Frees the TunnelControl.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlCloseTimeoutCb(void *clientData) // IN: TunnelControl
+{
+   TunnelControl *ctrl = clientData;
+
+   ASSERT(ctrl->closing);
+   TunnelControlClose(ctrl, FALSE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlSendCb --
+ *
+ *      AsyncSocket send callback for TunnelControlReply.  Frees the reply,
+ *      and finishes closing the connection if that was waiting for it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlSendCb(void *buf,          // IN
+                    int len,            // IN: not used
+                    AsyncSocket *asock, // IN: not used
+                    void *clientData)   // IN: TunnelControl
+{
+   TunnelControl *ctrl = clientData;
+
+   free(buf);
+   ctrl->sendsPending--;
+   if (ctrl->closing && ctrl->sendsPending == 0 && ctrl->asock) {
+      TunnelControlClose(ctrl, TRUE);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlReply --
+ *
+ *      Queue text on a control connection.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Takes ownership of text.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlReply(TunnelControl *ctrl, // IN
+                   char *text)          // IN
+{
+   ASSERT_MEM_ALLOC(text);
+
+   ctrl->sendsPending++;
+   if (AsyncSocket_Send(ctrl->asock, text, strlen(text), TunnelControlSendCb,
+                        ctrl) != ASOCKERR_SUCCESS) {
+      ctrl->sendsPending--;
+      free(text);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlCommand --
+ *
+ *      Run a control command line and reply to it.  The commands are:
+ *
+ *        start <server-url> <connection-id>   Start a session, reply its ID
+ *        stop <id>                            End a session
+ *        list                                 A line per session
+ *        stats <id>                           A session's TunnelStats
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlCommand(TunnelControl *ctrl, // IN
+                     const char *line)    // IN
+{
+   unsigned int index = 0;
+   char *cmd = StrUtil_GetNextToken(&index, line, " \t");
+   char *arg1 = StrUtil_GetNextToken(&index, line, " \t");
+   char *arg2 = StrUtil_GetNextToken(&index, line, " \t");
+   TunnelSession *session;
+
+   if (!cmd) {
+      /* Blank line. */
+   } else if (Str_Strcmp(cmd, "start") == 0) {
+      session = arg1 && arg2 ? TunnelSessionCreate(arg1, arg2) : NULL;
+      if (!session) {
+         TunnelControlReply(ctrl, Util_SafeStrdup(
+            "error usage: start <server-url> <connection-id>\n"));
+      } else {
+         Log("Tunnel session %u started for %s.\n", session->id,
+             session->serverArg);
+         TunnelControlReply(ctrl, Str_Asprintf(NULL, "ok %u\n",
+                                               session->id));
+         TunnelConnect(&session->stripes[0]);
+      }
+   } else if (Str_Strcmp(cmd, "stop") == 0) {
+      session = TunnelLookupSession(arg1);
+      if (!session) {
+         TunnelControlReply(ctrl, Util_SafeStrdup("error no such session\n"));
+      } else {
+         TunnelSessionEnd(session);
+         TunnelControlReply(ctrl, Util_SafeStrdup("ok\n"));
+      }
+   } else if (Str_Strcmp(cmd, "list") == 0) {
+      ListItem *li;
+
+      LIST_SCAN(li, gSessions) {
+         session = LIST_CONTAINER(li, TunnelSession, list);
+         TunnelControlReply(ctrl, Str_Asprintf(NULL, "%u %s %s\n",
+            session->id,
+            session->stripes[0].connected ? "connected" : "connecting",
+            session->serverArg));
+      }
+      TunnelControlReply(ctrl, Util_SafeStrdup("ok\n"));
+   } else if (Str_Strcmp(cmd, "stats") == 0) {
+      session = TunnelLookupSession(arg1);
+      if (!session) {
+         TunnelControlReply(ctrl, Util_SafeStrdup("error no such session\n"));
+      } else {
+         TunnelControlReply(ctrl, TunnelStats_Format(session->tp));
+         TunnelControlReply(ctrl, Util_SafeStrdup("ok\n"));
+      }
+   } else {
+      TunnelControlReply(ctrl, Str_Asprintf(NULL, "error unknown command "
+                                            "'%s'\n", cmd));
    }
 
-   if (http_proxy) {
-      if (!*http_proxy) {
-         /* Ignore empty proxy env var */
-         http_proxy = NULL;
-      } else if (!TunnelParseUrl(http_proxy, NULL, &proxyHost, &proxyPort,
-                                 NULL, NULL)) {
-         Warning("Invalid %s URL '%s'.  Attempting direct connection.\n",
-                 http_proxy_env, http_proxy);
-         http_proxy = NULL;
+   free(cmd);
+   free(arg1);
+   free(arg2);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlRecvCb --
+ *
+ *      AsyncSocket data received callback for a control connection.  Runs
+ *      each complete line of what has arrived.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlRecvCb(void *buf,          // IN: read data
+                    int len,            // IN: buf length
+                    AsyncSocket *asock, // IN
+                    void *clientData)   // IN: TunnelControl
+{
+   TunnelControl *ctrl = clientData;
+   char *lines;
+   char *lineEnd;
+   int size;
+
+   TunnelRecvCommit(&ctrl->recvBuf, buf, len);
+
+   lines = DynBuf_Get(&ctrl->recvBuf);
+   size = DynBuf_GetSize(&ctrl->recvBuf);
+   while (size > 0 && (lineEnd = memchr(lines, '\n', size)) != NULL) {
+      *lineEnd = '\0';
+      if (lineEnd > lines && lineEnd[-1] == '\r') {
+         lineEnd[-1] = '\0';
       }
+      TunnelControlCommand(ctrl, lines);
+      size -= lineEnd + 1 - lines;
+      lines = lineEnd + 1;
    }
+   memmove(DynBuf_Get(&ctrl->recvBuf), lines, size);
+   DynBuf_SetSize(&ctrl->recvBuf, size);
 
-   if (http_proxy) {
-      Log("Connecting to tunnel server '%s:%d' over %s, via %s server '%s:%d'.\n",
-          serverHost, serverPort, serverSecure ? "HTTPS" : "HTTP",
-          http_proxy_env, proxyHost, proxyPort);
-      host = proxyHost;
-      port = proxyPort;
-      connectFn = TunnelSocketProxyConnectCb;
+   if (size > MAX_HEADER_SIZE) {
+      TunnelControlClose(ctrl, TRUE);
    } else {
-      Log("Connecting to tunnel server '%s:%d' over %s.\n", serverHost,
-          serverPort, serverSecure ? "HTTPS" : "HTTP");
-      host = serverHost;
-      port = serverPort;
-      connectFn = TunnelSocketConnectCb;
+      TunnelRecvAppend(asock, &ctrl->recvBuf, TunnelControlRecvCb, ctrl);
    }
-   ASSERT(host && port > 0 && connectFn);
+}
 
-   gAsock = AsyncSocket_Connect(host, port, connectFn, NULL, 0, NULL,
-                                &asockErr);
-   if (ASOCKERR_SUCCESS != asockErr) {
-      Panic("Connection failed: %s (%d)\n", AsyncSocket_Err2String(asockErr),
-            asockErr);
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlErrorCb --
+ *
+ *      AsyncSocket error callback for a control connection.  Closes it,
+ *      once the replies are sent if the client just closed its end after
+ *      writing its commands.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlErrorCb(int error,          // IN
+                     AsyncSocket *asock, // IN
+                     void *clientData)   // IN: TunnelControl
+{
+   TunnelControl *ctrl = clientData;
+
+   if (!ctrl->asock) {
+      return;
+   }
+
+   if (error == ASOCKERR_REMOTE_DISCONNECT) {
+      TunnelControlClose(ctrl, TRUE);
+   } else {
+      TunnelControlClose(ctrl, FALSE);
    }
-   ASSERT(gAsock);
+}
 
-   AsyncSocket_SetErrorFn(gAsock, TunnelSocketErrorCb, NULL);
-   AsyncSocket_UseNodelay(gAsock, TRUE);
 
-   free(serverUrl);
-   free(serverProto);
-   free(serverHost);
-   free(proxyHost);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelControlConnectCb --
+ *
+ *      AsyncSocket listener callback for the daemon's control socket.  The
+ *      socket file's mode already keeps other users out, but an abstract
+ *      socket name has none, so the peer's user is checked as well.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Closes connections from other users.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelControlConnectCb(AsyncSocket *asock, // IN
+                       void *clientData)   // IN: not used
+{
+   TunnelControl *ctrl;
+   struct ucred cred;
+   socklen_t credLen = sizeof cred;
+
+   if (getsockopt(AsyncSocket_GetFd(asock), SOL_SOCKET, SO_PEERCRED, &cred,
+                  &credLen) < 0 || cred.uid != getuid()) {
+      Warning("Refusing control connection from another user.\n");
+      AsyncSocket_Close(asock);
+      return;
+   }
+
+   ctrl = Util_SafeCalloc(1, sizeof *ctrl);
+   ctrl->asock = asock;
+   DynBuf_Init(&ctrl->recvBuf);
+
+   AsyncSocket_SetErrorFn(asock, TunnelControlErrorCb, ctrl);
+   TunnelRecvAppend(asock, &ctrl->recvBuf, TunnelControlRecvCb, ctrl);
 }
 
 
@@ -783,7 +2278,8 @@ TunnelConnect(void)
 static void
 TunnelPrintUsage(const char *binName) // IN
 {
-   Warning("Usage: %s <server-url> <connection-id>\n", binName);
+   Warning("Usage: %s <server-url> <connection-id>\n"
+           "       %s -d <control-socket>\n", binName, binName);
    exit(1);
 }
 
@@ -793,8 +2289,9 @@ TunnelPrintUsage(const char *binName) // IN
  *
  * main --
  *
- *      Main tunnel entrypoint.  Create a TunnelProxy object, start the async
- *      connect process and start the main poll loop.
+ *      Main tunnel entrypoint.  Create a session for the command line's
+ *      server URL and connection ID and start the async connect process, or
+ *      listen on the daemon control socket, and start the main poll loop.
  *
  * Results:
  *      0.
@@ -809,17 +2306,17 @@ int
 main(int argc,    // IN
      char **argv) // IN
 {
+   TunnelSession *session = NULL;
+
    if (argc < 3) {
       TunnelPrintUsage(argv[0]);
    }
-   gServerArg = argv[1];
-   gConnectionIdArg = argv[2];
 
-   if (!*gServerArg || !*gConnectionIdArg) {
-      TunnelPrintUsage(argv[0]);
+   if (Str_Strcmp(argv[1], "-d") == 0) {
+      gDaemon = TRUE;
    }
 
-   Poll_InitDefault();
+   Poll_InitEpoll();
    Preference_Init();
    Log_Init(NULL, APPNAME".log.filename", APPNAME);
 
@@ -827,12 +2324,25 @@ main(int argc,    // IN
    SSL_InitEx(NULL, NULL, NULL, TRUE, FALSE, FALSE);
 
    AsyncSocket_Init();
+   TunnelStats_Init();
 
-   gTunnelProxy = TunnelProxy_Create(gConnectionIdArg, NULL, NULL, NULL, NULL,
-                                     NULL, NULL);
-   ASSERT(gTunnelProxy);
+   if (gDaemon) {
+      int asockErr = ASOCKERR_SUCCESS;
 
-   TunnelConnect();
+      /* Only this user may start sessions, or see their connection IDs. */
+      if (!TunnelProxy_ListenUnix(argv[2], TunnelControlConnectCb, NULL,
+                                  &asockErr)) {
+         Panic("Unable to listen on control socket %s: %s\n", argv[2],
+               AsyncSocket_Err2String(asockErr));
+      }
+      Log("Tunnel daemon listening on control socket %s.\n", argv[2]);
+   } else {
+      session = TunnelSessionCreate(argv[1], argv[2]);
+      if (!session) {
+         TunnelPrintUsage(argv[0]);
+      }
+      TunnelConnect(&session->stripes[0]);
+   }
 
    /* Enter the main loop */
    Poll_Loop(TRUE, NULL, POLL_CLASS_MAIN);
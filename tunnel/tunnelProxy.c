@@ -26,19 +26,28 @@
  */
 
 
+#include <ctype.h>      /* For tolower */
 #include <sys/time.h>   /* For gettimeofday */
 #include <time.h>       /* For gettimeofday */
 #include <sys/types.h>  /* For getsockname */
 #include <sys/socket.h> /* For getsockname */
 #include <netinet/in.h> /* For getsockname */
+#include <sys/un.h>     /* For sockaddr_un */
+#include <sys/stat.h>   /* For lstat, umask */
+#include <unistd.h>     /* For unlink */
+#include <errno.h>
+#include <sys/uio.h>    /* For struct iovec */
+#include <zlib.h>
 
 
 #include "tunnelProxy.h"
 #include "base64.h"
 #include "circList.h"
 #include "dynbuf.h"
+#include "hostinfo.h"
 #include "msg.h"
 #include "poll.h"
+#include "preference.h"
 #include "str.h"
 #include "strutil.h"
 #include "util.h"
@@ -59,17 +68,100 @@ typedef enum {
 } TPChunkType;
 
 
+/*
+ * Inbound chunk parser states.  Each state consumes one field of the wire
+ * format, so parsing can stop at any byte and resume when more data arrives.
+ */
+typedef enum {
+   TP_PARSE_HTTP_LEN,   // HTTP chunk size line, "%x\r"
+   TP_PARSE_HTTP_LF,    // "\n" ending the HTTP chunk size line
+   TP_PARSE_TYPE,       // Chunk type, "A;", "D;" or "M;"
+   TP_PARSE_CHUNK_ID,
+   TP_PARSE_ACK_ID,
+   TP_PARSE_CHANNEL_ID,
+   TP_PARSE_HDR_LEN,
+   TP_PARSE_HDR,        // Message header of HDR_LEN bytes, and ';'
+   TP_PARSE_BODY_LEN,
+   TP_PARSE_BODY,       // Body of BODY_LEN bytes, and ';'
+   TP_PARSE_HTTP_END,   // "\r\n" ending the HTTP chunk
+   TP_PARSE_DONE,
+   TP_PARSE_INVALID,    // Unparseable input, nothing more is read
+} TPParseState;
+
+
+/*
+ * Output scheduling classes for socket channels, set per portName with the
+ * view.tunnel.priority.<portName> preference ("low", "normal" or "high").
+ * Each round a channel may send 1 << priority times TP_BUF_MAXLEN bytes.
+ */
+typedef enum {
+   TP_PRIORITY_LOW,
+   TP_PRIORITY_NORMAL,
+   TP_PRIORITY_HIGH,
+} TPPriority;
+
+
+/*
+ * First byte of every DATA body on a channel with compression negotiated.
+ * The rest of the body is either the data as read, or the next part of the
+ * channel's deflate stream up to a Z_SYNC_FLUSH.
+ */
+typedef enum {
+   TP_DATA_RAW      = 82, // 'R'
+   TP_DATA_DEFLATED = 90, // 'Z'
+} TPDataEncoding;
+
+
 #define TP_MSGID_MAXLEN 24
-#define TP_PORTNAME_MAXLEN 24
 #define TP_BUF_MAXLEN 1024 * 10 // Tunnel reads/writes limited to 10K due to
                                 // buffer pooling in tunnel server.
 #define TP_MAX_UNACKNOWLEDGED 4
-#define TP_MAX_START_FLOW_CONTROL 4 * TP_MAX_UNACKNOWLEDGED
-#define TP_MIN_END_FLOW_CONTROL TP_MAX_UNACKNOWLEDGED
-
+#define TP_MIN_WINDOW_DEFAULT 4 * TP_MAX_UNACKNOWLEDGED // Chunks
+#define TP_MAX_WINDOW_DEFAULT 256                       // Chunks
+#define TP_WINDOW_GAIN 2        // Window size over the bandwidth-delay product
+#define TP_FILTER_USEC 10000000 // Lifetime of min RTT and max rate samples
+#define TP_ACK_DELAY_DEFAULT 40 // Msec before a lone ACK is sent
+#define TP_ECHO_RTO_MULT 4      // Echo reply timeout over srtt + 4 * rttVar
+#define TP_ECHO_TIMEOUT_MIN 2000000 // Usec, floor on the echo reply timeout
+#define TP_HEARTBEAT_MIN 1000   // Usec, shortest heartbeat timer delay
+#define TP_PRIORITY_PREF "view.tunnel.priority.%s" // By portName
+#define TP_COALESCE_PREF "view.tunnel.coalesce.%s" // Usec, by portName
+#define TP_COALESCE_MAX_USEC 1000000
+#define TP_COMPRESS_PREF "view.tunnel.compress.%s" // Bool, by portName
+#define TP_COMPRESS_DEFLATE "deflate" // compress value in RAISE_RQ/RAISE_RP
+#define TP_DEFLATE_SLACK 64          // Chunk bytes kept for deflate overhead
+#define TP_DEFLATE_SAMPLE 1024 * 64  // Input bytes per compression ratio check
+#define TP_DEFLATE_MAX_RATIO 90      // Percent of input size worth sending
+#define TP_DEFLATE_SKIP_CHUNKS 256   // Sent raw after a poor ratio check
+#define TP_HIGH_WATER_DEFAULT 1024 * 512 // Queued bytes to stop channel reads
+#define TP_MAX_REPLAY_DEFAULT 1024 * 1024 * 4 // Unacknowledged body bytes
+#define TP_LOW_WATER_DEFAULT 1024 * 128  // Queued bytes to restart them
+#define TP_CHUNK_HDR_MAXLEN 128 // HTTP chunk size line plus chunk header
+#define TP_SENDV_MAXCHUNKS 16   // Chunks serialized per TunnelProxy_HTTPSendv
+#define TP_RECV_BUFSIZE 1024 * 64 // Usual inbound parse and inflate buffer
+#define TP_RECV_MINSPACE 1024 * 16
+#define TP_CHUNK_MAXLEN 1024 * 1024 // Largest inbound chunk or header accepted
+#define TP_MAX_HELD 1024        // Chunks held ahead of order before disconnecting
+#define TP_CHANNEL_BUCKETS 64 // Power of two; channelIds are sequential
+#define TP_NAME_BUCKETS 32    // Power of two; for msgIds and portNames
+#define TP_CHUNK_SLAB 64      // TPChunks allocated at a time by the pool
+#define TP_BODY_CLASSES 4     // Chunk body size classes, see tpBodySizes
+#define TP_BODY_FREE_MAX 64   // Free bodies kept per size class
+#define TP_SENDV_FREE_MAX 8   // Free TunnelProxySendv handles kept by the pool
+#define TP_RECVBUF_FREE_MAX 8 // Free TP_RECV_BUFSIZE TPRecvBufs kept
+#define TP_INFLATE_MINSPACE 1024 * 10 // Else a new inflateBuf replaces it
+
+
+struct TPChannel;
+struct TPRecvBuf;
+struct TPChunkPool;
 
 typedef struct {
    ListItem list;
+   struct TPChannel *channel; // Channel whose queue holds the chunk, or NULL
+   struct TPRecvBuf *recvBuf; // Inbound chunk's body buffer
+   struct TPChunkPool *pool;  // Outbound chunk's allocator
+   signed char bodyClass;     // Pool size class of body, -1 if malloc'd
    char type;
    unsigned int ackId;
    unsigned int chunkId;
@@ -77,9 +169,95 @@ typedef struct {
    char msgId[TP_MSGID_MAXLEN];
    char *body;
    int len;
+   int refCount; // One for the queue it is on, plus one per TunnelProxySendv
+   VmTimeType sentTime;   // When last handed out for sending
+   uint64 deliveredAtSend; // tp->bytesDelivered at sentTime
 } TPChunk;
 
 
+/*
+ * Outbound chunks come from a per-TunnelProxy pool: headers are carved out
+ * of TP_CHUNK_SLAB sized slabs and recycled, and bodies are rounded up to
+ * a size class and kept on a per-class free list.  Chunks can outlive the
+ * TunnelProxy in a pending TunnelProxySendv, so the pool is freed once it
+ * is orphaned and its last chunk released.
+ */
+typedef struct TPFreeBody {
+   struct TPFreeBody *next;
+} TPFreeBody;
+
+typedef struct TPChunkPool {
+   ListItem *freeChunks; // TPChunks, linked by list
+   ListItem *slabs;
+   TPFreeBody *freeBodies[TP_BODY_CLASSES];
+   int freeBodyCnt[TP_BODY_CLASSES];
+   unsigned int slabCnt;
+   unsigned int liveChunks;
+   unsigned int liveChunksPeak;
+   struct TunnelProxySendv *freeSendvs;
+   int freeSendvCnt;
+   Bool orphaned; // The TunnelProxy is gone
+} TPChunkPool;
+
+typedef struct {
+   ListItem list;
+   TPChunk chunks[TP_CHUNK_SLAB];
+} TPChunkSlab;
+
+static const int tpBodySizes[TP_BODY_CLASSES] = {
+   256, 1024, 4096, TP_BUF_MAXLEN + 1
+};
+
+
+struct TunnelProxySendv {
+   struct TunnelProxySendv *next; // On the pool's free list
+   int chunkCnt;
+   TPChunk *chunks[TP_SENDV_MAXCHUNKS];
+   char hdrs[TP_SENDV_MAXCHUNKS][TP_CHUNK_HDR_MAXLEN];
+   struct iovec iov[3 * TP_SENDV_MAXCHUNKS]; // header, body, trailer
+};
+
+
+/*
+ * Reference counted inbound data buffer.  Inbound DATA chunk bodies are
+ * sent to channel sockets straight out of it with AsyncSocket_SendBuf,
+ * which holds a reference until the data is written, so the buffer is
+ * never moved or reused under a pending send.
+ */
+typedef struct TPRecvBuf {
+   AsyncSocketBuf owner;
+   struct TPRecvBuf *next; // In tpFreeRecvBufs
+   int size; // Bytes allocated for data
+   int len;  // Bytes of data read
+   char data[1];
+} TPRecvBuf;
+
+/*
+ * Released TPRecvBufs of TP_RECV_BUFSIZE, kept for reuse.  Not part of
+ * the TunnelProxy, as pending sends can hold them past TunnelProxy_Free.
+ */
+static TPRecvBuf *tpFreeRecvBufs;
+static int tpFreeRecvBufCnt;
+
+
+/*
+ * Inbound data and parser state of one HTTP connection.  Bytes before
+ * readChunkStart have been handled, bytes from readChunkStart to readPos
+ * belong to the chunk being parsed, and are kept contiguous so the chunk
+ * body can be passed on in place.
+ */
+typedef struct {
+   TPRecvBuf *readBuf;
+   int readPos;
+   int readChunkStart;
+   TPParseState parseState;
+   int parseHex;          // Hex field digits read so far
+   int parseHdrLen;
+   int parseBodyOffset;   // From readChunkStart
+   TPChunk parseChunk;
+} TPRecvStream;
+
+
 typedef struct {
    ListItem list;
    char msgId[TP_MSGID_MAXLEN];
@@ -90,21 +268,64 @@ typedef struct {
 
 typedef struct {
    ListItem list;
+   ListItem hashList; // In tp->listenerHash, by portName
    TunnelProxy *tp;
    char portName[TP_PORTNAME_MAXLEN];
    unsigned int port;
-   AsyncSocket *listenSock;
+   AsyncSocket *listenSock;  // NULL with view.tunnel.unixOnly
+   AsyncSocket *unixSock;    // NULL without view.tunnel.unixSocketPrefix
+   char *unixPath;           // '@' prefix for an abstract socket name
    Bool singleUse;
+   TPPriority priority;
+   int coalesceUsec; // 0 if channel writes are not coalesced
+   Bool compress;    // Offer compression when raising channels
 } TPListener;
 
 
-typedef struct {
+typedef struct TPChannel {
    ListItem list;
+   ListItem hashList;   // In tp->channelHash, by channelId
+   ListItem activeList; // In tp->activeChannels while queueOut is not empty
    TunnelProxy *tp;
    unsigned int channelId;
    char portName[TP_PORTNAME_MAXLEN];
    AsyncSocket *socket;
-   char recvByte;
+   ListItem *queueOut;  // Outgoing DATA chunks
+   int queuedBytes;     // Body bytes in queueOut
+   int quantum;         // Bytes added to deficit each round
+   int deficit;         // Bytes that may be sent this round
+   Bool recvPaused;     // Reads stopped until queuedBytes is back down
+   uint64 chunksIn;
+   uint64 chunksOut;
+   uint64 bytesIn;
+   uint64 bytesOut;
+
+   /*
+    * With coalescing on, reads are appended to openChunk, which is held off
+    * queueOut until it is full or coalesceUsec after its first read.
+    */
+   int coalesceUsec;
+   TPChunk *openChunk;
+
+   /*
+    * Once RAISE_RP accepts compression, queued DATA is deflated in order
+    * into one stream, and received DATA inflated from the server's stream.
+    * If a sample of TP_DEFLATE_SAMPLE bytes does not shrink enough, the
+    * next TP_DEFLATE_SKIP_CHUNKS chunks are sent raw.  If deflate ever
+    * fails, every later chunk is sent raw.
+    */
+   Bool compress;   // From the listener, offered in RAISE_RQ
+   Bool deflating;  // Accepted in RAISE_RP
+   Bool deflateFailed;
+   z_stream deflater;
+   z_stream inflater;
+   int maxDataLen;  // Largest DATA body read from the socket
+   int sampleIn;
+   int sampleOut;
+   int skipChunks;
+   TPRecvBuf *inflateBuf; // Sends of inflated data hold references
+
+   char recvBuf[TP_BUF_MAXLEN]; // Registered with AsyncSocket_RecvPartial
 } TPChannel;
 
 
@@ -119,6 +340,7 @@ struct TunnelProxy
    int64 sessionTimeout;      // From TP_MSG_AUTHENTICATED
 
    struct timeval lastConnect;
+   VmTimeType resetTime; // Reset notified, until a chunk arrives after it
 
    TunnelProxyNewListenerCb listenerCb;
    void *listenerCbData;
@@ -133,21 +355,120 @@ struct TunnelProxy
 
    unsigned int maxChannelId;
    Bool flowStopped;
+   VmTimeType flowStopTime;
+
+   /*
+    * Send window, in unacknowledged chunks.  Sized from the smallest recent
+    * round trip time and the largest recent delivery rate, and bounded by
+    * the view.tunnel.minWindow and view.tunnel.maxWindow preferences.
+    */
+   unsigned int window;
+   unsigned int minWindow;
+   unsigned int maxWindow;
+   VmTimeType minRtt;
+   VmTimeType minRttTime;
+   uint64 maxRate;        // Bytes per second
+   VmTimeType maxRateTime;
+   uint64 bytesDelivered; // Body bytes of all acknowledged chunks
+   uint64 chunksDelivered;
+
+   /*
+    * Heartbeat.  Every received batch stamps lastRecvTime, and the single
+    * heartbeat timer only compares it to its deadlines when it fires, then
+    * re-arms for the next one.  An ECHO_RQ goes out only after a third of
+    * lostContactTimeout without receiving anything.  Contact is lost when
+    * nothing at all arrives within a timeout derived from the smoothed echo
+    * round trip time and its variance, or within lostContactTimeout.
+    */
+   VmTimeType lastRecvTime;
+   VmTimeType echoSentTime; // 0 unless an ECHO_RQ is outstanding
+   VmTimeType srtt;
+   VmTimeType rttVar;
+   Bool heartbeatTimerSet;
+
+   /*
+    * Inbound chunks are ACKed by the next outbound chunk, or by an ACK chunk
+    * once TP_MAX_UNACKNOWLEDGED are waiting or ackDelay msec after the first
+    * one arrived, whichever is sooner.
+    */
+   int ackDelay; // From view.tunnel.ackDelay pref, 0 disables the timer
+   Bool ackTimerSet;
+
+   TunnelProxyStats stats;
 
    unsigned int lastChunkIdSeen;
    unsigned int lastChunkAckSeen;
    unsigned int lastChunkIdSent;
    unsigned int lastChunkAckSent;
 
-   // Outgoing fifo
+   /*
+    * Outgoing chunks.  MESSAGE and ACK chunks, and DATA chunks being resent
+    * or left by closed channels, go out first from queueOut in order.  New
+    * DATA chunks wait on their channel's queueOut, and channels with chunks
+    * waiting take turns in activeChannels by deficit round robin.  While
+    * the window is full, queueOut is held at its first DATA chunk and only
+    * the queued ACK chunk, of which there is at most one, passes it.
+    */
    ListItem *queueOut;
    ListItem *queueOutNeedAck;
+   unsigned int needAckCnt; // DATA and MESSAGE chunks in queueOutNeedAck
+   TPChunk *ackChunk;       // Lone ACK chunk in queueOut, or NULL
+   ListItem *activeChannels;
+   Bool activeTurnStarted; // Head of activeChannels got its quantum
+
+   /*
+    * Channel socket reads stop while more than highWater bytes wait on the
+    * channel's queue, and restart once no more than lowWater do, so a fast
+    * local sender is held back by TCP instead of filling our heap.
+    */
+   int highWater;
+   int lowWater;
+
+   /*
+    * Body bytes of chunks sent and kept for replay until ACKed.  DATA
+    * sending stops at maxReplay, as it does on a full window, so a stalled
+    * server can't make queueOutNeedAck grow without bound.
+    */
+   int64 replayBytes;
+   int64 maxReplay; // From the view.tunnel.maxReplayBytes pref
+
+   TPChunkPool *pool;
+   char *deflateBuf; // TP_BUF_MAXLEN + 1 bytes, encoded DATA body scratch
+
+   /*
+    * Listeners can also be exposed as Unix-domain sockets named
+    * <unixPrefix><portName>, for local clients that would rather skip
+    * loopback TCP.  With unixOnly no TCP port is bound at all.
+    */
+   char *unixPrefix;
+   Bool unixOnly;
 
    ListItem *listeners;
    ListItem *channels;
-   ListItem *msgHandlers;
 
-   DynBuf readBuf;
+   /*
+    * Lookup tables for inbound dispatch.  Buckets keep registration order,
+    * so handlers for one msgId are still called in the order added.
+    */
+   ListItem *channelHash[TP_CHANNEL_BUCKETS];
+   ListItem *listenerHash[TP_NAME_BUCKETS];
+   ListItem *msgHandlers[TP_NAME_BUCKETS];
+
+   /*
+    * The session may be striped over several HTTP connections, each with
+    * its own inbound stream.  Chunks arriving ahead of a lower chunkId
+    * still on its way over another stripe wait in recvHeld, sorted by
+    * chunkId, holding a reference to their readBuf.  At most TP_MAX_HELD
+    * may wait, so a stalled stripe can't make the others pile up input.
+    */
+   int stripes;          // Connections in use, from AUTHENTICATED
+   int stripesWanted;    // From the view.tunnel.stripes pref
+   TunnelProxyStripesCb stripesCb;
+   void *stripesCbData;
+   TPRecvStream recv[TP_MAX_STRIPES];
+   ListItem *recvHeld;
+   unsigned int recvHeldCnt;
+
    DynBuf writeBuf;
 };
 
@@ -160,9 +481,45 @@ static void TunnelProxyFireSendNeeded(TunnelProxy *tp);
 static void TunnelProxySendChunk(TunnelProxy *tp, TPChunkType type,
                                  unsigned int channelId, const char *msgId,
                                  char *body, int bodyLen);
+static TPChunk *TunnelProxyAllocChunk(TunnelProxy *tp, TPChunkType type);
+static void TunnelProxyFreePool(TPChunkPool *pool);
+static char *TunnelProxyAllocBody(TPChunkPool *pool, int size,
+                                  signed char *bodyClass);
+static void TunnelProxyFreeBody(TPChunkPool *pool, char *body, int bodyClass);
 static void TunnelProxyFreeChunk(TPChunk *chunk, ListItem **list);
+static void TunnelProxyReleaseChunk(TPChunk *chunk);
+static TPRecvBuf *TunnelProxyNewRecvBuf(int size);
+static void TunnelProxyReleaseRecvBuf(TPRecvBuf *recvBuf);
+static void TunnelProxyResetRecv(TunnelProxy *tp);
 static void TunnelProxyFreeMsgHandler(TPMsgHandler *handler, ListItem **list);
+static unsigned int TunnelProxyHashName(const char *name);
+static TPChannel *TunnelProxyLookupChannel(TunnelProxy *tp,
+                                           unsigned int channelId);
+static TPListener *TunnelProxyLookupListener(TunnelProxy *tp,
+                                             const char *portName);
+static void TunnelProxyCloseListenSocks(TPListener *listener);
 static void TunnelProxyResetTimeouts(TunnelProxy *tp, Bool requeue);
+static void TunnelProxyUpdateWindow(TunnelProxy *tp, VmTimeType now,
+                                    VmTimeType rtt, uint64 delivered);
+static Bool TunnelProxyUpdateFlowControl(TunnelProxy *tp);
+static void TunnelProxyCancelAckTimer(TunnelProxy *tp);
+static TPChunk *TunnelProxyNextDataChunk(TunnelProxy *tp);
+static TPChunk *TunnelProxyNextOutChunk(TunnelProxy *tp);
+static void TunnelProxyDequeueChunk(TunnelProxy *tp, TPChunk *chunk);
+static void TunnelProxyFlushChannel(TunnelProxy *tp, TPChannel *channel);
+static TPPriority TunnelProxyGetPriority(const char *portName);
+static int TunnelProxyGetCoalesceUsec(const char *portName);
+static void TunnelProxyQueueDataChunk(TunnelProxy *tp, TPChannel *channel,
+                                      TPChunk *chunk);
+static void TunnelProxyCoalesceData(TunnelProxy *tp, TPChannel *channel,
+                                    const char *body, int bodyLen);
+static void TunnelProxyCloseOpenChunk(TunnelProxy *tp, TPChannel *channel);
+static Bool TunnelProxyGetCompress(const char *portName);
+static Bool TunnelProxyStartCompression(TPChannel *channel);
+static void TunnelProxyDeflateChunk(TunnelProxy *tp, TPChannel *channel,
+                                    TPChunk *chunk);
+static Bool TunnelProxyInflateData(TunnelProxy *tp, TPChannel *channel,
+                                   const char *body, int bodyLen);
 
 
 /* Default Msg handler callbacks */
@@ -194,8 +551,13 @@ static Bool TunnelProxyLowerCb(TunnelProxy *tp, const char *msgId,
 
 /* Timer callbacks */
 
-static void TunnelProxyEchoTimeoutCb(void *userData);
-static void TunnelProxyLostContactTimeoutCb(void *userData);
+static VmTimeType TunnelProxyEchoTimeout(TunnelProxy *tp);
+static void TunnelProxyUpdateRtt(TunnelProxy *tp, VmTimeType rtt);
+static void TunnelProxyArmHeartbeat(TunnelProxy *tp, VmTimeType now);
+static void TunnelProxySendEcho(TunnelProxy *tp);
+static void TunnelProxyHeartbeatCb(void *userData);
+static void TunnelProxyAckTimeoutCb(void *userData);
+static void TunnelProxyCoalesceTimeoutCb(void *userData);
 
 
 /*
@@ -234,6 +596,52 @@ TunnelProxy_Create(const char *connectionId,             // IN
    tp->endChannelCb = endChannelCb;
    tp->endChannelCbData = endChannelCbData;
 
+   tp->minWindow = Preference_GetLong(TP_MIN_WINDOW_DEFAULT,
+                                      "view.tunnel.minWindow");
+   tp->maxWindow = Preference_GetLong(TP_MAX_WINDOW_DEFAULT,
+                                      "view.tunnel.maxWindow");
+   if ((int)tp->minWindow < 1) {
+      tp->minWindow = 1;
+   }
+   if ((int)tp->maxWindow < (int)tp->minWindow) {
+      tp->maxWindow = tp->minWindow;
+   }
+   tp->window = tp->minWindow;
+
+   tp->ackDelay = Preference_GetLong(TP_ACK_DELAY_DEFAULT,
+                                     "view.tunnel.ackDelay");
+
+   tp->highWater = Preference_GetLong(TP_HIGH_WATER_DEFAULT,
+                                      "view.tunnel.channelHighWater");
+   tp->lowWater = Preference_GetLong(TP_LOW_WATER_DEFAULT,
+                                     "view.tunnel.channelLowWater");
+   if (tp->highWater < TP_BUF_MAXLEN) {
+      tp->highWater = TP_BUF_MAXLEN;
+   }
+   if (tp->lowWater < 0 || tp->lowWater > tp->highWater) {
+      tp->lowWater = tp->highWater / 4;
+   }
+
+   tp->maxReplay = Preference_GetLong(TP_MAX_REPLAY_DEFAULT,
+                                      "view.tunnel.maxReplayBytes");
+   if (tp->maxReplay < TP_BUF_MAXLEN * 2) {
+      tp->maxReplay = TP_BUF_MAXLEN * 2;
+   }
+
+   tp->pool = Util_SafeCalloc(1, sizeof *tp->pool);
+
+   tp->unixPrefix = Preference_GetString(NULL, "view.tunnel.unixSocketPrefix");
+   if (tp->unixPrefix && !*tp->unixPrefix) {
+      free(tp->unixPrefix);
+      tp->unixPrefix = NULL;
+   }
+   tp->unixOnly = tp->unixPrefix &&
+                  Preference_GetBool(FALSE, "view.tunnel.unixOnly");
+
+   tp->stripes = 1;
+   tp->stripesWanted = Preference_GetLong(1, "view.tunnel.stripes");
+   tp->stripesWanted = MAX(1, MIN(tp->stripesWanted, TP_MAX_STRIPES));
+
 #define TP_AMH(_msg, _cb) TunnelProxy_AddMsgHandler(tp, _msg, _cb, NULL)
    TP_AMH(TP_MSG_AUTHENTICATED, TunnelProxyAuthenticatedCb);
    TP_AMH(TP_MSG_ECHO_RQ,       TunnelProxyEchoRequestCb);
@@ -286,9 +694,12 @@ TunnelProxyFireSendNeeded(TunnelProxy *tp) // IN
  * TunnelProxySendChunk --
  *
  *       Create and queue a new outgoing TPChunk object, specifying all the
- *       content.  The chunk will be appended to the TunnelProxy's outgoing
- *       queue, and the sendNeededCb passed to TunnelProxy_Connect invoked.
- *       Body content is always duplicated.
+ *       content.  DATA chunks are appended to their channel's outgoing
+ *       queue, others to the TunnelProxy's, and the sendNeededCb passed to
+ *       TunnelProxy_Connect invoked.  Body content is always duplicated.
+ *
+ *       DATA for a channel with coalescing on goes to the channel's open
+ *       chunk instead, see TunnelProxyCoalesceData.
  *
  * Results:
  *       None.
@@ -308,24 +719,42 @@ TunnelProxySendChunk(TunnelProxy *tp,        // IN
                      int bodyLen)            // IN/OPT
 {
    TPChunk *newChunk;
+   TPChannel *channel = NULL;
 
    ASSERT(tp);
 
-   newChunk = Util_SafeCalloc(1, sizeof(TPChunk));
-   newChunk->type = type;
+   if (type == TP_CHUNK_TYPE_DATA) {
+      channel = TunnelProxyLookupChannel(tp, channelId);
+      if (channel && channel->coalesceUsec > 0) {
+         TunnelProxyCoalesceData(tp, channel, body, bodyLen);
+         return;
+      }
+   } else if (type == TP_CHUNK_TYPE_ACK && tp->ackChunk) {
+      /* The queued ACK takes the newest chunk ID when it is sent. */
+      return;
+   }
 
+   newChunk = TunnelProxyAllocChunk(tp, type);
    newChunk->channelId = channelId;
    if (msgId) {
       Str_Strcpy(newChunk->msgId, msgId, TP_MSGID_MAXLEN);
    }
    if (body) {
       newChunk->len = bodyLen;
-      newChunk->body = Util_SafeMalloc(bodyLen + 1);
+      newChunk->body = TunnelProxyAllocBody(tp->pool, bodyLen + 1,
+                                            &newChunk->bodyClass);
       newChunk->body[bodyLen] = 0;
       memcpy(newChunk->body, body, bodyLen);
    }
 
-   LIST_QUEUE(&newChunk->list, &tp->queueOut);
+   if (channel) {
+      TunnelProxyQueueDataChunk(tp, channel, newChunk);
+   } else {
+      LIST_QUEUE(&newChunk->list, &tp->queueOut);
+      if (type == TP_CHUNK_TYPE_ACK) {
+         tp->ackChunk = newChunk;
+      }
+   }
 
    TunnelProxyFireSendNeeded(tp);
 }
@@ -334,10 +763,12 @@ TunnelProxySendChunk(TunnelProxy *tp,        // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_Free --
+ * TunnelProxyQueueDataChunk --
  *
- *       Free a TunnelProxy object.  Calls TunnelProxyDisconnect to close all
- *       sockets, frees all pending in and out chunks.
+ *       Append a DATA chunk to its channel's outgoing queue, adding the
+ *       channel to activeChannels if the queue was empty.  The body is
+ *       encoded first if the channel has compression on, since the deflate
+ *       stream must see chunks in the order they are sent.
  *
  * Results:
  *       None.
@@ -348,101 +779,137 @@ TunnelProxySendChunk(TunnelProxy *tp,        // IN
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_Free(TunnelProxy *tp) // IN
+static void
+TunnelProxyQueueDataChunk(TunnelProxy *tp,      // IN
+                          TPChannel *channel,   // IN
+                          TPChunk *chunk)       // IN
 {
-   ListItem *li;
-   ListItem *liNext;
-
    ASSERT(tp);
+   ASSERT(channel);
+   ASSERT(chunk && chunk->type == TP_CHUNK_TYPE_DATA);
 
-   TunnelProxyDisconnect(tp, NULL, TRUE, FALSE);
-
-   LIST_SCAN_SAFE(li, liNext, tp->queueOut) {
-      TunnelProxyFreeChunk(LIST_CONTAINER(li, TPChunk, list), &tp->queueOut);
-   }
-   LIST_SCAN_SAFE(li, liNext, tp->queueOutNeedAck) {
-      TunnelProxyFreeChunk(LIST_CONTAINER(li, TPChunk, list),
-                           &tp->queueOutNeedAck);
+   channel->chunksOut++;
+   channel->bytesOut += chunk->len;
+   if (channel->deflating) {
+      TunnelProxyDeflateChunk(tp, channel, chunk);
    }
 
-   LIST_SCAN_SAFE(li, liNext, tp->msgHandlers) {
-      TunnelProxyFreeMsgHandler(LIST_CONTAINER(li, TPMsgHandler, list),
-                                &tp->msgHandlers);
+   if (!channel->queueOut) {
+      /* Join the end of the current round. */
+      LIST_QUEUE(&channel->activeList, &tp->activeChannels);
    }
-
-   free(tp->capID);
-   free(tp->hostIp);
-   free(tp->hostAddr);
-   free(tp->reconnectSecret);
-   free(tp);
+   chunk->channel = channel;
+   LIST_QUEUE(&chunk->list, &channel->queueOut);
+   channel->queuedBytes += chunk->len;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyFreeChunk --
+ * TunnelProxyCoalesceData --
  *
- *       Free a TPChunk object, and remove it from the queue passed.
+ *       Append data read from a channel to the channel's open DATA chunk,
+ *       so that runs of small reads share one chunk header and chunkId.
+ *       A new open chunk is started when the data does not fit, and the
+ *       coalesceUsec timer is set for it.  A full open chunk is queued
+ *       right away.
  *
  * Results:
  *       None.
  *
  * Side effects:
- *       None.
+ *       May queue a DATA chunk and invoke the sendNeededCb.
  *
  *-----------------------------------------------------------------------------
  */
 
 static void
-TunnelProxyFreeChunk(TPChunk *chunk,  // IN
-                     ListItem **list) // IN/OUT
+TunnelProxyCoalesceData(TunnelProxy *tp,      // IN
+                        TPChannel *channel,   // IN
+                        const char *body,     // IN
+                        int bodyLen)          // IN
 {
-   ASSERT(chunk);
-   ASSERT(list);
-   LIST_DEL(&chunk->list, list);
-   free(chunk->body);
-   free(chunk);
+   TPChunk *chunk = channel->openChunk;
+
+   ASSERT(tp);
+   ASSERT(body && bodyLen > 0 && bodyLen <= channel->maxDataLen);
+
+   if (chunk && chunk->len + bodyLen > channel->maxDataLen) {
+      TunnelProxyCloseOpenChunk(tp, channel);
+      chunk = NULL;
+   }
+
+   if (chunk) {
+      tp->stats.coalesced++;
+   } else {
+      chunk = TunnelProxyAllocChunk(tp, TP_CHUNK_TYPE_DATA);
+      chunk->channelId = channel->channelId;
+      chunk->body = TunnelProxyAllocBody(tp->pool, TP_BUF_MAXLEN + 1,
+                                         &chunk->bodyClass);
+      channel->openChunk = chunk;
+
+      Poll_CB_RTime(TunnelProxyCoalesceTimeoutCb, channel,
+                    channel->coalesceUsec, FALSE, NULL);
+   }
+
+   memcpy(chunk->body + chunk->len, body, bodyLen);
+   chunk->len += bodyLen;
+   chunk->body[chunk->len] = 0;
+
+   if (chunk->len == channel->maxDataLen) {
+      TunnelProxyCloseOpenChunk(tp, channel);
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyFreeMsgHandler --
+ * TunnelProxyCloseOpenChunk --
  *
- *       Free a TPMsgHandler object, and remove it from the queue passed.
+ *       Stop coalescing into a channel's open DATA chunk, if it has one,
+ *       and queue it for sending.
  *
  * Results:
  *       None.
  *
  * Side effects:
- *       None.
+ *       Coalescing poll timeout removed.  Invokes the sendNeededCb.
  *
  *-----------------------------------------------------------------------------
  */
 
 static void
-TunnelProxyFreeMsgHandler(TPMsgHandler *handler, // IN
-                          ListItem **list)       // IN/OUT
+TunnelProxyCloseOpenChunk(TunnelProxy *tp,      // IN
+                          TPChannel *channel)   // IN
 {
-   ASSERT(handler);
-   LIST_DEL(&handler->list, list);
-   free(handler);
+   TPChunk *chunk = channel->openChunk;
+
+   if (!chunk) {
+      return;
+   }
+
+   Poll_CB_RTimeRemove(TunnelProxyCoalesceTimeoutCb, channel, FALSE);
+   channel->openChunk = NULL;
+
+   TunnelProxyQueueDataChunk(tp, channel, chunk);
+   TunnelProxyFireSendNeeded(tp);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_AddMsgHandler --
+ * TunnelProxyStartCompression --
  *
- *       Allocate a new msg handler object which handles messages of the given
- *       msgId, and add it to the TunnelProxy handler queue.
+ *       Set up a channel's deflate and inflate streams once the server has
+ *       accepted compression.  Socket reads are shortened by
+ *       TP_DEFLATE_SLACK, so a chunk that does not compress still fits in
+ *       TP_BUF_MAXLEN after deflating.
  *
  * Results:
- *       None.
+ *       TRUE on success, FALSE if zlib could not be initialized.
  *
  * Side effects:
  *       None.
@@ -450,234 +917,243 @@ TunnelProxyFreeMsgHandler(TPMsgHandler *handler, // IN
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_AddMsgHandler(TunnelProxy *tp,            // IN
-                          const char *msgId,          // IN
-                          TunnelProxyMsgHandlerCb cb, // IN
-                          void *userData)             // IN/OPT
+static Bool
+TunnelProxyStartCompression(TPChannel *channel) // IN
 {
-   TPMsgHandler *msgHandler;
+   ASSERT(channel);
+   ASSERT(!channel->deflating);
 
-   ASSERT(tp);
-   ASSERT(msgId);
+   memset(&channel->deflater, 0, sizeof channel->deflater);
+   memset(&channel->inflater, 0, sizeof channel->inflater);
 
-   msgHandler = Util_SafeCalloc(1, sizeof(TPMsgHandler));
-   Str_Strcpy(msgHandler->msgId, msgId, TP_MSGID_MAXLEN);
-   msgHandler->userData = userData;
-   msgHandler->cb = cb;
+   if (deflateInit(&channel->deflater, Z_BEST_SPEED) != Z_OK) {
+      return FALSE;
+   }
+   if (inflateInit(&channel->inflater) != Z_OK) {
+      deflateEnd(&channel->deflater);
+      return FALSE;
+   }
 
-   LIST_QUEUE(&msgHandler->list, &tp->msgHandlers);
+   Log("Compressing data for channel \"%d\".\n", channel->channelId);
+   channel->deflating = TRUE;
+   channel->maxDataLen = TP_BUF_MAXLEN - TP_DEFLATE_SLACK;
+   return TRUE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_RemoveMsgHandler --
- *
- *       Free an existing msg handler which handles messages of the given
- *       msgId, and remove it from the TunnelProxy handler queue.
+ * TunnelProxyDeflateChunk --
  *
- *       Handlers are matched based on msgId and cb/userData.  If no
- *       cb/userData is passed, all message handlers for the given msgId will
- *       be removed.
+ *       Replace a DATA chunk's body with its encoded form: a TPDataEncoding
+ *       byte, followed by the deflated body, or the body as is while the
+ *       channel is skipping compression after a poor ratio check.  The
+ *       encoded body is built in the proxy's deflateBuf and copied back,
+ *       so the chunk keeps its body when it has room.
  *
  * Results:
  *       None.
  *
  * Side effects:
- *       None.
+ *       Advances the channel's deflate stream.  On a deflate error, stops
+ *       compression on the channel for good.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_RemoveMsgHandler(TunnelProxy *tp,            // IN
-                             const char *msgId,          // IN
-                             TunnelProxyMsgHandlerCb cb, // IN
-                             void *userData)             // IN/OPT
+static void
+TunnelProxyDeflateChunk(TunnelProxy *tp,      // IN
+                        TPChannel *channel,   // IN
+                        TPChunk *chunk)       // IN
 {
-   ListItem *li;
-   ListItem *liNext;
+   char *body;
+   int bodyLen = 0;
 
-   ASSERT(tp);
-   ASSERT(msgId);
+   ASSERT(chunk->len <= channel->maxDataLen);
 
-   LIST_SCAN_SAFE(li, liNext, tp->msgHandlers) {
-      TPMsgHandler *handler = LIST_CONTAINER(li, TPMsgHandler, list);
-      if (Str_Strcmp(handler->msgId, msgId) == 0 &&
-          (!cb || (handler->cb == cb && handler->userData == userData))) {
-         TunnelProxyFreeMsgHandler(handler, &tp->msgHandlers);
+   if (!tp->deflateBuf) {
+      tp->deflateBuf = Util_SafeMalloc(TP_BUF_MAXLEN + 1);
+   }
+   body = tp->deflateBuf;
+
+   if (channel->skipChunks == 0 && !channel->deflateFailed) {
+      VmTimeType start = Hostinfo_SystemTimerUS();
+      z_stream *zs = &channel->deflater;
+      int zErr;
+
+      body[0] = TP_DATA_DEFLATED;
+      zs->next_in = (Bytef *)chunk->body;
+      zs->avail_in = chunk->len;
+      zs->next_out = (Bytef *)body + 1;
+      zs->avail_out = TP_BUF_MAXLEN - 1;
+
+      zErr = deflate(zs, Z_SYNC_FLUSH);
+      tp->stats.compressUsec += Hostinfo_SystemTimerUS() - start;
+
+      if (zErr == Z_OK && zs->avail_in == 0 && zs->avail_out > 0) {
+         bodyLen = TP_BUF_MAXLEN - zs->avail_out;
+      } else {
+         /*
+          * The server has not seen this part of the stream, so the stream
+          * can't be continued.  Raw chunks need no stream state.
+          */
+         Warning("Compressing data for channel \"%d\" failed (%d), sending "
+                 "it uncompressed.\n", channel->channelId, zErr);
+         channel->deflateFailed = TRUE;
+      }
+   }
+
+   if (bodyLen > 0) {
+      tp->stats.compressIn += chunk->len;
+      tp->stats.compressOut += bodyLen - 1;
+
+      channel->sampleIn += chunk->len;
+      channel->sampleOut += bodyLen - 1;
+      if (channel->sampleIn >= TP_DEFLATE_SAMPLE) {
+         if (channel->sampleOut * 100 >
+             channel->sampleIn * TP_DEFLATE_MAX_RATIO) {
+            DEBUG_MSG(("Channel \"%d\" compressed %d bytes to %d, skipping "
+                       "compression.\n", channel->channelId,
+                       channel->sampleIn, channel->sampleOut));
+            channel->skipChunks = TP_DEFLATE_SKIP_CHUNKS;
+         }
+         channel->sampleIn = 0;
+         channel->sampleOut = 0;
+      }
+   } else {
+      if (channel->skipChunks > 0) {
+         channel->skipChunks--;
       }
+      tp->stats.compressSkips++;
+
+      body[0] = TP_DATA_RAW;
+      memcpy(body + 1, chunk->body, chunk->len);
+      bodyLen = chunk->len + 1;
    }
+
+   if (chunk->bodyClass < 0 || tpBodySizes[chunk->bodyClass] < bodyLen + 1) {
+      TunnelProxyFreeBody(tp->pool, chunk->body, chunk->bodyClass);
+      chunk->body = TunnelProxyAllocBody(tp->pool, bodyLen + 1,
+                                         &chunk->bodyClass);
+   }
+   memcpy(chunk->body, body, bodyLen);
+   chunk->body[bodyLen] = 0;
+   chunk->len = bodyLen;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_SendMsg --
+ * TunnelProxyInflateBuf --
  *
- *       Append a message of msgId with the given body to the outgoing message
- *       queue.  The chunk will be assigned the next serial chunk id.  The
- *       body buffer will be copied.
+ *       Get the channel's buffer for inflated data, with room to inflate
+ *       into after its len.  The buffer is rewound if no sends are pending
+ *       on it, and replaced if it is nearly full.
  *
  * Results:
- *       None.
+ *       The channel's inflateBuf.
  *
  * Side effects:
- *       None.
+ *       May allocate a new inflateBuf.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_SendMsg(TunnelProxy *tp,   // IN
-                    const char *msgId, // IN
-                    const char *body,  // IN
-                    int len)           // IN
+static TPRecvBuf *
+TunnelProxyInflateBuf(TPChannel *channel) // IN
 {
-   ASSERT(tp);
-   ASSERT(msgId && strlen(msgId) < TP_MSGID_MAXLEN);
+   TPRecvBuf *out = channel->inflateBuf;
 
-   TunnelProxySendChunk(tp, TP_CHUNK_TYPE_MESSAGE, 0, msgId, (char*) body, len);
+   if (out && out->owner.refCount == 1) {
+      out->len = 0;
+   } else if (!out || out->size - out->len < TP_INFLATE_MINSPACE) {
+      if (out) {
+         TunnelProxyReleaseRecvBuf(out);
+      }
+      out = TunnelProxyNewRecvBuf(TP_RECV_BUFSIZE);
+      channel->inflateBuf = out;
+   }
+   return out;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_ReadMsg --
- *
- *       Parse a formatted message using a key=type:value markup syntax, with
- *       the value destination pointer passed in to the next argument, similar
- *       to sscanf.  Final argument must be NULL.  Supported types are:
- *
- *          S - a base64 encoded utf8 string
- *          E - a base64 encoded utf8 error string
- *          I - integer
- *          L - 64-bit integer
- *          B - boolean, 1, "true", and "yes" are all considered TRUE
- *
- *       e.g. TunnelProxy_ReadMsg(body, len, "reason=S", &reasonStr, NULL);
+ * TunnelProxyInflateData --
  *
- *       Returned strings must be freed by the caller.  Non-null string args
- *       must be freed regardless of return value, in case of partial success.
+ *       Inflate the deflated part of a received DATA chunk body into the
+ *       channel's inflateBuf, and send it to the channel's socket.  Output
+ *       that fills the buffer is sent in pieces.
  *
  * Results:
- *       TRUE if all key=type:value pairs parsed correctly, FALSE otherwise.
+ *       TRUE on success, FALSE if the data is not a valid continuation of
+ *       the channel's deflate stream.
  *
  * Side effects:
- *       None.
+ *       Advances the channel's inflate stream.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-TunnelProxy_ReadMsg(const char *body,        // IN
-                    int len,                 // IN
-                    const char* nameTypeKey, // IN
-                    ...)                     // OUT
+static Bool
+TunnelProxyInflateData(TunnelProxy *tp,      // IN
+                       TPChannel *channel,   // IN
+                       const char *body,     // IN
+                       int bodyLen)          // IN
 {
-   va_list args;
-   va_start(args, nameTypeKey);
-   Bool success = TRUE;
-   char *valueStr = NULL;
-
-   while (nameTypeKey) {
-      int nameLen = strlen(nameTypeKey);
-      char *prefix = strstr(body, nameTypeKey);
-      int idx;
-      int32 *I;
-      int64 *L;
-      Bool *B;
-
-      if (!prefix || prefix[nameLen] != ':' ||
-          (prefix != body && prefix[-1] != '|')) {
-         success = FALSE;
-         break;
+   VmTimeType start = Hostinfo_SystemTimerUS();
+   z_stream *zs = &channel->inflater;
+   TPRecvBuf *out = TunnelProxyInflateBuf(channel);
+   int outStart = out->len;
+   int zErr;
+
+   zs->next_in = (Bytef *)body;
+   zs->avail_in = bodyLen;
+
+   do {
+      if (out->len == out->size) {
+         channel->bytesIn += out->len - outStart;
+         AsyncSocket_SendBuf(channel->socket, &out->owner,
+                             out->data + outStart, out->len - outStart);
+         out = TunnelProxyInflateBuf(channel);
+         outStart = out->len;
       }
+      zs->next_out = (Bytef *)out->data + out->len;
+      zs->avail_out = out->size - out->len;
 
-      /*
-       * Find value string before '|' which starts the next element.  Skip the
-       * colon ':' after nameTypeKey, separating the type-id char from the value
-       * string.
-       */
-      idx = nameLen + 1;
-      valueStr = StrUtil_GetNextToken(&idx, prefix, "|");
-
-      switch (prefix[nameLen-1]) {
-      case 'S':
-      case 'E': {
-         char **S = va_arg(args, char**);
-         size_t decodeLen;
-         uint8 *decodeBuf = NULL;
+      zErr = inflate(zs, Z_SYNC_FLUSH);
+      out->len = out->size - zs->avail_out;
+   } while (zErr == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
 
-         decodeLen = Base64_DecodedLength(valueStr, strlen(valueStr));
-         decodeBuf = Util_SafeMalloc(decodeLen + 1);
+   tp->stats.decompressUsec += Hostinfo_SystemTimerUS() - start;
 
-         success = Base64_Decode(valueStr, decodeBuf, decodeLen, &decodeLen);
+   if ((zErr != Z_OK && zErr != Z_BUF_ERROR) || zs->avail_in > 0) {
+      out->len = outStart;
+      return FALSE;
+   }
 
-         if (success) {
-            decodeBuf[decodeLen] = '\0';
-            *S = (char*) decodeBuf;
-         } else {
-            free(decodeBuf);
-            *S = NULL;
-            goto exit;
-         }
-         break;
-      }
-      case 'I':
-         I = va_arg(args, int32*);
-         StrUtil_StrToInt(I, valueStr);
-         break;
-      case 'L':
-         L = va_arg(args, int64*);
-         StrUtil_StrToInt64(L, valueStr);
-         break;
-      case 'B':
-         B = va_arg(args, Bool*);
-         *B = FALSE;
-         if (Str_Strcmp(valueStr, "1") == 0 ||
-             Str_Strcasecmp(valueStr, "true") == 0 ||
-             Str_Strcasecmp(valueStr, "yes") == 0) {
-            *B = TRUE;
-         }
-         break;
-      default:
-         NOT_IMPLEMENTED();
-      }
-
-      free(valueStr);
-      valueStr = NULL;
-
-      nameTypeKey = va_arg(args, char*);
+   if (out->len > outStart) {
+      channel->bytesIn += out->len - outStart;
+      AsyncSocket_SendBuf(channel->socket, &out->owner,
+                          out->data + outStart, out->len - outStart);
    }
-
-exit:
-   va_end(args);
-   free(valueStr);
-
-   return success;
+   return TRUE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_FormatMsg --
- *
- *       Compose a formatted message using a key=type:value markup syntax,
- *       where the value is taken from the next argument.  Final argument
- *       must be NULL.  See TunnelProxy_ReadMsg for supported types.
- *
- *       e.g. TunnelProxy_FormatMsg(&val, &len, "portName=S", portName, NULL);
+ * TunnelProxy_Free --
  *
- *       Returned body must be freed by the caller.
+ *       Free a TunnelProxy object.  Calls TunnelProxyDisconnect to close all
+ *       sockets, frees all pending in and out chunks.
  *
  * Results:
- *       TRUE if all name=type:value pairs parsed correctly, FALSE otherwise.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -685,293 +1161,228 @@ exit:
  *-----------------------------------------------------------------------------
  */
 
-Bool
-TunnelProxy_FormatMsg(char **body,             // OUT
-                      int *len,                // OUT
-                      const char* nameTypeKey, // IN
-                      ...)                     // IN
+void
+TunnelProxy_Free(TunnelProxy *tp) // IN
 {
-   va_list args;
-   DynBuf builder;
-   Bool success = TRUE;
-
-   *body = NULL;
-   *len = -1;
+   ListItem *li;
+   ListItem *liNext;
+   int i;
 
-   DynBuf_Init(&builder);
-   va_start(args, nameTypeKey);
+   ASSERT(tp);
 
-   while (nameTypeKey) {
-      int nameLen = strlen(nameTypeKey);
-      char numStr[128];
-      const char *S;
-      char *SEncoded;
-      int32 I;
-      int64 L;
-      Bool B;
+   TunnelProxyDisconnect(tp, NULL, TRUE, FALSE);
+   TunnelProxyCancelAckTimer(tp);
 
-      DynBuf_Append(&builder, nameTypeKey, nameLen);
-      DynBuf_Append(&builder, ":", 1);
+   LIST_SCAN_SAFE(li, liNext, tp->queueOut) {
+      TunnelProxyFreeChunk(LIST_CONTAINER(li, TPChunk, list), &tp->queueOut);
+   }
+   tp->ackChunk = NULL;
+   LIST_SCAN_SAFE(li, liNext, tp->queueOutNeedAck) {
+      TunnelProxyFreeChunk(LIST_CONTAINER(li, TPChunk, list),
+                           &tp->queueOutNeedAck);
+   }
 
-      switch (nameTypeKey[nameLen-1]) {
-      case 'S':
-      case 'E':
-         // Strings are always Base64 encoded
-         S = va_arg(args, const char*);
-         ASSERT(S);
-         success = Base64_EasyEncode(S, strlen(S), &SEncoded);
-         if (!success) {
-            Log("Failed to base64-encode \"%s\"\n", S);
-            goto exit;
-         }
-         DynBuf_Append(&builder, SEncoded, strlen(SEncoded));
-         free(SEncoded);
-         break;
-      case 'I':
-         I = va_arg(args, int32);
-         Str_Sprintf(numStr, sizeof(numStr), "%d", I);
-         DynBuf_Append(&builder, numStr, strlen(numStr));
-         break;
-      case 'L':
-         L = va_arg(args, int64);
-         Str_Sprintf(numStr, sizeof(numStr), "%"FMT64"d", L);
-         DynBuf_Append(&builder, numStr, strlen(numStr));
-         break;
-      case 'B':
-         B = va_arg(args, int);
-         S = B ? "true" : "false";
-         DynBuf_Append(&builder, S, strlen(S));
-         break;
-      default:
-         NOT_IMPLEMENTED();
+   for (i = 0; i < TP_NAME_BUCKETS; i++) {
+      LIST_SCAN_SAFE(li, liNext, tp->msgHandlers[i]) {
+         TunnelProxyFreeMsgHandler(LIST_CONTAINER(li, TPMsgHandler, list),
+                                   &tp->msgHandlers[i]);
       }
-
-      DynBuf_Append(&builder, "|", 1);
-
-      nameTypeKey = va_arg(args, char*);
    }
 
-exit:
-   va_end(args);
+   TunnelProxyResetRecv(tp);
 
-   if (success) {
-      /* Null terminate for safety */
-      DynBuf_Append(&builder, "\0", 1);
+   free(tp->capID);
+   free(tp->hostIp);
+   free(tp->hostAddr);
+   free(tp->reconnectSecret);
+   free(tp->unixPrefix);
+   free(tp->deflateBuf);
 
-      *len = DynBuf_GetSize(&builder) - 1;
-      *body = (char*) DynBuf_Detach(&builder);
+   /* Chunks still held by a TunnelProxySendv free the pool later. */
+   tp->pool->orphaned = TRUE;
+   if (tp->pool->liveChunks == 0) {
+      TunnelProxyFreePool(tp->pool);
    }
-   DynBuf_Destroy(&builder);
-
-   return success;
+   free(tp);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_GetConnectUrl --
+ * TunnelProxyFreeChunk --
  *
- *       Create a URL to use when POSTing, based on a server URL retreived
- *       during broker tunnel initialization.  If the TunnelProxy has been
- *       connected before and there is a valid reconnectSecret, the URL will be
- *       different from an initial connection.
+ *       Remove a TPChunk object from the queue passed, and drop the queue's
+ *       reference to it.
  *
  * Results:
- *       The URL of the tunnel connect/reconnect.  Caller must free it.
+ *       None.
  *
  * Side effects:
- *       None.
+ *       Chunk is freed unless a TunnelProxySendv still refers to it.
  *
  *-----------------------------------------------------------------------------
  */
 
-char *
-TunnelProxy_GetConnectUrl(TunnelProxy *tp,       // IN
-                          const char *serverUrl) // IN
+static void
+TunnelProxyFreeChunk(TPChunk *chunk,  // IN
+                     ListItem **list) // IN/OUT
 {
-   size_t len = 0;
-   if (tp->capID) {
-      if (tp->reconnectSecret) {
-         return Str_Asprintf(&len, "%s"TP_RECONNECT_URL_PATH"?%s&%s", serverUrl,
-                             tp->capID, tp->reconnectSecret);
-      } else {
-         return Str_Asprintf(&len, "%s"TP_CONNECT_URL_PATH"?%s", serverUrl,
-                             tp->capID);
-      }
-   } else {
-      return Str_Asprintf(&len, "%s"TP_CONNECT_URL_PATH, serverUrl);
-   }
+   ASSERT(chunk);
+   ASSERT(list);
+   LIST_DEL(&chunk->list, list);
+   TunnelProxyReleaseChunk(chunk);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_Connect --
+ * TunnelProxyReleaseChunk --
  *
- *       Connect or reconnect a TunnelProxy.  Queues an INIT msg.
+ *       Drop a reference to a TPChunk object, freeing it once the last
+ *       reference is gone.
  *
  * Results:
- *       TunnelProxyErr.
+ *       None.
  *
  * Side effects:
- *       Reinitializes tunnel read/write buffers.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-TunnelProxyErr
-TunnelProxy_Connect(TunnelProxy *tp,                      // IN
-                    const char *hostIp,                   // IN/OPT
-                    const char *hostAddr,                 // IN/OPT
-                    TunnelProxySendNeededCb sendNeededCb, // IN/OPT
-                    void *sendNeededCbData,               // IN/OPT
-                    TunnelProxyDisconnectCb disconnectCb, // IN/OPT
-                    void *disconnectCbData)               // IN/OPT
+static void
+TunnelProxyReleaseChunk(TPChunk *chunk) // IN
 {
-   Bool isReconnect;
+   TPChunkPool *pool;
 
-   ASSERT(tp);
+   ASSERT(chunk);
+   ASSERT(chunk->refCount > 0);
 
-   isReconnect = (tp->lastConnect.tv_sec > 0);
-   if (isReconnect && !tp->reconnectSecret) {
-      return TP_ERR_INVALID_RECONNECT;
+   if (--chunk->refCount > 0) {
+      return;
    }
 
-   gettimeofday(&tp->lastConnect, NULL);
-
-   free(tp->hostIp);
-   free(tp->hostAddr);
-   tp->hostIp = strdup(hostIp ? hostIp : "127.0.0.1");
-   tp->hostAddr = strdup(hostAddr ? hostAddr : "localhost");
-
-   tp->sendNeededCb = sendNeededCb;
-   tp->sendNeededCbData = sendNeededCbData;
-   tp->disconnectCb = disconnectCb;
-   tp->disconnectCbData = disconnectCbData;
-
-   DynBuf_Destroy(&tp->readBuf);
-   DynBuf_Init(&tp->readBuf);
-   DynBuf_Destroy(&tp->writeBuf);
-   DynBuf_Init(&tp->writeBuf);
-
-   if (isReconnect) {
-      TunnelProxyResetTimeouts(tp, TRUE);
+   pool = chunk->pool;
+   ASSERT(pool && pool->liveChunks > 0);
 
-      tp->queueOut = LIST_SPLICE(tp->queueOutNeedAck, tp->queueOut);
-      tp->queueOutNeedAck = NULL;
-      /* Want to ACK the last chunk ID we saw */
-      tp->lastChunkAckSent = 0;
+   TunnelProxyFreeBody(pool, chunk->body, chunk->bodyClass);
+   LIST_QUEUE(&chunk->list, &pool->freeChunks);
+   pool->liveChunks--;
 
-      TunnelProxyFireSendNeeded(tp);
-   } else {
-      char *initBody = NULL;
-      int initLen = 0;
-      /* XXX: Need our own type, and version. */
-      TunnelProxy_FormatMsg(&initBody, &initLen,
-                            "type=S", "C", /* "simple" C client */
-                            "v1=I", 3, "v2=I", 1, "v3=I", 4,
-                            "cid=S", "1234",
-                            NULL);
-      TunnelProxy_SendMsg(tp, TP_MSG_INIT, initBody, initLen);
-      free(initBody);
+   if (pool->orphaned && pool->liveChunks == 0) {
+      TunnelProxyFreePool(pool);
    }
-
-   return TP_ERR_OK;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyDisconnect --
+ * TunnelProxyAllocChunk --
  *
- *       Disconnect a TunnelProxy.  If closeSockets is true, all sockets and
- *       channels are shutdown, and corresponding UNLISTEN_RP messages are
- *       sent.  If notify is true, the disconnect callback is invoked with
- *       with reason argument to allow reconnection.
+ *       Take a zeroed outgoing TPChunk from the TunnelProxy's pool, adding
+ *       a slab of TP_CHUNK_SLAB when the pool is empty.
  *
  * Results:
- *       TunnelProxyErr.
+ *       TPChunk with one reference.
  *
  * Side effects:
- *       None.
+ *       May allocate memory.
  *
  *-----------------------------------------------------------------------------
  */
 
-TunnelProxyErr
-TunnelProxyDisconnect(TunnelProxy *tp,    // IN
-                      const char *reason, // IN
-                      Bool closeSockets,  // IN
-                      Bool notify)        // IN
+static TPChunk *
+TunnelProxyAllocChunk(TunnelProxy *tp,  // IN
+                      TPChunkType type) // IN
 {
-   TunnelProxyErr err;
-
-   if (tp->lastConnect.tv_sec == 0) {
-      return TP_ERR_NOT_CONNECTED;
-   }
-
-   /* Cancel any existing timeouts */
-   TunnelProxyResetTimeouts(tp, FALSE);
+   TPChunkPool *pool = tp->pool;
+   TPChunk *chunk;
 
-   if (closeSockets) {
-      ListItem *li;
-      ListItem *liNext;
+   if (!pool->freeChunks) {
+      TPChunkSlab *slab = Util_SafeMalloc(sizeof *slab);
+      int i;
 
-      LIST_SCAN_SAFE(li, liNext, tp->listeners) {
-         TPListener *listener = LIST_CONTAINER(li, TPListener, list);
-         /* This will close all the channels as well */
-         err = TunnelProxy_CloseListener(tp, listener->portName);
-         ASSERT(TP_ERR_OK == err);
+      LIST_QUEUE(&slab->list, &pool->slabs);
+      pool->slabCnt++;
+      for (i = 0; i < TP_CHUNK_SLAB; i++) {
+         LIST_QUEUE(&slab->chunks[i].list, &pool->freeChunks);
       }
    }
 
-   if (notify && tp->disconnectCb) {
-      ASSERT(reason);
-      tp->disconnectCb(tp, tp->reconnectSecret, reason, tp->disconnectCbData);
-   }
-
-   return TP_ERR_OK;
+   chunk = LIST_CONTAINER(pool->freeChunks, TPChunk, list);
+   LIST_DEL(&chunk->list, &pool->freeChunks);
+   pool->liveChunks++;
+   pool->liveChunksPeak = MAX(pool->liveChunks, pool->liveChunksPeak);
+
+   memset(chunk, 0, sizeof *chunk);
+   chunk->pool = pool;
+   chunk->bodyClass = -1;
+   chunk->type = type;
+   chunk->refCount = 1;
+   return chunk;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_Disconnect --
+ * TunnelProxyAllocBody --
  *
- *       Disconnect a TunnelProxy.  All sockets and channels are shutdown, and
- *       corresponding UNLISTEN_RP messages are sent.  The disconnect callback
- *       passed to TunnelProxy_Connect is not invoked.
+ *       Allocate at least size bytes for a chunk body from the smallest size
+ *       class that fits, or with malloc if none does.
  *
  * Results:
- *       TunnelProxyErr.
+ *       Body buffer, and its size class for TunnelProxyFreeBody.
  *
  * Side effects:
- *       None.
+ *       May allocate memory.
  *
  *-----------------------------------------------------------------------------
  */
 
-TunnelProxyErr
-TunnelProxy_Disconnect(TunnelProxy *tp) // IN
+static char *
+TunnelProxyAllocBody(TPChunkPool *pool,       // IN
+                     int size,                // IN
+                     signed char *bodyClass)  // OUT: -1 if malloc'd
 {
-   return TunnelProxyDisconnect(tp, NULL, TRUE, FALSE);
+   int cls;
+
+   for (cls = 0; cls < TP_BODY_CLASSES; cls++) {
+      if (size <= tpBodySizes[cls]) {
+         break;
+      }
+   }
+   if (cls == TP_BODY_CLASSES) {
+      *bodyClass = -1;
+      return Util_SafeMalloc(size);
+   }
+
+   *bodyClass = cls;
+   if (pool->freeBodies[cls]) {
+      TPFreeBody *body = pool->freeBodies[cls];
+
+      pool->freeBodies[cls] = body->next;
+      pool->freeBodyCnt[cls]--;
+      return (char *)body;
+   }
+   return Util_SafeMalloc(tpBodySizes[cls]);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_CloseListener --
+ * TunnelProxyFreeBody --
  *
- *       Close a listening socket identified by portName.  All socket channels
- *       are closed, and an UNLISTEN_RP msg is sent to the tunnel server.
+ *       Return a chunk body to its size class free list, or free it if the
+ *       list already holds TP_BODY_FREE_MAX bodies or the body was not from
+ *       a size class.
  *
  * Results:
- *       TunnelProxyErr.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -979,67 +1390,38 @@ TunnelProxy_Disconnect(TunnelProxy *tp) // IN
  *-----------------------------------------------------------------------------
  */
 
-TunnelProxyErr
-TunnelProxy_CloseListener(TunnelProxy *tp,      // IN
-                          const char *portName) // IN
+static void
+TunnelProxyFreeBody(TPChunkPool *pool, // IN
+                    char *body,        // IN/OPT
+                    int bodyClass)     // IN
 {
-   TPListener *listener = NULL;
-   ListItem *li;
-   ListItem *liNext;
-   char *unlisten = NULL;
-   int unlistenLen = 0;
-   TunnelProxyErr err;
-
-   ASSERT(tp);
-   ASSERT(portName);
+   TPFreeBody *freeBody = (TPFreeBody *)body;
 
-   LIST_SCAN(li, tp->listeners) {
-      TPListener *listenerIter = LIST_CONTAINER(li, TPListener, list);
-      if (Str_Strcmp(listenerIter->portName, portName) == 0) {
-         listener = listenerIter;
-         break;
-      }
-   }
-   if (!listener) {
-      return TP_ERR_INVALID_LISTENER;
+   if (!body) {
+      return;
    }
 
-   AsyncSocket_Close(listener->listenSock);
-   LIST_DEL(&listener->list, &tp->listeners);
-   free(listener);
-
-   /*
-    * Send an UNLISTEN_RQ in any case of closing.  It might not be an actual
-    * reply if closing due to max connections being hit.
-    */
-   TunnelProxy_FormatMsg(&unlisten, &unlistenLen, "portName=S", portName, NULL);
-   TunnelProxy_SendMsg(tp, TP_MSG_UNLISTEN_RP, unlisten, unlistenLen);
-   free(unlisten);
-
-   /* Close all the channels */
-   LIST_SCAN_SAFE(li, liNext, tp->channels) {
-      TPChannel *channel = LIST_CONTAINER(li, TPChannel, list);
-      if (Str_Strcmp(channel->portName, portName) == 0) {
-         err = TunnelProxy_CloseChannel(tp, channel->channelId);
-         ASSERT(TP_ERR_OK == err);
-      }
+   if (bodyClass < 0 || pool->freeBodyCnt[bodyClass] >= TP_BODY_FREE_MAX) {
+      free(body);
+      return;
    }
 
-   return TP_ERR_OK;
+   freeBody->next = pool->freeBodies[bodyClass];
+   pool->freeBodies[bodyClass] = freeBody;
+   pool->freeBodyCnt[bodyClass]++;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_CloseChannel --
+ * TunnelProxyFreePool --
  *
- *       Close an individual socket channel identified by its channelId.  If
- *       the channel's listner is single-use, TunnelProxy_CloseListener is
- *       invoked.  Otherwise, a LOWER message is sent to the tunnel server.
+ *       Free a chunk pool's slabs, cached bodies and TunnelProxySendv
+ *       handles.  Every chunk must have been released.
  *
  * Results:
- *       TunnelProxyErr.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -1047,85 +1429,43 @@ TunnelProxy_CloseListener(TunnelProxy *tp,      // IN
  *-----------------------------------------------------------------------------
  */
 
-TunnelProxyErr
-TunnelProxy_CloseChannel(TunnelProxy *tp,        // IN
-                         unsigned int channelId) // IN
+static void
+TunnelProxyFreePool(TPChunkPool *pool) // IN
 {
-   TPChannel *channel = NULL;
    ListItem *li;
-   TunnelProxyErr err;
+   ListItem *liNext;
+   int i;
 
-   ASSERT(tp);
+   ASSERT(pool->liveChunks == 0);
 
-   LIST_SCAN(li, tp->channels) {
-      TPChannel *chanIter = LIST_CONTAINER(li, TPChannel, list);
-      if (chanIter->channelId == channelId) {
-         channel = chanIter;
-         break;
-      }
+   LIST_SCAN_SAFE(li, liNext, pool->slabs) {
+      LIST_DEL(li, &pool->slabs);
+      free(LIST_CONTAINER(li, TPChunkSlab, list));
    }
-   if (!channel) {
-      return TP_ERR_INVALID_CHANNELID;
-   }
-
-   LIST_SCAN(li, tp->listeners) {
-      TPListener *listener = LIST_CONTAINER(li, TPListener, list);
+   for (i = 0; i < TP_BODY_CLASSES; i++) {
+      while (pool->freeBodies[i]) {
+         TPFreeBody *body = pool->freeBodies[i];
 
-      if (listener->singleUse &&
-          Str_Strcmp(listener->portName, channel->portName) == 0) {
-         Log("Closing single-use listener \"%s\" after channel \"%d\" "
-             "disconnect.\n", channel->portName, channelId);
-
-         err = TunnelProxy_CloseListener(tp, channel->portName);
-         ASSERT(TP_ERR_OK == err);
-
-         /* Channel is no more */
-         channel = NULL;
-         break;
+         pool->freeBodies[i] = body->next;
+         free(body);
       }
    }
+   while (pool->freeSendvs) {
+      TunnelProxySendv *sendv = pool->freeSendvs;
 
-   if (channel) {
-      char *lower = NULL;
-      int lowerLen = 0;
-
-      if (channel->socket) {
-         AsyncSocket_Close(channel->socket);
-      }
-
-      TunnelProxy_FormatMsg(&lower, &lowerLen, "chanID=I", channelId, NULL);
-      TunnelProxy_SendMsg(tp, TP_MSG_LOWER, lower, lowerLen);
-      free(lower);
-
-      LIST_DEL(&channel->list, &tp->channels);
-      free(channel);
+      pool->freeSendvs = sendv->next;
+      free(sendv);
    }
-
-   return TP_ERR_OK;
+   free(pool);
 }
 
 
-/*
- * Tunnel channel connect and IO handlers
- */
-
-
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxySocketRecvCb --
- *
- *       Read IO callback handler for a given socket channel.  An attempt is
- *       made to read all data available on the socket in a non-blocking
- *       fashion.  If an error occurs while reading, TunnelProxy_CloseChannel
- *       is called.
- *
- *       If any data is read, a new outgoing data chunk is queued with all the
- *       data.  Max data size for one chunk is 10K (see
- *       wswc_tunnel/conveyor.cpp).
+ * TunnelProxyFreeMsgHandler --
  *
- *       AsyncSocket_Recv for 1 byte is issued to cause this callback to be
- *       invoked the next time there is at least one byte of data to read.
+ *       Free a TPMsgHandler object, and remove it from the queue passed.
  *
  * Results:
  *       None.
@@ -1137,198 +1477,91 @@ TunnelProxy_CloseChannel(TunnelProxy *tp,        // IN
  */
 
 static void
-TunnelProxySocketRecvCb(void *buf,          // IN/OPT: read data
-                        int len,            // IN/OPT: buf length
-                        AsyncSocket *asock, // IN
-                        void *clientData)   // IN: TPChannel
+TunnelProxyFreeMsgHandler(TPMsgHandler *handler, // IN
+                          ListItem **list)       // IN/OUT
 {
-   TPChannel *channel = clientData;
-   TunnelProxy *tp;
-   int throttle = 3;
-
-   ASSERT(channel);
-   ASSERT(channel->socket == asock);
-
-   tp = channel->tp;
-   ASSERT(tp);
-
-   while (throttle--) {
-      int asockErr = ASOCKERR_SUCCESS;
-      TunnelProxyErr err;
-      char recvBuf[TP_BUF_MAXLEN];
-      int recvLen = 0;
-
-      /*
-       * Non-blocking read with 0 timeout to drain queued data.  Offset into
-       * readBuf by the size of the buf argument.
-       */
-      asockErr = AsyncSocket_RecvBlocking(asock, &recvBuf[len],
-                                          sizeof(recvBuf) - len, &recvLen,
-                                          0);
-
-      /* Prepend the buf argument the first time through this loop */
-      if (len) {
-         ASSERT(buf);
-         memcpy(recvBuf, buf, len);
-         recvLen += len;
-         len = 0;
-      }
-
-      if (recvLen != 0) {
-         /* Send the data we have, regardless of recv success */
-         TunnelProxySendChunk(tp, TP_CHUNK_TYPE_DATA, channel->channelId,
-                              NULL, recvBuf, recvLen);
-      }
-
-      if (asockErr != ASOCKERR_SUCCESS && asockErr != ASOCKERR_TIMEOUT) {
-         Log("Error reading from channel \"%d\": %s\n", channel->channelId,
-             AsyncSocket_Err2String(asockErr));
-
-         err = TunnelProxy_CloseChannel(tp, channel->channelId);
-         ASSERT(TP_ERR_OK == err);
-         return;
-      }
-
-      if (recvLen == 0) {
-         break;
-      }
-   }
-
-   /* Recv at least 1-byte before calling this callback again */
-   AsyncSocket_Recv(asock, &channel->recvByte, 1,
-                    TunnelProxySocketRecvCb, channel);
+   ASSERT(handler);
+   LIST_DEL(&handler->list, list);
+   free(handler);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxySocketErrorCb --
+ * TunnelProxyHashName --
  *
- *       Error handler for a socket channel.  Calls TunnelProxy_CloseChannel
- *       to notify the server the local side of the channel has closed.
+ *       Hash a msgId or portName into a TP_NAME_BUCKETS bucket index.  Case
+ *       is ignored, since msgIds are matched case-insensitively.
  *
  * Results:
- *       None.
+ *       Bucket index.
  *
  * Side effects:
- *       Calls the TunnelProxy's endChannelCb to notify of channel death.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelProxySocketErrorCb(int error,          // IN
-                         AsyncSocket *asock, // IN
-                         void *clientData)   // IN
+static unsigned int
+TunnelProxyHashName(const char *name) // IN
 {
-   TPChannel *channel = clientData;
-   TunnelProxy *tp;
-   TunnelProxyErr err;
+   unsigned int hash = 0;
 
-   ASSERT(channel);
-   ASSERT(channel->socket == asock);
-
-   tp = channel->tp;
-   ASSERT(tp);
+   ASSERT(name);
 
-   if (tp->endChannelCb) {
-      tp->endChannelCb(tp, channel->portName, asock, tp->endChannelCbData);
+   for (; *name; name++) {
+      hash = hash * 31 + (unsigned char)tolower((unsigned char)*name);
    }
 
-   Log("Closing channel \"%d\" socket for listener \"%s\": %s.\n",
-       channel->channelId, channel->portName, AsyncSocket_Err2String(error));
-
-   err = TunnelProxy_CloseChannel(tp, channel->channelId);
-   ASSERT(TP_ERR_OK == err);
+   return hash & (TP_NAME_BUCKETS - 1);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxySocketConnectCb --
- *
- *       Connection handler callback to notify of a new local socket
- *       connection for a given TPListener.  Creates a new channel and adds it
- *       to the TunnelProxy's channel queue.
+ * TunnelProxyLookupChannel --
  *
- *       Sends a RAISE_RQ to the tunnel server to notify it of the new channel
- *       connection.
+ *       Find a socket channel by its channelId.
  *
  * Results:
- *       None.
+ *       TPChannel, or NULL if there is no such channel.
  *
  * Side effects:
- *       Calls the TunnelProxy's newChannelCb to notify of channel create.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelProxySocketConnectCb(AsyncSocket *asock, // IN
-                           void *clientData)   // IN
+static TPChannel *
+TunnelProxyLookupChannel(TunnelProxy *tp,        // IN
+                         unsigned int channelId) // IN
 {
-   TPListener *listener = clientData;
-   TunnelProxy *tp;
-   char *raiseBody;
-   int raiseLen;
-   TPChannel *newChannel;
-   int newChannelId;
-
-   ASSERT(listener);
+   ListItem *li;
 
-   tp = listener->tp;
    ASSERT(tp);
 
-   if (tp->newChannelCb && !tp->newChannelCb(tp, listener->portName, asock,
-                                             tp->newChannelCbData)) {
-      Log("Rejecting new channel connection to listener \"%s\"",
-          listener->portName);
-      AsyncSocket_Close(asock);
-      return;
+   LIST_SCAN(li, tp->channelHash[channelId & (TP_CHANNEL_BUCKETS - 1)]) {
+      TPChannel *channel = LIST_CONTAINER(li, TPChannel, hashList);
+      if (channel->channelId == channelId) {
+         return channel;
+      }
    }
 
-   newChannelId = ++tp->maxChannelId;
-
-   Log("Creating new channel \"%d\" to listener \"%s\".\n",
-       newChannelId, listener->portName);
-
-   newChannel = Util_SafeCalloc(1, sizeof(TPChannel));
-   newChannel->channelId = newChannelId;
-   Str_Strcpy(newChannel->portName, listener->portName, TP_PORTNAME_MAXLEN);
-   newChannel->socket = asock;
-   newChannel->tp = tp;
-
-   LIST_QUEUE(&newChannel->list, &tp->channels);
-
-   AsyncSocket_SetErrorFn(asock, TunnelProxySocketErrorCb, newChannel);
-   AsyncSocket_UseNodelay(asock, TRUE);
-
-   TunnelProxy_FormatMsg(&raiseBody, &raiseLen,
-                         "chanID=I", newChannel->channelId,
-                         "portName=S", newChannel->portName, NULL);
-   TunnelProxy_SendMsg(tp, TP_MSG_RAISE_RQ, raiseBody, raiseLen);
-   free(raiseBody);
+   return NULL;
 }
 
 
-/*
- * HTTP IO driver interface
- */
-
-
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyReadHex --
+ * TunnelProxyLookupListener --
  *
- *       Inline stream parsing helper.  Attempts to read a hex-encoded integer
- *       string followed by a trailing char, and returns it in the out param.
- *       Advances the idx param past the trailing char.
+ *       Find a listener by its portName.
  *
  * Results:
- *       TRUE if a terminated hex number was read, FALSE otherwise.
+ *       TPListener, or NULL if there is no such listener.
  *
  * Side effects:
  *       None.
@@ -1336,57 +1569,36 @@ TunnelProxySocketConnectCb(AsyncSocket *asock, // IN
  *-----------------------------------------------------------------------------
  */
 
-static inline Bool
-TunnelProxyReadHex(char *buf,  // IN
-                   int len,    // IN
-                   char trail, // IN
-                   int *idx,   // IN/OUT
-                   int *out)   // OUT
+static TPListener *
+TunnelProxyLookupListener(TunnelProxy *tp,      // IN
+                          const char *portName) // IN
 {
-   int numDigits = 0;
-   long value = 0;
-
-   while (len > *idx + numDigits) {
-      char digit = buf[*idx + numDigits];
-
-      if (digit == trail) {
-         *idx += numDigits + 1;
-         *out = value;
-         return TRUE;
-      }
+   ListItem *li;
 
-      numDigits++;
-      value = value << 4; /* Shift four places (multiply by 16) */
+   ASSERT(tp);
+   ASSERT(portName);
 
-      /* Add in digit value */
-      if (digit >= '0' && digit <= '9') {
-         value += digit - '0';      /* Number range 0..9 */
-      } else if (digit >= 'A' && digit <= 'F') {
-         value += digit - 'A' + 10; /* Character range 10..15 */
-      } else if (digit >= 'a' && digit <= 'f') {
-         value += digit - 'a' + 10; /* Character range 10..15 */
-      } else {
-         Log("TunnelProxyReadHex: Invalid number character: %u\n", digit);
-         return FALSE;
+   LIST_SCAN(li, tp->listenerHash[TunnelProxyHashName(portName)]) {
+      TPListener *listener = LIST_CONTAINER(li, TPListener, hashList);
+      if (Str_Strcmp(listener->portName, portName) == 0) {
+         return listener;
       }
    }
 
-   return FALSE;
+   return NULL;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyReadStr --
+ * TunnelProxy_AddMsgHandler --
  *
- *       Inline stream parsing helper.  Given a string length, attempts to
- *       verify that the entire string is available and is terminated by a ';'.
- *       Advances the idx param past the ';'.  Sets the start param to the
- *       beginning of the string.
+ *       Allocate a new msg handler object which handles messages of the given
+ *       msgId, and add it to the TunnelProxy handler queue.
  *
  * Results:
- *       TRUE if a ';' terminated string number was read, FALSE otherwise.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -1394,262 +1606,285 @@ TunnelProxyReadHex(char *buf,  // IN
  *-----------------------------------------------------------------------------
  */
 
-static inline Bool
-TunnelProxyReadStr(char *buf,    // IN
-                   int len,      // IN
-                   int *idx,     // IN/OUT: current index
-                   char **start, // OUT: start of string
-                   int strLen)   // IN: expecting this size
+void
+TunnelProxy_AddMsgHandler(TunnelProxy *tp,            // IN
+                          const char *msgId,          // IN
+                          TunnelProxyMsgHandlerCb cb, // IN
+                          void *userData)             // IN/OPT
 {
-   if (len > *idx + strLen + 1 && buf[*idx + strLen] == ';') {
-      *start = &buf[*idx];
-      *idx += strLen + 1;
-      return TRUE;
-   }
-   return FALSE;
+   TPMsgHandler *msgHandler;
+
+   ASSERT(tp);
+   ASSERT(msgId);
+
+   msgHandler = Util_SafeCalloc(1, sizeof(TPMsgHandler));
+   Str_Strcpy(msgHandler->msgId, msgId, TP_MSGID_MAXLEN);
+   msgHandler->userData = userData;
+   msgHandler->cb = cb;
+
+   LIST_QUEUE(&msgHandler->list,
+              &tp->msgHandlers[TunnelProxyHashName(msgId)]);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyReadChunk --
+ * TunnelProxy_RemoveMsgHandler --
  *
- *       Attempts to read a single well-formatted Ack, Data or Message chunk
- *       from the buf param.  Fills the chunk arg with the read data, without
- *       copying.
+ *       Free an existing msg handler which handles messages of the given
+ *       msgId, and remove it from the TunnelProxy handler queue.
  *
- *       If httpChunked is true, the buf is assumed to be HTTP-chunked encoded,
- *       with '%x\r\n.....\r\n' surrounding each chunk.
+ *       Handlers are matched based on msgId and cb/userData.  If no
+ *       cb/userData is passed, all message handlers for the given msgId will
+ *       be removed.
  *
  * Results:
- *       Size of data read from buf, 0 if no chunk was read.
+ *       None.
  *
  * Side effects:
- *       If successful, sets readLen to the amount of data read from the
- *       beginning of buf to construct the chunk.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static unsigned int
-TunnelProxyReadChunk(char *buf,        // IN
-                     int len,          // IN
-                     Bool httpChunked, // IN
-                     TPChunk *chunk)   // IN/OUT
+void
+TunnelProxy_RemoveMsgHandler(TunnelProxy *tp,            // IN
+                             const char *msgId,          // IN
+                             TunnelProxyMsgHandlerCb cb, // IN
+                             void *userData)             // IN/OPT
 {
-   int minLen = httpChunked ? 10 : 3;
-   int readLen = 0;
+   ListItem **bucket;
+   ListItem *li;
+   ListItem *liNext;
 
-#define READHEX(_val) \
-   if (!TunnelProxyReadHex(buf, len, ';', &readLen, _val)) { return 0; }
-#define READSTR(_out, _len) \
-   if (!TunnelProxyReadStr(buf, len, &readLen, _out, _len)) { return 0; }
+   ASSERT(tp);
+   ASSERT(msgId);
 
-   ASSERT(chunk);
-
-   if (len < minLen) {
-      return 0;
-   }
-
-   if (httpChunked) {
-      /* Chunked header looks like %x\r\n.....\r\n */
-      int chunkLen = 0;
-      if (!TunnelProxyReadHex(buf, len, '\r', &readLen, &chunkLen) ||
-          readLen + 1 + chunkLen + 2 > len) {
-         return FALSE;
-      }
-
-      ASSERT(buf[readLen] == '\n');
-      readLen++;
-   }
-
-   {
-      char *typeStr = NULL;
-      READSTR(&typeStr, 1)
-      chunk->type = *typeStr;
-   }
-
-   switch (chunk->type) {
-   case TP_CHUNK_TYPE_ACK:
-      READHEX(&chunk->ackId)
-      DEBUG_DATA(("RECV-ACK(ackId=%d)\n", chunk->ackId));
-      break;
-   case TP_CHUNK_TYPE_MESSAGE: {
-      char *hdr = NULL;
-      int hdrLen = 0;
-      char *msgId = NULL;
-
-      READHEX(&chunk->chunkId)
-      READHEX(&chunk->ackId)
-
-      READHEX(&hdrLen)
-      READSTR(&hdr, hdrLen)
-
-      READHEX(&chunk->len)
-      READSTR(&chunk->body, chunk->len)
-
-      if (!TunnelProxy_ReadMsg(hdr, hdrLen, "messageType=S", &msgId, NULL)) {
-         Log("Invalid messageType in tunnel message header!\n");
-         return FALSE;
+   bucket = &tp->msgHandlers[TunnelProxyHashName(msgId)];
+   LIST_SCAN_SAFE(li, liNext, *bucket) {
+      TPMsgHandler *handler = LIST_CONTAINER(li, TPMsgHandler, list);
+      if (Str_Strcmp(handler->msgId, msgId) == 0 &&
+          (!cb || (handler->cb == cb && handler->userData == userData))) {
+         TunnelProxyFreeMsgHandler(handler, bucket);
       }
-
-      Str_Strcpy(chunk->msgId, msgId, TP_MSGID_MAXLEN);
-      free(msgId);
-
-      DEBUG_DATA(("RECV-MSG(id=%d, ack=%d, msgid=%s, length=%d): %.*s\n",
-                  chunk->chunkId, chunk->ackId,
-                  chunk->msgId,
-                  chunk->len, chunk->len, chunk->body));
-      break;
-   }
-   case TP_CHUNK_TYPE_DATA:
-      READHEX(&chunk->chunkId)
-      READHEX(&chunk->ackId)
-      READHEX(&chunk->channelId)
-
-      READHEX(&chunk->len)
-      READSTR(&chunk->body, chunk->len)
-
-      DEBUG_DATA(("RECV-DATA(id=%d, ack=%d, channel=%d, length=%d)\n",
-                  chunk->chunkId, chunk->ackId, chunk->channelId, chunk->len));
-      break;
-   default:
-      Log("Invalid tunnel message type identifier \"%c\" (%d).\n",
-          chunk->type, chunk->type);
-      NOT_IMPLEMENTED();
    }
+}
 
-   if (httpChunked) {
-      ASSERT(buf[readLen] == '\r');
-      ASSERT(buf[readLen + 1] == '\n');
 
-      /* Move past trailing \r\n */
-      readLen += 2;
-   }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_SendMsg --
+ *
+ *       Append a message of msgId with the given body to the outgoing message
+ *       queue.  The chunk will be assigned the next serial chunk id.  The
+ *       body buffer will be copied.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   return readLen;
+void
+TunnelProxy_SendMsg(TunnelProxy *tp,   // IN
+                    const char *msgId, // IN
+                    const char *body,  // IN
+                    int len)           // IN
+{
+   ASSERT(tp);
+   ASSERT(msgId && strlen(msgId) < TP_MSGID_MAXLEN);
 
-#undef READHEX
-#undef READSTR
+   TunnelProxySendChunk(tp, TP_CHUNK_TYPE_MESSAGE, 0, msgId, (char*) body, len);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyHandleInChunk --
+ * TunnelProxy_ParseMsg --
  *
- *       Processes the next chunk in the incoming chunk queue.  If the chunk
- *       is an Ack, a message in the outgoing needs-ACK queue with the
- *       corresponding chunkId is found and freed.  If a Message chunk, a
- *       handler for the chunk's msgId header is found and invoked with the
- *       chunk data.  If a data chunk, the socket channel with the
- *       corresponding channelId is located and the chunk data written to the
- *       socket using AsyncSocket_Send.
+ *       Parse a formatted message using a key=type:value markup syntax, as
+ *       composed by TunnelProxy_FormatMsg, into msg's table of fields.  The
+ *       body is split in a single pass, and the values of string types are
+ *       Base64 decoded into a single arena.  Supported types are:
+ *
+ *          S - a base64 encoded utf8 string
+ *          E - a base64 encoded utf8 error string
+ *          b - base64 encoded binary data
+ *          s - a list of base64 encoded utf8 strings, separated by ','
+ *          I - integer
+ *          L - 64-bit integer
+ *          B - boolean, 1, "true", and "yes" are all considered TRUE
+ *          N - no value, only the key's presence matters
+ *
+ *       Fields which are malformed are skipped.  Values are then fetched
+ *       with TunnelProxy_MsgGet, and msg must be released with
+ *       TunnelProxy_MsgDestroy.
  *
  * Results:
  *       None.
  *
  * Side effects:
- *       None.
+ *       Allocates the arena, and a larger field table for messages of more
+ *       than TP_MSG_INLINE_FIELDS fields.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelProxyHandleInChunk(TunnelProxy *tp, // IN
-                         TPChunk *chunk)  // IN
+void
+TunnelProxy_ParseMsg(TunnelProxyMsg *msg, // OUT
+                     const char *body,    // IN
+                     int len)             // IN
 {
-   ListItem *li;
-   ListItem *liNext;
+   const char *end = body + len;
+   const char *pos = body;
+   size_t listSlots = 0;
+   size_t textSize = 0;
+   char **slot;
+   char *text;
+   int i;
 
-   ASSERT(tp);
-   ASSERT(chunk);
+   ASSERT(msg);
+   ASSERT(body || len == 0);
 
-   if (chunk->chunkId > 0) {
-      if (chunk->chunkId <= tp->lastChunkIdSeen) {
-         /* This chunk has been replayed... skip it. */
-         Log("Skipping replayed chunk ID '%d'.\n", chunk->chunkId);
-         return;
+   memset(msg, 0, sizeof *msg);
+   msg->fields = msg->inlineFields;
+   msg->fieldsAllocated = ARRAYSIZE(msg->inlineFields);
+
+   /* Bodies composed by TunnelProxy_FormatMsg are NUL terminated. */
+   if (len > 0) {
+      const char *nul = memchr(body, '\0', len);
+      if (nul) {
+         end = nul;
       }
-      tp->lastChunkIdSeen = chunk->chunkId;
    }
 
-   if (chunk->ackId > 0) {
-      if (chunk->ackId > tp->lastChunkIdSent) {
-         Log("Unknown ACK ID '%d' in received tunnel message.\n", chunk->ackId);
+   /* Split the body into fields, and size the arena. */
+   while (pos < end) {
+      const char *fieldEnd = memchr(pos, '|', end - pos);
+      const char *colon;
+      TunnelProxyMsgField *field;
+
+      if (!fieldEnd) {
+         fieldEnd = end;
+      }
+      colon = memchr(pos, ':', fieldEnd - pos);
+      if (!colon || colon - pos < 3 || colon[-2] != '=') {
+         pos = fieldEnd + 1;
+         continue;
       }
 
-      LIST_SCAN_SAFE(li, liNext, tp->queueOutNeedAck) {
-         TPChunk *outChunk = LIST_CONTAINER(li, TPChunk, list);
-         ASSERT(outChunk);
+      if (msg->fieldCount == msg->fieldsAllocated) {
+         TunnelProxyMsgField *fields;
 
-         /* queueOutNeedAck is sorted in ascending chunk ID order. */
-         if (chunk->ackId >= outChunk->chunkId) {
-            TunnelProxyFreeChunk(outChunk, &tp->queueOutNeedAck);
-         } else {
-            break;
+         msg->fieldsAllocated *= 2;
+         fields = Util_SafeMalloc(msg->fieldsAllocated * sizeof *fields);
+         memcpy(fields, msg->fields, msg->fieldCount * sizeof *fields);
+         if (msg->fields != msg->inlineFields) {
+            free(msg->fields);
          }
+         msg->fields = fields;
       }
 
-      tp->lastChunkAckSeen = chunk->ackId;
-   }
-
-   switch (chunk->type) {
-   case TP_CHUNK_TYPE_MESSAGE: {
-      Bool found = FALSE;
-
-      ASSERT(chunk->msgId);
-      LIST_SCAN_SAFE(li, liNext, tp->msgHandlers) {
-         TPMsgHandler *handler = LIST_CONTAINER(li, TPMsgHandler, list);
-
-         if (Str_Strcasecmp(handler->msgId, chunk->msgId) == 0) {
-            ASSERT(handler->cb);
-            found = TRUE;
-            if (handler->cb(tp, chunk->msgId, chunk->body, chunk->len,
-                            handler->userData)) {
-               /* True means the handler handled the message, so stop here. */
+      field = &msg->fields[msg->fieldCount++];
+      field->name = pos;
+      field->nameLen = colon - pos;
+      field->type = colon[-1];
+      field->value = colon + 1;
+      field->valueLen = fieldEnd - field->value;
+      field->list = NULL;
+
+      switch (field->type) {
+      case 's': {
+         const char *comma = field->value;
+
+         listSlots++;
+         while (comma < fieldEnd) {
+            listSlots++;
+            comma = memchr(comma, ',', fieldEnd - comma);
+            if (!comma) {
                break;
             }
+            comma++;
          }
       }
-
-      if (!found) {
-         DEBUG_MSG(("Unhandled message type '%s' received.\n", chunk->msgId));
+         /* Fall through */
+      case 'S':
+      case 'E':
+      case 'b':
+         textSize += field->valueLen + 1;
+         break;
+      default:
+         break;
       }
-      break;
+
+      pos = fieldEnd + 1;
    }
-   case TP_CHUNK_TYPE_DATA: {
-      Bool found = FALSE;
 
-      LIST_SCAN(li, tp->channels) {
-         TPChannel *channel = LIST_CONTAINER(li, TPChannel, list);
+   if (textSize == 0) {
+      return;
+   }
 
-         if (channel->channelId == chunk->channelId) {
-            char *body = Util_SafeMalloc(chunk->len);
-            memcpy(body, chunk->body, chunk->len);
+   /*
+    * Copy the encoded values into the arena and decode them in place, which
+    * Base64_Decode allows as it never writes ahead of what it has read.
+    * Lists' element pointers go at the start of the arena.
+    */
+   msg->arena = Util_SafeMalloc(listSlots * sizeof(char *) + textSize);
+   slot = (char **) msg->arena;
+   text = msg->arena + listSlots * sizeof(char *);
 
-            /* Send the copied body, to be freed on completion */
-            AsyncSocket_Send(channel->socket, body, chunk->len,
-                             (AsyncSocketSendFn) free, NULL);
+   for (i = 0; i < msg->fieldCount; i++) {
+      TunnelProxyMsgField *field = &msg->fields[i];
+      char *elem;
+      size_t decodeLen;
 
-            found = TRUE;
-            break;
+      switch (field->type) {
+      case 'S':
+      case 'E':
+      case 'b':
+         memcpy(text, field->value, field->valueLen);
+         text[field->valueLen] = '\0';
+         field->value = NULL;
+         if (Base64_Decode(text, (uint8 *) text, field->valueLen,
+                           &decodeLen)) {
+            text[decodeLen] = '\0';
+            field->value = text;
          }
+         text += field->valueLen + 1;
+         field->valueLen = decodeLen;
+         break;
+      case 's':
+         field->list = (const char **) slot;
+         elem = text;
+         memcpy(text, field->value, field->valueLen);
+         text[field->valueLen] = '\0';
+         text += field->valueLen + 1;
+         while (elem < text - 1) {
+            char *comma = strchr(elem, ',');
+
+            if (comma) {
+               *comma = '\0';
+            }
+            if (!Base64_Decode(elem, (uint8 *) elem, strlen(elem),
+                               &decodeLen)) {
+               field->list = NULL;
+               break;
+            }
+            elem[decodeLen] = '\0';
+            *slot++ = elem;
+            elem = comma ? comma + 1 : text;
+         }
+         *slot++ = NULL;
+         break;
+      default:
+         break;
       }
-
-      if (!found) {
-         DEBUG_MSG(("Data received for unknown channel id '%d'.\n",
-                    chunk->channelId));
-      }
-      break;
-   }
-   case TP_CHUNK_TYPE_ACK:
-      /* Let the common ACK handling happen */
-      break;
-   default:
-      NOT_IMPLEMENTED();
    }
 }
 
@@ -1657,215 +1892,3146 @@ TunnelProxyHandleInChunk(TunnelProxy *tp, // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_HTTPRecv --
+ * TunnelProxy_MsgGet --
+ *
+ *       Fetch values of a message parsed by TunnelProxy_ParseMsg, with the
+ *       value destination pointer passed in to the argument following each
+ *       key=type, similar to sscanf.  Final argument must be NULL.  The
+ *       destination types are:
  *
- *       Process incoming tunnel data read from an unknown HTTP source.  The
- *       buffer contents are assumed *not* to be in HTTP chunked encoding.
+ *          S, E - const char **
+ *          b    - const void **, then int * for the data length
+ *          s    - const char ***, set to a NULL terminated array
+ *          I    - int32 *
+ *          L    - int64 *
+ *          B    - Bool *
+ *          N    - none
  *
- *       Appends the buffer data to the TunnelProxy's readBuf, and attempts to
- *       construct and queue incoming chunks from the data by calling
- *       TunnelProxyReadChunk.  The data read from the readBuf and used
- *       to construct full chunks is removed from the front of the readBuf.
+ *       e.g. TunnelProxy_MsgGet(&msg, "reason=S", &reasonStr, NULL);
  *
- *       TunnelProxyHandleInChunk is called repeatedly to process any
- *       existing or newly queued incoming chunks.
+ *       Returned strings, data and lists point into msg, and are valid until
+ *       TunnelProxy_MsgDestroy.
  *
  * Results:
- *       None.
+ *       TRUE if all keys were present with valid values, FALSE otherwise.
+ *       Destinations of keys before the first missing one are set.
  *
  * Side effects:
- *       Many.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_HTTPRecv(TunnelProxy *tp,  // IN
-                     const char *buf,  // IN
-                     int bufSize,      // IN
-                     Bool httpChunked) // IN
+Bool
+TunnelProxy_MsgGet(const TunnelProxyMsg *msg, // IN
+                   const char *nameTypeKey,   // IN
+                   ...)                       // OUT
 {
-   int totalReadLen = 0;
+   va_list args;
+   Bool success = TRUE;
 
-   ASSERT(tp);
-   ASSERT(buf && bufSize > 0);
+   va_start(args, nameTypeKey);
 
-   DynBuf_Append(&tp->readBuf, buf, bufSize);
+   while (nameTypeKey) {
+      int nameLen = strlen(nameTypeKey);
+      const TunnelProxyMsgField *field = NULL;
+      char numStr[32];
+      int i;
+
+      for (i = 0; i < msg->fieldCount; i++) {
+         if (msg->fields[i].nameLen == nameLen &&
+             memcmp(msg->fields[i].name, nameTypeKey, nameLen) == 0) {
+            field = &msg->fields[i];
+            break;
+         }
+      }
+      if (!field ||
+          (field->type == 's' ? !field->list : !field->value)) {
+         success = FALSE;
+         break;
+      }
 
-   while (TRUE) {
-      unsigned int readLen;
-      TPChunk chunk;
+      switch (field->type) {
+      case 'S':
+      case 'E':
+         *va_arg(args, const char **) = field->value;
+         break;
+      case 'b':
+         *va_arg(args, const void **) = field->value;
+         *va_arg(args, int *) = field->valueLen;
+         break;
+      case 's':
+         *va_arg(args, const char ***) = field->list;
+         break;
+      case 'I':
+      case 'L':
+      case 'B':
+         if (field->valueLen >= sizeof numStr) {
+            success = FALSE;
+            goto exit;
+         }
+         memcpy(numStr, field->value, field->valueLen);
+         numStr[field->valueLen] = '\0';
 
-      memset(&chunk, 0, sizeof(chunk));
-      readLen = TunnelProxyReadChunk(&tp->readBuf.data[totalReadLen],
-                                     tp->readBuf.size - totalReadLen,
-                                     httpChunked, &chunk);
-      if (!readLen) {
+         if (field->type == 'I') {
+            StrUtil_StrToInt(va_arg(args, int32 *), numStr);
+         } else if (field->type == 'L') {
+            StrUtil_StrToInt64(va_arg(args, int64 *), numStr);
+         } else {
+            *va_arg(args, Bool *) = Str_Strcmp(numStr, "1") == 0 ||
+                                    Str_Strcasecmp(numStr, "true") == 0 ||
+                                    Str_Strcasecmp(numStr, "yes") == 0;
+         }
          break;
+      case 'N':
+         break;
+      default:
+         NOT_IMPLEMENTED();
       }
 
-      TunnelProxyHandleInChunk(tp, &chunk);
-      totalReadLen += readLen;
-   }
-
-   if (!totalReadLen) {
-      return;
+      nameTypeKey = va_arg(args, char*);
    }
 
-   /* Shrink the front of the read buffer */
-   memcpy(tp->readBuf.data, &tp->readBuf.data[totalReadLen],
-          tp->readBuf.size - totalReadLen);
-   tp->readBuf.size -= totalReadLen;
+exit:
+   va_end(args);
 
-   /* Reset timeouts after successfully reading a chunk. */
-   TunnelProxyResetTimeouts(tp, TRUE);
+   return success;
+}
 
-   /* Toggle flow control if needed */
-   {
-      unsigned int unackCnt = tp->lastChunkIdSent - tp->lastChunkAckSeen;
 
-      if ((unackCnt > TP_MAX_START_FLOW_CONTROL) && !tp->flowStopped) {
-         DEBUG_MSG(("Starting flow control (%d unacknowledged chunks)\n",
-                    unackCnt));
-         tp->flowStopped = TRUE;
-      } else if ((unackCnt < TP_MIN_END_FLOW_CONTROL) && tp->flowStopped) {
-         DEBUG_MSG(("Ending flow control\n"));
-         tp->flowStopped = FALSE;
-         TunnelProxyFireSendNeeded(tp);
-      }
-   }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_MsgDestroy --
+ *
+ *       Free the memory of a message parsed by TunnelProxy_ParseMsg.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Values returned by TunnelProxy_MsgGet are no longer valid.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   /* Queue new ACK if we haven't sent one in a while */
-   if (tp->lastChunkIdSeen - tp->lastChunkAckSent >= TP_MAX_UNACKNOWLEDGED) {
-      DEBUG_MSG(("Recv'd %d unacknowledged chunks.  Sending ACK chunk.\n",
-                 TP_MAX_UNACKNOWLEDGED));
-      TunnelProxySendChunk(tp, TP_CHUNK_TYPE_ACK, 0, NULL, NULL, 0);
+void
+TunnelProxy_MsgDestroy(TunnelProxyMsg *msg) // IN
+{
+   free(msg->arena);
+   msg->arena = NULL;
+   if (msg->fields != msg->inlineFields) {
+      free(msg->fields);
    }
+   msg->fields = NULL;
+   msg->fieldCount = 0;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyWriteNextOutChunk --
+ * TunnelProxyAppendBase64 --
  *
- *       Serialize the next chunk in the outgoing chunk queue into the
- *       TunnelProxy's writeBuf.  If the chunk to be serialized is a Data
- *       chunk, its body is first base64 encoded.
+ *       Base64 encode data straight onto the end of a DynBuf.
  *
- *       If the outgoing chunk doesn't have an ackId field set, the next chunk
- *       on the incoming to-be-ACK's queue is used, and is freed.
+ * Results:
+ *       FALSE if out of memory.
  *
- *       Once processed the chunk is moved to the outgoing needs-ACK queue.
+ * Side effects:
+ *       None.
  *
- * Results:
- *       TRUE if a chunk was written successfully, FALSE otherwise.
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyAppendBase64(DynBuf *buf,      // IN/OUT
+                        const void *data, // IN
+                        size_t len)       // IN
+{
+   size_t size = DynBuf_GetSize(buf);
+   size_t encodedMax = Base64_EncodedLength(data, len);
+   size_t encodedLen = 0;
+
+   if (DynBuf_GetAllocatedSize(buf) < size + encodedMax &&
+       !DynBuf_Enlarge(buf, size + encodedMax)) {
+      return FALSE;
+   }
+   if (!Base64_Encode(data, len, (char *) DynBuf_Get(buf) + size,
+                      encodedMax, &encodedLen)) {
+      return FALSE;
+   }
+   DynBuf_SetSize(buf, size + encodedLen);
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_FormatMsg --
+ *
+ *       Compose a formatted message using a key=type:value markup syntax,
+ *       where the value is taken from the next argument.  Final argument
+ *       must be NULL.  See TunnelProxy_ParseMsg for supported types.  The
+ *       arguments for each are:
+ *
+ *          S, E - const char *
+ *          b    - const void *, then int for the data length
+ *          s    - const char * const *, a NULL terminated array
+ *          I    - int32
+ *          L    - int64
+ *          B    - Bool
+ *          N    - none
+ *
+ *       e.g. TunnelProxy_FormatMsg(&val, &len, "portName=S", portName, NULL);
+ *
+ *       Returned body must be freed by the caller.
+ *
+ * Results:
+ *       TRUE if all name=type:value pairs parsed correctly, FALSE otherwise.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+TunnelProxy_FormatMsg(char **body,             // OUT
+                      int *len,                // OUT
+                      const char* nameTypeKey, // IN
+                      ...)                     // IN
+{
+   va_list args;
+   DynBuf builder;
+   Bool success = TRUE;
+
+   *body = NULL;
+   *len = -1;
+
+   DynBuf_Init(&builder);
+   va_start(args, nameTypeKey);
+
+   while (nameTypeKey) {
+      int nameLen = strlen(nameTypeKey);
+      char numStr[128];
+      const char *S;
+      const char * const *list;
+      const void *data;
+      int dataLen;
+      int32 I;
+      int64 L;
+      Bool B;
+
+      DynBuf_Append(&builder, nameTypeKey, nameLen);
+      DynBuf_Append(&builder, ":", 1);
+
+      switch (nameTypeKey[nameLen-1]) {
+      case 'S':
+      case 'E':
+         // Strings are always Base64 encoded
+         S = va_arg(args, const char*);
+         ASSERT(S);
+         success = TunnelProxyAppendBase64(&builder, S, strlen(S));
+         break;
+      case 'b':
+         data = va_arg(args, const void*);
+         dataLen = va_arg(args, int);
+         ASSERT(data || dataLen == 0);
+         success = TunnelProxyAppendBase64(&builder, data, dataLen);
+         break;
+      case 's':
+         list = va_arg(args, const char * const *);
+         ASSERT(list);
+         for (; success && *list; list++) {
+            success = TunnelProxyAppendBase64(&builder, *list, strlen(*list));
+            if (list[1]) {
+               DynBuf_Append(&builder, ",", 1);
+            }
+         }
+         break;
+      case 'I':
+         I = va_arg(args, int32);
+         Str_Sprintf(numStr, sizeof(numStr), "%d", I);
+         DynBuf_Append(&builder, numStr, strlen(numStr));
+         break;
+      case 'L':
+         L = va_arg(args, int64);
+         Str_Sprintf(numStr, sizeof(numStr), "%"FMT64"d", L);
+         DynBuf_Append(&builder, numStr, strlen(numStr));
+         break;
+      case 'B':
+         B = va_arg(args, int);
+         S = B ? "true" : "false";
+         DynBuf_Append(&builder, S, strlen(S));
+         break;
+      case 'N':
+         break;
+      default:
+         NOT_IMPLEMENTED();
+      }
+
+      if (!success) {
+         Log("Failed to base64-encode value of \"%s\"\n", nameTypeKey);
+         goto exit;
+      }
+
+      DynBuf_Append(&builder, "|", 1);
+
+      nameTypeKey = va_arg(args, char*);
+   }
+
+exit:
+   va_end(args);
+
+   if (success) {
+      /* Null terminate for safety */
+      DynBuf_Append(&builder, "\0", 1);
+
+      *len = DynBuf_GetSize(&builder) - 1;
+      *body = (char*) DynBuf_Detach(&builder);
+   }
+   DynBuf_Destroy(&builder);
+
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_GetConnectUrl --
+ *
+ *       Create a URL to use when POSTing, based on a server URL retreived
+ *       during broker tunnel initialization.  If the TunnelProxy has been
+ *       connected before and there is a valid reconnectSecret, the URL will be
+ *       different from an initial connection.
+ *
+ * Results:
+ *       The URL of the tunnel connect/reconnect.  Caller must free it.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+TunnelProxy_GetConnectUrl(TunnelProxy *tp,       // IN
+                          const char *serverUrl) // IN
+{
+   size_t len = 0;
+   if (tp->capID) {
+      if (tp->reconnectSecret) {
+         return Str_Asprintf(&len, "%s"TP_RECONNECT_URL_PATH"?%s&%s", serverUrl,
+                             tp->capID, tp->reconnectSecret);
+      } else {
+         return Str_Asprintf(&len, "%s"TP_CONNECT_URL_PATH"?%s", serverUrl,
+                             tp->capID);
+      }
+   } else {
+      return Str_Asprintf(&len, "%s"TP_CONNECT_URL_PATH, serverUrl);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_GetStripeUrl --
+ *
+ *       Create a URL to use when POSTing an additional connection of a
+ *       striped session, based on the same server URL passed to
+ *       TunnelProxy_GetConnectUrl.
+ *
+ * Results:
+ *       The URL of the stripe connection, or NULL if the session has no
+ *       reconnectSecret to identify it.  Caller must free it.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+TunnelProxy_GetStripeUrl(TunnelProxy *tp,       // IN
+                         const char *serverUrl, // IN
+                         int stripe)            // IN
+{
+   size_t len = 0;
+
+   ASSERT(stripe > 0 && stripe < tp->stripes);
+
+   if (!tp->capID || !tp->reconnectSecret) {
+      return NULL;
+   }
+   return Str_Asprintf(&len, "%s"TP_STRIPE_URL_PATH"?%s&%s&%d", serverUrl,
+                       tp->capID, tp->reconnectSecret, stripe);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_GetStripes --
+ *
+ *       Get the number of HTTP connections the session is striped over.
+ *
+ * Results:
+ *       1 unless the server accepted a view.tunnel.stripes request.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+TunnelProxy_GetStripes(TunnelProxy *tp) // IN
+{
+   ASSERT(tp);
+   return tp->stripes;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_LimitStripes --
+ *
+ *       Stripe the session over fewer HTTP connections, as when the
+ *       connection of a stripe could not be opened.  Reconnects only reopen
+ *       the stripes below the limit, so a stripe that keeps failing does not
+ *       keep resetting the session.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelProxy_LimitStripes(TunnelProxy *tp, // IN
+                         int stripes)     // IN
+{
+   ASSERT(tp);
+   ASSERT(stripes > 0);
+
+   if (stripes < tp->stripes) {
+      tp->stripes = stripes;
+      Log("Tunnel striped over %d connections.\n", tp->stripes);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_Connect --
+ *
+ *       Connect or reconnect a TunnelProxy.  Queues an INIT msg.  The
+ *       stripesCb is invoked once the session may be striped over more HTTP
+ *       connections, and again on each reconnect of a striped session.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       Reinitializes tunnel read/write buffers.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxy_Connect(TunnelProxy *tp,                      // IN
+                    const char *hostIp,                   // IN/OPT
+                    const char *hostAddr,                 // IN/OPT
+                    TunnelProxySendNeededCb sendNeededCb, // IN/OPT
+                    void *sendNeededCbData,               // IN/OPT
+                    TunnelProxyDisconnectCb disconnectCb, // IN/OPT
+                    void *disconnectCbData,               // IN/OPT
+                    TunnelProxyStripesCb stripesCb,       // IN/OPT
+                    void *stripesCbData)                  // IN/OPT
+{
+   Bool isReconnect;
+
+   ASSERT(tp);
+
+   isReconnect = (tp->lastConnect.tv_sec > 0);
+   if (isReconnect && !tp->reconnectSecret) {
+      return TP_ERR_INVALID_RECONNECT;
+   }
+
+   gettimeofday(&tp->lastConnect, NULL);
+
+   free(tp->hostIp);
+   free(tp->hostAddr);
+   tp->hostIp = strdup(hostIp ? hostIp : "127.0.0.1");
+   tp->hostAddr = strdup(hostAddr ? hostAddr : "localhost");
+
+   tp->sendNeededCb = sendNeededCb;
+   tp->sendNeededCbData = sendNeededCbData;
+   tp->disconnectCb = disconnectCb;
+   tp->disconnectCbData = disconnectCbData;
+   tp->stripesCb = stripesCb;
+   tp->stripesCbData = stripesCbData;
+
+   TunnelProxyResetRecv(tp);
+   DynBuf_Destroy(&tp->writeBuf);
+   DynBuf_Init(&tp->writeBuf);
+
+   if (isReconnect) {
+      ListItem *li;
+      ListItem *liNext;
+
+      TunnelProxyResetTimeouts(tp, TRUE);
+
+      tp->queueOut = LIST_SPLICE(tp->queueOutNeedAck, tp->queueOut);
+      tp->queueOutNeedAck = NULL;
+      tp->needAckCnt = 0;
+      tp->replayBytes = 0;
+
+      /* ACKs sent on the old connection are replaced by one fresh ACK. */
+      LIST_SCAN_SAFE(li, liNext, tp->queueOut) {
+         TPChunk *chunk = LIST_CONTAINER(li, TPChunk, list);
+
+         if (chunk->type == TP_CHUNK_TYPE_ACK && chunk != tp->ackChunk) {
+            TunnelProxyFreeChunk(chunk, &tp->queueOut);
+         }
+      }
+
+      /* Want to ACK the last chunk ID we saw */
+      tp->lastChunkAckSent = 0;
+      if (tp->lastChunkIdSeen > 0) {
+         TunnelProxySendChunk(tp, TP_CHUNK_TYPE_ACK, 0, NULL, NULL, 0);
+      }
+
+      /* Nothing is in flight on the new connection, so resends may go. */
+      TunnelProxyUpdateFlowControl(tp);
+      TunnelProxyFireSendNeeded(tp);
+
+      if (tp->stripes > 1 && tp->stripesCb) {
+         tp->stripesCb(tp, tp->stripes, tp->stripesCbData);
+      }
+   } else {
+      char *initBody = NULL;
+      int initLen = 0;
+
+      tp->stripes = 1;
+
+      /* XXX: Need our own type, and version. */
+      TunnelProxy_FormatMsg(&initBody, &initLen,
+                            "type=S", "C", /* "simple" C client */
+                            "v1=I", 3, "v2=I", 1, "v3=I", 4,
+                            "cid=S", "1234",
+                            NULL);
+      TunnelProxy_SendMsg(tp, TP_MSG_INIT, initBody, initLen);
+      free(initBody);
+   }
+
+   return TP_ERR_OK;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyDisconnect --
+ *
+ *       Disconnect a TunnelProxy.  If closeSockets is true, all sockets and
+ *       channels are shutdown, and corresponding UNLISTEN_RP messages are
+ *       sent.  If notify is true, the disconnect callback is invoked with
+ *       with reason argument to allow reconnection.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxyDisconnect(TunnelProxy *tp,    // IN
+                      const char *reason, // IN
+                      Bool closeSockets,  // IN
+                      Bool notify)        // IN
+{
+   TunnelProxyErr err;
+
+   if (tp->lastConnect.tv_sec == 0) {
+      return TP_ERR_NOT_CONNECTED;
+   }
+
+   /* Cancel any existing timeouts */
+   TunnelProxyResetTimeouts(tp, FALSE);
+   TunnelProxyCancelAckTimer(tp);
+
+   Log("Tunnel disconnected: %"FMT64"u bytes in, %"FMT64"u bytes out, "
+       "%u reconnects.\n", tp->stats.bytesIn, tp->stats.bytesOut,
+       tp->stats.reconnects);
+
+   if (closeSockets) {
+      ListItem *li;
+      ListItem *liNext;
+
+      LIST_SCAN_SAFE(li, liNext, tp->listeners) {
+         TPListener *listener = LIST_CONTAINER(li, TPListener, list);
+         /* This will close all the channels as well */
+         err = TunnelProxy_CloseListener(tp, listener->portName);
+         ASSERT(TP_ERR_OK == err);
+      }
+   }
+
+   if (notify && tp->disconnectCb) {
+      ASSERT(reason);
+      if (tp->reconnectSecret && tp->resetTime == 0) {
+         tp->resetTime = Hostinfo_SystemTimerUS();
+      }
+      tp->disconnectCb(tp, tp->reconnectSecret, reason, tp->disconnectCbData);
+   }
+
+   return TP_ERR_OK;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_Disconnect --
+ *
+ *       Disconnect a TunnelProxy.  All sockets and channels are shutdown, and
+ *       corresponding UNLISTEN_RP messages are sent.  The disconnect callback
+ *       passed to TunnelProxy_Connect is not invoked.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxy_Disconnect(TunnelProxy *tp) // IN
+{
+   return TunnelProxyDisconnect(tp, NULL, TRUE, FALSE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_Reset --
+ *
+ *       Reset a TunnelProxy whose HTTP connection failed, as on a protocol
+ *       error or lost contact.  Channels stay open, and the disconnect
+ *       callback is invoked with the reconnect secret, if there is one, so
+ *       the session can reconnect without losing data.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       Invokes the disconnect callback.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxy_Reset(TunnelProxy *tp,    // IN
+                  const char *reason) // IN
+{
+   ASSERT(reason);
+
+   return TunnelProxyDisconnect(tp, reason, FALSE, TRUE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_CloseListener --
+ *
+ *       Close a listening socket identified by portName.  All socket channels
+ *       are closed, and an UNLISTEN_RP msg is sent to the tunnel server.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxy_CloseListener(TunnelProxy *tp,      // IN
+                          const char *portName) // IN
+{
+   TPListener *listener = NULL;
+   ListItem *li;
+   ListItem *liNext;
+   char *unlisten = NULL;
+   int unlistenLen = 0;
+   TunnelProxyErr err;
+
+   ASSERT(tp);
+   ASSERT(portName);
+
+   listener = TunnelProxyLookupListener(tp, portName);
+   if (!listener) {
+      return TP_ERR_INVALID_LISTENER;
+   }
+
+   TunnelProxyCloseListenSocks(listener);
+   LIST_DEL(&listener->list, &tp->listeners);
+   LIST_DEL(&listener->hashList,
+            &tp->listenerHash[TunnelProxyHashName(portName)]);
+   free(listener);
+
+   /*
+    * Send an UNLISTEN_RQ in any case of closing.  It might not be an actual
+    * reply if closing due to max connections being hit.
+    */
+   TunnelProxy_FormatMsg(&unlisten, &unlistenLen, "portName=S", portName, NULL);
+   TunnelProxy_SendMsg(tp, TP_MSG_UNLISTEN_RP, unlisten, unlistenLen);
+   free(unlisten);
+
+   /* Close all the channels */
+   LIST_SCAN_SAFE(li, liNext, tp->channels) {
+      TPChannel *channel = LIST_CONTAINER(li, TPChannel, list);
+      if (Str_Strcmp(channel->portName, portName) == 0) {
+         err = TunnelProxy_CloseChannel(tp, channel->channelId);
+         ASSERT(TP_ERR_OK == err);
+      }
+   }
+
+   return TP_ERR_OK;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_CloseChannel --
+ *
+ *       Close an individual socket channel identified by its channelId.  If
+ *       the channel's listner is single-use, TunnelProxy_CloseListener is
+ *       invoked.  Otherwise, a LOWER message is sent to the tunnel server.
+ *
+ * Results:
+ *       TunnelProxyErr.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxyErr
+TunnelProxy_CloseChannel(TunnelProxy *tp,        // IN
+                         unsigned int channelId) // IN
+{
+   TPChannel *channel;
+   TPListener *listener;
+   TunnelProxyErr err;
+
+   ASSERT(tp);
+
+   channel = TunnelProxyLookupChannel(tp, channelId);
+   if (!channel) {
+      return TP_ERR_INVALID_CHANNELID;
+   }
+
+   listener = TunnelProxyLookupListener(tp, channel->portName);
+   if (listener && listener->singleUse) {
+      Log("Closing single-use listener \"%s\" after channel \"%d\" "
+          "disconnect.\n", channel->portName, channelId);
+
+      err = TunnelProxy_CloseListener(tp, channel->portName);
+      ASSERT(TP_ERR_OK == err);
+
+      /* Channel is no more */
+      channel = NULL;
+   }
+
+   if (channel) {
+      char *lower = NULL;
+      int lowerLen = 0;
+
+      if (channel->socket) {
+         AsyncSocket_Close(channel->socket);
+      }
+
+      /* Data read before the close must reach the server before LOWER. */
+      TunnelProxyFlushChannel(tp, channel);
+
+      TunnelProxy_FormatMsg(&lower, &lowerLen, "chanID=I", channelId, NULL);
+      TunnelProxy_SendMsg(tp, TP_MSG_LOWER, lower, lowerLen);
+      free(lower);
+
+      if (channel->deflating) {
+         deflateEnd(&channel->deflater);
+         inflateEnd(&channel->inflater);
+      }
+      if (channel->inflateBuf) {
+         TunnelProxyReleaseRecvBuf(channel->inflateBuf);
+      }
+
+      LIST_DEL(&channel->list, &tp->channels);
+      LIST_DEL(&channel->hashList,
+               &tp->channelHash[channelId & (TP_CHANNEL_BUCKETS - 1)]);
+      free(channel);
+   }
+
+   return TP_ERR_OK;
+}
+
+
+/*
+ * Tunnel channel connect and IO handlers
+ */
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxySocketRecvCb --
+ *
+ *       Read IO callback handler for a given socket channel, registered with
+ *       AsyncSocket_RecvPartial on the channel's recvBuf.  Queues an
+ *       outgoing data chunk with whatever was read, up to maxDataLen bytes.
+ *       Max data size for one chunk is 10K (see wswc_tunnel/conveyor.cpp).
+ *       Read errors reach TunnelProxySocketErrorCb, which closes the channel.
+ *
+ *       Called with no data to start reading.  Once highWater bytes are
+ *       queued for the channel, the recv is paused, whether or not data is
+ *       being sent to the socket, and TunnelProxyDequeueChunk resumes it.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxySocketRecvCb(void *buf,          // IN/OPT: read data
+                        int len,            // IN/OPT: buf length
+                        AsyncSocket *asock, // IN
+                        void *clientData)   // IN: TPChannel
+{
+   TPChannel *channel = clientData;
+   TunnelProxy *tp;
+
+   ASSERT(channel);
+   ASSERT(channel->socket == asock);
+
+   tp = channel->tp;
+   ASSERT(tp);
+
+   if (len > 0) {
+      ASSERT(buf == channel->recvBuf);
+      TunnelProxySendChunk(tp, TP_CHUNK_TYPE_DATA, channel->channelId,
+                           NULL, buf, len);
+   }
+
+   if (!buf) {
+      ASSERT(channel->maxDataLen <= sizeof channel->recvBuf);
+      AsyncSocket_RecvPartial(asock, channel->recvBuf, channel->maxDataLen,
+                              TunnelProxySocketRecvCb, channel);
+   }
+
+   if (channel->queuedBytes >= tp->highWater && !channel->recvPaused) {
+      /* Stop reading until TunnelProxyDequeueChunk drains the queue. */
+      DEBUG_MSG(("Pausing reads from channel \"%d\" (%d bytes queued).\n",
+                 channel->channelId, channel->queuedBytes));
+      channel->recvPaused = TRUE;
+      tp->stats.channelPauses++;
+      AsyncSocket_PauseRecv(asock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxySocketErrorCb --
+ *
+ *       Error handler for a socket channel.  Calls TunnelProxy_CloseChannel
+ *       to notify the server the local side of the channel has closed.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Calls the TunnelProxy's endChannelCb to notify of channel death.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxySocketErrorCb(int error,          // IN
+                         AsyncSocket *asock, // IN
+                         void *clientData)   // IN
+{
+   TPChannel *channel = clientData;
+   TunnelProxy *tp;
+   TunnelProxyErr err;
+
+   ASSERT(channel);
+   ASSERT(channel->socket == asock);
+
+   tp = channel->tp;
+   ASSERT(tp);
+
+   if (tp->endChannelCb) {
+      tp->endChannelCb(tp, channel->portName, asock, tp->endChannelCbData);
+   }
+
+   Log("Closing channel \"%d\" socket for listener \"%s\": %s.\n",
+       channel->channelId, channel->portName, AsyncSocket_Err2String(error));
+
+   err = TunnelProxy_CloseChannel(tp, channel->channelId);
+   ASSERT(TP_ERR_OK == err);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyAcceptChannel --
+ *
+ *       Handle a new local socket connection for a given TPListener.
+ *       Creates a new channel and adds it to the TunnelProxy's channel queue.
+ *
+ *       Sends a RAISE_RQ to the tunnel server to notify it of the new channel
+ *       connection.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Calls the TunnelProxy's newChannelCb to notify of channel create.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyAcceptChannel(TPListener *listener, // IN
+                         AsyncSocket *asock,   // IN
+                         Bool tcp)             // IN: Set TCP_NODELAY
+{
+   TunnelProxy *tp;
+   char *raiseBody;
+   int raiseLen;
+   TPChannel *newChannel;
+   int newChannelId;
+
+   ASSERT(listener);
+
+   tp = listener->tp;
+   ASSERT(tp);
+
+   if (tp->newChannelCb && !tp->newChannelCb(tp, listener->portName, asock,
+                                             tp->newChannelCbData)) {
+      Log("Rejecting new channel connection to listener \"%s\"",
+          listener->portName);
+      AsyncSocket_Close(asock);
+      return;
+   }
+
+   newChannelId = ++tp->maxChannelId;
+
+   Log("Creating new channel \"%d\" to listener \"%s\".\n",
+       newChannelId, listener->portName);
+
+   newChannel = Util_SafeCalloc(1, sizeof(TPChannel));
+   newChannel->channelId = newChannelId;
+   Str_Strcpy(newChannel->portName, listener->portName, TP_PORTNAME_MAXLEN);
+   newChannel->socket = asock;
+   newChannel->tp = tp;
+   newChannel->quantum = (1 << listener->priority) * TP_BUF_MAXLEN;
+   newChannel->coalesceUsec = listener->coalesceUsec;
+   newChannel->compress = listener->compress;
+   newChannel->maxDataLen = TP_BUF_MAXLEN;
+
+   LIST_QUEUE(&newChannel->list, &tp->channels);
+   LIST_QUEUE(&newChannel->hashList,
+              &tp->channelHash[newChannelId & (TP_CHANNEL_BUCKETS - 1)]);
+
+   AsyncSocket_SetErrorFn(asock, TunnelProxySocketErrorCb, newChannel);
+   if (tcp) {
+      AsyncSocket_UseNodelay(asock, TRUE);
+   }
+
+   if (newChannel->compress) {
+      TunnelProxy_FormatMsg(&raiseBody, &raiseLen,
+                            "chanID=I", newChannel->channelId,
+                            "portName=S", newChannel->portName,
+                            "compress=S", TP_COMPRESS_DEFLATE, NULL);
+   } else {
+      TunnelProxy_FormatMsg(&raiseBody, &raiseLen,
+                            "chanID=I", newChannel->channelId,
+                            "portName=S", newChannel->portName, NULL);
+   }
+   TunnelProxy_SendMsg(tp, TP_MSG_RAISE_RQ, raiseBody, raiseLen);
+   free(raiseBody);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxySocketConnectCb --
+ *
+ *       Connection handler callback to notify of a new local TCP connection
+ *       for a given TPListener.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       See TunnelProxyAcceptChannel.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxySocketConnectCb(AsyncSocket *asock, // IN
+                           void *clientData)   // IN: TPListener
+{
+   TunnelProxyAcceptChannel(clientData, asock, TRUE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyUnixConnectCb --
+ *
+ *       Connection handler callback to notify of a new local Unix-domain
+ *       socket connection for a given TPListener.  Same as
+ *       TunnelProxySocketConnectCb, without TCP socket options.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       See TunnelProxyAcceptChannel.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyUnixConnectCb(AsyncSocket *asock, // IN
+                         void *clientData)   // IN: TPListener
+{
+   TunnelProxyAcceptChannel(clientData, asock, FALSE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_ListenUnix --
+ *
+ *       Listen on a Unix-domain socket that only the current user may
+ *       connect to: the socket file is created with mode 0600.  A leftover
+ *       socket file at the path is removed first, but only if nobody
+ *       accepts connections on it, so a second tunnel using the same path
+ *       can't take over a live listener.
+ *
+ * Results:
+ *       Listening AsyncSocket, or NULL with the error in *listenErr.
+ *
+ * Side effects:
+ *       May unlink a stale socket file.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+AsyncSocket *
+TunnelProxy_ListenUnix(const char *path,                // IN
+                       AsyncSocketConnectFn connectFn,  // IN
+                       void *clientData,                // IN
+                       int *listenErr)                  // OUT
+{
+   struct sockaddr_un addr = { 0 };
+   struct stat st;
+   AsyncSocket *asock;
+   mode_t oldMask;
+
+   ASSERT(path);
+   ASSERT(connectFn);
+
+   if (path[0] != '@' && strlen(path) < sizeof addr.sun_path &&
+       lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+      addr.sun_family = AF_UNIX;
+      Str_Strcpy(addr.sun_path, path, sizeof addr.sun_path);
+      if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0 &&
+          errno == ECONNREFUSED) {
+         Log("Removing stale listener socket %s.\n", path);
+         unlink(path);
+      }
+      if (fd >= 0) {
+         close(fd);
+      }
+   }
+
+   oldMask = umask(0177);
+   asock = AsyncSocket_ListenUnix(path, connectFn, clientData, NULL,
+                                  listenErr);
+   umask(oldMask);
+
+   return asock;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyCloseListenSocks --
+ *
+ *       Close a TPListener's listening sockets, removing the socket file of
+ *       a filesystem Unix-domain listener.  Channels already accepted are
+ *       left open.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyCloseListenSocks(TPListener *listener) // IN
+{
+   ASSERT(listener);
+
+   if (listener->listenSock) {
+      AsyncSocket_Close(listener->listenSock);
+      listener->listenSock = NULL;
+   }
+   if (listener->unixSock) {
+      AsyncSocket_Close(listener->unixSock);
+      listener->unixSock = NULL;
+      if (listener->unixPath[0] != '@') {
+         unlink(listener->unixPath);
+      }
+   }
+   free(listener->unixPath);
+   listener->unixPath = NULL;
+}
+
+
+/*
+ * HTTP IO driver interface
+ */
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyParseHex --
+ *
+ *       Inline stream parsing helper.  Reads hex digits at the parse position
+ *       into the parseHex accumulator until the trailing char is found, so a
+ *       number split across reads is picked up where it left off.  Numbers
+ *       above max are rejected before they can overflow.
+ *
+ * Results:
+ *       1 if a terminated hex number was read into the out param, 0 if more
+ *       data is needed, -1 on an invalid character or a number above max.
+ *
+ * Side effects:
+ *       Advances readPos past the bytes read.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static inline int
+TunnelProxyParseHex(TPRecvStream *rs, // IN
+                    char trail,       // IN
+                    int max,          // IN
+                    int *out)         // OUT
+{
+   char *buf = rs->readBuf->data;
+   int len = rs->readBuf->len;
+
+   while (rs->readPos < len) {
+      char digit = buf[rs->readPos++];
+
+      if (digit == trail) {
+         *out = rs->parseHex;
+         rs->parseHex = 0;
+         return 1;
+      }
+
+      if (rs->parseHex > max >> 4) {
+         Log("TunnelProxyParseHex: Number exceeds %d.\n", max);
+         return -1;
+      }
+      rs->parseHex = rs->parseHex << 4; /* Shift four places (multiply by 16) */
+
+      /* Add in digit value */
+      if (digit >= '0' && digit <= '9') {
+         rs->parseHex += digit - '0';      /* Number range 0..9 */
+      } else if (digit >= 'A' && digit <= 'F') {
+         rs->parseHex += digit - 'A' + 10; /* Character range 10..15 */
+      } else if (digit >= 'a' && digit <= 'f') {
+         rs->parseHex += digit - 'a' + 10; /* Character range 10..15 */
+      } else {
+         Log("TunnelProxyParseHex: Invalid number character: %u\n", digit);
+         return -1;
+      }
+
+      if (rs->parseHex > max) {
+         Log("TunnelProxyParseHex: Number exceeds %d.\n", max);
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyParseStr --
+ *
+ *       Inline stream parsing helper.  Given a string length, checks whether
+ *       the entire string and its terminating ';' are available at the parse
+ *       position, without scanning it.
+ *
+ * Results:
+ *       1 if the string was read and its offset from readChunkStart returned
+ *       in the out param, 0 if more data is needed, -1 if the string is not
+ *       ';' terminated.
+ *
+ * Side effects:
+ *       Advances readPos past the ';'.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static inline int
+TunnelProxyParseStr(TPRecvStream *rs, // IN
+                    int strLen,       // IN: expecting this size
+                    int *offset)      // OUT: start of string
+{
+   char *buf = rs->readBuf->data;
+   int len = rs->readBuf->len;
+
+   if (len < rs->readPos + strLen + 1) {
+      return 0;
+   }
+   if (buf[rs->readPos + strLen] != ';') {
+      Log("TunnelProxyParseStr: Missing ';' after %d byte string.\n", strLen);
+      return -1;
+   }
+
+   *offset = rs->readPos - rs->readChunkStart;
+   rs->readPos += strLen + 1;
+   return 1;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyFreeRecvBuf --
+ *
+ *       AsyncSocketBuf releaseFn for a TPRecvBuf.  Keeps it for reuse by
+ *       TunnelProxyNewRecvBuf if it has the common size, else frees it.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyFreeRecvBuf(AsyncSocketBuf *owner) // IN: first in the TPRecvBuf
+{
+   TPRecvBuf *recvBuf = (TPRecvBuf *)owner;
+
+   if (recvBuf->size != TP_RECV_BUFSIZE ||
+       tpFreeRecvBufCnt >= TP_RECVBUF_FREE_MAX) {
+      free(recvBuf);
+      return;
+   }
+   recvBuf->next = tpFreeRecvBufs;
+   tpFreeRecvBufs = recvBuf;
+   tpFreeRecvBufCnt++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyNewRecvBuf --
+ *
+ *       Get an empty TPRecvBuf for size bytes of data, reusing a released
+ *       one if size is TP_RECV_BUFSIZE.
+ *
+ * Results:
+ *       TPRecvBuf with one reference.
+ *
+ * Side effects:
+ *       May allocate memory.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TPRecvBuf *
+TunnelProxyNewRecvBuf(int size) // IN
+{
+   TPRecvBuf *recvBuf;
+
+   if (size == TP_RECV_BUFSIZE && tpFreeRecvBufs) {
+      recvBuf = tpFreeRecvBufs;
+      tpFreeRecvBufs = recvBuf->next;
+      tpFreeRecvBufCnt--;
+   } else {
+      recvBuf = Util_SafeMalloc(offsetof(TPRecvBuf, data) + size);
+   }
+
+   recvBuf->owner.refCount = 1;
+   recvBuf->owner.releaseFn = TunnelProxyFreeRecvBuf;
+   recvBuf->size = size;
+   recvBuf->len = 0;
+   return recvBuf;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyReleaseRecvBuf --
+ *
+ *       Drop a reference to a TPRecvBuf, freeing it once the last reference
+ *       is gone.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyReleaseRecvBuf(TPRecvBuf *recvBuf) // IN
+{
+   ASSERT(recvBuf);
+
+   AsyncSocket_BufRelease(&recvBuf->owner);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyRecvCompact --
+ *
+ *       Move the partially parsed chunk at readChunkStart to the front of a
+ *       readBuf of at least minSize bytes, dropping the handled data before
+ *       it.  This is done in place if no sends are pending on the readBuf
+ *       and it is large enough, otherwise the chunk is moved to a new
+ *       readBuf, leaving the old one to the pending sends.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       May allocate a new readBuf.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyRecvCompact(TPRecvStream *rs, // IN
+                       int minSize)      // IN
+{
+   TPRecvBuf *oldBuf = rs->readBuf;
+   int pending = oldBuf ? oldBuf->len - rs->readChunkStart : 0;
+
+   ASSERT(minSize >= pending);
+
+   if (oldBuf && oldBuf->owner.refCount == 1 && oldBuf->size >= minSize) {
+      if (rs->readChunkStart > 0) {
+         memmove(oldBuf->data, &oldBuf->data[rs->readChunkStart], pending);
+      }
+   } else {
+      int size = MAX(TP_RECV_BUFSIZE, minSize);
+
+      rs->readBuf = TunnelProxyNewRecvBuf(size);
+      if (oldBuf) {
+         memcpy(rs->readBuf->data, &oldBuf->data[rs->readChunkStart],
+                pending);
+         TunnelProxyReleaseRecvBuf(oldBuf);
+      }
+   }
+
+   rs->readBuf->len = pending;
+   rs->readPos -= rs->readChunkStart;
+   rs->readChunkStart = 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyRecvReserve --
+ *
+ *       Make sure the readBuf has room for a chunk of chunkLen bytes starting
+ *       at readChunkStart, so that it is read into place without being moved
+ *       again.  Called as soon as the chunk length is known, when at most the
+ *       chunk header and the rest of the current read need moving.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       May compact or replace the readBuf.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyRecvReserve(TPRecvStream *rs, // IN
+                       int chunkLen)     // IN
+{
+   if (rs->readChunkStart + chunkLen > rs->readBuf->size) {
+      TunnelProxyRecvCompact(rs, chunkLen);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyParseChunk --
+ *
+ *       Continues parsing the readBuf from readPos, using the resumable
+ *       parseState, until a single well-formatted Ack, Data or Message chunk
+ *       is complete.  Fills the chunk arg with the read data, without
+ *       copying.  The chunk body points into the readBuf, and is valid until
+ *       the next call.
+ *
+ *       If httpChunked is true, the data is assumed to be HTTP-chunked
+ *       encoded, with '%x\r\n.....\r\n' surrounding each chunk.
+ *
+ * Results:
+ *       TRUE if a chunk was read, FALSE if more data is needed or the input
+ *       is malformed, in which case parseState is left TP_PARSE_INVALID.
+ *
+ * Side effects:
+ *       Advances readPos, and readChunkStart past a returned chunk.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyParseChunk(TPRecvStream *rs,  // IN
+                      Bool httpChunked,  // IN
+                      TPChunk *chunk)    // OUT
+{
+   TPChunk *inChunk = &rs->parseChunk;
+   int ret = 1;
+
+   ASSERT(chunk);
+
+   /* Nothing has been read since the last (re)connect. */
+   if (!rs->readBuf) {
+      return FALSE;
+   }
+
+   while (ret > 0) {
+      int avail = rs->readBuf->len - rs->readPos;
+      int offset = 0;
+
+      switch (rs->parseState) {
+      case TP_PARSE_HTTP_LEN:
+         if (!httpChunked) {
+            rs->parseState = TP_PARSE_TYPE;
+            break;
+         }
+         ret = TunnelProxyParseHex(rs, '\r', TP_CHUNK_MAXLEN, &offset);
+         if (ret > 0) {
+            /* Reserve the rest of the line, the chunk and the "\r\n". */
+            TunnelProxyRecvReserve(rs, rs->readPos - rs->readChunkStart +
+                                   1 + offset + 2);
+            rs->parseState = TP_PARSE_HTTP_LF;
+         }
+         break;
+      case TP_PARSE_HTTP_LF:
+         if (avail < 1) {
+            ret = 0;
+            break;
+         }
+         if (rs->readBuf->data[rs->readPos] != '\n') {
+            Log("Invalid HTTP chunk size line terminator.\n");
+            ret = -1;
+            break;
+         }
+         rs->readPos++;
+         rs->parseState = TP_PARSE_TYPE;
+         break;
+      case TP_PARSE_TYPE:
+         ret = TunnelProxyParseStr(rs, 1, &offset);
+         if (ret <= 0) {
+            break;
+         }
+         inChunk->type = rs->readBuf->data[rs->readChunkStart + offset];
+         switch (inChunk->type) {
+         case TP_CHUNK_TYPE_ACK:
+            rs->parseState = TP_PARSE_ACK_ID;
+            break;
+         case TP_CHUNK_TYPE_MESSAGE:
+         case TP_CHUNK_TYPE_DATA:
+            rs->parseState = TP_PARSE_CHUNK_ID;
+            break;
+         default:
+            Log("Invalid tunnel message type identifier \"%c\" (%d).\n",
+                inChunk->type, inChunk->type);
+            ret = -1;
+         }
+         break;
+      case TP_PARSE_CHUNK_ID:
+         ret = TunnelProxyParseHex(rs, ';', MAX_INT32, &offset);
+         if (ret > 0) {
+            inChunk->chunkId = offset;
+            rs->parseState = TP_PARSE_ACK_ID;
+         }
+         break;
+      case TP_PARSE_ACK_ID:
+         ret = TunnelProxyParseHex(rs, ';', MAX_INT32, &offset);
+         if (ret <= 0) {
+            break;
+         }
+         inChunk->ackId = offset;
+         if (inChunk->type == TP_CHUNK_TYPE_ACK) {
+            DEBUG_DATA(("RECV-ACK(ackId=%d)\n", inChunk->ackId));
+            rs->parseState = httpChunked ? TP_PARSE_HTTP_END : TP_PARSE_DONE;
+         } else if (inChunk->type == TP_CHUNK_TYPE_DATA) {
+            rs->parseState = TP_PARSE_CHANNEL_ID;
+         } else {
+            rs->parseState = TP_PARSE_HDR_LEN;
+         }
+         break;
+      case TP_PARSE_CHANNEL_ID:
+         ret = TunnelProxyParseHex(rs, ';', MAX_INT32, &offset);
+         if (ret > 0) {
+            inChunk->channelId = offset;
+            rs->parseState = TP_PARSE_BODY_LEN;
+         }
+         break;
+      case TP_PARSE_HDR_LEN:
+         ret = TunnelProxyParseHex(rs, ';', TP_CHUNK_MAXLEN,
+                                   &rs->parseHdrLen);
+         if (ret > 0) {
+            rs->parseState = TP_PARSE_HDR;
+         }
+         break;
+      case TP_PARSE_HDR: {
+         TunnelProxyMsg hdr;
+         const char *msgId = NULL;
+
+         ret = TunnelProxyParseStr(rs, rs->parseHdrLen, &offset);
+         if (ret <= 0) {
+            break;
+         }
+         TunnelProxy_ParseMsg(&hdr, &rs->readBuf->data[rs->readChunkStart +
+                                                       offset],
+                              rs->parseHdrLen);
+         if (!TunnelProxy_MsgGet(&hdr, "messageType=S", &msgId, NULL)) {
+            Log("Invalid messageType in tunnel message header!\n");
+            TunnelProxy_MsgDestroy(&hdr);
+            ret = -1;
+            break;
+         }
+         Str_Strcpy(inChunk->msgId, msgId, TP_MSGID_MAXLEN);
+         TunnelProxy_MsgDestroy(&hdr);
+         rs->parseState = TP_PARSE_BODY_LEN;
+         break;
+      }
+      case TP_PARSE_BODY_LEN:
+         ret = TunnelProxyParseHex(rs, ';', TP_CHUNK_MAXLEN, &inChunk->len);
+         if (ret > 0) {
+            if (!httpChunked) {
+               TunnelProxyRecvReserve(rs, rs->readPos - rs->readChunkStart +
+                                      inChunk->len + 1);
+            }
+            rs->parseState = TP_PARSE_BODY;
+         }
+         break;
+      case TP_PARSE_BODY:
+         ret = TunnelProxyParseStr(rs, inChunk->len, &rs->parseBodyOffset);
+         if (ret > 0) {
+            rs->parseState = httpChunked ? TP_PARSE_HTTP_END : TP_PARSE_DONE;
+         }
+         break;
+      case TP_PARSE_HTTP_END:
+         if (avail < 2) {
+            ret = 0;
+            break;
+         }
+         if (rs->readBuf->data[rs->readPos] != '\r' ||
+             rs->readBuf->data[rs->readPos + 1] != '\n') {
+            Log("Invalid HTTP chunk terminator.\n");
+            ret = -1;
+            break;
+         }
+
+         /* Move past trailing \r\n */
+         rs->readPos += 2;
+         rs->parseState = TP_PARSE_DONE;
+         break;
+      case TP_PARSE_DONE:
+         *chunk = *inChunk;
+         if (chunk->type != TP_CHUNK_TYPE_ACK) {
+            chunk->recvBuf = rs->readBuf;
+            chunk->body = &rs->readBuf->data[rs->readChunkStart +
+                                             rs->parseBodyOffset];
+         }
+
+         if (chunk->type == TP_CHUNK_TYPE_MESSAGE) {
+            DEBUG_DATA(("RECV-MSG(id=%d, ack=%d, msgid=%s, length=%d): "
+                        "%.*s\n", chunk->chunkId, chunk->ackId,
+                        chunk->msgId, chunk->len, chunk->len, chunk->body));
+         } else if (chunk->type == TP_CHUNK_TYPE_DATA) {
+            DEBUG_DATA(("RECV-DATA(id=%d, ack=%d, channel=%d, length=%d)\n",
+                        chunk->chunkId, chunk->ackId, chunk->channelId,
+                        chunk->len));
+         }
+
+         memset(inChunk, 0, sizeof(*inChunk));
+         rs->readChunkStart = rs->readPos;
+         rs->parseState = TP_PARSE_HTTP_LEN;
+         return TRUE;
+      case TP_PARSE_INVALID:
+         ret = -1;
+         break;
+      default:
+         NOT_REACHED();
+      }
+   }
+
+   if (ret < 0) {
+      rs->parseState = TP_PARSE_INVALID;
+   }
+   return FALSE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyHandleInChunk --
+ *
+ *       Processes the next chunk in the incoming chunk queue.  If the chunk
+ *       is an Ack, a message in the outgoing needs-ACK queue with the
+ *       corresponding chunkId is found and freed.  If a Message chunk, a
+ *       handler for the chunk's msgId header is found and invoked with the
+ *       chunk data.  If a data chunk, the socket channel with the
+ *       corresponding channelId is located and the chunk data written to the
+ *       socket using AsyncSocket_Send.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyHandleInChunk(TunnelProxy *tp, // IN
+                         TPChunk *chunk)  // IN
+{
+   ListItem *li;
+   ListItem *liNext;
+
+   ASSERT(tp);
+   ASSERT(chunk);
+
+   if (chunk->chunkId > 0) {
+      if (chunk->chunkId <= tp->lastChunkIdSeen) {
+         /* This chunk has been replayed... skip it. */
+         Log("Skipping replayed chunk ID '%d'.\n", chunk->chunkId);
+         return;
+      }
+      tp->lastChunkIdSeen = chunk->chunkId;
+   }
+   tp->stats.chunksIn++;
+   tp->stats.bytesIn += chunk->len;
+
+   if (chunk->ackId > 0) {
+      VmTimeType sentTime = 0;
+      uint64 deliveredAtSend = 0;
+
+      if (chunk->ackId > tp->lastChunkIdSent) {
+         Log("Unknown ACK ID '%d' in received tunnel message.\n", chunk->ackId);
+      }
+
+      LIST_SCAN_SAFE(li, liNext, tp->queueOutNeedAck) {
+         TPChunk *outChunk = LIST_CONTAINER(li, TPChunk, list);
+         ASSERT(outChunk);
+
+         /* queueOutNeedAck is sorted in ascending chunk ID order. */
+         if (chunk->ackId >= outChunk->chunkId) {
+            if (outChunk->type != TP_CHUNK_TYPE_ACK) {
+               ASSERT(tp->needAckCnt > 0);
+               tp->needAckCnt--;
+               tp->bytesDelivered += outChunk->len;
+               tp->chunksDelivered++;
+               sentTime = outChunk->sentTime;
+               deliveredAtSend = outChunk->deliveredAtSend;
+            }
+            tp->replayBytes -= outChunk->len;
+            TunnelProxyFreeChunk(outChunk, &tp->queueOutNeedAck);
+         } else {
+            break;
+         }
+      }
+
+      /* Sample the round trip of the newest chunk acknowledged. */
+      if (sentTime > 0) {
+         VmTimeType now = Hostinfo_SystemTimerUS();
+         TunnelProxyUpdateWindow(tp, now, now - sentTime,
+                                 tp->bytesDelivered - deliveredAtSend);
+      }
+
+      /* ACK chunks are not ordered with the rest across stripes. */
+      tp->lastChunkAckSeen = MAX(tp->lastChunkAckSeen, chunk->ackId);
+   }
+
+   switch (chunk->type) {
+   case TP_CHUNK_TYPE_MESSAGE: {
+      Bool found = FALSE;
+
+      ASSERT(chunk->msgId);
+      LIST_SCAN_SAFE(li, liNext,
+                     tp->msgHandlers[TunnelProxyHashName(chunk->msgId)]) {
+         TPMsgHandler *handler = LIST_CONTAINER(li, TPMsgHandler, list);
+
+         if (Str_Strcasecmp(handler->msgId, chunk->msgId) == 0) {
+            ASSERT(handler->cb);
+            found = TRUE;
+            if (handler->cb(tp, chunk->msgId, chunk->body, chunk->len,
+                            handler->userData)) {
+               /* True means the handler handled the message, so stop here. */
+               break;
+            }
+         }
+      }
+
+      if (!found) {
+         DEBUG_MSG(("Unhandled message type '%s' received.\n", chunk->msgId));
+      }
+      break;
+   }
+   case TP_CHUNK_TYPE_DATA: {
+      TPChannel *channel = TunnelProxyLookupChannel(tp, chunk->channelId);
+      char *body = chunk->body;
+      int bodyLen = chunk->len;
+
+      if (!channel) {
+         DEBUG_MSG(("Data received for unknown channel id '%d'.\n",
+                    chunk->channelId));
+         break;
+      }
+      channel->chunksIn++;
+
+      if (channel->deflating) {
+         char encoding = chunk->len > 0 ? chunk->body[0] : 0;
+
+         /* Skip the TPDataEncoding byte. */
+         body++;
+         bodyLen--;
+
+         if (encoding == TP_DATA_DEFLATED &&
+             TunnelProxyInflateData(tp, channel, body, bodyLen)) {
+            break;
+         } else if (encoding != TP_DATA_RAW) {
+            Log("Invalid compressed data for channel \"%d\".\n",
+                chunk->channelId);
+            TunnelProxy_CloseChannel(tp, chunk->channelId);
+            break;
+         }
+      }
+
+      /*
+       * Send the body straight out of the readBuf, which must stay put
+       * until the send completes.
+       */
+      channel->bytesIn += bodyLen;
+      AsyncSocket_SendBuf(channel->socket, &chunk->recvBuf->owner, body,
+                          bodyLen);
+      break;
+   }
+   case TP_CHUNK_TYPE_ACK:
+      /* Let the common ACK handling happen */
+      break;
+   default:
+      NOT_IMPLEMENTED();
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyOrderInChunk --
+ *
+ *       Pass a parsed chunk to TunnelProxyHandleInChunk in chunkId order.
+ *       On a striped session, a chunk that overtook a lower chunkId sent on
+ *       another stripe is copied to recvHeld, keeping its body in place in
+ *       the readBuf, and is handled once the chunks before it are.
+ *
+ * Results:
+ *       FALSE if the chunk would be held and TP_MAX_HELD chunks already are.
+ *
+ * Side effects:
+ *       May handle held chunks.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyOrderInChunk(TunnelProxy *tp, // IN
+                        TPChunk *chunk)  // IN
+{
+   ListItem *li;
+
+   if (tp->stripes > 1 && chunk->chunkId > tp->lastChunkIdSeen + 1) {
+      TPChunk *held;
+
+      if (tp->recvHeldCnt >= TP_MAX_HELD) {
+         Log("Tunnel chunk %u is %u chunks ahead of order, with %u held "
+             "already.\n", chunk->chunkId,
+             chunk->chunkId - tp->lastChunkIdSeen - 1, tp->recvHeldCnt);
+         return FALSE;
+      }
+
+      held = Util_SafeMalloc(sizeof *held);
+
+      *held = *chunk;
+      if (held->recvBuf) {
+         held->recvBuf->owner.refCount++;
+      }
+      tp->stats.reordered++;
+
+      LIST_SCAN(li, tp->recvHeld) {
+         if (LIST_CONTAINER(li, TPChunk, list)->chunkId > held->chunkId) {
+            break;
+         }
+      }
+      if (!li) {
+         LIST_QUEUE(&held->list, &tp->recvHeld);
+      } else if (li == tp->recvHeld) {
+         LIST_PUSH(&held->list, &tp->recvHeld);
+      } else {
+         /* Queueing on a list headed by li links held in just before it. */
+         LIST_QUEUE(&held->list, &li);
+      }
+      tp->recvHeldCnt++;
+      return TRUE;
+   }
+
+   TunnelProxyHandleInChunk(tp, chunk);
+
+   while (tp->recvHeld) {
+      TPChunk *held = LIST_CONTAINER(tp->recvHeld, TPChunk, list);
+
+      if (held->chunkId > tp->lastChunkIdSeen + 1) {
+         break;
+      }
+      LIST_DEL(&held->list, &tp->recvHeld);
+      tp->recvHeldCnt--;
+      TunnelProxyHandleInChunk(tp, held);
+      if (held->recvBuf) {
+         TunnelProxyReleaseRecvBuf(held->recvBuf);
+      }
+      free(held);
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyResetRecv --
+ *
+ *       Drop all inbound data, held chunks and parser state, for a new
+ *       connection or before freeing the TunnelProxy.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyResetRecv(TunnelProxy *tp) // IN
+{
+   ListItem *li;
+   ListItem *liNext;
+   int i;
+
+   LIST_SCAN_SAFE(li, liNext, tp->recvHeld) {
+      TPChunk *held = LIST_CONTAINER(li, TPChunk, list);
+
+      LIST_DEL(&held->list, &tp->recvHeld);
+      if (held->recvBuf) {
+         TunnelProxyReleaseRecvBuf(held->recvBuf);
+      }
+      free(held);
+   }
+   tp->recvHeldCnt = 0;
+
+   for (i = 0; i < TP_MAX_STRIPES; i++) {
+      TPRecvStream *rs = &tp->recv[i];
+
+      if (rs->readBuf) {
+         TunnelProxyReleaseRecvBuf(rs->readBuf);
+      }
+      memset(rs, 0, sizeof *rs);
+      rs->parseState = TP_PARSE_HTTP_LEN;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyProcessRecv --
+ *
+ *       Parse and handle all complete chunks in a stripe's readBuf.  Parsing
+ *       picks up where the previous call stopped, so partial chunk data
+ *       already in the readBuf is not looked at again.
+ *
+ *       TunnelProxyOrderInChunk is called for each chunk as it completes.
+ *       Malformed input, or a chunk too far ahead of order, disconnects the
+ *       tunnel.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Many.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyProcessRecv(TunnelProxy *tp,  // IN
+                       TPRecvStream *rs, // IN
+                       Bool httpChunked) // IN
+{
+   Bool chunkRead = FALSE;
+   TPChunk chunk;
+
+   ASSERT(tp);
+   ASSERT(rs);
+
+   while (TunnelProxyParseChunk(rs, httpChunked, &chunk)) {
+      if (!TunnelProxyOrderInChunk(tp, &chunk)) {
+         rs->parseState = TP_PARSE_INVALID;
+         break;
+      }
+      chunkRead = TRUE;
+   }
+
+   if (rs->parseState == TP_PARSE_INVALID) {
+      char *msg;
+
+      /* Nothing more is parsed, so don't let input pile up behind it. */
+      rs->readBuf->len = rs->readChunkStart;
+      rs->readPos = rs->readChunkStart;
+
+      Log("Tunnel stream %d has a protocol error, disconnecting.\n",
+          (int)(rs - tp->recv));
+      msg = Msg_GetString(MSGID("cdk.linuxTunnel.protocolError")
+                          "Client disconnected following a tunnel protocol "
+                          "error.");
+      TunnelProxyDisconnect(tp, msg, FALSE, TRUE);
+      free(msg);
+      return;
+   }
+
+   /*
+    * Everything has been handled, so just rewind instead of moving data,
+    * unless chunk bodies are still being sent out of, or held in, the
+    * readBuf.
+    */
+   if (rs->readBuf && rs->readBuf->owner.refCount == 1 &&
+       rs->readChunkStart == rs->readBuf->len) {
+      rs->readBuf->len = 0;
+      rs->readPos = 0;
+      rs->readChunkStart = 0;
+   }
+
+   if (!chunkRead) {
+      return;
+   }
+
+   if (tp->resetTime) {
+      tp->stats.reconnects++;
+      tp->stats.reconnectUsec = Hostinfo_SystemTimerUS() - tp->resetTime;
+      tp->stats.reconnectTotalUsec += tp->stats.reconnectUsec;
+      tp->resetTime = 0;
+      Log("Tunnel reconnected in %"FMT64"ums.\n",
+          tp->stats.reconnectUsec / 1000);
+   }
+
+   /*
+    * Proof of contact.  The heartbeat timer checks this lazily when it
+    * fires, so nothing is re-armed here.
+    */
+   tp->lastRecvTime = Hostinfo_SystemTimerUS();
+
+   /* Toggle flow control if needed */
+   if (TunnelProxyUpdateFlowControl(tp)) {
+      TunnelProxyFireSendNeeded(tp);
+   }
+
+   /* Queue new ACK if we haven't sent one in a while */
+   if (tp->lastChunkIdSeen - tp->lastChunkAckSent >= TP_MAX_UNACKNOWLEDGED) {
+      DEBUG_MSG(("Recv'd %d unacknowledged chunks.  Sending ACK chunk.\n",
+                 TP_MAX_UNACKNOWLEDGED));
+      TunnelProxyCancelAckTimer(tp);
+      tp->stats.acksByCount++;
+      TunnelProxySendChunk(tp, TP_CHUNK_TYPE_ACK, 0, NULL, NULL, 0);
+   } else if (tp->lastChunkIdSeen > tp->lastChunkAckSent &&
+              !tp->ackTimerSet && tp->ackDelay > 0) {
+      /* Don't leave the server waiting on an ACK until the next chunk. */
+      Poll_CB_RTime(TunnelProxyAckTimeoutCb, tp, tp->ackDelay * 1000, FALSE,
+                    NULL);
+      tp->ackTimerSet = TRUE;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPRecv --
+ *
+ *       Process incoming tunnel data read from an unknown HTTP source.
+ *       The stripe is 0 for the main connection, or the index passed to
+ *       TunnelProxy_GetStripeUrl for the connection the data came from.
+ *
+ *       Copies the buffer data to the stripe's readBuf, and calls
+ *       TunnelProxyProcessRecv to parse and handle it.  Callers that can
+ *       read straight into the readBuf should use
+ *       TunnelProxy_HTTPRecvGetBuf and TunnelProxy_HTTPRecvCommit instead.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Many.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelProxy_HTTPRecv(TunnelProxy *tp,  // IN
+                     int stripe,       // IN
+                     const char *buf,  // IN
+                     int bufSize,      // IN
+                     Bool httpChunked) // IN
+{
+   ASSERT(tp);
+   ASSERT(buf && bufSize > 0);
+
+   while (bufSize > 0) {
+      int recvSize = 0;
+      char *recvBuf = TunnelProxy_HTTPRecvGetBuf(tp, stripe, &recvSize);
+
+      recvSize = MIN(recvSize, bufSize);
+      memcpy(recvBuf, buf, recvSize);
+      TunnelProxy_HTTPRecvCommit(tp, stripe, recvSize, httpChunked);
+
+      buf += recvSize;
+      bufSize -= recvSize;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPRecvGetBuf --
+ *
+ *       Get the free space at the end of the stripe's readBuf, for the
+ *       caller to read incoming tunnel data into directly.  The data is
+ *       then processed by TunnelProxy_HTTPRecvCommit.
+ *
+ *       The partially parsed chunk is moved to the front of the readBuf
+ *       only when little space is left and it is small.
+ *
+ * Results:
+ *       Pointer to the free space, with its size in the bufSize param.
+ *
+ * Side effects:
+ *       May compact or grow the readBuf.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+TunnelProxy_HTTPRecvGetBuf(TunnelProxy *tp, // IN
+                           int stripe,      // IN
+                           int *bufSize)    // OUT
+{
+   TPRecvStream *rs;
+   TPRecvBuf *recvBuf;
+
+   ASSERT(tp);
+   ASSERT(stripe >= 0 && stripe < tp->stripes);
+   ASSERT(bufSize);
+
+   rs = &tp->recv[stripe];
+   recvBuf = rs->readBuf;
+   if (!recvBuf) {
+      TunnelProxyRecvCompact(rs, TP_RECV_BUFSIZE);
+   } else if (recvBuf->size - recvBuf->len < TP_RECV_MINSPACE) {
+      int pending = recvBuf->len - rs->readChunkStart;
+
+      if (pending <= TP_RECV_MINSPACE || recvBuf->size == recvBuf->len) {
+         TunnelProxyRecvCompact(rs, pending + TP_RECV_MINSPACE);
+      }
+   }
+
+   recvBuf = rs->readBuf;
+   *bufSize = recvBuf->size - recvBuf->len;
+   return &recvBuf->data[recvBuf->len];
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPRecvCommit --
+ *
+ *       Process len bytes of incoming tunnel data that the caller has read
+ *       into the buffer returned by TunnelProxy_HTTPRecvGetBuf.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Many.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelProxy_HTTPRecvCommit(TunnelProxy *tp,  // IN
+                           int stripe,       // IN
+                           int len,          // IN
+                           Bool httpChunked) // IN
+{
+   TPRecvStream *rs;
+
+   ASSERT(tp);
+   ASSERT(stripe >= 0 && stripe < tp->stripes);
+
+   rs = &tp->recv[stripe];
+   ASSERT(rs->readBuf);
+   ASSERT(len > 0 && rs->readBuf->len + len <= rs->readBuf->size);
+
+   rs->readBuf->len += len;
+
+   TunnelProxyProcessRecv(tp, rs, httpChunked);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyNextDataChunk --
+ *
+ *       Pick the next DATA chunk to send by deficit round robin.  The channel
+ *       at the head of activeChannels gets its quantum when its turn starts,
+ *       and keeps the turn while its next chunk fits in its deficit.
+ *
+ * Results:
+ *       The chunk, still queued, or NULL if no channel has data.
+ *
+ * Side effects:
+ *       May rotate activeChannels.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TPChunk *
+TunnelProxyNextDataChunk(TunnelProxy *tp) // IN
+{
+   ASSERT(tp);
+
+   while (tp->activeChannels) {
+      TPChannel *channel = LIST_CONTAINER(tp->activeChannels, TPChannel,
+                                          activeList);
+      TPChunk *chunk;
+
+      ASSERT(channel->queueOut);
+      chunk = LIST_CONTAINER(channel->queueOut, TPChunk, list);
+
+      if (!tp->activeTurnStarted) {
+         channel->deficit += channel->quantum;
+         tp->activeTurnStarted = TRUE;
+      }
+      if (chunk->len <= channel->deficit) {
+         return chunk;
+      }
+
+      tp->activeChannels = tp->activeChannels->next;
+      tp->activeTurnStarted = FALSE;
+   }
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyNextOutChunk --
+ *
+ *       Pick the next chunk to send.  Chunks on the TunnelProxy's queue go
+ *       first, in order, then DATA chunks from channel queues.  While flow
+ *       control is on, no DATA chunk is sent: the TunnelProxy's queue is
+ *       held at its first DATA chunk, which keeps resent chunks in chunk ID
+ *       order and a closing channel's DATA ahead of its LOWER message, and
+ *       only the queued ACK chunk may pass.
+ *
+ * Results:
+ *       The chunk, still queued, or NULL if nothing may be sent.
+ *
+ * Side effects:
+ *       May rotate activeChannels.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TPChunk *
+TunnelProxyNextOutChunk(TunnelProxy *tp) // IN
+{
+   ASSERT(tp);
+
+   if (tp->queueOut) {
+      TPChunk *chunk = LIST_CONTAINER(tp->queueOut, TPChunk, list);
+
+      if (chunk->type == TP_CHUNK_TYPE_DATA && tp->flowStopped) {
+         return tp->ackChunk;
+      }
+      return chunk;
+   }
+
+   return tp->flowStopped ? NULL : TunnelProxyNextDataChunk(tp);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyDequeueChunk --
+ *
+ *       Remove a chunk returned by TunnelProxyPopOutChunk from the queue it
+ *       was picked from, charging DATA chunks to their channel's deficit.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       The channel leaves activeChannels once its queue is empty.  Reads
+ *       from the channel socket restart if they were stopped and the queue
+ *       is down to lowWater.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyDequeueChunk(TunnelProxy *tp,  // IN
+                        TPChunk *chunk)   // IN
+{
+   TPChannel *channel = chunk->channel;
+
+   ASSERT(tp);
+
+   if (!channel) {
+      LIST_DEL(&chunk->list, &tp->queueOut);
+      return;
+   }
+
+   ASSERT(tp->activeChannels == &channel->activeList);
+   channel->deficit -= chunk->len;
+   channel->queuedBytes -= chunk->len;
+   LIST_DEL(&chunk->list, &channel->queueOut);
+   chunk->channel = NULL;
+
+   if (channel->recvPaused && channel->queuedBytes <= tp->lowWater) {
+      DEBUG_MSG(("Resuming reads from channel \"%d\".\n",
+                 channel->channelId));
+      channel->recvPaused = FALSE;
+      AsyncSocket_ResumeRecv(channel->socket);
+   }
+
+   if (!channel->queueOut) {
+      LIST_DEL(&channel->activeList, &tp->activeChannels);
+      channel->deficit = 0;
+      tp->activeTurnStarted = FALSE;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyFlushChannel --
+ *
+ *       Move a closing channel's queued DATA chunks, and its open chunk if
+ *       any, to the end of the TunnelProxy's outgoing queue, so they go out
+ *       ahead of anything queued after them, such as the channel's LOWER
+ *       message.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       The channel leaves activeChannels.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyFlushChannel(TunnelProxy *tp,      // IN
+                        TPChannel *channel)   // IN
+{
+   ListItem *li;
+   ListItem *liNext;
+
+   ASSERT(tp);
+   ASSERT(channel);
+
+   TunnelProxyCloseOpenChunk(tp, channel);
+
+   if (!channel->queueOut) {
+      return;
+   }
+
+   if (tp->activeChannels == &channel->activeList) {
+      tp->activeTurnStarted = FALSE;
+   }
+   LIST_DEL(&channel->activeList, &tp->activeChannels);
+
+   LIST_SCAN_SAFE(li, liNext, channel->queueOut) {
+      TPChunk *chunk = LIST_CONTAINER(li, TPChunk, list);
+      LIST_DEL(&chunk->list, &channel->queueOut);
+      chunk->channel = NULL;
+      LIST_QUEUE(&chunk->list, &tp->queueOut);
+   }
+   channel->queuedBytes = 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyGetPriority --
+ *
+ *       Look up the output priority class for a port name in the
+ *       view.tunnel.priority.<portName> preference.
+ *
+ * Results:
+ *       TPPriority, TP_PRIORITY_NORMAL if unset or unknown.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TPPriority
+TunnelProxyGetPriority(const char *portName) // IN
+{
+   char prefName[sizeof TP_PRIORITY_PREF + TP_PORTNAME_MAXLEN];
+   TPPriority priority = TP_PRIORITY_NORMAL;
+   char *value;
+
+   Str_Sprintf(prefName, sizeof prefName, TP_PRIORITY_PREF, portName);
+   value = Preference_GetString(NULL, prefName);
+   if (!value) {
+      return priority;
+   }
+
+   if (Str_Strcasecmp(value, "high") == 0) {
+      priority = TP_PRIORITY_HIGH;
+   } else if (Str_Strcasecmp(value, "low") == 0) {
+      priority = TP_PRIORITY_LOW;
+   } else if (Str_Strcasecmp(value, "normal") != 0) {
+      Log("Unknown %s value \"%s\", using \"normal\".\n", prefName, value);
+   }
+   free(value);
+
+   return priority;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyGetCoalesceUsec --
+ *
+ *       Look up how long a channel's small writes may be held for coalescing
+ *       in the view.tunnel.coalesce.<portName> preference.
+ *
+ * Results:
+ *       Microseconds, 0 if coalescing is off for the port.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+TunnelProxyGetCoalesceUsec(const char *portName) // IN
+{
+   char prefName[sizeof TP_COALESCE_PREF + TP_PORTNAME_MAXLEN];
+   int32 usec;
+
+   Str_Sprintf(prefName, sizeof prefName, TP_COALESCE_PREF, portName);
+   usec = Preference_GetLong(0, prefName);
+   if (usec < 0) {
+      usec = 0;
+   } else if (usec > TP_COALESCE_MAX_USEC) {
+      Log("Limiting %s to %d usec.\n", prefName, TP_COALESCE_MAX_USEC);
+      usec = TP_COALESCE_MAX_USEC;
+   }
+
+   return usec;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyGetCompress --
+ *
+ *       Look up whether to offer compression for a port name's channels in
+ *       the view.tunnel.compress.<portName> preference.
+ *
+ * Results:
+ *       TRUE if compression should be offered, FALSE by default.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyGetCompress(const char *portName) // IN
+{
+   char prefName[sizeof TP_COMPRESS_PREF + TP_PORTNAME_MAXLEN];
+
+   Str_Sprintf(prefName, sizeof prefName, TP_COMPRESS_PREF, portName);
+   return Preference_GetBool(FALSE, prefName);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyPopOutChunk --
+ *
+ *       Take the next sendable chunk off the outgoing chunk queue and format
+ *       its header into hdr, which must hold TP_CHUNK_HDR_MAXLEN bytes.  The
+ *       serialized chunk is the header, followed by the chunk body, followed
+ *       by the returned trailer string.  If httpChunked is TRUE, the header
+ *       includes the HTTP chunk size line and the trailer ends the HTTP
+ *       chunk.  The chunk is picked by TunnelProxyNextOutChunk.
+ *
+ *       If the outgoing chunk doesn't have an ackId field set, the last chunk
+ *       ID seen is acknowledged in it.
+ *
+ *       Once processed the chunk is moved to the outgoing needs-ACK queue.
+ *
+ * Results:
+ *       The chunk, or NULL if there is nothing to send.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static TPChunk *
+TunnelProxyPopOutChunk(TunnelProxy *tp,      // IN
+                       Bool httpChunked,     // IN
+                       char *hdr,            // OUT
+                       int *hdrLen,          // OUT
+                       const char **trailer) // OUT
+{
+   TPChunk *chunk = NULL;
+   char msg[TP_CHUNK_HDR_MAXLEN];
+   int msgLen = 0;
+
+   ASSERT(tp);
+   ASSERT(hdr);
+   ASSERT(hdrLen);
+   ASSERT(trailer);
+
+   chunk = TunnelProxyNextOutChunk(tp);
+   if (!chunk) {
+      return NULL;
+   }
+
+   /*
+    * Assign the next chunk ID if this is not an ACK or a resent chunk
+    * following a reconnect.
+    */
+   if (chunk->chunkId == 0 && chunk->type != TP_CHUNK_TYPE_ACK) {
+      chunk->chunkId = ++tp->lastChunkIdSent;
+   }
+   tp->stats.chunksOut++;
+   tp->stats.bytesOut += chunk->len;
+   if (chunk->type != TP_CHUNK_TYPE_ACK) {
+      chunk->sentTime = Hostinfo_SystemTimerUS();
+      chunk->deliveredAtSend = tp->bytesDelivered;
+   } else {
+      /* A queued ACK is cancelled whenever another chunk carries it. */
+      ASSERT(chunk == tp->ackChunk);
+      ASSERT(tp->lastChunkAckSent < tp->lastChunkIdSeen);
+      tp->ackChunk = NULL;
+   }
+   if (tp->lastChunkAckSent < tp->lastChunkIdSeen) {
+      chunk->ackId = tp->lastChunkIdSeen;
+      tp->lastChunkAckSent = chunk->ackId;
+      if (chunk->type != TP_CHUNK_TYPE_ACK) {
+         tp->stats.acksPiggyback++;
+      }
+      TunnelProxyCancelAckTimer(tp);
+   }
+   if (chunk != tp->ackChunk && tp->ackChunk) {
+      ASSERT(chunk->type != TP_CHUNK_TYPE_ACK);
+      TunnelProxyFreeChunk(tp->ackChunk, &tp->queueOut);
+      tp->ackChunk = NULL;
+   }
+
+   switch (chunk->type) {
+   case TP_CHUNK_TYPE_MESSAGE: {
+      char msgIdEncoded[TP_MSGID_MAXLEN * 2];
+      size_t msgIdEncodedLen = 0;
+
+      /* Same header TunnelProxy_FormatMsg builds for "messageType=S". */
+      if (!Base64_Encode((uint8 *)chunk->msgId, strlen(chunk->msgId),
+                         msgIdEncoded, sizeof(msgIdEncoded),
+                         &msgIdEncodedLen)) {
+         Log("Failed to create tunnel msg header chunkId=%d.\n",
+             chunk->chunkId);
+         return NULL;
+      }
+      msgLen = Str_Sprintf(msg, sizeof(msg),
+                           "M;%X;%.0X;%X;messageType=S:%s|;%X;",
+                           chunk->chunkId, chunk->ackId,
+                           (int)msgIdEncodedLen + 15, msgIdEncoded,
+                           chunk->len);
+      *trailer = httpChunked ? ";\r\n" : ";";
+
+      DEBUG_DATA(("SEND-MSG(id=%d, ack=%d, msgid=%s, length=%d): %.*s\n",
+                  chunk->chunkId, chunk->ackId,
+                  chunk->msgId,
+                  chunk->len, chunk->len, chunk->body));
+      break;
+   }
+   case TP_CHUNK_TYPE_DATA:
+      msgLen = Str_Sprintf(msg, sizeof(msg), "D;%X;%.0X;%X;%X;",
+                           chunk->chunkId, chunk->ackId, chunk->channelId,
+                           chunk->len);
+      *trailer = httpChunked ? ";\r\n" : ";";
+
+      DEBUG_DATA(("SEND-DATA(id=%d, ack=%d, channel=%d, length=%d)\n",
+                  chunk->chunkId, chunk->ackId, chunk->channelId, chunk->len));
+      break;
+   case TP_CHUNK_TYPE_ACK:
+      ASSERT(chunk->ackId > 0);
+      ASSERT(chunk->len == 0);
+      msgLen = Str_Sprintf(msg, sizeof(msg), "A;%X;", chunk->ackId);
+      *trailer = httpChunked ? "\r\n" : "";
+
+      DEBUG_DATA(("SEND-ACK(ackId=%d)\n", chunk->ackId));
+      break;
+   default:
+      NOT_REACHED();
+   }
+
+   if (httpChunked) {
+      /* The HTTP chunk covers everything but the trailing CRLF. */
+      *hdrLen = Str_Sprintf(hdr, TP_CHUNK_HDR_MAXLEN, "%X\r\n%s",
+                            msgLen + chunk->len + (int)strlen(*trailer) - 2,
+                            msg);
+   } else {
+      memcpy(hdr, msg, msgLen);
+      *hdrLen = msgLen;
+   }
+
+   /*
+    * Move outgoing Data/Message chunk to need-ACK outgoing list.
+    * TunnelProxyHandleInChunk assumes queueOutNeedAck is sorted by
+    * ascending chunk ID, so queue at the end.
+    */
+   TunnelProxyDequeueChunk(tp, chunk);
+   LIST_QUEUE(&chunk->list, &tp->queueOutNeedAck);
+   tp->replayBytes += chunk->len;
+   tp->stats.replayBytesPeak = MAX(tp->stats.replayBytesPeak,
+                                   tp->replayBytes);
+   if (chunk->type != TP_CHUNK_TYPE_ACK) {
+      tp->needAckCnt++;
+      /* Stop sending DATA as soon as the window fills. */
+      TunnelProxyUpdateFlowControl(tp);
+   }
+
+   return chunk;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyWriteNextOutChunk --
+ *
+ *       Serialize the next chunk in the outgoing chunk queue into the
+ *       TunnelProxy's writeBuf.
+ *
+ * Results:
+ *       TRUE if a chunk was written successfully, FALSE otherwise.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyWriteNextOutChunk(TunnelProxy *tp,  // IN
+                             Bool httpChunked) // IN
+{
+   TPChunk *chunk;
+   char hdr[TP_CHUNK_HDR_MAXLEN];
+   int hdrLen = 0;
+   const char *trailer = NULL;
+
+   ASSERT(tp);
+
+   chunk = TunnelProxyPopOutChunk(tp, httpChunked, hdr, &hdrLen, &trailer);
+   if (!chunk) {
+      return FALSE;
+   }
+
+   DynBuf_Append(&tp->writeBuf, hdr, hdrLen);
+   DynBuf_Append(&tp->writeBuf, chunk->body, chunk->len);
+   DynBuf_Append(&tp->writeBuf, trailer, strlen(trailer));
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPSend --
+ *
+ *       Write outgoing chunk data to the buffer supplied.  The buffer is
+ *       intended to be written to the tunnel server over HTTP.  The buffer
+ *       contents are *not* separated by HTTP chunked encoding.
+ *
+ *       The data written from the writeBuf is removed from the front of the
+ *       writeBuf and the amount of data written returned in the bufSize
+ *       param.
+ *
+ *       TunnelProxyWriteNextOutChunk is called repeatedly to serialize any
+ *       existing or newly queued outgoing chunks.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Many.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelProxy_HTTPSend(TunnelProxy *tp,  // IN
+                     char *buf,        // IN/OUT
+                     int *bufSize,     // IN/OUT
+                     Bool httpChunked) // IN
+{
+   ASSERT(tp);
+   ASSERT(buf && *bufSize > 0);
+
+   /*
+    * If we don't do the HTTP chunked encoding ourselves, the caller has to,
+    * so only serialize a single message at a time so the caller can chunk
+    * encode it.
+    */
+   while (TunnelProxyWriteNextOutChunk(tp, httpChunked) && httpChunked) {
+      /* Do nothing. */
+   }
+
+   *bufSize = MIN(tp->writeBuf.size, *bufSize);
+   memcpy(buf, tp->writeBuf.data, *bufSize);
+
+   /* Shrink the front of the write buffer */
+   memcpy(tp->writeBuf.data, &tp->writeBuf.data[*bufSize],
+          tp->writeBuf.size - *bufSize);
+   tp->writeBuf.size -= *bufSize;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyFreeSendv --
+ *
+ *       Keep a finished TunnelProxySendv handle on the pool's free list for
+ *       the next TunnelProxy_HTTPSendv, or free it if the list is full.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyFreeSendv(TPChunkPool *pool,       // IN
+                     TunnelProxySendv *sendv) // IN
+{
+   if (pool->freeSendvCnt >= TP_SENDV_FREE_MAX) {
+      free(sendv);
+      return;
+   }
+   sendv->next = pool->freeSendvs;
+   pool->freeSendvs = sendv;
+   pool->freeSendvCnt++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPSendv --
+ *
+ *       Zero-copy variant of TunnelProxy_HTTPSend.  Serializes up to
+ *       TP_SENDV_MAXCHUNKS outgoing chunks (only one if httpChunked is
+ *       FALSE, so the caller can chunk encode it) and returns an iovec array
+ *       of header, body and trailer segments.  Chunk bodies are referenced
+ *       in place, and only the small per-chunk headers are formatted.
+ *
+ *       The segments remain valid until TunnelProxy_HTTPSendvComplete is
+ *       called on the returned handle.  Must not be mixed with
+ *       TunnelProxy_HTTPSend, which buffers partial output in the writeBuf.
+ *
+ * Results:
+ *       Handle to pass to TunnelProxy_HTTPSendvComplete, or NULL if there
+ *       is nothing to send.
+ *
+ * Side effects:
+ *       Chunks are moved to the needs-ACK queue.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+TunnelProxySendv *
+TunnelProxy_HTTPSendv(TunnelProxy *tp,     // IN
+                      Bool httpChunked,    // IN
+                      struct iovec **iov,  // OUT
+                      int *iovCnt)         // OUT
+{
+   TunnelProxySendv *sendv;
+   int cnt = 0;
+
+   ASSERT(tp);
+   ASSERT(iov);
+   ASSERT(iovCnt);
+   ASSERT(tp->writeBuf.size == 0);
+
+   *iov = NULL;
+   *iovCnt = 0;
+
+   if (!TunnelProxy_HTTPSendNeeded(tp)) {
+      return NULL;
+   }
+
+   sendv = tp->pool->freeSendvs;
+   if (sendv) {
+      tp->pool->freeSendvs = sendv->next;
+      tp->pool->freeSendvCnt--;
+   } else {
+      sendv = Util_SafeMalloc(sizeof(TunnelProxySendv));
+   }
+   sendv->chunkCnt = 0;
+
+   do {
+      TPChunk *chunk;
+      char *hdr = sendv->hdrs[sendv->chunkCnt];
+      int hdrLen = 0;
+      const char *trailer = NULL;
+
+      chunk = TunnelProxyPopOutChunk(tp, httpChunked, hdr, &hdrLen, &trailer);
+      if (!chunk) {
+         break;
+      }
+
+      chunk->refCount++;
+      sendv->chunks[sendv->chunkCnt++] = chunk;
+
+      sendv->iov[cnt].iov_base = hdr;
+      sendv->iov[cnt++].iov_len = hdrLen;
+      if (chunk->len > 0) {
+         sendv->iov[cnt].iov_base = chunk->body;
+         sendv->iov[cnt++].iov_len = chunk->len;
+      }
+      if (*trailer) {
+         sendv->iov[cnt].iov_base = (char *)trailer;
+         sendv->iov[cnt++].iov_len = strlen(trailer);
+      }
+   } while (httpChunked && sendv->chunkCnt < TP_SENDV_MAXCHUNKS);
+
+   if (sendv->chunkCnt == 0) {
+      TunnelProxyFreeSendv(tp->pool, sendv);
+      return NULL;
+   }
+
+   *iov = sendv->iov;
+   *iovCnt = cnt;
+   return sendv;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPSendvComplete --
+ *
+ *       Release the chunks referenced by a TunnelProxy_HTTPSendv handle once
+ *       its segments have been written (or abandoned), and return the handle
+ *       to the chunks' pool for reuse.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Chunks already acknowledged or freed with the TunnelProxy are freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelProxy_HTTPSendvComplete(TunnelProxySendv *sendv) // IN
+{
+   TPChunkPool *pool;
+   Bool keep;
+   int i;
+
+   ASSERT(sendv);
+   ASSERT(sendv->chunkCnt > 0);
+
+   /*
+    * Releasing the last chunk of an orphaned pool frees it, so only a pool
+    * that is still in use is looked at afterwards.
+    */
+   pool = sendv->chunks[0]->pool;
+   keep = !pool->orphaned;
+
+   for (i = 0; i < sendv->chunkCnt; i++) {
+      TunnelProxyReleaseChunk(sendv->chunks[i]);
+   }
+
+   if (keep) {
+      TunnelProxyFreeSendv(pool, sendv);
+   } else {
+      free(sendv);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxy_HTTPSendNeeded --
+ *
+ *       Determine if TunnelProxy_HTTPSend should be called in order to
+ *       serialize outgoing tunnel chunks, so as to be written over HTTP.
+ *
+ * Results:
+ *       TRUE if there is chunk data to send, FALSE if there's nothing to send.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+TunnelProxy_HTTPSendNeeded(TunnelProxy *tp) // IN
+{
+   ASSERT(tp);
+
+   if (tp->queueOut && tp->flowStopped) {
+      TPChunk *chunk = LIST_CONTAINER(tp->queueOut, TPChunk, list);
+
+      return chunk->type != TP_CHUNK_TYPE_DATA || tp->ackChunk != NULL;
+   }
+   return tp->queueOut || (!tp->flowStopped && tp->activeChannels);
+}
+
+
+/*
+ * Default Msg handler impls
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyEchoRequestCb --
+ *
+ *       ECHO_RQ tunnel msg handler.  Sends an ECHO_RP msg.
+ *
+ * Results:
+ *       TRUE.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyEchoRequestCb(TunnelProxy *tp,   // IN
+                         const char *msgId, // IN
+                         const char *body,  // IN
+                         int len,           // IN
+                         void *userData)    // IN: not used
+{
+   TunnelProxy_SendMsg(tp, TP_MSG_ECHO_RP, NULL, 0);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyEchoReplyCb --
+ *
+ *       ECHO_RP tunnel msg handler.  Takes a round trip time sample for the
+ *       heartbeat, the send window and the stats histogram from the matching
+ *       ECHO_RQ.
+ *
+ * Results:
+ *       TRUE.
+ *
+ * Side effects:
+ *       May resize the send window.  Re-arms the heartbeat timer.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyEchoReplyCb(TunnelProxy *tp,   // IN
+                       const char *msgId, // IN
+                       const char *body,  // IN
+                       int len,           // IN
+                       void *userData)    // IN: not used
+{
+   if (tp->echoSentTime > 0) {
+      VmTimeType now = Hostinfo_SystemTimerUS();
+      VmTimeType rttMs = (now - tp->echoSentTime) / 1000;
+      int bucket = 0;
+
+      while (rttMs > 0 && bucket < TP_STATS_RTT_BUCKETS - 1) {
+         rttMs >>= 1;
+         bucket++;
+      }
+      tp->stats.rttHist[bucket]++;
+
+      TunnelProxyUpdateRtt(tp, now - tp->echoSentTime);
+      TunnelProxyUpdateWindow(tp, now, now - tp->echoSentTime, 0);
+      tp->echoSentTime = 0;
+
+      /*
+       * The heartbeat was waiting on the echo timeout; wait for the next
+       * idle period instead.  Echoes only go out on an idle link, so this
+       * is rare.
+       */
+      if (tp->heartbeatTimerSet) {
+         Poll_CB_RTimeRemove(TunnelProxyHeartbeatCb, tp, FALSE);
+         tp->heartbeatTimerSet = FALSE;
+         TunnelProxyArmHeartbeat(tp, now);
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyStopCb --
+ *
+ *       STOP tunnel msg handler.  Disconnects the TunnelProxy.
+ *
+ * Results:
+ *       TRUE.
+ *
+ * Side effects:
+ *       None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelProxyStopCb(TunnelProxy *tp,   // IN
+                  const char *msgId, // IN
+                  const char *body,  // IN
+                  int len,           // IN
+                  void *userData)    // IN: not used
+{
+   TunnelProxyErr err;
+   TunnelProxyMsg msg;
+   const char *reason = NULL;
+
+   TunnelProxy_ParseMsg(&msg, body, len);
+   TunnelProxy_MsgGet(&msg, "reason=S", &reason, NULL);
+   Warning("TUNNEL STOPPED: %s\n", reason ? reason : "<Invalid Reason>");
+
+   /* Reconnect secret isn't valid after a STOP */
+   free(tp->reconnectSecret);
+   tp->reconnectSecret = NULL;
+
+   err = TunnelProxyDisconnect(tp, reason, TRUE, TRUE);
+   ASSERT(TP_ERR_OK == err);
+
+   TunnelProxy_MsgDestroy(&msg);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyAuthenticatedCb --
+ *
+ *       AUTHENTICATED tunnel msg handler.  Stores reconnection and timeout
+ *       information in the TunnelProxy object, and the number of stripes
+ *       if the server accepted the one requested in START.
+ *
+ * Results:
+ *       TRUE.
  *
  * Side effects:
- *       None.
+ *       May call the stripesCb.
  *
  *-----------------------------------------------------------------------------
  */
 
 static Bool
-TunnelProxyWriteNextOutChunk(TunnelProxy *tp,  // IN
-                             Bool httpChunked) // IN
+TunnelProxyAuthenticatedCb(TunnelProxy *tp,   // IN
+                           const char *msgId, // IN
+                           const char *body,  // IN
+                           int len,           // IN
+                           void *userData)    // IN: not used
 {
-   ListItem *li;
-   TPChunk *chunk = NULL;
-   char *msg = NULL;
-   size_t msgLen = 0;
-
-   ASSERT(tp);
-
-   LIST_SCAN(li, tp->queueOut) {
-      TPChunk *chunkIter = LIST_CONTAINER(li, TPChunk, list);
-      if (!tp->flowStopped || chunkIter->type != TP_CHUNK_TYPE_DATA) {
-         chunk = chunkIter;
-         break;
-      }
-   }
-   if (!chunk) {
-      return FALSE;
-   }
+   TunnelProxyMsg msg;
+   const char *capID = NULL;
+   const char *reconnectSecret = NULL;
+   Bool allowAutoReconnection = FALSE;
+   int stripes = 1;
 
-   /*
-    * Assign the next chunk ID if this is not an ACK or a resent chunk
-    * following a reconnect.
+   /* Ignored body contents:
+    *    "sessionTimeout" long, time until the session will die
     */
-   if (chunk->chunkId == 0 && chunk->type != TP_CHUNK_TYPE_ACK) {
-      chunk->chunkId = ++tp->lastChunkIdSent;
-   }
-   if (tp->lastChunkAckSent < tp->lastChunkIdSeen) {
-      chunk->ackId = tp->lastChunkIdSeen;
-      tp->lastChunkAckSent = chunk->ackId;
+   TunnelProxy_ParseMsg(&msg, body, len);
+   if (!TunnelProxy_MsgGet(&msg,
+                           "allowAutoReconnection=B", &allowAutoReconnection,
+                           "capID=S", &capID,
+                           "lostContactTimeout=L", &tp->lostContactTimeout,
+                           "disconnectedTimeout=L", &tp->disconnectedTimeout,
+                           NULL)) {
+      NOT_IMPLEMENTED();
    }
 
-   switch (chunk->type) {
-   case TP_CHUNK_TYPE_MESSAGE: {
-      char *hdr;
-      int hdrLen = 0;
-      if (!TunnelProxy_FormatMsg(&hdr, &hdrLen, "messageType=S", chunk->msgId,
-                                 NULL)) {
-         Log("Failed to create tunnel msg header chunkId=%d.\n",
-             chunk->chunkId);
-         return FALSE;
-      }
-      msg = Str_Asprintf(&msgLen, "M;%X;%.0X;%X;%.*s;%X;%.*s;", chunk->chunkId,
-                         chunk->ackId, hdrLen, hdrLen, hdr, chunk->len,
-                         chunk->len, chunk->body);
-      free(hdr);
-
-      DEBUG_DATA(("SEND-MSG(id=%d, ack=%d, msgid=%s, length=%d): %.*s\n",
-                  chunk->chunkId, chunk->ackId,
-                  chunk->msgId,
-                  chunk->len, chunk->len, chunk->body));
-      break;
+   if (tp->capID && Str_Strcmp(capID, tp->capID) != 0) {
+      Warning("Tunnel authenticated capID \"%s\" does not match expected "
+              "value \"%s\".\n", capID, tp->capID);
+   } else if (!tp->capID) {
+      tp->capID = Util_SafeStrdup(capID);
    }
-   case TP_CHUNK_TYPE_DATA: {
-      msg = Str_Asprintf(&msgLen, "D;%X;%.0X;%X;%X;", chunk->chunkId,
-                         chunk->ackId, chunk->channelId, chunk->len);
 
-      msg = Util_SafeRealloc(msg, msgLen + chunk->len + 1);
-      memcpy(&msg[msgLen], chunk->body, chunk->len);
-      msg[msgLen + chunk->len] = ';';
-      msgLen += chunk->len + 1;
+   free(tp->reconnectSecret);
+   tp->reconnectSecret = NULL;
 
-      DEBUG_DATA(("SEND-DATA(id=%d, ack=%d, channel=%d, length=%d)\n",
-                  chunk->chunkId, chunk->ackId, chunk->channelId, chunk->len));
-      break;
+   if (allowAutoReconnection) {
+      if (TunnelProxy_MsgGet(&msg, "reconnectSecret=S", &reconnectSecret,
+                             NULL)) {
+         tp->reconnectSecret = Util_SafeStrdup(reconnectSecret);
+      } else {
+         Warning("Tunnel automatic reconnect disabled: no reconnect secret "
+                 "in auth_rp.\n");
+      }
    }
-   case TP_CHUNK_TYPE_ACK:
-      ASSERT(chunk->ackId > 0);
-      msg = Str_Asprintf(&msgLen, "A;%X;", chunk->ackId);
 
-      DEBUG_DATA(("SEND-ACK(ackId=%d)\n", chunk->ackId));
-      break;
-   default:
-      NOT_REACHED();
+   /* Stripe connections are identified by the reconnectSecret. */
+   if (tp->reconnectSecret && tp->stripesWanted > 1 &&
+       TunnelProxy_MsgGet(&msg, "stripes=I", &stripes, NULL)) {
+      tp->stripes = MAX(1, MIN(stripes, tp->stripesWanted));
+      Log("Tunnel striped over %d connections.\n", tp->stripes);
    }
 
-   ASSERT(msg);
+   /* Kick off the heartbeat */
+   TunnelProxyResetTimeouts(tp, TRUE);
 
-   if (httpChunked) {
-      char chunkHdr[32];
-      Str_Sprintf(chunkHdr, sizeof(chunkHdr), "%X\r\n", (int)msgLen);
-      DynBuf_Append(&tp->writeBuf, chunkHdr, strlen(chunkHdr));
-      DynBuf_Append(&tp->writeBuf, msg, msgLen);
-      DynBuf_Append(&tp->writeBuf, "\r\n", 2);
-   } else {
-      DynBuf_Append(&tp->writeBuf, msg, msgLen);
+   if (tp->stripes > 1 && tp->stripesCb) {
+      tp->stripesCb(tp, tp->stripes, tp->stripesCbData);
    }
 
-   /*
-    * Move outgoing Data/Message chunk to need-ACK outgoing list.
-    * TunnelProxyHandleInChunk assumes queueOutNeedAck is sorted by
-    * ascending chunk ID, so queue at the end.
-    */
-   LIST_DEL(&chunk->list, &tp->queueOut);
-   LIST_QUEUE(&chunk->list, &tp->queueOutNeedAck);
-
-   free(msg);
+   TunnelProxy_MsgDestroy(&msg);
    return TRUE;
 }
 
@@ -1873,66 +5039,42 @@ TunnelProxyWriteNextOutChunk(TunnelProxy *tp,  // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_HTTPSend --
- *
- *       Write outgoing chunk data to the buffer supplied.  The buffer is
- *       intended to be written to the tunnel server over HTTP.  The buffer
- *       contents are *not* separated by HTTP chunked encoding.
- *
- *       The data written from the writeBuf is removed from the front of the
- *       writeBuf and the amount of data written returned in the bufSize
- *       param.
+ * TunnelProxyReadyCb --
  *
- *       TunnelProxyWriteNextOutChunk is called repeatedly to serialize any
- *       existing or newly queued outgoing chunks.
+ *       READY tunnel msg handler.  Just prints a message.
  *
  * Results:
- *       None.
+ *       TRUE.
  *
  * Side effects:
- *       Many.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-TunnelProxy_HTTPSend(TunnelProxy *tp,  // IN
-                     char *buf,        // IN/OUT
-                     int *bufSize,     // IN/OUT
-                     Bool httpChunked) // IN
+static Bool
+TunnelProxyReadyCb(TunnelProxy *tp,   // IN: not used
+                   const char *msgId, // IN: not used
+                   const char *body,  // IN: not used
+                   int len,           // IN: not used
+                   void *userData)    // IN: not used
 {
-   ASSERT(tp);
-   ASSERT(buf && *bufSize > 0);
-
-   /*
-    * If we don't do the HTTP chunked encoding ourselves, the caller has to,
-    * so only serialize a single message at a time so the caller can chunk
-    * encode it.
-    */
-   while (TunnelProxyWriteNextOutChunk(tp, httpChunked) && httpChunked) {
-      /* Do nothing. */
-   }
-
-   *bufSize = MIN(tp->writeBuf.size, *bufSize);
-   memcpy(buf, tp->writeBuf.data, *bufSize);
-
-   /* Shrink the front of the write buffer */
-   memcpy(tp->writeBuf.data, &tp->writeBuf.data[*bufSize],
-          tp->writeBuf.size - *bufSize);
-   tp->writeBuf.size -= *bufSize;
+   Warning("TUNNEL READY\n");
+   return TRUE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxy_HTTPSendNeeded --
+ * TunnelProxySysMsgCb --
  *
- *       Determine if TunnelProxy_HTTPSend should be called in order to
- *       serialize outgoing tunnel chunks, so as to be written over HTTP.
+ *       SYSMSG tunnel msg handler.  Prints the system message to stdout.
+ *
+ *       XXX: Should do something better here, like notify the user.
  *
  * Results:
- *       TRUE if there is chunk data to send, FALSE if there's nothing to send.
+ *       TRUE.
  *
  * Side effects:
  *       None.
@@ -1940,34 +5082,33 @@ TunnelProxy_HTTPSend(TunnelProxy *tp,  // IN
  *-----------------------------------------------------------------------------
  */
 
-Bool
-TunnelProxy_HTTPSendNeeded(TunnelProxy *tp) // IN
+static Bool
+TunnelProxySysMsgCb(TunnelProxy *tp,   // IN
+                    const char *msgId, // IN
+                    const char *body,  // IN
+                    int len,           // IN
+                    void *userData)    // IN: not used
 {
-   ListItem *li;
-   TPChunk *chunk = NULL;
+   TunnelProxyMsg parsed;
+   const char *msg = NULL;
 
-   ASSERT(tp);
+   TunnelProxy_ParseMsg(&parsed, body, len);
+   TunnelProxy_MsgGet(&parsed, "msg=S", &msg, NULL);
+   Warning("TUNNEL SYSTEM MESSAGE: %s\n", msg ? msg : "<Invalid Message>");
+   TunnelProxy_MsgDestroy(&parsed);
 
-   LIST_SCAN(li, tp->queueOut) {
-      chunk = LIST_CONTAINER(li, TPChunk, list);
-      if (!tp->flowStopped || chunk->type != TP_CHUNK_TYPE_DATA) {
-         return TRUE;
-      }
-   }
-   return FALSE;
+   return TRUE;
 }
 
 
-/*
- * Default Msg handler impls
- */
-
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyEchoRequestCb --
+ * TunnelProxyErrorCb --
  *
- *       ECHO_RQ tunnel msg handler.  Sends an ECHO_RP msg.
+ *       ERROR tunnel msg handler.  Prints the error and panics.
+ *
+ *       XXX: Should do something better here, like notify the user.
  *
  * Results:
  *       TRUE.
@@ -1979,13 +5120,20 @@ TunnelProxy_HTTPSendNeeded(TunnelProxy *tp) // IN
  */
 
 static Bool
-TunnelProxyEchoRequestCb(TunnelProxy *tp,   // IN
-                         const char *msgId, // IN
-                         const char *body,  // IN
-                         int len,           // IN
-                         void *userData)    // IN: not used
+TunnelProxyErrorCb(TunnelProxy *tp,   // IN
+                   const char *msgId, // IN
+                   const char *body,  // IN
+                   int len,           // IN
+                   void *userData)    // IN: not used
 {
-   TunnelProxy_SendMsg(tp, TP_MSG_ECHO_RP, NULL, 0);
+   TunnelProxyMsg parsed;
+   const char *msg = NULL;
+
+   TunnelProxy_ParseMsg(&parsed, body, len);
+   TunnelProxy_MsgGet(&parsed, "msg=S", &msg, NULL);
+   Warning("TUNNEL ERROR: %s\n", msg ? msg : "<Invalid Error>");
+   TunnelProxy_MsgDestroy(&parsed);
+
    return TRUE;
 }
 
@@ -1993,13 +5141,16 @@ TunnelProxyEchoRequestCb(TunnelProxy *tp,   // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyEchoReplyCb --
+ * TunnelProxyPleaseInitCb --
+ *
+ *       PLEASE_INIT tunnel msg handler.  Sends a START message in response
+ *       containing the host's ip address, hostname, and time.
  *
- *       ECHO_RP tunnel msg handler.  Does nothing other than avoid "Unhandled
- *       message" in logs.
+ *       XXX: Need to figure out the host's IP address and hostname, or at
+ *            least make a decent guess.
  *
  * Results:
- *       TRUE.
+ *       TRUE if the correlation-id matches that sent in INIT msg.
  *
  * Side effects:
  *       None.
@@ -2008,12 +5159,67 @@ TunnelProxyEchoRequestCb(TunnelProxy *tp,   // IN
  */
 
 static Bool
-TunnelProxyEchoReplyCb(TunnelProxy *tp,   // IN
-                       const char *msgId, // IN
-                       const char *body,  // IN
-                       int len,           // IN
-                       void *userData)    // IN: not used
+TunnelProxyPleaseInitCb(TunnelProxy *tp,   // IN
+                        const char *msgId, // IN
+                        const char *body,  // IN
+                        int len,           // IN
+                        void *userData)    // IN: not used
 {
+   /* Ignored body contents:
+    *    "plugins" string array
+    *    "criticalities" ?? string array
+    */
+   char *startBody = NULL;
+   int startLen = 0;
+   int64 t1 = 0;
+
+   ASSERT(tp->hostIp && tp->hostAddr);
+
+   {
+      TunnelProxyMsg msg;
+      const char *cid = NULL;
+      Bool cidMatches;
+
+      TunnelProxy_ParseMsg(&msg, body, len);
+      TunnelProxy_MsgGet(&msg, "cid=S", &cid, NULL);
+      cidMatches = cid && Str_Strcmp(cid, "1234") == 0;
+      if (!cidMatches) {
+         Warning("Incorrect correlation-id in tunnel PLEASEINIT: %s.\n",
+                 cid ? cid : "<none>");
+      }
+      TunnelProxy_MsgDestroy(&msg);
+      if (!cidMatches) {
+         return FALSE;
+      }
+   }
+
+   {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      t1 = tv.tv_sec * 1000;
+      t1 += tv.tv_usec / 1000;
+   }
+
+   if (tp->stripesWanted > 1) {
+      /* Ask to stripe over more connections; older servers ignore this. */
+      TunnelProxy_FormatMsg(&startBody, &startLen,
+                            "ipaddress=S", tp->hostIp,
+                            "hostaddress=S", tp->hostAddr,
+                            "capID=S", tp->capID ? tp->capID : "",
+                            "type=S", "C", // "simple" C client
+                            "t1=L", t1,
+                            "stripes=I", tp->stripesWanted, NULL);
+   } else {
+      TunnelProxy_FormatMsg(&startBody, &startLen,
+                            "ipaddress=S", tp->hostIp,
+                            "hostaddress=S", tp->hostAddr,
+                            "capID=S", tp->capID ? tp->capID : "",
+                            "type=S", "C", // "simple" C client
+                            "t1=L", t1, NULL);
+   }
+   TunnelProxy_SendMsg(tp, TP_MSG_START, startBody, startLen);
+   free(startBody);
+
    return TRUE;
 }
 
@@ -2021,12 +5227,18 @@ TunnelProxyEchoReplyCb(TunnelProxy *tp,   // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyStopCb --
+ * TunnelProxyRaiseReplyCb --
  *
- *       STOP tunnel msg handler.  Disconnects the TunnelProxy.
+ *       RAISE_RP tunnel msg handler.  If the message does not contain an
+ *       error, we start up socket channel IO for the channel id referred to
+ *       by chanId in the message by calling TunnelProxySocketRecvCb,
+ *       otherwise calls TunnelProxy_CloseChannel to teardown the
+ *       server-disallowed socket.  Compression is turned on for the channel
+ *       if we offered it and the message's compress value accepts it.
  *
  * Results:
- *       TRUE.
+ *       TRUE if IO was started or the channel was closed, FALSE if the
+ *       channel is unknown.
  *
  * Side effects:
  *       None.
@@ -2035,26 +5247,53 @@ TunnelProxyEchoReplyCb(TunnelProxy *tp,   // IN
  */
 
 static Bool
-TunnelProxyStopCb(TunnelProxy *tp,   // IN
-                  const char *msgId, // IN
-                  const char *body,  // IN
-                  int len,           // IN
-                  void *userData)    // IN: not used
+TunnelProxyRaiseReplyCb(TunnelProxy *tp,   // IN
+                        const char *msgId, // IN
+                        const char *body,  // IN
+                        int len,           // IN
+                        void *userData)    // IN: not used
 {
+   TunnelProxyMsg msg;
+   const char *problem = NULL;
+   int chanId = 0;
+   TPChannel *channel;
    TunnelProxyErr err;
-   char *reason;
 
-   TunnelProxy_ReadMsg(body, len, "reason=S", &reason, NULL);
-   Warning("TUNNEL STOPPED: %s\n", reason);
+   TunnelProxy_ParseMsg(&msg, body, len);
+   if (!TunnelProxy_MsgGet(&msg, "chanID=I", &chanId, NULL)) {
+      NOT_IMPLEMENTED();
+   }
 
-   /* Reconnect secret isn't valid after a STOP */
-   free(tp->reconnectSecret);
-   tp->reconnectSecret = NULL;
+   channel = TunnelProxyLookupChannel(tp, chanId);
+   if (!channel) {
+      Log("Invalid channel \"%d\" in raise reply.\n", chanId);
+      TunnelProxy_MsgDestroy(&msg);
+      return FALSE;
+   }
+
+   TunnelProxy_MsgGet(&msg, "problem=E", &problem, NULL);
+
+   if (!problem && channel->compress) {
+      const char *compress = NULL;
+
+      TunnelProxy_MsgGet(&msg, "compress=S", &compress, NULL);
+      if (compress && Str_Strcasecmp(compress, TP_COMPRESS_DEFLATE) == 0 &&
+          !TunnelProxyStartCompression(channel)) {
+         problem = "Failed to start compression";
+      }
+   }
 
-   err = TunnelProxyDisconnect(tp, reason, TRUE, TRUE);
-   ASSERT(TP_ERR_OK == err);
+   if (problem) {
+      Log("Error raising channel \"%d\": %s\n", chanId, problem);
+
+      err = TunnelProxy_CloseChannel(tp, channel->channelId);
+      ASSERT(TP_ERR_OK == err);
+   } else {
+      /* Kick off channel reading */
+      TunnelProxySocketRecvCb(NULL, 0, channel->socket, channel);
+   }
+   TunnelProxy_MsgDestroy(&msg);
 
-   free(reason);
    return TRUE;
 }
 
@@ -2062,10 +5301,12 @@ TunnelProxyStopCb(TunnelProxy *tp,   // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyAuthenticatedCb --
+ * TunnelProxyListenRequestCb --
  *
- *       AUTHENTICATED tunnel msg handler.  Stores reconnection and timeout
- *       information in the TunnelProxy object.
+ *       LISTEN_RQ tunnel msg handler.  Creates a local listener socket, and a
+ *       TPListener object to manage it.  Sends LISTEN_RP message in reply if
+ *       we were able to listen successfully.  Calls the TunnelProxy's
+ *       listenerCb to notify of a new listener creation.
  *
  * Results:
  *       TRUE.
@@ -2077,60 +5318,172 @@ TunnelProxyStopCb(TunnelProxy *tp,   // IN
  */
 
 static Bool
-TunnelProxyAuthenticatedCb(TunnelProxy *tp,   // IN
+TunnelProxyListenRequestCb(TunnelProxy *tp,   // IN
                            const char *msgId, // IN
                            const char *body,  // IN
                            int len,           // IN
                            void *userData)    // IN: not used
 {
-   char *capID = NULL;
-   Bool allowAutoReconnection = FALSE;
+   TunnelProxyMsg msg;
+   int bindPort = -1;
+   const char *serverHost = NULL;
+   int serverPort = 0;
+   const char *portName;
+   int maxConns;
+   int cid;
+   const char *bindAddr = NULL;
+   int listenErr = ASOCKERR_SUCCESS;
+   char *reply = NULL;
+   int replyLen = 0;
+   AsyncSocket *asock = NULL;
+   TPListener *newListener = NULL;
+   char *problem = NULL;
 
-   /* Ignored body contents:
-    *    "sessionTimeout" long, time until the session will die
-    */
-   if (!TunnelProxy_ReadMsg(body, len,
-                            "allowAutoReconnection=B", &allowAutoReconnection,
-                            "capID=S", &capID,
-                            "lostContactTimeout=L", &tp->lostContactTimeout,
-                            "disconnectedTimeout=L", &tp->disconnectedTimeout,
-                            NULL)) {
+   TunnelProxy_ParseMsg(&msg, body, len);
+   if (!TunnelProxy_MsgGet(&msg,
+                           "clientPort=I", &bindPort,
+                           "serverHost=S", &serverHost,
+                           "serverPort=I", &serverPort,
+                           "portName=S", &portName,
+                           "maxConnections=I", &maxConns,
+                           "cid=I", &cid, NULL)) {
       NOT_IMPLEMENTED();
    }
 
-   if (tp->capID && Str_Strcmp(capID, tp->capID) != 0) {
-      Warning("Tunnel authenticated capID \"%s\" does not match expected "
-              "value \"%s\".\n", capID, tp->capID);
-   } else {
-      tp->capID = capID;
-      capID = NULL;
+   if (bindPort == -1) {
+      bindPort = INADDR_ANY;
    }
 
-   free(tp->reconnectSecret);
-   tp->reconnectSecret = NULL;
+   /* clientHost is often null, so parse it optionally */
+   TunnelProxy_MsgGet(&msg, "clientHost=S", &bindAddr, NULL);
+   if (!bindAddr) {
+      bindAddr = "127.0.0.1";
+   }
+
+   /* Create the listener early, so it can be the ConnectCb user data */
+   newListener = Util_SafeCalloc(1, sizeof(TPListener));
+   newListener->tp = tp;
+
+   if (!tp->unixOnly) {
+      asock = AsyncSocket_ListenIPStr(bindAddr, bindPort,
+                                      TunnelProxySocketConnectCb, newListener,
+                                      NULL, &listenErr);
+      if (!asock || ASOCKERR_SUCCESS != listenErr) {
+         Log("Error creating new listener \"%s\" on %s:%d to server %s:%d: "
+             "%s\n", portName, bindAddr, bindPort, serverHost, serverPort,
+             AsyncSocket_Err2String(listenErr));
+
+         problem = strdup(AsyncSocket_Err2String(listenErr));
+         goto error;
+      }
+      newListener->listenSock = asock;
+
+      AsyncSocket_UseNodelay(asock, TRUE);
+
+      if (bindPort == 0) {
+         /* Find the local port we've bound. */
+         int fd = AsyncSocket_GetFd(asock);
+         struct sockaddr addr = { 0 };
+         socklen_t addrLen = sizeof(addr);
+
+         if (getsockname(fd, &addr, &addrLen) < 0) {
+            NOT_IMPLEMENTED();
+         }
 
-   if (allowAutoReconnection &&
-       !TunnelProxy_ReadMsg(body, len,
-                            "reconnectSecret=S", &tp->reconnectSecret,
-                            NULL)) {
-      Warning("Tunnel automatic reconnect disabled: no reconnect secret in "
-              "auth_rp.\n");
+         bindPort = ntohs(((struct sockaddr_in*) &addr)->sin_port);
+      }
+      ASSERT(bindPort > 0);
    }
 
-   /* Kick off echo & disconnect timeouts */
-   TunnelProxyResetTimeouts(tp, TRUE);
+   if (tp->unixPrefix) {
+      newListener->unixPath = Str_SafeAsprintf(NULL, "%s%s", tp->unixPrefix,
+                                               portName);
+      newListener->unixSock = TunnelProxy_ListenUnix(newListener->unixPath,
+                                                     TunnelProxyUnixConnectCb,
+                                                     newListener, &listenErr);
+      if (!newListener->unixSock) {
+         Log("Error creating new listener \"%s\" on %s to server %s:%d: "
+             "%s\n", portName, newListener->unixPath, serverHost, serverPort,
+             AsyncSocket_Err2String(listenErr));
+         if (tp->unixOnly) {
+            problem = strdup(AsyncSocket_Err2String(listenErr));
+            goto error;
+         }
+      }
+   }
+
+   if (tp->unixOnly) {
+      /* Local clients find the channel by its socket name, not a port. */
+      bindAddr = newListener->unixPath;
+      bindPort = 0;
+   }
+
+   if (tp->listenerCb && !tp->listenerCb(tp, portName, bindAddr,
+                                         bindPort, tp->listenerCbData)) {
+      Log("Rejecting new listener \"%s\" on %s:%d to server %s:%d.\n",
+          portName, bindAddr, bindPort, serverHost, serverPort);
+
+      problem = strdup("User Rejected");
+      goto error;
+   }
+
+   if (tp->unixOnly) {
+      Log("Creating new listener \"%s\" on %s to server %s:%d.\n",
+          portName, newListener->unixPath, serverHost, serverPort);
+   } else if (newListener->unixSock) {
+      Log("Creating new listener \"%s\" on %s:%d and %s to server %s:%d.\n",
+          portName, bindAddr, bindPort, newListener->unixPath, serverHost,
+          serverPort);
+   } else {
+      Log("Creating new listener \"%s\" on %s:%d to server %s:%d.\n",
+          portName, bindAddr, bindPort, serverHost, serverPort);
+   }
+
+   Str_Strcpy(newListener->portName, portName, TP_PORTNAME_MAXLEN);
+   newListener->port = bindPort;
+   newListener->singleUse = maxConns == 1;
+   newListener->priority = TunnelProxyGetPriority(portName);
+   newListener->coalesceUsec = TunnelProxyGetCoalesceUsec(portName);
+   newListener->compress = TunnelProxyGetCompress(portName);
+
+   LIST_QUEUE(&newListener->list, &tp->listeners);
+   LIST_QUEUE(&newListener->hashList,
+              &tp->listenerHash[TunnelProxyHashName(portName)]);
+
+   TunnelProxy_FormatMsg(&reply, &replyLen,
+                         "cid=I", cid,
+                         "portName=S", portName,
+                         "clientHost=S", bindAddr,
+                         "clientPort=I", bindPort, NULL);
+
+exit:
+   TunnelProxy_SendMsg(tp, TP_MSG_LISTEN_RP, reply, replyLen);
+
+   TunnelProxy_MsgDestroy(&msg);
+   free(reply);
 
-   free(capID);
    return TRUE;
+
+error:
+   ASSERT(problem && !reply);
+   TunnelProxy_FormatMsg(&reply, &replyLen, "cid=I", cid, "problem=E", problem,
+                         NULL);
+   free(problem);
+   TunnelProxyCloseListenSocks(newListener);
+   free(newListener);
+   goto exit;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyReadyCb --
+ * TunnelProxyUnlistenRequestCb --
  *
- *       READY tunnel msg handler.  Just prints a message.
+ *       UNLISTEN_RQ tunnel msg handler.  Looks up the portName provided in
+ *       the message and calls TunnelProxy_CloseListener to close the listener
+ *       and all its socket channels.  Sends an UNLISTEN_RP to verify the
+ *       close completed successfully.
  *
  * Results:
  *       TRUE.
@@ -2142,13 +5495,31 @@ TunnelProxyAuthenticatedCb(TunnelProxy *tp,   // IN
  */
 
 static Bool
-TunnelProxyReadyCb(TunnelProxy *tp,   // IN: not used
-                   const char *msgId, // IN: not used
-                   const char *body,  // IN: not used
-                   int len,           // IN: not used
-                   void *userData)    // IN: not used
+TunnelProxyUnlistenRequestCb(TunnelProxy *tp,   // IN
+                             const char *msgId, // IN
+                             const char *body,  // IN
+                             int len,           // IN
+                             void *userData)    // IN: not used
 {
-   Warning("TUNNEL READY\n");
+   TunnelProxyMsg msg;
+   const char *portName = NULL;
+   char *reply = NULL;
+   int replyLen = 0;
+
+   TunnelProxy_ParseMsg(&msg, body, len);
+   if (!TunnelProxy_MsgGet(&msg, "portName=S", &portName, NULL)) {
+      NOT_IMPLEMENTED();
+   }
+
+   if (!portName || TP_ERR_OK != TunnelProxy_CloseListener(tp, portName)) {
+      TunnelProxy_FormatMsg(&reply, &replyLen, "problem=E", "Invalid portName",
+                            NULL);
+   }
+
+   TunnelProxy_SendMsg(tp, TP_MSG_UNLISTEN_RP, reply, replyLen);
+
+   TunnelProxy_MsgDestroy(&msg);
+   free(reply);
    return TRUE;
 }
 
@@ -2156,11 +5527,11 @@ TunnelProxyReadyCb(TunnelProxy *tp,   // IN: not used
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxySysMsgCb --
- *
- *       SYSMSG tunnel msg handler.  Prints the system message to stdout.
+ * TunnelProxyLowerCb --
  *
- *       XXX: Should do something better here, like notify the user.
+ *       LOWER tunnel msg handler.  Looks up the channel for the channel ID
+ *       provided in the message and calls TunnelProxy_CloseChannel to close
+ *       the channel and its socket.
  *
  * Results:
  *       TRUE.
@@ -2172,17 +5543,27 @@ TunnelProxyReadyCb(TunnelProxy *tp,   // IN: not used
  */
 
 static Bool
-TunnelProxySysMsgCb(TunnelProxy *tp,   // IN
-                    const char *msgId, // IN
-                    const char *body,  // IN
-                    int len,           // IN
-                    void *userData)    // IN: not used
+TunnelProxyLowerCb(TunnelProxy *tp,   // IN
+                   const char *msgId, // IN
+                   const char *body,  // IN
+                   int len,           // IN
+                   void *userData)    // IN: not used
 {
-   char *msg;
+   TunnelProxyMsg msg;
+   int chanId = 0;
+   TunnelProxyErr err;
 
-   TunnelProxy_ReadMsg(body, len, "msg=S", &msg, NULL);
-   Warning("TUNNEL SYSTEM MESSAGE: %s\n", msg ? msg : "<Invalid Message>");
-   free(msg);
+   TunnelProxy_ParseMsg(&msg, body, len);
+   if (!TunnelProxy_MsgGet(&msg, "chanID=I", &chanId, NULL)) {
+      NOT_IMPLEMENTED();
+   }
+   TunnelProxy_MsgDestroy(&msg);
+
+   Warning("Tunnel requested socket channel close (chanID: %d)\n", chanId);
+   err = TunnelProxy_CloseChannel(tp, chanId);
+   if (err != TP_ERR_OK) {
+       Warning("Error closing socket channel %d: %d\n", chanId, err);
+   }
 
    return TRUE;
 }
@@ -2191,51 +5572,55 @@ TunnelProxySysMsgCb(TunnelProxy *tp,   // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyErrorCb --
- *
- *       ERROR tunnel msg handler.  Prints the error and panics.
+ * TunnelProxyResetTimeouts --
  *
- *       XXX: Should do something better here, like notify the user.
+ *       Cancel the heartbeat timer, and restart it from now if the
+ *       TunnelProxy has a lostContactTimeout as received in the
+ *       AUTHENTICATED msg.
  *
  * Results:
- *       TRUE.
+ *       None.
  *
  * Side effects:
- *       None.
+ *       Poll timeouts removed/added.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Bool
-TunnelProxyErrorCb(TunnelProxy *tp,   // IN
-                   const char *msgId, // IN
-                   const char *body,  // IN
-                   int len,           // IN
-                   void *userData)    // IN: not used
+static void
+TunnelProxyResetTimeouts(TunnelProxy *tp, // IN
+                         Bool requeue)    // IN: restart timeouts
 {
-   char *msg;
+   ASSERT(tp);
 
-   TunnelProxy_ReadMsg(body, len, "msg=S", &msg, NULL);
-   Warning("TUNNEL ERROR: %s\n", msg ? msg : "<Invalid Error>");
-   free(msg);
+   if (tp->heartbeatTimerSet) {
+      Poll_CB_RTimeRemove(TunnelProxyHeartbeatCb, tp, FALSE);
+      tp->heartbeatTimerSet = FALSE;
+   }
 
-   return TRUE;
+   if (requeue && tp->lostContactTimeout > 0) {
+      VmTimeType now = Hostinfo_SystemTimerUS();
+
+      tp->lastRecvTime = now;
+      tp->echoSentTime = 0;
+      TunnelProxyArmHeartbeat(tp, now);
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyPleaseInitCb --
- *
- *       PLEASE_INIT tunnel msg handler.  Sends a START message in response
- *       containing the host's ip address, hostname, and time.
+ * TunnelProxyEchoTimeout --
  *
- *       XXX: Need to figure out the host's IP address and hostname, or at
- *            least make a decent guess.
+ *       How long to wait for anything to arrive after an ECHO_RQ before
+ *       contact is lost.  TP_ECHO_RTO_MULT retransmission timeouts as TCP
+ *       would compute them from the echo round trip samples, at least
+ *       TP_ECHO_TIMEOUT_MIN, and never more than what is left of
+ *       lostContactTimeout after the idle time that triggered the echo.
  *
  * Results:
- *       TRUE if the correlation-id matches that sent in INIT msg.
+ *       Timeout in usec.
  *
  * Side effects:
  *       None.
@@ -2243,67 +5628,33 @@ TunnelProxyErrorCb(TunnelProxy *tp,   // IN
  *-----------------------------------------------------------------------------
  */
 
-static Bool
-TunnelProxyPleaseInitCb(TunnelProxy *tp,   // IN
-                        const char *msgId, // IN
-                        const char *body,  // IN
-                        int len,           // IN
-                        void *userData)    // IN: not used
+static VmTimeType
+TunnelProxyEchoTimeout(TunnelProxy *tp) // IN
 {
-   /* Ignored body contents:
-    *    "plugins" string array
-    *    "criticalities" ?? string array
-    */
-   char *startBody = NULL;
-   int startLen = 0;
-   int64 t1 = 0;
+   VmTimeType lostContact = tp->lostContactTimeout * 1000;
+   VmTimeType maxTimeout = lostContact - lostContact / 3;
+   VmTimeType timeout;
 
-   ASSERT(tp->hostIp && tp->hostAddr);
-
-   {
-      char *cid = NULL;
-      TunnelProxy_ReadMsg(body, len, "cid=S", &cid, NULL);
-      if (!cid || Str_Strcmp(cid, "1234") != 0) {
-         Warning("Incorrect correlation-id in tunnel PLEASEINIT: %s.\n", cid);
-         return FALSE;
-      }
-      free(cid);
-   }
-
-   {
-      struct timeval tv;
-      gettimeofday(&tv, NULL);
-      t1 = tv.tv_sec * 1000;
-      t1 += tv.tv_usec / 1000;
+   if (tp->srtt == 0) {
+      return maxTimeout;
    }
 
-   TunnelProxy_FormatMsg(&startBody, &startLen,
-                         "ipaddress=S", tp->hostIp,
-                         "hostaddress=S", tp->hostAddr,
-                         "capID=S", tp->capID ? tp->capID : "",
-                         "type=S", "C", // "simple" C client
-                         "t1=L", t1, NULL);
-   TunnelProxy_SendMsg(tp, TP_MSG_START, startBody, startLen);
-   free(startBody);
-
-   return TRUE;
+   timeout = TP_ECHO_RTO_MULT * (tp->srtt + 4 * tp->rttVar);
+   timeout = MAX(timeout, TP_ECHO_TIMEOUT_MIN);
+   return MIN(timeout, maxTimeout);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyRaiseReplyCb --
+ * TunnelProxyUpdateRtt --
  *
- *       RAISE_RP tunnel msg handler.  If the message does not contain an
- *       error, we start up socket channel IO for the channel id referred to
- *       by chanId in the message by calling TunnelProxySocketRecvCb,
- *       otherwise calls TunnelProxy_CloseChannel to teardown the
- *       server-disallowed socket.
+ *       Fold an echo round trip time sample into the smoothed RTT and its
+ *       mean deviation, with the RFC 2988 gains.
  *
  * Results:
- *       TRUE if IO was started or the channel was closed, FALSE if the
- *       channel is unknown.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -2311,248 +5662,207 @@ TunnelProxyPleaseInitCb(TunnelProxy *tp,   // IN
  *-----------------------------------------------------------------------------
  */
 
-static Bool
-TunnelProxyRaiseReplyCb(TunnelProxy *tp,   // IN
-                        const char *msgId, // IN
-                        const char *body,  // IN
-                        int len,           // IN
-                        void *userData)    // IN: not used
+static void
+TunnelProxyUpdateRtt(TunnelProxy *tp, // IN
+                     VmTimeType rtt)  // IN: usec
 {
-   char *problem = NULL;
-   int chanId = 0;
-   TPChannel *channel = NULL;
-   ListItem *li;
-   TunnelProxyErr err;
-
-   if (!TunnelProxy_ReadMsg(body, len, "chanID=I", &chanId, NULL)) {
-      NOT_IMPLEMENTED();
-   }
-
-   LIST_SCAN(li, tp->channels) {
-      TPChannel *chanIter = LIST_CONTAINER(li, TPChannel, list);
-      if (chanIter->channelId == chanId) {
-         channel = chanIter;
-         break;
-      }
-   }
-   if (!channel) {
-      Log("Invalid channel \"%d\" in raise reply.\n", chanId);
-      return FALSE;
+   if (tp->srtt == 0) {
+      tp->srtt = rtt;
+      tp->rttVar = rtt / 2;
+   } else {
+      VmTimeType delta = rtt > tp->srtt ? rtt - tp->srtt : tp->srtt - rtt;
+
+      tp->rttVar = (3 * tp->rttVar + delta) / 4;
+      tp->srtt = (7 * tp->srtt + rtt) / 8;
    }
+}
 
-   TunnelProxy_ReadMsg(body, len, "problem=E", &problem, NULL);
 
-   if (problem) {
-      Log("Error raising channel \"%d\": %s\n", chanId, problem);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyArmHeartbeat --
+ *
+ *       Set the heartbeat timer for the nearest deadline: lostContactTimeout
+ *       after the last receive, and either the echo timeout after an
+ *       outstanding ECHO_RQ, or the idle time at which one is sent.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Poll timeout added.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      err = TunnelProxy_CloseChannel(tp, channel->channelId);
-      ASSERT(TP_ERR_OK == err);
+static void
+TunnelProxyArmHeartbeat(TunnelProxy *tp, // IN
+                        VmTimeType now)  // IN
+{
+   VmTimeType lostContact = tp->lostContactTimeout * 1000;
+   VmTimeType deadline = tp->lastRecvTime + lostContact;
+
+   ASSERT(!tp->heartbeatTimerSet);
+
+   if (tp->echoSentTime) {
+      deadline = MIN(deadline, MAX(tp->echoSentTime, tp->lastRecvTime) +
+                               TunnelProxyEchoTimeout(tp));
    } else {
-      /* Kick off channel reading */
-      TunnelProxySocketRecvCb(NULL, 0, channel->socket, channel);
+      deadline = MIN(deadline, tp->lastRecvTime + lostContact / 3);
    }
 
-   return TRUE;
+   Poll_CB_RTime(TunnelProxyHeartbeatCb, tp,
+                 MAX(deadline - now, TP_HEARTBEAT_MIN), FALSE, NULL);
+   tp->heartbeatTimerSet = TRUE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyListenRequestCb --
+ * TunnelProxyUpdateWindow --
  *
- *       LISTEN_RQ tunnel msg handler.  Creates a local listener socket, and a
- *       TPListener object to manage it.  Sends LISTEN_RP message in reply if
- *       we were able to listen successfully.  Calls the TunnelProxy's
- *       listenerCb to notify of a new listener creation.
+ *       Take a round trip time sample, and the number of bytes acknowledged
+ *       over that round trip if known, and resize the send window to
+ *       TP_WINDOW_GAIN times the product of the smallest recent RTT and the
+ *       largest recent delivery rate.
+ *
+ *       While the window is what limits sending, the measured rate follows
+ *       the window, so the gain lets the window keep growing until the
+ *       network's delivery rate stops rising.
  *
  * Results:
- *       TRUE.
+ *       None.
  *
  * Side effects:
- *       None.
+ *       May change the send window.
  *
  *-----------------------------------------------------------------------------
  */
 
-static Bool
-TunnelProxyListenRequestCb(TunnelProxy *tp,   // IN
-                           const char *msgId, // IN
-                           const char *body,  // IN
-                           int len,           // IN
-                           void *userData)    // IN: not used
+static void
+TunnelProxyUpdateWindow(TunnelProxy *tp,    // IN
+                        VmTimeType now,     // IN
+                        VmTimeType rtt,     // IN: usec
+                        uint64 delivered)   // IN/OPT: bytes acked during rtt
 {
-   int bindPort = -1;
-   char *serverHost = NULL;
-   int serverPort = 0;
-   char *portName;
-   int maxConns;
-   int cid;
-   char *bindAddr = NULL;
-   int listenErr = ASOCKERR_SUCCESS;
-   char *reply = NULL;
-   int replyLen = 0;
-   AsyncSocket *asock = NULL;
-   TPListener *newListener = NULL;
-   char *problem = NULL;
+   uint64 avgChunkLen;
+   uint64 window;
 
-   if (!TunnelProxy_ReadMsg(body, len,
-                            "clientPort=I", &bindPort,
-                            "serverHost=S", &serverHost,
-                            "serverPort=I", &serverPort,
-                            "portName=S", &portName,
-                            "maxConnections=I", &maxConns,
-                            "cid=I", &cid, NULL)) {
-      NOT_IMPLEMENTED();
-   }
+   ASSERT(tp);
 
-   if (bindPort == -1) {
-      bindPort = INADDR_ANY;
+   if (rtt <= 0) {
+      rtt = 1;
    }
 
-   /* clientHost is often null, so parse it optionally */
-   TunnelProxy_ReadMsg(body, len, "clientHost=S", &bindAddr);
-   if (!bindAddr) {
-      bindAddr = strdup("127.0.0.1");
+   if (tp->minRtt == 0 || rtt <= tp->minRtt ||
+       now - tp->minRttTime > TP_FILTER_USEC) {
+      tp->minRtt = rtt;
+      tp->minRttTime = now;
    }
 
-   /* Create the listener early, so it can be the ConnectCb user data */
-   newListener = Util_SafeCalloc(1, sizeof(TPListener));
-
-   asock = AsyncSocket_ListenIPStr(bindAddr, bindPort,
-                                   TunnelProxySocketConnectCb, newListener,
-                                   NULL, &listenErr);
-   if (!asock || ASOCKERR_SUCCESS != listenErr) {
-      Log("Error creating new listener \"%s\" on %s:%d to server %s:%d: %s\n",
-          portName, bindAddr, bindPort, serverHost, serverPort,
-          AsyncSocket_Err2String(listenErr));
+   if (delivered > 0) {
+      uint64 rate = delivered * 1000000 / rtt;
 
-      problem = strdup(AsyncSocket_Err2String(listenErr));
-      goto error;
+      if (rate >= tp->maxRate || now - tp->maxRateTime > TP_FILTER_USEC) {
+         tp->maxRate = rate;
+         tp->maxRateTime = now;
+      }
    }
 
-   AsyncSocket_UseNodelay(asock, TRUE);
+   if (tp->maxRate == 0 || tp->chunksDelivered == 0) {
+      return;
+   }
 
-   if (bindPort == 0) {
-      /* Find the local port we've bound. */
-      int fd = AsyncSocket_GetFd(asock);
-      struct sockaddr addr = { 0 };
-      socklen_t addrLen = sizeof(addr);
+   avgChunkLen = MAX(tp->bytesDelivered / tp->chunksDelivered, 1);
+   window = TP_WINDOW_GAIN * tp->maxRate * tp->minRtt / 1000000 / avgChunkLen;
 
-      if (getsockname(fd, &addr, &addrLen) < 0) {
-         NOT_IMPLEMENTED();
+   if (window > tp->maxWindow) {
+      window = tp->maxWindow;
+      if (tp->window != tp->maxWindow) {
+         /* Count reaching the cap, not every sample taken while there. */
+         tp->stats.windowAtMax++;
       }
-
-      bindPort = ntohs(((struct sockaddr_in*) &addr)->sin_port);
+   } else if (window < tp->minWindow) {
+      window = tp->minWindow;
    }
-   ASSERT(bindPort > 0);
-
-   if (tp->listenerCb && !tp->listenerCb(tp, portName, bindAddr,
-                                         bindPort, tp->listenerCbData)) {
-      AsyncSocket_Close(asock);
-
-      Log("Rejecting new listener \"%s\" on %s:%d to server %s:%d.\n",
-          portName, bindAddr, bindPort, serverHost, serverPort);
 
-      problem = strdup("User Rejected");
-      goto error;
+   if (window != tp->window) {
+      DEBUG_MSG(("Send window %u -> %u chunks (rtt %"FMT64"dus, "
+                 "%"FMT64"u bytes/sec)\n", tp->window, (unsigned int)window,
+                 tp->minRtt, tp->maxRate));
+      tp->window = window;
    }
-
-   Log("Creating new listener \"%s\" on %s:%d to server %s:%d.\n",
-       portName, bindAddr, bindPort, serverHost, serverPort);
-
-   Str_Strcpy(newListener->portName, portName, TP_PORTNAME_MAXLEN);
-   newListener->port = bindPort;
-   newListener->listenSock = asock;
-   newListener->singleUse = maxConns == 1;
-   newListener->tp = tp;
-
-   LIST_QUEUE(&newListener->list, &tp->listeners);
-
-   TunnelProxy_FormatMsg(&reply, &replyLen,
-                         "cid=I", cid,
-                         "portName=S", portName,
-                         "clientHost=S", bindAddr,
-                         "clientPort=I", bindPort, NULL);
-
-exit:
-   TunnelProxy_SendMsg(tp, TP_MSG_LISTEN_RP, reply, replyLen);
-
-   free(bindAddr);
-   free(serverHost);
-   free(portName);
-   free(reply);
-
-   return TRUE;
-
-error:
-   ASSERT(problem && !reply);
-   TunnelProxy_FormatMsg(&reply, &replyLen, "cid=I", cid, "problem=E", problem,
-                         NULL);
-   free(problem);
-   free(newListener);
-   goto exit;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyUnlistenRequestCb --
+ * TunnelProxyUpdateFlowControl --
  *
- *       UNLISTEN_RQ tunnel msg handler.  Looks up the portName provided in
- *       the message and calls TunnelProxy_CloseListener to close the listener
- *       and all its socket channels.  Sends an UNLISTEN_RP to verify the
- *       close completed successfully.
+ *       Stop sending DATA chunks once the send window is full, and allow it
+ *       again once a quarter of the window has been acknowledged.  The
+ *       window counts DATA and MESSAGE chunks sent on the current
+ *       connection and not yet acknowledged.
  *
  * Results:
- *       TRUE.
+ *       TRUE if flow control ended, and chunks may be sendable again.
  *
  * Side effects:
- *       None.
+ *       Updates flow control statistics.
  *
  *-----------------------------------------------------------------------------
  */
 
 static Bool
-TunnelProxyUnlistenRequestCb(TunnelProxy *tp,   // IN
-                             const char *msgId, // IN
-                             const char *body,  // IN
-                             int len,           // IN
-                             void *userData)    // IN: not used
+TunnelProxyUpdateFlowControl(TunnelProxy *tp) // IN
 {
-   char *portName = NULL;
-   char *reply = NULL;
-   int replyLen = 0;
+   unsigned int unackCnt;
 
-   if (!TunnelProxy_ReadMsg(body, len, "portName=S", &portName, NULL)) {
-      NOT_IMPLEMENTED();
-   }
+   ASSERT(tp);
 
-   if (!portName || TP_ERR_OK != TunnelProxy_CloseListener(tp, portName)) {
-      TunnelProxy_FormatMsg(&reply, &replyLen, "problem=E", "Invalid portName",
-                            NULL);
+   unackCnt = tp->needAckCnt;
+
+   if (!tp->flowStopped &&
+       (unackCnt >= tp->window || tp->replayBytes >= tp->maxReplay)) {
+      DEBUG_MSG(("Starting flow control (%d unacknowledged chunks, "
+                 "%"FMT64"d bytes)\n", unackCnt, tp->replayBytes));
+      tp->flowStopped = TRUE;
+      tp->flowStopTime = Hostinfo_SystemTimerUS();
+      tp->stats.flowStops++;
+      if (tp->replayBytes >= tp->maxReplay) {
+         tp->stats.replayStops++;
+      }
+   } else if (tp->flowStopped &&
+              unackCnt < tp->window - tp->window / 4 &&
+              tp->replayBytes < tp->maxReplay - tp->maxReplay / 4) {
+      DEBUG_MSG(("Ending flow control\n"));
+      tp->flowStopped = FALSE;
+      tp->stats.flowStoppedUsec += Hostinfo_SystemTimerUS() - tp->flowStopTime;
+      return TRUE;
    }
 
-   TunnelProxy_SendMsg(tp, TP_MSG_UNLISTEN_RP, reply, replyLen);
-
-   free(portName);
-   free(reply);
-   return TRUE;
+   return FALSE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyLowerCb --
+ * TunnelProxy_GetStats --
  *
- *       LOWER tunnel msg handler.  Looks up the channel for the channel ID
- *       provided in the message and calls TunnelProxy_CloseChannel to close
- *       the channel and its socket.
+ *       Get the TunnelProxy's traffic, send window and flow control
+ *       statistics.  Queue depths are counted at the time of the call.
+ *
+ *       flowStops and flowStoppedUsec count time the window kept queued data
+ *       from being sent.  If they keep growing while windowAtMax does too,
+ *       the view.tunnel.maxWindow preference rather than the network is
+ *       what limits throughput.
  *
  * Results:
- *       TRUE.
+ *       None.
  *
  * Side effects:
  *       None.
@@ -2560,79 +5870,117 @@ TunnelProxyUnlistenRequestCb(TunnelProxy *tp,   // IN
  *-----------------------------------------------------------------------------
  */
 
-static Bool
-TunnelProxyLowerCb(TunnelProxy *tp,   // IN
-                   const char *msgId, // IN
-                   const char *body,  // IN
-                   int len,           // IN
-                   void *userData)    // IN: not used
+void
+TunnelProxy_GetStats(TunnelProxy *tp,          // IN
+                     TunnelProxyStats *stats)  // OUT
 {
-   int chanId = 0;
-   TunnelProxyErr err;
+   ListItem *li;
 
-   if (!TunnelProxy_ReadMsg(body, len, "chanID=I", &chanId, NULL)) {
-      NOT_IMPLEMENTED();
+   ASSERT(tp);
+   ASSERT(stats);
+
+   *stats = tp->stats;
+   stats->window = tp->window;
+   stats->unacknowledged = tp->needAckCnt;
+   stats->minRttUsec = tp->minRtt;
+   stats->srttUsec = tp->srtt;
+   stats->rttVarUsec = tp->rttVar;
+   stats->deliveryRate = tp->maxRate;
+   stats->bytesDelivered = tp->bytesDelivered;
+   stats->replayBytes = tp->replayBytes;
+   stats->chunkSlabs = tp->pool->slabCnt;
+   stats->chunksLivePeak = tp->pool->liveChunksPeak;
+   if (tp->flowStopped) {
+      stats->flowStoppedUsec += Hostinfo_SystemTimerUS() - tp->flowStopTime;
    }
 
-   Warning("Tunnel requested socket channel close (chanID: %d)\n", chanId);
-   err = TunnelProxy_CloseChannel(tp, chanId);
-   if (err != TP_ERR_OK) {
-       Warning("Error closing socket channel %d: %d\n", chanId, err);
+   stats->queueOut = 0;
+   stats->queueOutNeedAck = 0;
+   stats->queuedBytes = 0;
+   LIST_SCAN(li, tp->queueOut) {
+      stats->queueOut++;
    }
+   LIST_SCAN(li, tp->queueOutNeedAck) {
+      stats->queueOutNeedAck++;
+   }
+   LIST_SCAN(li, tp->channels) {
+      TPChannel *channel = LIST_CONTAINER(li, TPChannel, list);
+      ListItem *liChunk;
 
-   return TRUE;
+      LIST_SCAN(liChunk, channel->queueOut) {
+         stats->queueOut++;
+      }
+      stats->queuedBytes += channel->queuedBytes;
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyResetTimeouts --
- *
- *       Cancel pending echo and lost contact timeouts and requeues them if
- *       the TunnelProxy has a lostContactTimeout as received in the
- *       AUTHENTICATED msg.
+ * TunnelProxy_GetChannelStats --
  *
- *       The echo timeout is 1/3 the time of the lost contact timeout, to
- *       mimic wswc_tunnel.
+ *       Get the traffic counters of each open channel.
  *
  * Results:
- *       None.
+ *       Number of channels.  *stats is set to an array of them, which the
+ *       caller frees, or NULL if there are none.
  *
  * Side effects:
- *       Poll timeouts removed/added.
+ *       None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-TunnelProxyResetTimeouts(TunnelProxy *tp, // IN
-                         Bool requeue)    // IN: restart timeouts
+int
+TunnelProxy_GetChannelStats(TunnelProxy *tp,                  // IN
+                            TunnelProxyChannelStats **stats)  // OUT
 {
+   ListItem *li;
+   int count = 0;
+   int i = 0;
+
    ASSERT(tp);
+   ASSERT(stats);
 
-   Poll_CB_RTimeRemove(TunnelProxyLostContactTimeoutCb, tp, FALSE);
-   Poll_CB_RTimeRemove(TunnelProxyEchoTimeoutCb, tp, TRUE);
+   LIST_SCAN(li, tp->channels) {
+      count++;
+   }
 
-   if (requeue && tp->lostContactTimeout > 0) {
-      Poll_CB_RTime(TunnelProxyLostContactTimeoutCb,
-                    tp, tp->lostContactTimeout * 1000, FALSE, NULL);
-      Poll_CB_RTime(TunnelProxyEchoTimeoutCb,
-                    tp, tp->lostContactTimeout * 1000 / 3, TRUE, NULL);
+   *stats = NULL;
+   if (count == 0) {
+      return 0;
+   }
+
+   *stats = Util_SafeCalloc(count, sizeof **stats);
+   LIST_SCAN(li, tp->channels) {
+      TPChannel *channel = LIST_CONTAINER(li, TPChannel, list);
+      TunnelProxyChannelStats *chanStats = &(*stats)[i++];
+
+      chanStats->channelId = channel->channelId;
+      Str_Strcpy(chanStats->portName, channel->portName,
+                 sizeof chanStats->portName);
+      chanStats->chunksIn = channel->chunksIn;
+      chanStats->chunksOut = channel->chunksOut;
+      chanStats->bytesIn = channel->bytesIn;
+      chanStats->bytesOut = channel->bytesOut;
+      chanStats->queuedBytes = channel->queuedBytes;
    }
+
+   return count;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyEchoTimeoutCb --
+ * TunnelProxySendEcho --
  *
- *       Echo poll timeout callback.  Sends an ECHO_RQ with a "now" field
- *       containing the current time in millis.
+ *       Sends an ECHO_RQ with a "now" field containing the current time in
+ *       millis.
  *
- *       NOTE: There is no ECHO_RP message handler currently, as the handler
- *       in wswc_tunnel does nothing.
+ *       The send time is remembered, so TunnelProxyEchoReplyCb can take a
+ *       round trip time sample from the ECHO_RP.
  *
  * Results:
  *       None.
@@ -2644,9 +5992,8 @@ TunnelProxyResetTimeouts(TunnelProxy *tp, // IN
  */
 
 static void
-TunnelProxyEchoTimeoutCb(void *userData) // IN: TunnelProxy
+TunnelProxySendEcho(TunnelProxy *tp) // IN
 {
-   TunnelProxy *tp = userData;
    char *req = NULL;
    int reqLen = 0;
    int64 now = 0;
@@ -2664,6 +6011,8 @@ TunnelProxyEchoTimeoutCb(void *userData) // IN: TunnelProxy
 
    TunnelProxy_FormatMsg(&req, &reqLen, "now=L", now, NULL);
    TunnelProxy_SendMsg(tp, TP_MSG_ECHO_RQ, req, reqLen);
+   tp->echoSentTime = Hostinfo_SystemTimerUS();
+   tp->stats.echoesSent++;
    free(req);
 }
 
@@ -2671,31 +6020,148 @@ TunnelProxyEchoTimeoutCb(void *userData) // IN: TunnelProxy
 /*
  *-----------------------------------------------------------------------------
  *
- * TunnelProxyLostContactTimeoutCb --
+ * TunnelProxyAckTimeoutCb --
+ *
+ *       Delayed ACK poll timeout callback.  Queues an ACK chunk if received
+ *       chunks are still unacknowledged, because nothing was sent to carry
+ *       the ACK since the first of them arrived.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       May queue an ACK chunk.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyAckTimeoutCb(void *userData) // IN: TunnelProxy
+{
+   TunnelProxy *tp = userData;
+
+   ASSERT(tp);
+
+   tp->ackTimerSet = FALSE;
+
+   if (tp->lastChunkIdSeen > tp->lastChunkAckSent) {
+      DEBUG_MSG(("ACK delay expired.  Sending ACK chunk.\n"));
+      tp->stats.acksByTimer++;
+      TunnelProxySendChunk(tp, TP_CHUNK_TYPE_ACK, 0, NULL, NULL, 0);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyCoalesceTimeoutCb --
+ *
+ *       Coalescing poll timeout callback.  The channel's open DATA chunk has
+ *       been held for its latency budget, so queue it as it is.
+ *
+ * Results:
+ *       None.
+ *
+ * Side effects:
+ *       Queues a DATA chunk.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyCoalesceTimeoutCb(void *userData) // IN: TPChannel
+{
+   TPChannel *channel = userData;
+
+   ASSERT(channel && channel->openChunk);
+
+   TunnelProxyCloseOpenChunk(channel->tp, channel);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyCancelAckTimer --
  *
- *       Lost contact timeout callback.  Calls TunnelProxyDisconnect to notify
- *       the client of the disconnect, and allows reconnection without
- *       destroying our listening ports.
+ *       Remove the delayed ACK poll timeout, if it is set.
  *
  * Results:
  *       None.
  *
  * Side effects:
+ *       Poll timeout removed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelProxyCancelAckTimer(TunnelProxy *tp) // IN
+{
+   ASSERT(tp);
+
+   if (tp->ackTimerSet) {
+      Poll_CB_RTimeRemove(TunnelProxyAckTimeoutCb, tp, FALSE);
+      tp->ackTimerSet = FALSE;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelProxyHeartbeatCb --
+ *
+ *       Heartbeat poll timeout callback.  If nothing has arrived for
+ *       lostContactTimeout, or since well after an outstanding ECHO_RQ,
+ *       calls TunnelProxyDisconnect to notify the client of the disconnect,
+ *       and allows reconnection without destroying our listening ports.
+ *       Otherwise sends an ECHO_RQ if the link has gone idle, and re-arms.
+ *
+ * Results:
  *       None.
  *
+ * Side effects:
+ *       May send an ECHO_RQ or disconnect.
+ *
  *-----------------------------------------------------------------------------
  */
 
 static void
-TunnelProxyLostContactTimeoutCb(void *userData) // IN: TunnelProxy
+TunnelProxyHeartbeatCb(void *userData) // IN: TunnelProxy
 {
    TunnelProxy *tp = userData;
-   char *msg;
+   VmTimeType now = Hostinfo_SystemTimerUS();
+   VmTimeType lostContact;
+   VmTimeType echoTimeout;
+   VmTimeType idle;
 
    ASSERT(tp);
 
-   msg = Msg_GetString(MSGID("cdk.linuxTunnel.lostContact")
-                       "Client disconnected following no activity.");
-   TunnelProxyDisconnect(tp, msg, FALSE, TRUE);
-   free(msg);
+   tp->heartbeatTimerSet = FALSE;
+   lostContact = tp->lostContactTimeout * 1000;
+   echoTimeout = TunnelProxyEchoTimeout(tp);
+   idle = now - tp->lastRecvTime;
+
+   if (idle >= lostContact ||
+       (tp->echoSentTime && now - tp->echoSentTime >= echoTimeout &&
+        idle >= echoTimeout)) {
+      char *msg;
+
+      Log("Tunnel lost contact: nothing received for %"FMT64"dms, echo rtt "
+          "%"FMT64"dus +/- %"FMT64"dus.\n", idle / 1000, tp->srtt, tp->rttVar);
+
+      msg = Msg_GetString(MSGID("cdk.linuxTunnel.lostContact")
+                          "Client disconnected following no activity.");
+      TunnelProxyDisconnect(tp, msg, FALSE, TRUE);
+      free(msg);
+      return;
+   }
+
+   if (!tp->echoSentTime && idle >= lostContact / 3) {
+      TunnelProxySendEcho(tp);
+   }
+
+   TunnelProxyArmHeartbeat(tp, now);
 }
@@ -41,6 +41,22 @@
 
 #define TP_CONNECT_URL_PATH "/ice/tunnel"
 #define TP_RECONNECT_URL_PATH "/ice/reconnect"
+#define TP_STRIPE_URL_PATH "/ice/stripe"
+
+
+/*
+ * Most HTTP connections a session can be striped over, including the first.
+ */
+
+#define TP_MAX_STRIPES 8
+
+
+/*
+ * Longest listener port name, and buckets in the echo round trip histogram.
+ */
+
+#define TP_PORTNAME_MAXLEN 24
+#define TP_STATS_RTT_BUCKETS 12
 
 
 /*
@@ -96,6 +112,63 @@ typedef enum {
 } TunnelProxyErr;
 
 typedef struct TunnelProxy TunnelProxy;
+typedef struct TunnelProxySendv TunnelProxySendv;
+
+typedef struct {
+   unsigned int window;         // Send window, in unacknowledged chunks
+   unsigned int unacknowledged; // Chunks sent and not yet acknowledged
+   int64 minRttUsec;            // Smallest recent round trip time
+   int64 srttUsec;              // Smoothed echo round trip time
+   int64 rttVarUsec;            // Mean deviation of srttUsec
+   unsigned int echoesSent;     // ECHO_RQs sent on an idle link
+   uint64 deliveryRate;         // Largest recent delivery rate, bytes/sec
+   uint64 bytesDelivered;       // Body bytes acknowledged by the server
+   unsigned int flowStops;      // Times sending stopped on a full window
+   uint64 flowStoppedUsec;      // Time spent stopped on a full window
+   unsigned int windowAtMax;    // Times the window grew to maxWindow
+   unsigned int acksByCount;    // ACK chunks sent for a run of chunks
+   unsigned int acksByTimer;    // ACK chunks sent when the ACK delay expired
+   unsigned int acksPiggyback;  // ACKs carried by outbound DATA/MESSAGEs
+   unsigned int channelPauses;  // Channel reads stopped at the high watermark
+   unsigned int coalesced;      // Channel reads merged into an open chunk
+   uint64 compressIn;           // DATA bytes deflated
+   uint64 compressOut;          // Deflated size of compressIn
+   uint64 compressUsec;         // Time spent deflating
+   uint64 decompressUsec;       // Time spent inflating
+   unsigned int compressSkips;  // DATA chunks sent raw on a poor ratio
+   unsigned int reordered;      // Chunks held for an earlier one to arrive
+   unsigned int reconnects;     // Lossless reconnects completed
+   uint64 reconnectUsec;        // Reset to first chunk back, last reconnect
+   uint64 reconnectTotalUsec;   // reconnectUsec summed over all reconnects
+   uint64 chunksIn;             // Chunks received, all types
+   uint64 chunksOut;            // Chunks sent, all types, resends included
+   uint64 bytesIn;              // Body bytes of chunksIn
+   uint64 bytesOut;             // Body bytes of chunksOut, after deflate
+   unsigned int queueOut;       // Chunks waiting to be sent
+   unsigned int queueOutNeedAck; // Chunks sent and waiting for an ACK
+   uint64 queuedBytes;          // Body bytes waiting on channel queues
+   uint64 replayBytes;          // Body bytes sent and waiting for an ACK
+   uint64 replayBytesPeak;      // High-water mark of replayBytes
+   unsigned int replayStops;    // flowStops at view.tunnel.maxReplayBytes
+   unsigned int chunkSlabs;     // Slabs of chunks the pool allocated
+   unsigned int chunksLivePeak; // Most chunks allocated at once
+
+   /*
+    * Echo round trip times.  rttHist[0] counts those under 1ms, rttHist[i]
+    * those from 2^(i-1) up to 2^i ms, and the last bucket everything over.
+    */
+   unsigned int rttHist[TP_STATS_RTT_BUCKETS];
+} TunnelProxyStats;
+
+typedef struct {
+   unsigned int channelId;
+   char portName[TP_PORTNAME_MAXLEN];
+   uint64 chunksIn;  // DATA chunks received from the server
+   uint64 chunksOut; // DATA chunks queued for the server
+   uint64 bytesIn;   // Bytes written to the channel socket
+   uint64 bytesOut;  // Bytes read from the channel socket
+   int queuedBytes;  // Bytes waiting on the channel's queue
+} TunnelProxyChannelStats;
 
 
 typedef void (*TunnelProxySendNeededCb)(TunnelProxy *tp, void *userData);
@@ -104,6 +177,9 @@ typedef void (*TunnelProxyDisconnectCb)(TunnelProxy *tp,
                                         const char *reconnectSecret,
                                         const char *reason, void *userData);
 
+typedef void (*TunnelProxyStripesCb)(TunnelProxy *tp, int stripes,
+                                     void *userData);
+
 typedef Bool (*TunnelProxyMsgHandlerCb)(TunnelProxy *tp, const char *msgId,
                                         const char *body, int len,
                                         void *userData);
@@ -130,15 +206,22 @@ TunnelProxy *TunnelProxy_Create(const char *connectionId,
 void TunnelProxy_Free(TunnelProxy *tp);
 
 char *TunnelProxy_GetConnectUrl(TunnelProxy *tp, const char *serverUrl);
+char *TunnelProxy_GetStripeUrl(TunnelProxy *tp, const char *serverUrl,
+                               int stripe);
+int TunnelProxy_GetStripes(TunnelProxy *tp);
+void TunnelProxy_LimitStripes(TunnelProxy *tp, int stripes);
 
 TunnelProxyErr TunnelProxy_Connect(TunnelProxy *tp,
                                    const char *hostIp, const char *hostAddr,
                                    TunnelProxySendNeededCb sendNeededCb,
                                    void *sendNeededCbData,
                                    TunnelProxyDisconnectCb disconnectCb,
-                                   void *disconnectCbData);
+                                   void *disconnectCbData,
+                                   TunnelProxyStripesCb stripesCb,
+                                   void *stripesCbData);
 
 TunnelProxyErr TunnelProxy_Disconnect(TunnelProxy *tp);
+TunnelProxyErr TunnelProxy_Reset(TunnelProxy *tp, const char *reason);
 
 void TunnelProxy_AddMsgHandler(TunnelProxy *tp, const char *msgId,
                                TunnelProxyMsgHandlerCb cb,
@@ -156,17 +239,40 @@ TunnelProxyErr TunnelProxy_CloseChannel(TunnelProxy *tp,
 
 TunnelProxyErr TunnelProxy_CloseListener(TunnelProxy *tp, const char *portName);
 
+AsyncSocket *TunnelProxy_ListenUnix(const char *path,
+                                    AsyncSocketConnectFn connectFn,
+                                    void *clientData, int *listenErr);
+
+void TunnelProxy_GetStats(TunnelProxy *tp, TunnelProxyStats *stats);
+int TunnelProxy_GetChannelStats(TunnelProxy *tp,
+                                TunnelProxyChannelStats **stats);
+
 
 /*
- * HTTP IO driver interface
+ * HTTP IO driver interface.  Data read from each connection of a striped
+ * session is passed in with that connection's stripe index, 0 for the
+ * connection given to TunnelProxy_Connect.  Sends may go out on any of them.
  */
 
-void TunnelProxy_HTTPRecv(TunnelProxy *tp, const char *buf, int bufSize,
-                          Bool httpChunked);
+void TunnelProxy_HTTPRecv(TunnelProxy *tp, int stripe, const char *buf,
+                          int bufSize, Bool httpChunked);
+char *TunnelProxy_HTTPRecvGetBuf(TunnelProxy *tp, int stripe, int *bufSize);
+void TunnelProxy_HTTPRecvCommit(TunnelProxy *tp, int stripe, int len,
+                                Bool httpChunked);
 void TunnelProxy_HTTPSend(TunnelProxy *tp, char *buf, int *bufSize,
                           Bool httpChunked);
 Bool TunnelProxy_HTTPSendNeeded(TunnelProxy *tp);
 
+/*
+ * Zero-copy variant of TunnelProxy_HTTPSend.  The returned segments point at
+ * queued chunk memory, which stays valid until TunnelProxy_HTTPSendvComplete
+ * is called on the returned handle, even if the TunnelProxy is freed first.
+ */
+struct iovec;
+TunnelProxySendv *TunnelProxy_HTTPSendv(TunnelProxy *tp, Bool httpChunked,
+                                        struct iovec **iov, int *iovCnt);
+void TunnelProxy_HTTPSendvComplete(TunnelProxySendv *sendv);
+
 
 /*
  * Message parsing utilities
@@ -177,16 +283,37 @@ Bool TunnelProxy_HTTPSendNeeded(TunnelProxy *tp);
 #define TP_TYPE_LONG "=L"
 #define TP_TYPE_BOOL "=B"
 #define TP_TYPE_ERROR "=E"
-
-/* Not yet supported */
-/*
 #define TP_TYPE_BINARY "=b"
 #define TP_TYPE_STRINGLIST "=s"
 #define TP_TYPE_EMPTY "=N"
-*/
 
-Bool TunnelProxy_ReadMsg(const char *body, int len,
-                         const char* nameTypeKey, ...);
+#define TP_MSG_INLINE_FIELDS 16
+
+typedef struct {
+   const char *name;  // Key and type, e.g. "capID=S", not NUL terminated
+   int nameLen;
+   char type;
+   const char *value; // Decoded for S, E and b, NULL if invalid
+   int valueLen;
+   const char **list; // Decoded s elements, NULL terminated
+} TunnelProxyMsgField;
+
+/*
+ * A message body parsed into its fields.  Decoded values live in one arena,
+ * and the first TP_MSG_INLINE_FIELDS fields in the struct itself.
+ */
+typedef struct {
+   TunnelProxyMsgField *fields;
+   int fieldCount;
+   int fieldsAllocated;
+   TunnelProxyMsgField inlineFields[TP_MSG_INLINE_FIELDS];
+   char *arena;
+} TunnelProxyMsg;
+
+void TunnelProxy_ParseMsg(TunnelProxyMsg *msg, const char *body, int len);
+Bool TunnelProxy_MsgGet(const TunnelProxyMsg *msg,
+                        const char* nameTypeKey, ...);
+void TunnelProxy_MsgDestroy(TunnelProxyMsg *msg);
 
 Bool TunnelProxy_FormatMsg(char **body, int *len,
                            const char* nameTypeKey, ...);
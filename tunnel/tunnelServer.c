@@ -0,0 +1,1309 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * tunnelServer.c --
+ *
+ *      Minimal local stand-in for the View Security Server end of the
+ *      tunnel, for measuring vmware-view-tunnel.  Accepts one tunnel POST at
+ *      a time over plain HTTP, answers the INIT/START handshake, asks the
+ *      tunnel to listen on a number of ports, and echoes every channel's
+ *      data back to it.  With -s, grants a tunnel that asks for stripes up
+ *      to that many connections, and sends its chunks round robin over
+ *      them; with -r as well, it answers the stripe POSTs with a 403
+ *      instead, as a server that can't take them would.  Channels raised with compression have their DATA inflated
+ *      and deflated again into the server's own stream for the echo.  No
+ *      reconnects.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>     /* For getopt */
+#include <zlib.h>
+
+
+#include "tunnelProxy.h"
+
+#include "dynbuf.h"
+#include "poll.h"
+#include "preference.h"
+#include "ssl.h"
+#include "str.h"
+#include "util.h"
+
+
+#define APPNAME "vmware-view-tunnel-server"
+#define TMPBUFSIZE 1024 * 16 /* arbitrary */
+#define DEFAULT_PORT 18443
+#define DEFAULT_LISTEN_PORT 18500
+#define DEFAULT_LISTENERS 4
+#define DEFAULT_LOST_CONTACT 30000 // Msec, sent in AUTHENTICATED
+#define SERVER_CID "1234" // Correlation id the tunnel expects in PLEASE_INIT
+#define SERVER_SECRET "bench" // Reconnect secret, names stripe connections
+#define CHUNK_HDR_MAXLEN 128
+#define COMPRESS_DEFLATE "deflate" // compress value in RAISE_RQ/RAISE_RP
+#define DATA_RAW 'R'      // First byte of a compressed channel's DATA body,
+#define DATA_DEFLATED 'Z' // see TPDataEncoding in tunnelProxy.c
+
+
+/*
+ * An HTTP connection from the tunnel.  Inbound bytes are stripped of their
+ * HTTP chunk framing into tunnelBuf, which is then split into tunnel
+ * chunks.  stripe is -1 until the request header says which connection of
+ * the session this is.
+ */
+typedef struct {
+   AsyncSocket *asock;
+   int stripe;
+   DynBuf recvBuf;
+   DynBuf tunnelBuf;
+} TunnelServerConn;
+
+/*
+ * A chunk that arrived on one stripe ahead of a lower chunkId still on its
+ * way over another.  Held chunks are kept sorted by chunkId.
+ */
+typedef struct TunnelServerHeld {
+   struct TunnelServerHeld *next;
+   unsigned int chunkId;
+   int len;
+   char *data;
+} TunnelServerHeld;
+
+/*
+ * A channel the tunnel raised with compression, and its two deflate
+ * streams: the tunnel's, inflated here, and the server's own for echoes.
+ */
+typedef struct TunnelServerChannel {
+   struct TunnelServerChannel *next;
+   int chanId;
+   z_stream inflater;
+   z_stream deflater;
+} TunnelServerChannel;
+
+/*
+ * The tunnel session being served, over stripes connections once the
+ * tunnel has opened them all.  Stripe 0 is the connection that started it.
+ */
+typedef struct {
+   TunnelServerConn *conns[TP_MAX_STRIPES];
+   int stripes;
+   int nextStripe;
+   TunnelServerHeld *held;
+   TunnelServerChannel *compressed;
+   unsigned int lastChunkIdSeen;
+   unsigned int lastChunkAckSent;
+   unsigned int lastChunkIdSent;
+} TunnelServerSession;
+
+typedef void (*TunnelServerMsgFn)(TunnelServerSession *session,
+                                  const TunnelProxyMsg *msg);
+
+static TunnelServerSession gSession;
+static int gStripes = 1;
+static Bool gRejectStripes = FALSE;
+static int gListeners = DEFAULT_LISTENERS;
+static int gLostContact = DEFAULT_LOST_CONTACT;
+static int gListenPort = DEFAULT_LISTEN_PORT;
+
+static void TunnelServerRecvCb(void *buf, int len, AsyncSocket *asock,
+                               void *clientData);
+static int TunnelServerProcessChunk(TunnelServerSession *session,
+                                    const char *buf, int len);
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerSendCb --
+ *
+ *      AsyncSocket send callback.  Frees the buffer sent.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerSendCb(void *buf,          // IN
+                   int len,            // IN: not used
+                   AsyncSocket *asock, // IN: not used
+                   void *clientData)   // IN: not used
+{
+   free(buf);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerSendChunk --
+ *
+ *      Queue a tunnel chunk, in an HTTP chunk of its own, on the next of the
+ *      session's connections in turn.  hdr is the chunk header after the
+ *      type, chunkId and ack fields, and body, if any, follows it.  Every
+ *      chunk acknowledges all the tunnel's chunks seen.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerSendChunk(TunnelServerSession *session, // IN
+                      char type,                    // IN
+                      const char *hdr,              // IN
+                      const char *body,             // IN/OPT
+                      int bodyLen)                  // IN
+{
+   TunnelServerConn *conn = NULL;
+   char chunkHdr[CHUNK_HDR_MAXLEN];
+   int chunkHdrLen;
+   char *buf;
+   int bufLen;
+   int len;
+   int i;
+
+   /* Skip stripes the tunnel hasn't connected yet. */
+   for (i = 0; i < session->stripes && !conn; i++) {
+      conn = session->conns[session->nextStripe];
+      session->nextStripe = (session->nextStripe + 1) % session->stripes;
+   }
+   if (!conn) {
+      return;
+   }
+
+   if (type == 'A') {
+      chunkHdrLen = Str_Sprintf(chunkHdr, sizeof chunkHdr, "A;%X;",
+                                session->lastChunkIdSeen);
+   } else {
+      chunkHdrLen = Str_Sprintf(chunkHdr, sizeof chunkHdr, "%c;%X;%X;%s",
+                                type, ++session->lastChunkIdSent,
+                                session->lastChunkIdSeen, hdr);
+   }
+   session->lastChunkAckSent = session->lastChunkIdSeen;
+
+   /* Size line, chunk header, body, trailing ';' if any body, and CRLF. */
+   len = chunkHdrLen + bodyLen + (body ? 1 : 0);
+   buf = Util_SafeMalloc(len + 16);
+   bufLen = Str_Sprintf(buf, 16, "%X\r\n", len);
+   memcpy(buf + bufLen, chunkHdr, chunkHdrLen);
+   bufLen += chunkHdrLen;
+   if (body) {
+      memcpy(buf + bufLen, body, bodyLen);
+      bufLen += bodyLen;
+      buf[bufLen++] = ';';
+   }
+   buf[bufLen++] = '\r';
+   buf[bufLen++] = '\n';
+
+   if (AsyncSocket_Send(conn->asock, buf, bufLen, TunnelServerSendCb,
+                        NULL) != ASOCKERR_SUCCESS) {
+      free(buf);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerSendMsg --
+ *
+ *      Queue a tunnel MESSAGE chunk.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerSendMsg(TunnelServerSession *session, // IN
+                    const char *msgId,            // IN
+                    const char *body,             // IN/OPT
+                    int len)                      // IN
+{
+   char *msgHdr = NULL;
+   int msgHdrLen = 0;
+   char *hdr;
+
+   TunnelProxy_FormatMsg(&msgHdr, &msgHdrLen, "messageType=S", msgId, NULL);
+   hdr = Str_Asprintf(NULL, "%X;%s;%X;", msgHdrLen, msgHdr, body ? len : 0);
+
+   TunnelServerSendChunk(session, 'M', hdr, body ? body : "", body ? len : 0);
+
+   free(hdr);
+   free(msgHdr);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerInitCb --
+ *
+ *      INIT message handler.  Replies with PLEASE_INIT.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerInitCb(TunnelServerSession *session, // IN
+                   const TunnelProxyMsg *msg)    // IN: not used
+{
+   char *body = NULL;
+   int len = 0;
+
+   TunnelProxy_FormatMsg(&body, &len, "cid=S", SERVER_CID, NULL);
+   TunnelServerSendMsg(session, TP_MSG_PLEASE_INIT, body, len);
+   free(body);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerStartCb --
+ *
+ *      START message handler.  Replies with AUTHENTICATED and READY, then
+ *      sends a LISTEN_RQ for each port.  If the tunnel asked for stripes
+ *      and -s allows more than one, AUTHENTICATED grants them, along with
+ *      the reconnect secret that stripe connections are named by.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerStartCb(TunnelServerSession *session, // IN
+                    const TunnelProxyMsg *msg)    // IN
+{
+   char *body = NULL;
+   int len = 0;
+   int stripes = 1;
+   int i;
+
+   if (gStripes > 1 && TunnelProxy_MsgGet(msg, "stripes=I", &stripes, NULL)) {
+      stripes = MAX(1, MIN(stripes, gStripes));
+   }
+
+   if (stripes > 1) {
+      TunnelProxy_FormatMsg(&body, &len,
+                            "allowAutoReconnection=B", TRUE,
+                            "reconnectSecret=S", SERVER_SECRET,
+                            "stripes=I", stripes,
+                            "capID=S", "bench",
+                            "lostContactTimeout=L", (int64) gLostContact,
+                            "disconnectedTimeout=L", (int64) 60000, NULL);
+      Log("Tunnel striped over %d connections.\n", stripes);
+   } else {
+      TunnelProxy_FormatMsg(&body, &len,
+                            "allowAutoReconnection=B", FALSE,
+                            "capID=S", "bench",
+                            "lostContactTimeout=L", (int64) gLostContact,
+                            "disconnectedTimeout=L", (int64) 60000, NULL);
+   }
+   TunnelServerSendMsg(session, TP_MSG_AUTHENTICATED, body, len);
+   free(body);
+   session->stripes = stripes;
+
+   TunnelServerSendMsg(session, TP_MSG_READY, NULL, 0);
+
+   for (i = 0; i < gListeners; i++) {
+      char portName[32];
+
+      Str_Sprintf(portName, sizeof portName, "bench%d", i);
+      TunnelProxy_FormatMsg(&body, &len,
+                            "clientPort=I", gListenPort + i,
+                            "serverHost=S", "localhost",
+                            "serverPort=I", 0,
+                            "portName=S", portName,
+                            "maxConnections=I", 64,
+                            "cid=I", i + 1, NULL);
+      TunnelServerSendMsg(session, TP_MSG_LISTEN_RQ, body, len);
+      free(body);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerRaiseCb --
+ *
+ *      RAISE_RQ message handler.  Accepts the channel, and compression if
+ *      the tunnel offers it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerRaiseCb(TunnelServerSession *session, // IN
+                    const TunnelProxyMsg *msg)    // IN
+{
+   int chanId = 0;
+   const char *compress = NULL;
+   TunnelServerChannel *channel = NULL;
+   char *body = NULL;
+   int len = 0;
+
+   if (!TunnelProxy_MsgGet(msg, "chanID=I", &chanId, NULL)) {
+      Warning("RAISE_RQ without chanID.\n");
+      return;
+   }
+
+   TunnelProxy_MsgGet(msg, "compress=S", &compress, NULL);
+   if (compress && Str_Strcasecmp(compress, COMPRESS_DEFLATE) == 0) {
+      channel = Util_SafeCalloc(1, sizeof *channel);
+      channel->chanId = chanId;
+      if (inflateInit(&channel->inflater) != Z_OK) {
+         free(channel);
+         channel = NULL;
+      } else if (deflateInit(&channel->deflater, Z_BEST_SPEED) != Z_OK) {
+         inflateEnd(&channel->inflater);
+         free(channel);
+         channel = NULL;
+      }
+   }
+
+   if (channel) {
+      channel->next = session->compressed;
+      session->compressed = channel;
+      TunnelProxy_FormatMsg(&body, &len, "chanID=I", chanId,
+                            "compress=S", COMPRESS_DEFLATE, NULL);
+   } else {
+      TunnelProxy_FormatMsg(&body, &len, "chanID=I", chanId, NULL);
+   }
+   TunnelServerSendMsg(session, TP_MSG_RAISE_RP, body, len);
+   free(body);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerEchoCb --
+ *
+ *      ECHO_RQ message handler.  Replies with ECHO_RP.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerEchoCb(TunnelServerSession *session, // IN
+                   const TunnelProxyMsg *msg)    // IN: not used
+{
+   TunnelServerSendMsg(session, TP_MSG_ECHO_RP, NULL, 0);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerEchoData --
+ *
+ *      Echo a DATA chunk body back on its channel.  On a compressed channel
+ *      the body is decoded, inflating it if deflated, and sent back
+ *      deflated by the server's stream.
+ *
+ * Results:
+ *      FALSE if a compressed channel's body can't be decoded.
+ *
+ * Side effects:
+ *      Advances the channel's deflate streams.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerEchoData(TunnelServerSession *session, // IN
+                     int chanId,                   // IN
+                     const char *body,             // IN
+                     int bodyLen)                  // IN
+{
+   static char data[TMPBUFSIZE];
+   static char out[TMPBUFSIZE];
+   TunnelServerChannel *channel;
+   char hdr[CHUNK_HDR_MAXLEN];
+   const char *plain;
+   int plainLen;
+   z_stream *zs;
+
+   for (channel = session->compressed;
+        channel && channel->chanId != chanId;
+        channel = channel->next) {
+   }
+
+   if (!channel) {
+      Str_Sprintf(hdr, sizeof hdr, "%X;%X;", chanId, bodyLen);
+      TunnelServerSendChunk(session, 'D', hdr, body, bodyLen);
+      return TRUE;
+   }
+
+   if (bodyLen < 1) {
+      return FALSE;
+   }
+   if (body[0] == DATA_RAW) {
+      plain = body + 1;
+      plainLen = bodyLen - 1;
+   } else if (body[0] == DATA_DEFLATED) {
+      zs = &channel->inflater;
+      zs->next_in = (Bytef *)body + 1;
+      zs->avail_in = bodyLen - 1;
+      zs->next_out = (Bytef *)data;
+      zs->avail_out = sizeof data;
+      if (inflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in > 0 ||
+          zs->avail_out == 0) {
+         Warning("Invalid compressed data for channel %d.\n", chanId);
+         return FALSE;
+      }
+      plain = data;
+      plainLen = sizeof data - zs->avail_out;
+   } else {
+      return FALSE;
+   }
+
+   zs = &channel->deflater;
+   out[0] = DATA_DEFLATED;
+   zs->next_in = (Bytef *)plain;
+   zs->avail_in = plainLen;
+   zs->next_out = (Bytef *)out + 1;
+   zs->avail_out = sizeof out - 1;
+   if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in > 0 ||
+       zs->avail_out == 0) {
+      Warning("Compressing data for channel %d failed.\n", chanId);
+      return FALSE;
+   }
+
+   bodyLen = sizeof out - zs->avail_out;
+   Str_Sprintf(hdr, sizeof hdr, "%X;%X;", chanId, bodyLen);
+   TunnelServerSendChunk(session, 'D', hdr, out, bodyLen);
+   return TRUE;
+}
+
+
+static const struct {
+   const char *msgId;
+   TunnelServerMsgFn fn;
+} gMsgHandlers[] = {
+   { TP_MSG_INIT,     TunnelServerInitCb },
+   { TP_MSG_START,    TunnelServerStartCb },
+   { TP_MSG_RAISE_RQ, TunnelServerRaiseCb },
+   { TP_MSG_ECHO_RQ,  TunnelServerEchoCb },
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerParseHex --
+ *
+ *      Parse a ';' terminated hex field of a tunnel chunk, as written by
+ *      TunnelProxy.  An empty field is 0.
+ *
+ * Results:
+ *      FALSE if the terminator has not arrived yet.
+ *
+ * Side effects:
+ *      Moves *pos past the field.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerParseHex(const char *buf,     // IN
+                     int len,             // IN
+                     int *pos,            // IN/OUT
+                     unsigned int *value) // OUT
+{
+   const char *end = memchr(buf + *pos, ';', len - *pos);
+
+   if (!end) {
+      return FALSE;
+   }
+
+   *value = strtoul(buf + *pos, NULL, 16);
+   *pos = end - buf + 1;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerHold --
+ *
+ *      Keep a copy of a complete DATA or MESSAGE chunk that arrived ahead of
+ *      the next chunkId expected, to be handled in order later.
+ *
+ * Results:
+ *      TRUE if the chunk was held.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerHold(TunnelServerSession *session, // IN
+                 unsigned int chunkId,         // IN
+                 const char *buf,              // IN
+                 int len)                      // IN
+{
+   TunnelServerHeld **prev = &session->held;
+   TunnelServerHeld *held;
+
+   if (session->stripes <= 1 || chunkId <= session->lastChunkIdSeen + 1) {
+      return FALSE;
+   }
+
+   held = Util_SafeMalloc(sizeof *held + len);
+   held->chunkId = chunkId;
+   held->len = len;
+   held->data = (char *) (held + 1);
+   memcpy(held->data, buf, len);
+
+   while (*prev && (*prev)->chunkId < chunkId) {
+      prev = &(*prev)->next;
+   }
+   held->next = *prev;
+   *prev = held;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerProcessHeld --
+ *
+ *      Handle held chunks that are next in order.
+ *
+ * Results:
+ *      FALSE if one is malformed.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerProcessHeld(TunnelServerSession *session) // IN
+{
+   while (session->held &&
+          session->held->chunkId == session->lastChunkIdSeen + 1) {
+      TunnelServerHeld *held = session->held;
+      int chunkLen;
+
+      session->held = held->next;
+      chunkLen = TunnelServerProcessChunk(session, held->data, held->len);
+      free(held);
+      if (chunkLen <= 0) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerProcessChunk --
+ *
+ *      Handle the tunnel chunk at the start of buf if all of it arrived.
+ *      DATA is echoed back on the same channel, messages go to the handlers
+ *      in gMsgHandlers, and ACKs are ignored as nothing is ever resent.
+ *      DATA and MESSAGE chunks that arrive ahead of order are held instead.
+ *
+ * Results:
+ *      Length of the chunk consumed, 0 if incomplete, -1 if malformed.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+TunnelServerProcessChunk(TunnelServerSession *session, // IN
+                         const char *buf,              // IN
+                         int len)                      // IN
+{
+   unsigned int chunkId;
+   unsigned int ack;
+   unsigned int chanId;
+   unsigned int hdrLen;
+   unsigned int bodyLen;
+   int pos = 2;
+   int hdrPos;
+
+   if (len < 2) {
+      return 0;
+   }
+   if (buf[1] != ';') {
+      return -1;
+   }
+
+   switch (buf[0]) {
+   case 'A':
+      return TunnelServerParseHex(buf, len, &pos, &ack) ? pos : 0;
+
+   case 'D':
+      if (!TunnelServerParseHex(buf, len, &pos, &chunkId) ||
+          !TunnelServerParseHex(buf, len, &pos, &ack) ||
+          !TunnelServerParseHex(buf, len, &pos, &chanId) ||
+          !TunnelServerParseHex(buf, len, &pos, &bodyLen) ||
+          len - pos < bodyLen + 1) {
+         return 0;
+      }
+      if (TunnelServerHold(session, chunkId, buf, pos + bodyLen + 1)) {
+         return pos + bodyLen + 1;
+      }
+      session->lastChunkIdSeen = MAX(session->lastChunkIdSeen, chunkId);
+
+      if (!TunnelServerEchoData(session, chanId, buf + pos, bodyLen)) {
+         return -1;
+      }
+      return pos + bodyLen + 1;
+
+   case 'M':
+      if (!TunnelServerParseHex(buf, len, &pos, &chunkId) ||
+          !TunnelServerParseHex(buf, len, &pos, &ack) ||
+          !TunnelServerParseHex(buf, len, &pos, &hdrLen) ||
+          len - pos < hdrLen + 1) {
+         return 0;
+      }
+      hdrPos = pos;
+      pos += hdrLen + 1;
+      if (!TunnelServerParseHex(buf, len, &pos, &bodyLen) ||
+          len - pos < bodyLen + 1) {
+         return 0;
+      }
+      if (TunnelServerHold(session, chunkId, buf, pos + bodyLen + 1)) {
+         return pos + bodyLen + 1;
+      }
+      session->lastChunkIdSeen = MAX(session->lastChunkIdSeen, chunkId);
+
+      {
+         TunnelProxyMsg hdr;
+         TunnelProxyMsg body;
+         const char *msgId = NULL;
+         int i;
+
+         TunnelProxy_ParseMsg(&hdr, buf + hdrPos, hdrLen);
+         TunnelProxy_ParseMsg(&body, buf + pos, bodyLen);
+         if (TunnelProxy_MsgGet(&hdr, "messageType=S", &msgId, NULL)) {
+            for (i = 0; i < ARRAYSIZE(gMsgHandlers); i++) {
+               if (Str_Strcmp(msgId, gMsgHandlers[i].msgId) == 0) {
+                  gMsgHandlers[i].fn(session, &body);
+                  break;
+               }
+            }
+         }
+         TunnelProxy_MsgDestroy(&body);
+         TunnelProxy_MsgDestroy(&hdr);
+      }
+      return pos + bodyLen + 1;
+
+   default:
+      return -1;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerConsume --
+ *
+ *      Drop the first len bytes of a DynBuf.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerConsume(DynBuf *buf, // IN/OUT
+                    int len)     // IN
+{
+   int size = DynBuf_GetSize(buf);
+
+   memmove(DynBuf_Get(buf), (char *) DynBuf_Get(buf) + len, size - len);
+   DynBuf_SetSize(buf, size - len);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerCloseConn --
+ *
+ *      Close a connection and free it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerCloseConn(TunnelServerConn *conn) // IN
+{
+   AsyncSocket_Close(conn->asock);
+   DynBuf_Destroy(&conn->recvBuf);
+   DynBuf_Destroy(&conn->tunnelBuf);
+   free(conn);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerEndSession --
+ *
+ *      Close all of the session's connections and drop its held chunks,
+ *      ready for the next session.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerEndSession(TunnelServerSession *session, // IN
+                       const char *reason)           // IN
+{
+   int i;
+
+   if (!session->conns[0]) {
+      return;
+   }
+
+   Log("Tunnel session ended: %s\n", reason);
+
+   for (i = 0; i < TP_MAX_STRIPES; i++) {
+      if (session->conns[i]) {
+         TunnelServerCloseConn(session->conns[i]);
+      }
+   }
+   while (session->held) {
+      TunnelServerHeld *held = session->held;
+
+      session->held = held->next;
+      free(held);
+   }
+   while (session->compressed) {
+      TunnelServerChannel *channel = session->compressed;
+
+      session->compressed = channel->next;
+      inflateEnd(&channel->inflater);
+      deflateEnd(&channel->deflater);
+      free(channel);
+   }
+   memset(session, 0, sizeof *session);
+   session->stripes = 1;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerProcessHeader --
+ *
+ *      Handle the request header of a new connection, once all of it has
+ *      arrived.  A POST to the stripe URL joins the current session as the
+ *      stripe it names, unless stripes are rejected; anything else starts a
+ *      new session, ending the current one.  Either way it is answered with
+ *      a chunked 200 response.
+ *
+ * Results:
+ *      FALSE if the connection can't be served.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerProcessHeader(TunnelServerConn *conn) // IN
+{
+   static const char response[] =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n";
+   static const char rejected[] =
+      "HTTP/1.1 403 Forbidden\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n";
+   TunnelServerSession *session = &gSession;
+   char *buf = DynBuf_Get(&conn->recvBuf);
+   int len = DynBuf_GetSize(&conn->recvBuf);
+   char *end = len > 0 ? Str_Strnstr(buf, "\r\n\r\n", len) : NULL;
+   char *path;
+
+   if (!end) {
+      return TRUE;
+   }
+
+   /* The request line is "POST <path> HTTP/1.1". */
+   path = memchr(buf, ' ', end - buf);
+   path = path ? path + 1 : end;
+
+   if (strncmp(path, TP_STRIPE_URL_PATH "?",
+               sizeof TP_STRIPE_URL_PATH) == 0) {
+      /* <path>?<capID>&<reconnectSecret>&<stripe> */
+      char *stripeArg = NULL;
+      char *p;
+
+      for (p = path; p < end && *p != ' '; p++) {
+         if (*p == '&') {
+            stripeArg = p + 1;
+         }
+      }
+      conn->stripe = stripeArg ? atoi(stripeArg) : 0;
+      if (gRejectStripes) {
+         /* Stays unattached until the tunnel closes it. */
+         Log("Tunnel stripe %d rejected.\n", conn->stripe);
+         conn->stripe = -1;
+         TunnelServerConsume(&conn->recvBuf, end + 4 - buf);
+         AsyncSocket_Send(conn->asock, Util_SafeStrdup(rejected),
+                          sizeof rejected - 1, TunnelServerSendCb, NULL);
+         return TRUE;
+      }
+      if (conn->stripe <= 0 || conn->stripe >= session->stripes ||
+          session->conns[conn->stripe]) {
+         Log("Tunnel stripe %d not wanted.\n", conn->stripe);
+         return FALSE;
+      }
+      Log("Tunnel stripe %d connected.\n", conn->stripe);
+   } else if (strncmp(path, TP_RECONNECT_URL_PATH,
+                      sizeof TP_RECONNECT_URL_PATH - 1) == 0) {
+      Log("Tunnel reconnect refused.\n");
+      return FALSE;
+   } else {
+      TunnelServerEndSession(session, "New tunnel connection");
+      conn->stripe = 0;
+   }
+   session->conns[conn->stripe] = conn;
+
+   TunnelServerConsume(&conn->recvBuf, end + 4 - buf);
+   AsyncSocket_Send(conn->asock, Util_SafeStrdup(response),
+                    sizeof response - 1, TunnelServerSendCb, NULL);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerProcess --
+ *
+ *      Handle what arrived on the connection: the request header, then the
+ *      HTTP chunks and the tunnel chunks in them.  Acknowledges chunks not
+ *      acknowledged by any reply.
+ *
+ * Results:
+ *      FALSE if the stream is malformed.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+TunnelServerProcess(TunnelServerConn *conn) // IN
+{
+   TunnelServerSession *session = &gSession;
+   char *buf;
+   int len;
+   int used;
+
+   if (conn->stripe < 0) {
+      if (!TunnelServerProcessHeader(conn)) {
+         return FALSE;
+      } else if (conn->stripe < 0) {
+         return TRUE;
+      }
+   }
+
+   /* Strip the HTTP chunk framing. */
+   for (;;) {
+      char *lineEnd;
+      unsigned int chunkLen;
+
+      buf = DynBuf_Get(&conn->recvBuf);
+      len = DynBuf_GetSize(&conn->recvBuf);
+      lineEnd = len > 0 ? Str_Strnstr(buf, "\r\n", len) : NULL;
+      if (!lineEnd) {
+         break;
+      }
+      chunkLen = strtoul(buf, NULL, 16);
+      used = lineEnd + 2 - buf;
+      if (len - used < chunkLen + 2) {
+         break;
+      }
+      DynBuf_Append(&conn->tunnelBuf, buf + used, chunkLen);
+      TunnelServerConsume(&conn->recvBuf, used + chunkLen + 2);
+   }
+
+   buf = DynBuf_Get(&conn->tunnelBuf);
+   len = DynBuf_GetSize(&conn->tunnelBuf);
+   used = 0;
+   while (used < len) {
+      int chunkLen = TunnelServerProcessChunk(session, buf + used,
+                                              len - used);
+
+      if (chunkLen < 0) {
+         return FALSE;
+      } else if (chunkLen == 0) {
+         break;
+      }
+      used += chunkLen;
+      if (!TunnelServerProcessHeld(session)) {
+         return FALSE;
+      }
+   }
+   if (used > 0) {
+      TunnelServerConsume(&conn->tunnelBuf, used);
+   }
+
+   if (session->lastChunkAckSent != session->lastChunkIdSeen) {
+      TunnelServerSendChunk(session, 'A', NULL, NULL, 0);
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerClose --
+ *
+ *      Close a connection.  If it belongs to the session, the whole
+ *      session ends, since the tunnel can't carry on without it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Frees the TunnelServerConn.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerClose(TunnelServerConn *conn, // IN
+                  const char *reason)     // IN
+{
+   if (conn->stripe >= 0 && gSession.conns[conn->stripe] == conn) {
+      TunnelServerEndSession(&gSession, reason);
+   } else {
+      Log("Tunnel connection closed: %s\n", reason);
+      TunnelServerCloseConn(conn);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerRecv --
+ *
+ *      Issue an AsyncSocket_RecvPartial into the free space at the end of
+ *      the connection's recvBuf, growing it first if little is left.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May grow recvBuf.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerRecv(TunnelServerConn *conn) // IN
+{
+   size_t size = DynBuf_GetSize(&conn->recvBuf);
+
+   if (DynBuf_GetAllocatedSize(&conn->recvBuf) - size < TMPBUFSIZE / 4) {
+      Bool grown = DynBuf_Enlarge(&conn->recvBuf, size + TMPBUFSIZE);
+      ASSERT_MEM_ALLOC(grown);
+   }
+
+   AsyncSocket_RecvPartial(conn->asock,
+                           (char *) DynBuf_Get(&conn->recvBuf) + size,
+                           DynBuf_GetAllocatedSize(&conn->recvBuf) - size,
+                           TunnelServerRecvCb, conn);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerRecvCb --
+ *
+ *      AsyncSocket data received callback.  Processes what arrived at the
+ *      end of recvBuf, and receives more.  Processing only ever closes
+ *      other connections, those of a session a new one replaces.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerRecvCb(void *buf,          // IN: read data
+                   int len,            // IN: buf length
+                   AsyncSocket *asock, // IN
+                   void *clientData)   // IN: TunnelServerConn
+{
+   TunnelServerConn *conn = clientData;
+   size_t size = DynBuf_GetSize(&conn->recvBuf);
+
+   ASSERT(buf == (char *) DynBuf_Get(&conn->recvBuf) + size);
+   DynBuf_SetSize(&conn->recvBuf, size + len);
+
+   if (!TunnelServerProcess(conn)) {
+      TunnelServerClose(conn, "Malformed tunnel request or chunk");
+   } else {
+      TunnelServerRecv(conn);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerErrorCb --
+ *
+ *      AsyncSocket error callback.  Closes the connection.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerErrorCb(int error,          // IN
+                    AsyncSocket *asock, // IN
+                    void *clientData)   // IN: TunnelServerConn
+{
+   TunnelServerClose(clientData, AsyncSocket_Err2String(error));
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerConnectCb --
+ *
+ *      AsyncSocket listener callback.  Reads the new connection's request
+ *      header to find out which session and stripe it is for.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerConnectCb(AsyncSocket *asock, // IN
+                      void *clientData)   // IN: not used
+{
+   TunnelServerConn *conn = Util_SafeCalloc(1, sizeof *conn);
+
+   Log("Tunnel connection accepted.\n");
+
+   conn->asock = asock;
+   conn->stripe = -1;
+   DynBuf_Init(&conn->recvBuf);
+   DynBuf_Init(&conn->tunnelBuf);
+
+   AsyncSocket_SetErrorFn(asock, TunnelServerErrorCb, conn);
+   AsyncSocket_UseNodelay(asock, TRUE);
+   TunnelServerRecv(conn);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelServerPrintUsage --
+ *
+ *      Print usage and exit.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Exits.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelServerPrintUsage(const char *binName) // IN
+{
+   fprintf(stderr, "Usage: %s [-p port] [-l first listen port] "
+           "[-n listen ports]\n"
+           "       [-c lost contact timeout msec] [-s max stripes] [-r]\n",
+           binName);
+   exit(1);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * main --
+ *
+ *      Parse the options, listen for the tunnel on 127.0.0.1, and enter the
+ *      poll loop.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+int
+main(int argc,    // IN
+     char **argv) // IN
+{
+   int port = DEFAULT_PORT;
+   int asockErr = ASOCKERR_SUCCESS;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "p:l:n:c:s:r")) != -1) {
+      switch (opt) {
+      case 'p':
+         port = atoi(optarg);
+         break;
+      case 'l':
+         gListenPort = atoi(optarg);
+         break;
+      case 'n':
+         gListeners = atoi(optarg);
+         break;
+      case 'c':
+         gLostContact = atoi(optarg);
+         break;
+      case 's':
+         gStripes = atoi(optarg);
+         break;
+      case 'r':
+         gRejectStripes = TRUE;
+         break;
+      default:
+         TunnelServerPrintUsage(argv[0]);
+      }
+   }
+   if (port <= 0 || gListenPort <= 0 || gListeners <= 0 || gStripes <= 0 ||
+       gStripes > TP_MAX_STRIPES) {
+      TunnelServerPrintUsage(argv[0]);
+   }
+
+   Poll_InitEpoll();
+   Preference_Init();
+   SSL_InitEx(NULL, NULL, NULL, TRUE, FALSE, FALSE);
+   AsyncSocket_Init();
+
+   gSession.stripes = 1;
+
+   if (!AsyncSocket_ListenIPStr("127.0.0.1", port, TunnelServerConnectCb,
+                                NULL, NULL, &asockErr)) {
+      Panic("Unable to listen on port %d: %s\n", port,
+            AsyncSocket_Err2String(asockErr));
+   }
+   Log("Tunnel server listening on 127.0.0.1:%d.\n", port);
+
+   Poll_Loop(TRUE, NULL, POLL_CLASS_MAIN);
+
+   return 0;
+}
@@ -0,0 +1,476 @@
+/*********************************************************
+ * Copyright (C) 2008 VMware, Inc. All rights reserved.
+ *
+ * This file is part of VMware View Open Client.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * tunnelStats.c --
+ *
+ *      Export of TunnelProxy statistics, as "name value" lines, so a slow
+ *      session can be pinned on the tunnel, the network or the desktop
+ *      while it is still running.
+ *
+ *      With the view.tunnel.statsFile pref set, the stats are rewritten to
+ *      that file every view.tunnel.statsInterval seconds.  With the
+ *      view.tunnel.statsPort pref set, a connection to that port on
+ *      127.0.0.1 gets the current stats and is closed.  Either way, each
+ *      session's stats follow a "session <id>" line.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>      /* For rename */
+#include <time.h>
+
+
+#include "tunnelStats.h"
+
+#include "circList.h"
+#include "dynbuf.h"
+#include "log.h"
+#include "poll.h"
+#include "preference.h"
+#include "str.h"
+#include "util.h"
+
+
+#define STATS_INTERVAL_DEFAULT 10 // Seconds
+
+
+typedef struct TunnelStatsSession {
+   ListItem list;
+   TunnelProxy *tp;
+   unsigned int id;
+} TunnelStatsSession;
+
+static ListItem *gStatsSessions = NULL;
+static char *gStatsFile = NULL;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsAppend --
+ *
+ *      Append a printf-formatted line to a DynBuf.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStatsAppend(DynBuf *buf,       // IN/OUT
+                  const char *fmt,   // IN
+                  ...)               // IN
+{
+   va_list args;
+   size_t len = 0;
+   char *line;
+
+   va_start(args, fmt);
+   line = Str_Vasprintf(&len, fmt, args);
+   va_end(args);
+
+   ASSERT_MEM_ALLOC(line);
+   DynBuf_Append(buf, line, len);
+   free(line);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStats_Format --
+ *
+ *      Format the TunnelProxy's stats and per-channel counters.
+ *
+ * Results:
+ *      NUL-terminated text, caller frees.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+TunnelStats_Format(TunnelProxy *tp) // IN
+{
+   TunnelProxyStats stats;
+   TunnelProxyChannelStats *chanStats = NULL;
+   int chanCount;
+   DynBuf buf;
+   int i;
+
+   ASSERT(tp);
+
+   TunnelProxy_GetStats(tp, &stats);
+   chanCount = TunnelProxy_GetChannelStats(tp, &chanStats);
+
+   DynBuf_Init(&buf);
+
+   TunnelStatsAppend(&buf, "time %"FMT64"d\n", (int64)time(NULL));
+   TunnelStatsAppend(&buf, "chunksIn %"FMT64"u\n", stats.chunksIn);
+   TunnelStatsAppend(&buf, "chunksOut %"FMT64"u\n", stats.chunksOut);
+   TunnelStatsAppend(&buf, "bytesIn %"FMT64"u\n", stats.bytesIn);
+   TunnelStatsAppend(&buf, "bytesOut %"FMT64"u\n", stats.bytesOut);
+   TunnelStatsAppend(&buf, "queueOut %u\n", stats.queueOut);
+   TunnelStatsAppend(&buf, "queueOutNeedAck %u\n", stats.queueOutNeedAck);
+   TunnelStatsAppend(&buf, "queuedBytes %"FMT64"u\n", stats.queuedBytes);
+   TunnelStatsAppend(&buf, "replayBytes %"FMT64"u\n", stats.replayBytes);
+   TunnelStatsAppend(&buf, "replayBytesPeak %"FMT64"u\n",
+                     stats.replayBytesPeak);
+   TunnelStatsAppend(&buf, "replayStops %u\n", stats.replayStops);
+   TunnelStatsAppend(&buf, "chunkSlabs %u\n", stats.chunkSlabs);
+   TunnelStatsAppend(&buf, "chunksLivePeak %u\n", stats.chunksLivePeak);
+   TunnelStatsAppend(&buf, "window %u\n", stats.window);
+   TunnelStatsAppend(&buf, "unacknowledged %u\n", stats.unacknowledged);
+   TunnelStatsAppend(&buf, "minRttUsec %"FMT64"d\n", stats.minRttUsec);
+   TunnelStatsAppend(&buf, "srttUsec %"FMT64"d\n", stats.srttUsec);
+   TunnelStatsAppend(&buf, "rttVarUsec %"FMT64"d\n", stats.rttVarUsec);
+   TunnelStatsAppend(&buf, "echoesSent %u\n", stats.echoesSent);
+   TunnelStatsAppend(&buf, "deliveryRate %"FMT64"u\n", stats.deliveryRate);
+   TunnelStatsAppend(&buf, "bytesDelivered %"FMT64"u\n",
+                     stats.bytesDelivered);
+   TunnelStatsAppend(&buf, "flowStops %u\n", stats.flowStops);
+   TunnelStatsAppend(&buf, "flowStoppedUsec %"FMT64"u\n",
+                     stats.flowStoppedUsec);
+   TunnelStatsAppend(&buf, "windowAtMax %u\n", stats.windowAtMax);
+   TunnelStatsAppend(&buf, "acksByCount %u\n", stats.acksByCount);
+   TunnelStatsAppend(&buf, "acksByTimer %u\n", stats.acksByTimer);
+   TunnelStatsAppend(&buf, "acksPiggyback %u\n", stats.acksPiggyback);
+   TunnelStatsAppend(&buf, "channelPauses %u\n", stats.channelPauses);
+   TunnelStatsAppend(&buf, "coalesced %u\n", stats.coalesced);
+   TunnelStatsAppend(&buf, "compressIn %"FMT64"u\n", stats.compressIn);
+   TunnelStatsAppend(&buf, "compressOut %"FMT64"u\n", stats.compressOut);
+   TunnelStatsAppend(&buf, "compressUsec %"FMT64"u\n", stats.compressUsec);
+   TunnelStatsAppend(&buf, "decompressUsec %"FMT64"u\n",
+                     stats.decompressUsec);
+   TunnelStatsAppend(&buf, "compressSkips %u\n", stats.compressSkips);
+   TunnelStatsAppend(&buf, "reordered %u\n", stats.reordered);
+   TunnelStatsAppend(&buf, "reconnects %u\n", stats.reconnects);
+   TunnelStatsAppend(&buf, "reconnectUsec %"FMT64"u\n", stats.reconnectUsec);
+   TunnelStatsAppend(&buf, "reconnectTotalUsec %"FMT64"u\n",
+                     stats.reconnectTotalUsec);
+
+   /* Bucket names are the upper bound in ms, "inf" for the last. */
+   for (i = 0; i < TP_STATS_RTT_BUCKETS - 1; i++) {
+      TunnelStatsAppend(&buf, "rttMs.%d %u\n", 1 << i, stats.rttHist[i]);
+   }
+   TunnelStatsAppend(&buf, "rttMs.inf %u\n", stats.rttHist[i]);
+
+   for (i = 0; i < chanCount; i++) {
+      TunnelProxyChannelStats *chan = &chanStats[i];
+
+      TunnelStatsAppend(&buf, "channel.%u.portName %s\n", chan->channelId,
+                        chan->portName);
+      TunnelStatsAppend(&buf, "channel.%u.chunksIn %"FMT64"u\n",
+                        chan->channelId, chan->chunksIn);
+      TunnelStatsAppend(&buf, "channel.%u.chunksOut %"FMT64"u\n",
+                        chan->channelId, chan->chunksOut);
+      TunnelStatsAppend(&buf, "channel.%u.bytesIn %"FMT64"u\n",
+                        chan->channelId, chan->bytesIn);
+      TunnelStatsAppend(&buf, "channel.%u.bytesOut %"FMT64"u\n",
+                        chan->channelId, chan->bytesOut);
+      TunnelStatsAppend(&buf, "channel.%u.queuedBytes %d\n",
+                        chan->channelId, chan->queuedBytes);
+   }
+   free(chanStats);
+
+   DynBuf_Append(&buf, "", 1);
+   return DynBuf_Detach(&buf);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsFormatAll --
+ *
+ *      Format the stats of every session added.
+ *
+ * Results:
+ *      NUL-terminated text, caller frees.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+TunnelStatsFormatAll(void)
+{
+   DynBuf buf;
+   ListItem *li;
+
+   DynBuf_Init(&buf);
+
+   LIST_SCAN(li, gStatsSessions) {
+      TunnelStatsSession *session = LIST_CONTAINER(li, TunnelStatsSession,
+                                                   list);
+      char *text = TunnelStats_Format(session->tp);
+
+      TunnelStatsAppend(&buf, "session %u\n", session->id);
+      DynBuf_Append(&buf, text, strlen(text));
+      free(text);
+   }
+
+   DynBuf_Append(&buf, "", 1);
+   return DynBuf_Detach(&buf);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsWriteFile --
+ *
+ *      Poll callback.  Rewrites the stats file, through a temporary file so
+ *      readers never see it half written.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStatsWriteFile(void *clientData) // IN: not used
+{
+   char *text = TunnelStatsFormatAll();
+   char *tmpFile = Str_Asprintf(NULL, "%s.tmp", gStatsFile);
+   FILE *fp;
+
+   ASSERT_MEM_ALLOC(tmpFile);
+
+   fp = fopen(tmpFile, "w");
+   if (!fp) {
+      Warning("Unable to write tunnel stats to \"%s\".\n", tmpFile);
+   } else if (fputs(text, fp) == EOF || fclose(fp) != 0 ||
+              rename(tmpFile, gStatsFile) != 0) {
+      Warning("Unable to write tunnel stats to \"%s\".\n", gStatsFile);
+   }
+
+   free(tmpFile);
+   free(text);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsSendCb --
+ *
+ *      AsyncSocket send callback.  The stats are out, so close the socket.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStatsSendCb(void *buf,          // IN
+                  int len,            // IN: not used
+                  AsyncSocket *asock, // IN
+                  void *clientData)   // IN: not used
+{
+   free(buf);
+   AsyncSocket_Close(asock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsErrorCb --
+ *
+ *      AsyncSocket error callback.  Closes the socket.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStatsErrorCb(int error,          // IN: not used
+                   AsyncSocket *asock, // IN
+                   void *clientData)   // IN: not used
+{
+   AsyncSocket_Close(asock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStatsConnectCb --
+ *
+ *      AsyncSocket listener callback.  Sends the current stats.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+TunnelStatsConnectCb(AsyncSocket *asock, // IN
+                     void *clientData)   // IN: not used
+{
+   char *text = TunnelStatsFormatAll();
+
+   AsyncSocket_SetErrorFn(asock, TunnelStatsErrorCb, NULL);
+   if (AsyncSocket_Send(asock, text, strlen(text), TunnelStatsSendCb,
+                        NULL) != ASOCKERR_SUCCESS) {
+      free(text);
+      AsyncSocket_Close(asock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStats_Init --
+ *
+ *      Start exporting the stats of sessions added as the
+ *      view.tunnel.statsFile, view.tunnel.statsInterval and
+ *      view.tunnel.statsPort prefs ask.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May register a periodic poll callback and a listener.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelStats_Init(void)
+{
+   int interval;
+   int port;
+
+   ASSERT(!gStatsFile);
+
+   gStatsFile = Preference_GetString(NULL, "view.tunnel.statsFile");
+   if (gStatsFile && *gStatsFile) {
+      interval = Preference_GetLong(STATS_INTERVAL_DEFAULT,
+                                    "view.tunnel.statsInterval");
+      interval = MAX(interval, 1);
+      Poll_CB_RTime(TunnelStatsWriteFile, NULL, interval * 1000000, TRUE,
+                    NULL);
+   }
+
+   port = Preference_GetLong(0, "view.tunnel.statsPort");
+   if (port > 0) {
+      int asockErr = ASOCKERR_SUCCESS;
+
+      if (!AsyncSocket_ListenIPStr("127.0.0.1", port, TunnelStatsConnectCb,
+                                   NULL, NULL, &asockErr)) {
+         Warning("Unable to listen for tunnel stats on port %d: %s\n", port,
+                 AsyncSocket_Err2String(asockErr));
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStats_Add --
+ *
+ *      Add a session's TunnelProxy to the stats exported.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelStats_Add(TunnelProxy *tp,        // IN
+                unsigned int sessionId) // IN
+{
+   TunnelStatsSession *session = Util_SafeCalloc(1, sizeof *session);
+
+   ASSERT(tp);
+
+   session->tp = tp;
+   session->id = sessionId;
+   LIST_QUEUE(&session->list, &gStatsSessions);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * TunnelStats_Remove --
+ *
+ *      Stop exporting a TunnelProxy's stats.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+TunnelStats_Remove(TunnelProxy *tp) // IN
+{
+   ListItem *li;
+   ListItem *liNext;
+
+   LIST_SCAN_SAFE(li, liNext, gStatsSessions) {
+      TunnelStatsSession *session = LIST_CONTAINER(li, TunnelStatsSession,
+                                                   list);
+
+      if (session->tp == tp) {
+         LIST_DEL(&session->list, &gStatsSessions);
+         free(session);
+         return;
+      }
+   }
+}